@@ -0,0 +1,456 @@
+-- Completion-based asynchronous I/O (Linux only): operations are queued on a
+-- ring, submitted in batches, and report their results to callbacks. The ring
+-- uses io_uring when the kernel has it (5.7 or later) and emulates it with
+-- epoll otherwise.
+--
+--   local aio = require("aio")
+--   terra done(data : &opaque, result : int64) ... end  -- bytes, or -errno
+--   var ring : aio.Ring
+--   ring:init(256, aio.AUTO)
+--   ring:read(fd, buf, n, -1, done, data)   -- queue; -1 reads at the current position
+--   ring:write(fd2, buf2, n2, -1, done, data2)
+--   ring:wait(1)  -- one system call submits both, then runs callbacks as they complete
+--   ring:destroy()
+--
+-- Operations are read, write, accept, and readfixed/writefixed, which use a
+-- buffer registered with ring:registerbuffers so that io_uring does not map it
+-- for each call. Queuing does not enter the kernel: submit() hands over all
+-- queued operations with one system call, and wait(n) submits and then runs the
+-- callbacks of at least n completions, fewer if nothing is left in flight.
+-- Callbacks may queue further operations; those go out with the next submit or
+-- wait.
+--
+-- In a coroutine (see terralib.coroutine), aio.awaitread, awaitwrite,
+-- awaitreadfixed, awaitwritefixed and awaitaccept take the ring and the same
+-- arguments without the callback, suspend the coroutine, and evaluate to the
+-- result. The completion resumes the coroutine and destroys it once it is done.
+--
+-- The epoll backend tries each operation when it is submitted and waits for
+-- readiness with lib/async.t's epoll helpers only if it would block. It therefore
+-- has async's requirement of non-blocking descriptors, and each descriptor can have
+-- only one operation waiting at a time. io_uring has neither restriction.
+
+local ffi = require("ffi")
+if ffi.os ~= "Linux" then
+    error("the aio library needs epoll or io_uring, which are only available on Linux")
+end
+
+local C = terralib.includecstring [[
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+/* IORING_FEAT_FAST_POLL is from the 5.7 headers, which also have every opcode and
+   field used here (IORING_OP_READ and IORING_OP_WRITE are from 5.6, IORING_OP_ACCEPT
+   and accept_flags from 5.5); with older headers only the epoll backend is built */
+#ifdef IORING_FEAT_FAST_POLL
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#define TERRA_AIO_URING 1
+#endif
+#endif
+
+enum { terra_aio_read, terra_aio_write, terra_aio_readfixed, terra_aio_writefixed, terra_aio_accept };
+
+/* the mapped submission and completion rings; the kernel's structures have
+   unions and are only touched from C */
+typedef struct terra_aio_uring {
+    int fd;
+    unsigned *sqhead, *sqtail, *sqmask, *sqarray, *cqhead, *cqtail, *cqmask;
+    void *sqes, *cqes, *sqmap, *cqmap;
+    size_t sqmapsize, cqmapsize, sqessize;
+    unsigned entries, tail, submitted;
+} terra_aio_uring;
+
+static void terra_aio_uring_destroy(terra_aio_uring *r) {
+#ifdef TERRA_AIO_URING
+    if (r->sqes && r->sqes != MAP_FAILED) munmap(r->sqes, r->sqessize);
+    if (r->cqmap && r->cqmap != MAP_FAILED && r->cqmap != r->sqmap) munmap(r->cqmap, r->cqmapsize);
+    if (r->sqmap && r->sqmap != MAP_FAILED) munmap(r->sqmap, r->sqmapsize);
+#endif
+    if (r->fd >= 0) close(r->fd);
+    r->fd = -1;
+}
+
+static int terra_aio_uring_init(terra_aio_uring *r, unsigned entries) {
+    memset(r, 0, sizeof(*r));
+    r->fd = -1;
+#ifdef TERRA_AIO_URING
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    r->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (r->fd < 0) return -1;
+    /* fast poll (5.7) is when sockets stopped needing a worker thread per operation */
+    if (!(p.features & IORING_FEAT_FAST_POLL)) {
+        terra_aio_uring_destroy(r);
+        errno = ENOSYS;
+        return -1;
+    }
+    r->sqmapsize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cqmapsize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cqmapsize > r->sqmapsize) r->sqmapsize = r->cqmapsize;
+        r->cqmapsize = 0;
+    }
+    r->sqmap = mmap(NULL, r->sqmapsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    r->fd, IORING_OFF_SQ_RING);
+    r->cqmap = r->cqmapsize ? mmap(NULL, r->cqmapsize, PROT_READ | PROT_WRITE,
+                                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING)
+                            : r->sqmap;
+    r->sqessize = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqessize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   r->fd, IORING_OFF_SQES);
+    if (r->sqmap == MAP_FAILED || r->cqmap == MAP_FAILED || r->sqes == MAP_FAILED) {
+        terra_aio_uring_destroy(r);
+        return -1;
+    }
+    char *sq = (char *)r->sqmap, *cq = (char *)r->cqmap;
+    r->sqhead = (unsigned *)(sq + p.sq_off.head);
+    r->sqtail = (unsigned *)(sq + p.sq_off.tail);
+    r->sqmask = (unsigned *)(sq + p.sq_off.ring_mask);
+    r->sqarray = (unsigned *)(sq + p.sq_off.array);
+    r->cqhead = (unsigned *)(cq + p.cq_off.head);
+    r->cqtail = (unsigned *)(cq + p.cq_off.tail);
+    r->cqmask = (unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = cq + p.cq_off.cqes;
+    r->entries = p.sq_entries;
+    r->tail = r->submitted = *r->sqtail;
+    return 0;
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+/* fill the next submission queue entry; -1 if the queue is full */
+static int terra_aio_uring_prep(terra_aio_uring *r, int kind, int fd, void *buf, unsigned n,
+                                int64_t offset, unsigned index, void *data) {
+#ifdef TERRA_AIO_URING
+    static const unsigned char opcodes[] = { IORING_OP_READ, IORING_OP_WRITE, IORING_OP_READ_FIXED,
+                                             IORING_OP_WRITE_FIXED, IORING_OP_ACCEPT };
+    if (r->tail - __atomic_load_n(r->sqhead, __ATOMIC_ACQUIRE) >= r->entries) return -1;
+    unsigned i = r->tail & *r->sqmask;
+    struct io_uring_sqe *sqe = (struct io_uring_sqe *)r->sqes + i;
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcodes[kind];
+    sqe->fd = fd;
+    sqe->user_data = (uintptr_t)data;
+    if (kind == terra_aio_accept) {
+        sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    } else {
+        sqe->addr = (uintptr_t)buf;
+        sqe->len = n;
+        sqe->off = (uint64_t)offset;
+        sqe->buf_index = index;
+    }
+    r->sqarray[i] = i;
+    r->tail++;
+    __atomic_store_n(r->sqtail, r->tail, __ATOMIC_RELEASE);
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+/* submit the filled entries and wait for at least wait completions */
+static int terra_aio_uring_enter(terra_aio_uring *r, unsigned wait) {
+#ifdef TERRA_AIO_URING
+    unsigned n = r->tail - r->submitted;
+    if (n == 0 && wait == 0) return 0;
+    int s = syscall(__NR_io_uring_enter, r->fd, n, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (s < 0) return errno == EINTR ? 0 : -1;
+    r->submitted += s;
+    return s;
+#else
+    return -1;
+#endif
+}
+
+/* take the next completion; 0 if there is none */
+static int terra_aio_uring_peek(terra_aio_uring *r, void **data, int *result) {
+#ifdef TERRA_AIO_URING
+    unsigned head = *r->cqhead;
+    if (head == __atomic_load_n(r->cqtail, __ATOMIC_ACQUIRE)) return 0;
+    struct io_uring_cqe *cqe = (struct io_uring_cqe *)r->cqes + (head & *r->cqmask);
+    *data = (void *)(uintptr_t)cqe->user_data;
+    *result = cqe->res;
+    __atomic_store_n(r->cqhead, head + 1, __ATOMIC_RELEASE);
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+static int terra_aio_uring_registerbuffers(terra_aio_uring *r, struct iovec *buffers, unsigned n) {
+#ifdef TERRA_AIO_URING
+    return syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_BUFFERS, buffers, n);
+#else
+    return -1;
+#endif
+}
+
+static int terra_aio_errno(void) { return errno; }
+]]
+local async = require("async")
+local epoll = async.epoll
+
+local aio = {}
+
+aio.AUTO, aio.URING, aio.EPOLL = 0, 1, 2
+aio.iovec = C.iovec
+
+-- called with the data given when the operation was queued and its result:
+-- the number of bytes transferred, the accepted socket, or -errno
+local Callback = {&opaque, int64} -> {}
+aio.Callback = Callback
+
+local struct Op {
+    kind : int;
+    fd : int;
+    buf : &opaque;
+    n : uint32;
+    offset : int64;
+    callback : Callback;
+    data : &opaque;
+    result : int64;
+    -- the free list, or the epoll backend's queued and completed lists
+    next : &Op;
+}
+
+local struct Ring {
+    backend : int;
+    uring : C.terra_aio_uring;
+    epfd : int;
+    -- one per operation in flight, at most the size of the completion queue
+    ops : &Op;
+    free : &Op;
+    inflight : int64;
+    -- epoll backend: operations not yet tried, and completions not yet reported
+    queued : &Op;
+    queuedtail : &Op;
+    done : &Op;
+    donetail : &Op;
+}
+aio.Ring = Ring
+
+-- entries is the size of the submission queue; backend is aio.AUTO, aio.URING or aio.EPOLL
+terra Ring:init(entries : uint32, backend : int) : bool
+    self.backend, self.epfd, self.inflight = aio.EPOLL, -1, 0
+    self.queued, self.queuedtail, self.done, self.donetail = nil, nil, nil, nil
+    self.uring.fd = -1
+    if backend ~= aio.EPOLL and C.terra_aio_uring_init(&self.uring, entries) == 0 then
+        self.backend = aio.URING
+    elseif backend == aio.URING then
+        return false
+    else
+        self.epfd = C.epoll_create1(0)
+        if self.epfd < 0 then return false end
+    end
+    var n = 2 * entries
+    self.ops = [&Op](C.malloc(n * sizeof(Op)))
+    self.free = nil
+    for i = 0, n do
+        self.ops[i].next = self.free
+        self.free = &self.ops[i]
+    end
+    return true
+end
+
+terra Ring:destroy()
+    if self.backend == aio.URING then C.terra_aio_uring_destroy(&self.uring) else C.close(self.epfd) end
+    C.free(self.ops)
+end
+
+-- io_uring reads buffers registered here without mapping them per operation;
+-- readfixed and writefixed need their buffer to lie in registered buffer index
+terra Ring:registerbuffers(buffers : &C.iovec, n : uint32) : bool
+    if self.backend == aio.URING then
+        return C.terra_aio_uring_registerbuffers(&self.uring, buffers, n) == 0
+    end
+    return true
+end
+
+terra Ring:complete(op : &Op, result : int64)
+    op.result, op.next = result, nil
+    if self.donetail == nil then self.done = op else self.donetail.next = op end
+    self.donetail = op
+end
+
+-- epoll backend: run op now, or wait for its descriptor if it would block
+terra Ring:attempt(op : &Op)
+    var r : int64
+    if op.kind == C.terra_aio_accept then
+        r = epoll.accept(op.fd)
+    elseif op.kind == C.terra_aio_read or op.kind == C.terra_aio_readfixed then
+        if op.offset < 0 then r = C.read(op.fd, op.buf, op.n) else r = C.pread(op.fd, op.buf, op.n, op.offset) end
+    else
+        if op.offset < 0 then r = C.write(op.fd, op.buf, op.n) else r = C.pwrite(op.fd, op.buf, op.n, op.offset) end
+    end
+    if r >= 0 then
+        self:complete(op, r)
+        return
+    end
+    if epoll.wouldblock() ~= 0 then
+        var events = terralib.select(op.kind == C.terra_aio_write or op.kind == C.terra_aio_writefixed,
+                                     C.EPOLLOUT, C.EPOLLIN)
+        if epoll.watch(self.epfd, op.fd, events, op) == 0 then return end
+    end
+    self:complete(op, -C.terra_aio_errno())
+end
+
+-- hand all queued operations to the kernel; the number submitted, or -1
+terra Ring:submit() : int
+    if self.backend == aio.URING then
+        return C.terra_aio_uring_enter(&self.uring, 0)
+    end
+    var n = 0
+    while self.queued ~= nil do
+        var op = self.queued
+        self.queued = op.next
+        if self.queued == nil then self.queuedtail = nil end
+        self:attempt(op)
+        n = n + 1
+    end
+    return n
+end
+
+terra Ring:queue(kind : int, fd : int, buf : &opaque, n : uint32, offset : int64, index : uint32,
+                 callback : Callback, data : &opaque) : bool
+    var op = self.free
+    if op == nil then return false end
+    if self.backend == aio.URING and
+       C.terra_aio_uring_prep(&self.uring, kind, fd, buf, n, offset, index, op) ~= 0 then
+        -- the submission queue is full: submit it as a batch and try again
+        if self:submit() < 0 or
+           C.terra_aio_uring_prep(&self.uring, kind, fd, buf, n, offset, index, op) ~= 0 then
+            return false
+        end
+    end
+    self.free = op.next
+    self.inflight = self.inflight + 1
+    op.kind, op.fd, op.buf, op.n, op.offset = kind, fd, buf, n, offset
+    op.callback, op.data, op.next = callback, data, nil
+    if self.backend == aio.EPOLL then
+        if self.queuedtail == nil then self.queued = op else self.queuedtail.next = op end
+        self.queuedtail = op
+    end
+    return true
+end
+
+-- each returns false if too many operations are in flight
+terra Ring:read(fd : int, buf : &opaque, n : uint32, offset : int64, callback : Callback, data : &opaque) : bool
+    return self:queue(C.terra_aio_read, fd, buf, n, offset, 0, callback, data)
+end
+terra Ring:write(fd : int, buf : &opaque, n : uint32, offset : int64, callback : Callback, data : &opaque) : bool
+    return self:queue(C.terra_aio_write, fd, buf, n, offset, 0, callback, data)
+end
+terra Ring:readfixed(fd : int, buf : &opaque, n : uint32, offset : int64, index : uint32,
+                     callback : Callback, data : &opaque) : bool
+    return self:queue(C.terra_aio_readfixed, fd, buf, n, offset, index, callback, data)
+end
+terra Ring:writefixed(fd : int, buf : &opaque, n : uint32, offset : int64, index : uint32,
+                      callback : Callback, data : &opaque) : bool
+    return self:queue(C.terra_aio_writefixed, fd, buf, n, offset, index, callback, data)
+end
+terra Ring:accept(fd : int, callback : Callback, data : &opaque) : bool
+    return self:queue(C.terra_aio_accept, fd, nil, 0, 0, 0, callback, data)
+end
+
+terra Ring:dispatch(op : &Op, result : int64)
+    var callback, data = op.callback, op.data
+    op.next, self.free = self.free, op
+    self.inflight = self.inflight - 1
+    callback(data, result)
+end
+
+-- submit, then run the callbacks of at least minimum completions, or of all
+-- operations in flight if there are fewer; the number run, or -1
+terra Ring:wait(minimum : int64) : int64
+    var n : int64 = 0
+    if self:submit() < 0 then return -1 end
+    if self.backend == aio.URING then
+        while true do
+            var data : &opaque, result : int
+            while C.terra_aio_uring_peek(&self.uring, &data, &result) ~= 0 do
+                self:dispatch([&Op](data), result)
+                n = n + 1
+            end
+            if n >= minimum or self.inflight == 0 then break end
+            if C.terra_aio_uring_enter(&self.uring, 1) < 0 then return -1 end
+        end
+        return n
+    end
+    var ready : (&opaque)[64]
+    while true do
+        while self.done ~= nil do
+            var op = self.done
+            self.done = op.next
+            if self.done == nil then self.donetail = nil end
+            self:dispatch(op, op.result)
+            n = n + 1
+        end
+        if self.queued ~= nil then
+            self:submit()
+        elseif n >= minimum or self.inflight == 0 then
+            break
+        else
+            var m = epoll.poll(self.epfd, &ready[0], 64)
+            if m < 0 then return -1 end
+            for i = 0, m do self:attempt([&Op](ready[i])) end
+        end
+    end
+    return n
+end
+
+aio.setnonblocking = async.setnonblocking
+
+-- the coroutine interface: a completion resumes the coroutine that waits for it
+local struct Waiter {
+    handle : &opaque;
+    result : int64;
+}
+
+terra aio.resumewaiter(data : &opaque, result : int64)
+    var w = [&Waiter](data)
+    var h = w.handle -- w lives in the coroutine's frame
+    w.result = result
+    terralib.resume(h)
+    if terralib.coroutinedone(h) then terralib.destroycoroutine(h) end
+end
+
+local function awaiter(method)
+    return macro(function(ring, ...)
+        local args = terralib.newlist { ... }
+        return quote
+            var w : Waiter
+            w.handle = terralib.currentcoroutine()
+            if [ring]:[method]([args], aio.resumewaiter, &w) then
+                terralib.suspend()
+            else
+                w.result = -C.ENOBUFS
+            end
+        in
+            w.result
+        end
+    end)
+end
+aio.awaitread, aio.awaitwrite = awaiter("read"), awaiter("write")
+aio.awaitreadfixed, aio.awaitwritefixed = awaiter("readfixed"), awaiter("writefixed")
+aio.awaitaccept = awaiter("accept")
+
+-- start a coroutine that awaits operations, destroying it if it already finished
+aio.spawn = macro(function(h)
+    return quote
+        var hv : &opaque = h
+        if terralib.coroutinedone(hv) then terralib.destroycoroutine(hv) end
+    end
+end)
+
+return aio
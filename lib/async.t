@@ -0,0 +1,218 @@
+-- Asynchronous I/O with coroutines: a scheduler that resumes coroutines created
+-- with terralib.coroutine when the file descriptors they wait for become ready,
+-- driven by an epoll event loop (Linux only).
+--
+--   local async = require("async")
+--   terra echo(s : &async.Scheduler, fd : int)
+--       var buf : int8[4096]
+--       while true do
+--           var n = async.read(s, fd, &buf[0], 4096)
+--           if n <= 0 or async.write(s, fd, &buf[0], n) < 0 then break end
+--       end
+--       async.close(fd)
+--   end
+--   local startecho = terralib.coroutine(echo)
+--   ...
+--   s:spawn(startecho(&s, fd))  -- runs echo up to its first wait
+--   s:run()                     -- until all spawned coroutines finished
+--
+-- Coroutines are stackless: only the body of the coroutine itself can suspend,
+-- not the functions it calls. The operations that may wait (wait, yield, read,
+-- write and accept) are therefore macros that expand into the body. Each wait
+-- registers the coroutine's handle with epoll as a one-shot event and suspends;
+-- the scheduler resumes it once the descriptor is ready, and the operation then
+-- retries. Descriptors must be non-blocking (see setnonblocking; accept returns
+-- non-blocking sockets). run returns when no spawned coroutine is left, and
+-- blocks forever if the remaining ones wait for descriptors that never get ready.
+
+local ffi = require("ffi")
+if ffi.os ~= "Linux" then
+    error("the async library needs epoll, which is only available on Linux")
+end
+
+local C = terralib.includecstring [[
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+/* struct epoll_event is packed on some targets, so only C touches it */
+static int terra_async_watch(int epfd, int fd, unsigned events, void *data) {
+    struct epoll_event ev;
+    ev.events = events | EPOLLONESHOT;
+    ev.data.ptr = data;
+    if (epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev) == 0) return 0;
+    if (errno != ENOENT) return -1;
+    return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+static int terra_async_poll(int epfd, void **ready, int max) {
+    struct epoll_event ev[64];
+    int n = epoll_wait(epfd, ev, max < 64 ? max : 64, -1);
+    for (int i = 0; i < n; i++) ready[i] = ev[i].data.ptr;
+    return n < 0 && errno == EINTR ? 0 : n;
+}
+static int terra_async_wouldblock(void) { return errno == EAGAIN || errno == EWOULDBLOCK; }
+static int terra_async_interrupted(void) { return errno == EINTR; }
+static int terra_async_setnonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL);
+    return flags < 0 ? -1 : fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+static int terra_async_accept(int fd) {
+    return accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+}
+enum { terra_async_readable = EPOLLIN | EPOLLRDHUP, terra_async_writable = EPOLLOUT };
+]]
+
+local async = {}
+
+local struct Scheduler {
+    epfd : int;
+    -- ring of coroutines to resume, grown when full
+    ready : &&opaque;
+    head : uint64;
+    tail : uint64;
+    mask : uint64;
+    -- spawned coroutines that have not finished
+    live : int64;
+}
+async.Scheduler = Scheduler
+
+terra Scheduler:init() : bool
+    self.epfd = C.epoll_create1(0)
+    self.head, self.tail, self.mask, self.live = 0, 0, 63, 0
+    self.ready = [&&opaque](C.malloc(64 * sizeof([&opaque])))
+    return self.epfd >= 0 and self.ready ~= nil
+end
+
+terra Scheduler:destroy()
+    C.close(self.epfd)
+    C.free(self.ready)
+end
+
+terra Scheduler:schedule(h : &opaque)
+    if self.tail - self.head > self.mask then
+        var n = (self.mask + 1) * 2
+        var ready = [&&opaque](C.malloc(n * sizeof([&opaque])))
+        for i = self.head, self.tail do ready[i - self.head] = self.ready[i and self.mask] end
+        C.free(self.ready)
+        self.ready, self.tail, self.head, self.mask = ready, self.tail - self.head, 0, n - 1
+    end
+    self.ready[self.tail and self.mask] = h
+    self.tail = self.tail + 1
+end
+
+-- take over a coroutine that was just started and is suspended in a wait or yield
+terra Scheduler:spawn(h : &opaque)
+    if terralib.coroutinedone(h) then
+        terralib.destroycoroutine(h)
+    else
+        self.live = self.live + 1
+    end
+end
+
+-- false if waiting for events failed
+terra Scheduler:run() : bool
+    var events : (&opaque)[64]
+    while self.live > 0 do
+        while self.head ~= self.tail do
+            var h = self.ready[self.head and self.mask]
+            self.head = self.head + 1
+            terralib.resume(h)
+            if terralib.coroutinedone(h) then
+                terralib.destroycoroutine(h)
+                self.live = self.live - 1
+            end
+        end
+        if self.live > 0 then
+            var n = C.terra_async_poll(self.epfd, &events[0], 64)
+            if n < 0 then return false end
+            for i = 0, n do self:schedule(events[i]) end
+        end
+    end
+    return true
+end
+
+terra async.setnonblocking(fd : int) : bool
+    return C.terra_async_setnonblocking(fd) == 0
+end
+
+terra async.close(fd : int)
+    C.close(fd)
+end
+
+-- the C helpers behind the scheduler, for other epoll-based libraries such as
+-- lib/aio.t: watch(epfd, fd, events, data) arms a one-shot event, poll(epfd, ready,
+-- max) waits for events and stores their data, wouldblock() and interrupted() test
+-- errno, and accept(fd) returns a non-blocking socket
+async.epoll = {
+    watch = C.terra_async_watch, poll = C.terra_async_poll,
+    wouldblock = C.terra_async_wouldblock, interrupted = C.terra_async_interrupted,
+    accept = C.terra_async_accept,
+}
+
+-- suspend until fd is ready for events, async.readable or async.writable;
+-- false, without suspending, if fd cannot be watched
+local wait = macro(function(s, fd, events)
+    return quote
+        var ok = C.terra_async_watch(s.epfd, fd, events, terralib.currentcoroutine()) == 0
+        if ok then terralib.suspend() end
+    in
+        ok
+    end
+end)
+async.wait = wait
+async.readable, async.writable = C.terra_async_readable, C.terra_async_writable
+
+-- let the other ready coroutines run first
+async.yield = macro(function(s)
+    return quote
+        var sv : &Scheduler = s
+        sv:schedule(terralib.currentcoroutine())
+        terralib.suspend()
+    end
+end)
+
+-- retry call, an expression that sets errno when it fails, while it would block
+local function retry(s, fd, events, call, failed)
+    return quote
+        var sv : &Scheduler, fdv : int = s, fd
+        var r = [call(fdv)]
+        while [failed(r)] and (C.terra_async_interrupted() ~= 0 or
+                               (C.terra_async_wouldblock() ~= 0 and wait(sv, fdv, events))) do
+            r = [call(fdv)]
+        end
+    in
+        r
+    end
+end
+
+-- read up to n bytes, returning the number read, 0 at the end of the input, or -1
+async.read = macro(function(s, fd, buf, n)
+    return retry(s, fd, C.terra_async_readable,
+        function(fdv) return `C.read(fdv, buf, n) end, function(r) return `r < 0 end)
+end)
+
+-- write all n bytes, returning n or -1
+async.write = macro(function(s, fd, buf, n)
+    return quote
+        var p, left = [&int8](buf), [int64](n)
+        while left > 0 do
+            var r = [retry(s, fd, C.terra_async_writable,
+                function(fdv) return `C.write(fdv, p, left) end, function(r) return `r < 0 end)]
+            if r < 0 then break end
+            p, left = p + r, left - r
+        end
+    in
+        terralib.select(left == 0, [int64](n), -1)
+    end
+end)
+
+-- accept a connection on a listening socket, returning a non-blocking socket or -1
+async.accept = macro(function(s, fd)
+    return retry(s, fd, C.terra_async_readable,
+        function(fdv) return `C.terra_async_accept(fdv) end, function(r) return `r < 0 end)
+end)
+
+return async
@@ -0,0 +1,576 @@
+-- Atomics and lock-free primitives, built on terralib.attrload/attrstore with an
+-- ordering, terralib.atomicrmw, terralib.cmpxchg and terralib.fence.
+--
+--   local atomics = require("atomics")
+--   local Counter = atomics.Atomic(int64)
+--   local hits = global(Counter, `Counter { 0 })
+--   terra hit() return hits:fetchadd(1, "monotonic") end
+--
+-- Atomic(T) wraps an integer, floating-point or pointer value. Its methods are
+-- macros that compile to a single instruction and take an optional LLVM memory
+-- ordering, seq_cst by default:
+--   load(o)  store(v, o)  exchange(v, o)  compareexchange(expected, desired, o)
+--   cas(expected, desired, o)  fetchadd/fetchsub/fetchmax/fetchmin(v, o)
+--   fetchand/fetchor/fetchxor(v, o)  (integers only)
+-- compareexchange returns a tuple of the previous value and whether it was
+-- replaced; cas returns only the latter.
+--
+-- On top of these the module provides
+--   SpinLock        test-and-test-and-set lock with exponential backoff
+--   TicketLock      FIFO lock, waiters back off in proportion to their place in line
+--   SeqLock         readers retry instead of blocking writers
+--   Queue(T)        bounded multi-producer multi-consumer ring (Vyukov)
+--   EpochDomain     epoch-based reclamation for lock-free structures
+--   Stack(T)        Treiber stack whose nodes are reclaimed through an EpochDomain
+--   ShardedCounter  counter with one cache line per CPU, cheap to add to from many threads
+-- Types with an init method must be initialized before use; zeroed memory is a
+-- valid initial state for everything except Queue and Stack.
+
+local ffi = require("ffi")
+
+local C = terralib.includecstring [[
+#if defined(__linux__)
+#define _GNU_SOURCE
+#include <sched.h>
+/* the CPU running the calling thread, or -1 */
+static int terra_atomics_cpu(void) { return sched_getcpu(); }
+#else
+static int terra_atomics_cpu(void) { return -1; }
+#endif
+#include <stdlib.h>
+]]
+
+local atomics = {}
+
+-- the line size all shared hot fields are padded to
+local CACHELINE = 64
+
+local orderings = {
+    unordered = true, monotonic = true, acquire = true, release = true,
+    acq_rel = true, seq_cst = true,
+}
+-- the strongest ordering a failed compare-exchange can have for each success ordering
+local failureorderings = {
+    monotonic = "monotonic", acquire = "acquire", release = "monotonic",
+    acq_rel = "acquire", seq_cst = "seq_cst",
+}
+
+local function ordering(o, default)
+    if o == nil then return default end
+    local v = terralib.isquote(o) and o:asvalue() or o
+    if not orderings[v] then
+        error(("expected a memory ordering (unordered, monotonic, acquire, release, acq_rel or seq_cst) but found %s"):format(tostring(v)), 2)
+    end
+    return v
+end
+
+-- a hint to the CPU that the thread is spinning
+local pause
+if ffi.arch == "x64" or ffi.arch == "x86" then
+    pause = terralib.intrinsic("llvm.x86.sse2.pause", {} -> {})
+elseif ffi.arch == "arm64" then
+    local hint = terralib.intrinsic("llvm.aarch64.hint", int32 -> {})
+    pause = macro(function() return `hint(1) end) -- yield
+else
+    pause = macro(function() return quote end end)
+end
+atomics.pause = pause
+
+-- spin for spins pauses, doubling the wait up to a bound
+local MAXSPINS = 1024
+local backoff = macro(function(spins)
+    return quote
+        for i = 0, spins do pause() end
+        if spins < MAXSPINS then spins = spins * 2 end
+    end
+end)
+
+atomics.Atomic = terralib.memoize(function(T)
+    if not (T:isintegral() or T:isfloat() or T:ispointer()) then
+        error("expected an integer, floating-point or pointer type but found " .. tostring(T), 2)
+    end
+    local struct Atomic {
+        value : T;
+    }
+    function Atomic.metamethods.__typename() return ("Atomic(%s)"):format(tostring(T)) end
+
+    local M = Atomic.methods
+    M.load = macro(function(self, o)
+        local attrs = { ordering = ordering(o, "seq_cst") }
+        return `terralib.attrload(&self.value, attrs)
+    end)
+    M.store = macro(function(self, v, o)
+        local attrs = { ordering = ordering(o, "seq_cst") }
+        return `terralib.attrstore(&self.value, [T](v), attrs)
+    end)
+    -- atomicrmw cannot exchange pointers and cmpxchg cannot compare floats, so
+    -- those go through an integer of the same size
+    local I = T:ispointer() and intptr or T:isfloat() and (T == float and uint32 or uint64) or T
+    M.exchange = macro(function(self, v, o)
+        local attrs = { ordering = ordering(o, "seq_cst") }
+        if T:ispointer() then
+            return `[T](terralib.atomicrmw("xchg", [&I](&self.value), [I](v), attrs))
+        end
+        return `terralib.atomicrmw("xchg", &self.value, [T](v), attrs)
+    end)
+    local function compareexchange(self, expected, desired, o)
+        local success = ordering(o, "seq_cst")
+        if not failureorderings[success] then
+            error("a compare-exchange cannot be unordered", 3)
+        end
+        local attrs = { success_ordering = success, failure_ordering = failureorderings[success] }
+        if T:isfloat() then
+            return quote
+                var e : T, d : T = expected, desired
+                var r = terralib.cmpxchg([&I](&self.value), @[&I](&e), @[&I](&d), attrs)
+            in
+                { @[&T](&r._0), r._1 }
+            end
+        end
+        return `terralib.cmpxchg(&self.value, [T](expected), [T](desired), attrs)
+    end
+    M.compareexchange = macro(compareexchange)
+    M.cas = macro(function(self, expected, desired, o)
+        return `[compareexchange(self, expected, desired, o)]._1
+    end)
+
+    local function rmw(intop, unsignedop, floatop)
+        return macro(function(self, v, o)
+            local op
+            if T:isfloat() then op = floatop
+            elseif T:isintegral() then op = T.signed and intop or unsignedop end
+            if not op then
+                error(("this operation is not supported on %s"):format(tostring(Atomic)), 2)
+            end
+            local attrs = { ordering = ordering(o, "seq_cst") }
+            return `terralib.atomicrmw(op, &self.value, [T](v), attrs)
+        end)
+    end
+    M.fetchadd = rmw("add", "add", "fadd")
+    M.fetchsub = rmw("sub", "sub", "fsub")
+    M.fetchmax = rmw("max", "umax", "fmax")
+    M.fetchmin = rmw("min", "umin", "fmin")
+    M.fetchand = rmw("and", "and")
+    M.fetchor = rmw("or", "or")
+    M.fetchxor = rmw("xor", "xor")
+    return Atomic
+end)
+local Atomic = atomics.Atomic
+
+local struct SpinLock {
+    locked : Atomic(uint32);
+}
+atomics.SpinLock = SpinLock
+
+terra SpinLock:init()
+    self.locked:store(0, "release")
+end
+
+terra SpinLock:trylock() : bool
+    -- test before setting so a contended lock stays in every waiter's cache
+    return self.locked:load("monotonic") == 0 and self.locked:exchange(1, "acquire") == 0
+end
+
+terra SpinLock:lock()
+    var spins : uint32 = 1
+    while self.locked:exchange(1, "acquire") ~= 0 do
+        while self.locked:load("monotonic") ~= 0 do
+            backoff(spins)
+        end
+    end
+end
+
+terra SpinLock:unlock()
+    self.locked:store(0, "release")
+end
+
+local struct TicketLock {
+    next : Atomic(uint32);
+    serving : Atomic(uint32);
+}
+atomics.TicketLock = TicketLock
+
+terra TicketLock:init()
+    self.next:store(0, "monotonic")
+    self.serving:store(0, "release")
+end
+
+terra TicketLock:lock()
+    var ticket = self.next:fetchadd(1, "monotonic")
+    while true do
+        var serving = self.serving:load("acquire")
+        if serving == ticket then return end
+        -- waiters further back in line poll less often
+        for i = 0, (ticket - serving) * 32 do pause() end
+    end
+end
+
+terra TicketLock:unlock()
+    -- only the holder writes serving
+    self.serving:store(self.serving:load("monotonic") + 1, "release")
+end
+
+-- Readers copy the protected data between readbegin and readretry, and start over
+-- while readretry returns true:
+--   var s = lock:readbegin()
+--   var copy = data
+--   while lock:readretry(s) do s = lock:readbegin() copy = data end
+-- Readers may see torn data before retrying, so they must not follow pointers or
+-- index with it until readretry returned false. Writers exclude each other.
+local struct SeqLock {
+    sequence : Atomic(uint32);
+    writer : SpinLock;
+}
+atomics.SeqLock = SeqLock
+
+terra SeqLock:init()
+    self.sequence:store(0, "monotonic")
+    self.writer:init()
+end
+
+terra SeqLock:writebegin()
+    self.writer:lock()
+    -- an odd sequence marks a write in progress
+    self.sequence:store(self.sequence:load("monotonic") + 1, "monotonic")
+    terralib.fence({ ordering = "release" })
+end
+
+terra SeqLock:writeend()
+    self.sequence:store(self.sequence:load("monotonic") + 1, "release")
+    self.writer:unlock()
+end
+
+terra SeqLock:readbegin() : uint32
+    var spins : uint32 = 1
+    while true do
+        var s = self.sequence:load("acquire")
+        if (s and 1) == 0 then return s end
+        backoff(spins)
+    end
+end
+
+terra SeqLock:readretry(s : uint32) : bool
+    terralib.fence({ ordering = "acquire" })
+    return self.sequence:load("monotonic") ~= s
+end
+
+atomics.Queue = terralib.memoize(function(T)
+    local struct Cell {
+        sequence : Atomic(uint64);
+        value : T;
+    }
+    -- producers and consumers only share cells, not the positions they claim them at
+    local struct Queue {
+        cells : &Cell;
+        mask : uint64;
+        pad0 : uint8[CACHELINE - 16];
+        head : Atomic(uint64);
+        pad1 : uint8[CACHELINE - 8];
+        tail : Atomic(uint64);
+        pad2 : uint8[CACHELINE - 8];
+    }
+    function Queue.metamethods.__typename() return ("Queue(%s)"):format(tostring(T)) end
+
+    -- room for at least capacity elements, rounded up to a power of two
+    terra Queue:init(capacity : uint64) : bool
+        var n : uint64 = 2
+        while n < capacity do n = n * 2 end
+        self.cells = [&Cell](C.malloc(n * sizeof(Cell)))
+        if self.cells == nil then return false end
+        for i = 0, n do self.cells[i].sequence:store(i, "monotonic") end
+        self.mask = n - 1
+        self.head:store(0, "monotonic")
+        self.tail:store(0, "release")
+        return true
+    end
+
+    terra Queue:destroy()
+        C.free(self.cells)
+        self.cells = nil
+    end
+
+    -- false if the queue is full
+    terra Queue:push(value : T) : bool
+        var pos = self.head:load("monotonic")
+        while true do
+            var cell = &self.cells[pos and self.mask]
+            var diff = [int64](cell.sequence:load("acquire") - pos)
+            if diff == 0 then
+                var r = self.head:compareexchange(pos, pos + 1, "monotonic")
+                if r._1 then
+                    cell.value = value
+                    cell.sequence:store(pos + 1, "release")
+                    return true
+                end
+                pos = r._0
+            elseif diff < 0 then
+                return false
+            else
+                pos = self.head:load("monotonic")
+            end
+        end
+    end
+
+    -- false if the queue is empty
+    terra Queue:pop(out : &T) : bool
+        var pos = self.tail:load("monotonic")
+        while true do
+            var cell = &self.cells[pos and self.mask]
+            var diff = [int64](cell.sequence:load("acquire") - (pos + 1))
+            if diff == 0 then
+                var r = self.tail:compareexchange(pos, pos + 1, "monotonic")
+                if r._1 then
+                    @out = cell.value
+                    cell.sequence:store(pos + self.mask + 1, "release")
+                    return true
+                end
+                pos = r._0
+            elseif diff < 0 then
+                return false
+            else
+                pos = self.tail:load("monotonic")
+            end
+        end
+    end
+    return Queue
+end)
+
+-- Epoch-based reclamation. Each thread registers a participant and brackets its
+-- accesses to shared nodes with enter and exit. A node that was unlinked is
+-- passed to retire and freed once every participant that was inside a critical
+-- section when it was retired has left it, which is two epochs later. The global
+-- epoch only advances when all active participants have seen it.
+local MAXPARTICIPANTS = 64
+atomics.MAXPARTICIPANTS = MAXPARTICIPANTS
+
+-- the header of a retired node, usually its first field
+local struct Retired {
+    next : &Retired;
+    free : {&Retired} -> {};
+}
+atomics.Retired = Retired
+
+local NLIMBO = 3
+local struct Participant {
+    -- the epoch this participant last entered at, shifted left, with the low bit
+    -- set while it is inside a critical section
+    epoch : Atomic(uint64);
+    inuse : Atomic(uint32);
+    retired : uint32;
+    -- the nodes retired in each of the last three epochs; only the owner touches them
+    limbo : (&Retired)[NLIMBO];
+    limboepoch : uint64[NLIMBO];
+} -- exactly one cache line
+atomics.Participant = Participant
+
+local struct EpochDomain {
+    epoch : Atomic(uint64);
+    pad : uint8[CACHELINE - 8];
+    participants : Participant[MAXPARTICIPANTS];
+}
+atomics.EpochDomain = EpochDomain
+
+terra EpochDomain:init()
+    self.epoch:store(0, "monotonic")
+    for i = 0, MAXPARTICIPANTS do
+        self.participants[i].inuse:store(0, "monotonic")
+    end
+    terralib.fence({ ordering = "release" })
+end
+
+-- a participant for the calling thread, or nil if all are taken
+terra EpochDomain:register() : &Participant
+    for i = 0, MAXPARTICIPANTS do
+        var p = &self.participants[i]
+        if p.inuse:load("monotonic") == 0 and p.inuse:cas(0, 1, "acquire") then
+            p.epoch:store(0, "release")
+            p.retired = 0
+            for s = 0, NLIMBO do p.limbo[s], p.limboepoch[s] = nil, 0 end
+            return p
+        end
+    end
+    return nil
+end
+
+terra EpochDomain:enter(p : &Participant)
+    var e = self.epoch:load("monotonic")
+    p.epoch:store((e << 1) or 1, "monotonic")
+    -- the announcement must be visible before any shared node is read
+    terralib.fence({ ordering = "seq_cst" })
+end
+
+terra EpochDomain:exit(p : &Participant)
+    p.epoch:store(p.epoch:load("monotonic") and not 1ULL, "release")
+end
+
+-- advance the global epoch if every active participant has seen it
+terra EpochDomain:tryadvance() : bool
+    var e = self.epoch:load("monotonic")
+    terralib.fence({ ordering = "seq_cst" })
+    for i = 0, MAXPARTICIPANTS do
+        var q = &self.participants[i]
+        if q.inuse:load("monotonic") ~= 0 then
+            var pe = q.epoch:load("monotonic")
+            if (pe and 1) ~= 0 and (pe >> 1) ~= e then return false end
+        end
+    end
+    terralib.fence({ ordering = "acquire" })
+    return self.epoch:cas(e, e + 1, "acq_rel")
+end
+
+local terra freelist(r : &Retired)
+    while r ~= nil do
+        var next = r.next
+        r.free(r)
+        r = next
+    end
+end
+
+-- free the nodes of p that no participant can still see
+terra EpochDomain:collect(p : &Participant)
+    var e = self.epoch:load("acquire")
+    for s = 0, NLIMBO do
+        if p.limbo[s] ~= nil and p.limboepoch[s] + 2 <= e then
+            freelist(p.limbo[s])
+            p.limbo[s] = nil
+        end
+    end
+end
+
+terra EpochDomain:retire(p : &Participant, r : &Retired)
+    var e = self.epoch:load("acquire")
+    var s = e % NLIMBO
+    if p.limboepoch[s] ~= e then
+        -- the slot holds nodes retired at least three epochs ago
+        freelist(p.limbo[s])
+        p.limbo[s], p.limboepoch[s] = nil, e
+    end
+    r.next = p.limbo[s]
+    p.limbo[s] = r
+    p.retired = p.retired + 1
+    if p.retired % 64 == 0 then
+        self:tryadvance()
+        self:collect(p)
+    end
+end
+
+-- release p, first waiting until the nodes it retired can be freed
+terra EpochDomain:unregister(p : &Participant)
+    var spins : uint32 = 1
+    while true do
+        self:collect(p)
+        var empty = true
+        for s = 0, NLIMBO do empty = empty and p.limbo[s] == nil end
+        if empty then break end
+        if not self:tryadvance() then backoff(spins) end
+    end
+    p.epoch:store(0, "monotonic")
+    p.inuse:store(0, "release")
+end
+
+atomics.Stack = terralib.memoize(function(T)
+    local struct Node {
+        retired : Retired;
+        value : T;
+        next : &Node;
+    }
+    local struct Stack {
+        top : Atomic(&Node);
+        domain : &EpochDomain;
+    }
+    function Stack.metamethods.__typename() return ("Stack(%s)"):format(tostring(T)) end
+
+    local terra freenode(r : &Retired)
+        C.free(r)
+    end
+
+    terra Stack:init(domain : &EpochDomain)
+        self.domain = domain
+        self.top:store(nil, "release")
+    end
+
+    -- false if no memory is left
+    terra Stack:push(value : T) : bool
+        var node = [&Node](C.malloc(sizeof(Node)))
+        if node == nil then return false end
+        node.retired.free = freenode
+        node.value = value
+        var top = self.top:load("monotonic")
+        while true do
+            node.next = top
+            var r = self.top:compareexchange(top, node, "release")
+            if r._1 then return true end
+            top = r._0
+        end
+    end
+
+    -- false if the stack is empty; p is the calling thread's participant
+    terra Stack:pop(p : &Participant, out : &T) : bool
+        self.domain:enter(p)
+        -- nodes are not freed while we are inside, so top.next is safe to read and
+        -- a node cannot be reused at the same address underneath the cas
+        var top = self.top:load("acquire")
+        while top ~= nil do
+            var r = self.top:compareexchange(top, top.next, "acquire")
+            if r._1 then break end
+            top = r._0
+        end
+        self.domain:exit(p)
+        if top == nil then return false end
+        @out = top.value
+        self.domain:retire(p, &top.retired)
+        return true
+    end
+
+    -- free the remaining nodes; no other thread may use the stack
+    terra Stack:destroy()
+        var top = self.top:load("acquire")
+        while top ~= nil do
+            var next = top.next
+            C.free(top)
+            top = next
+        end
+        self.top:store(nil, "monotonic")
+    end
+    return Stack
+end)
+
+local NSHARDS = 64
+local struct Shard {
+    value : Atomic(int64);
+    pad : uint8[CACHELINE - 8];
+}
+local struct ShardedCounter {
+    shards : Shard[NSHARDS];
+}
+atomics.ShardedCounter = ShardedCounter
+
+-- threads on systems that do not report the CPU get shards round-robin
+local nextshard = global(Atomic(uint32), `[Atomic(uint32)] { 0 })
+local threadshard = global(uint32, 0):setthreadlocal()
+
+local terra shardindex() : uint32
+    var cpu = C.terra_atomics_cpu()
+    if cpu >= 0 then return cpu % NSHARDS end
+    if threadshard == 0 then threadshard = nextshard:fetchadd(1, "monotonic") % NSHARDS + 1 end
+    return threadshard - 1
+end
+
+terra ShardedCounter:init()
+    for i = 0, NSHARDS do self.shards[i].value:store(0, "monotonic") end
+    terralib.fence({ ordering = "release" })
+end
+
+terra ShardedCounter:add(n : int64)
+    self.shards[shardindex()].value:fetchadd(n, "monotonic")
+end
+
+-- the sum of all additions that happened before the call; concurrent additions
+-- may or may not be counted
+terra ShardedCounter:read() : int64
+    var sum : int64 = 0
+    for i = 0, NSHARDS do sum = sum + self.shards[i].value:load("monotonic") end
+    return sum
+end
+
+return atomics
@@ -0,0 +1,201 @@
+-- Batched calls: run a Terra function over arrays of arguments with a single
+-- call from Lua.
+--
+--   local batched = fn:batch()                -- a Terra function
+--   batched(n, out, xs, ys)                   -- out[i] = fn(xs[i], ys[i]) for 0 <= i < n
+--   local out = terralib.mapcall(fn, xs, ys)  -- allocates out, n is the length of xs
+--
+-- fn:batch(options) generates a loop around fn that takes a count, a pointer to
+-- the results (unless fn returns nothing) and a pointer per argument, and
+-- memoizes it per function and options. fn is usually inlined into the loop and
+-- vectorized with it. The options are:
+--   uniform = { i, ... }  arguments passed as a single value shared by all elements
+--   threads = N           split the elements between up to N threads (POSIX only)
+--   grain = M             the least number of elements worth a thread (default 4096)
+-- The result is a Terra function, so it can also be called from Terra code.
+
+local ffi = require("ffi")
+
+local C -- pthreads, loaded for the first threaded batch
+local function pthreads()
+    if not C then
+        if ffi.os == "Windows" then
+            error("threaded batches are not supported on Windows")
+        end
+        C = terralib.includecstring [[
+            #include <pthread.h>
+        ]]
+    end
+    return C
+end
+
+-- fresh parameters of a batch over fn: the result pointer and one per argument,
+-- along with the arguments of the call to fn for element i, if i is given
+local function signature(T, uniform, i)
+    local out = not T.returntype:isunit() and symbol(&T.returntype, "out") or nil
+    local params, args = terralib.newlist(), terralib.newlist()
+    if out then params:insert(out) end
+    for k, t in ipairs(T.parameters) do
+        if uniform[k] then
+            local p = symbol(t, "a" .. k)
+            params:insert(p)
+            args:insert(p)
+        else
+            local p = symbol(&t, "a" .. k)
+            params:insert(p)
+            if i then args:insert(`p[i]) end
+        end
+    end
+    return params, args, out
+end
+
+local function chunkfunction(fn, T, uniform)
+    local begin, finish, i = symbol(int64, "begin"), symbol(int64, "finish"), symbol(int64, "i")
+    local params, args, out = signature(T, uniform, i)
+    local call = out and quote out[i] = fn([args]) end or quote fn([args]) end
+    local terra chunk([begin], [finish], [params])
+        var [i] = begin
+        while i < finish do
+            [call]
+            i = i + 1
+        end
+    end
+    chunk:setname(fn.name .. ".chunk")
+    return chunk
+end
+
+local function threadedbatch(fn, T, uniform, chunk, threads, grain)
+    local C = pthreads()
+    local n = symbol(int64, "n")
+    local params = signature(T, uniform, nil)
+    local Job = terralib.types.newstruct(fn.name .. ".job")
+    Job.entries:insertall {
+        { field = "begin", type = int64 }, { field = "finish", type = int64 },
+        { field = "thread", type = C.pthread_t }, { field = "started", type = bool },
+    }
+    for k, p in ipairs(params) do
+        Job.entries:insert { field = "p" .. k, type = p.type }
+    end
+    local function fields(job)
+        return params:mapi(function(k) return `job.["p" .. k] end)
+    end
+    local terra run(arg : &opaque) : &opaque
+        var job = [&Job](arg)
+        chunk(job.begin, job.finish, [fields(job)])
+        return nil
+    end
+    local terra batched([n], [params])
+        var nthreads = (n + grain - 1) / grain
+        if nthreads > threads then nthreads = threads end
+        if nthreads <= 1 then
+            chunk(0, n, [params])
+            return
+        end
+        var jobs : Job[threads]
+        var per = (n + nthreads - 1) / nthreads
+        for t = 0, nthreads do
+            var job = &jobs[t]
+            job.begin = t * per
+            job.finish = (t + 1) * per
+            if job.finish > n then job.finish = n end
+            escape
+                for k, p in ipairs(params) do
+                    emit quote job.["p" .. k] = p end
+                end
+            end
+            -- the calling thread runs the first chunk itself, and any chunk
+            -- whose thread could not be started
+            job.started = t > 0 and C.pthread_create(&job.thread, nil, run, job) == 0
+        end
+        for t = 0, nthreads do
+            if not jobs[t].started then run(&jobs[t]) end
+        end
+        for t = 1, nthreads do
+            if jobs[t].started then C.pthread_join(jobs[t].thread, nil) end
+        end
+    end
+    return batched
+end
+
+local cache = setmetatable({}, { __mode = "k" })
+
+local function batch(fn, options)
+    assert(terralib.isfunction(fn) and fn:isdefined(), "expected a defined terra function")
+    options = options or {}
+    local T = fn:gettype()
+    assert(not T.isvararg, "cannot batch a function with variable arguments")
+    local uniform, uniformlist = {}, terralib.newlist(options.uniform or {})
+    for _, k in ipairs(uniformlist) do
+        if type(k) ~= "number" or not T.parameters[k] then
+            error(("%s has no parameter %s"):format(fn.name, tostring(k)), 2)
+        end
+        uniform[k] = true
+    end
+    local threads, grain = options.threads or 1, options.grain or 4096
+    if type(threads) ~= "number" or threads < 1 or threads % 1 ~= 0 or
+       type(grain) ~= "number" or grain < 1 or grain % 1 ~= 0 then
+        error("threads and grain must be positive integers", 2)
+    end
+    table.sort(uniformlist)
+    local key = ("%s/%d/%d"):format(table.concat(uniformlist, ","), threads, grain)
+    cache[fn] = cache[fn] or {}
+    if not cache[fn][key] then
+        local chunk = chunkfunction(fn, T, uniform)
+        local batched
+        if threads > 1 then
+            batched = threadedbatch(fn, T, uniform, chunk, threads, grain)
+        else
+            local n = symbol(int64, "n")
+            local params = signature(T, uniform, nil)
+            batched = terra([n], [params]) chunk(0, n, [params]) end
+        end
+        batched:setname(fn.name .. ".batch")
+        cache[fn][key] = batched
+    end
+    return cache[fn][key]
+end
+
+-- the number of elements of an array argument, or nil for pointers
+local function length(a, t)
+    if type(a) == "table" then return #a end
+    if type(a) ~= "cdata" then return nil end
+    local at = terralib.typeof(a)
+    if at then return at:isarray() and at.N or nil end
+    if not tostring(ffi.typeof(a)):match("%[%?%]>$") then return nil end
+    t:complete()
+    return ffi.sizeof(a) / ffi.sizeof(t:cstring()) -- a variable-length array
+end
+
+local function mapcall(fn, ...)
+    local batched = batch(fn)
+    local T = fn:gettype()
+    local args, n = { ... }, nil
+    if select("#", ...) ~= #T.parameters then
+        error(("%s expects %d arrays of arguments but got %d"):format(
+            fn.name, #T.parameters, select("#", ...)), 2)
+    end
+    for k, t in ipairs(T.parameters) do
+        local len = length(args[k], t)
+        if not len then
+            error(("argument %d is not a table or an array; use fn:batch() to pass pointers"):format(k), 2)
+        elseif n and len ~= n then
+            error(("argument %d has %d elements but argument 1 has %d"):format(k, len, n), 2)
+        end
+        n = len
+        if type(args[k]) == "table" then
+            t:complete()
+            args[k] = ffi.new(t:cstring() .. "[?]", n, args[k])
+        end
+    end
+    n = n or 0
+    if T.returntype:isunit() then
+        batched(n, unpack(args, 1, #T.parameters))
+        return
+    end
+    T.returntype:complete()
+    local out = ffi.new(T.returntype:cstring() .. "[?]", n)
+    batched(n, out, unpack(args, 1, #T.parameters))
+    return out
+end
+
+return { batch = batch, mapcall = mapcall }
@@ -0,0 +1,91 @@
+-- Entry points: Lua functions that call a Terra function with as little work per
+-- call as LuaJIT allows.
+--
+--   local entrypoint = require("entrypoint")
+--   local add = entrypoint(addvectors)       -- addvectors : {vec3, vec3} -> vec3
+--   local out = terralib.new(vec3)
+--   add(out, a, b)                           -- writes the result into out
+--
+-- Calling a Terra function from Lua goes through its __call metamethod and the
+-- FFI's generic marshalling: aggregates are copied into the call and every
+-- aggregate result is a fresh cdata. An entry point instead calls a small Terra
+-- wrapper that takes structs, arrays and vectors by reference and writes an
+-- aggregate result through a pointer passed as the first argument, so a loop of
+-- calls allocates nothing. The Lua side is a closure generated for the exact
+-- number of arguments, which LuaJIT compiles into a direct call. Aggregate
+-- arguments must be cdata; when the result argument is nil a new one is
+-- allocated, which is as slow as calling the function directly.
+
+local ffi = require("ffi")
+
+local function byreference(t)
+    return t:isstruct() or t:isarray() or t:isvector()
+end
+
+local function wrap(fn, T)
+    local params = T.parameters:map(function(t)
+        return symbol(byreference(t) and &t or t)
+    end)
+    local args = terralib.newlist()
+    for i, p in ipairs(params) do
+        args:insert(byreference(T.parameters[i]) and `@p or `p)
+    end
+    local rt = T.returntype
+    local wrapper
+    if byreference(rt) then
+        local result = symbol(&rt, "result")
+        wrapper = terra([result], [params])
+            @result = fn([args])
+        end
+    elseif rt:isunit() then
+        wrapper = terra([params]) fn([args]) end
+    else
+        wrapper = terra([params]) : rt return fn([args]) end
+    end
+    wrapper:setname(fn.name .. ".entrypoint")
+    return wrapper
+end
+
+-- Lua callers, one per arity and kind of result; they only differ in their upvalues
+local callers = {}
+local function caller(nargs, kind)
+    local key = kind .. nargs
+    if not callers[key] then
+        local names = {}
+        for i = 1, nargs do names[i] = "a" .. i end
+        local arglist = table.concat(names, ", ")
+        local src
+        if kind == "aggregate" then
+            src = ("return function(%s) return function(result%s) result = result or new(ctype) "
+                .. "cfn(result%s) return result end end"):format("cfn, ctype, new",
+                nargs > 0 and ", " .. arglist or "", nargs > 0 and ", " .. arglist or "")
+        elseif kind == "unit" then
+            src = ("return function(cfn) return function(%s) cfn(%s) end end"):format(arglist, arglist)
+        else
+            src = ("return function(cfn) return function(%s) return cfn(%s) end end"):format(arglist, arglist)
+        end
+        callers[key] = assert(loadstring(src, "=entrypoint"))()
+    end
+    return callers[key]
+end
+
+local entries = setmetatable({}, { __mode = "k" })
+
+local function entrypoint(fn)
+    assert(terralib.isfunction(fn) and fn:isdefined(), "expected a defined terra function")
+    if entries[fn] then return entries[fn] end
+    local T = fn:gettype()
+    assert(not T.isvararg, "cannot make an entry point for a function with variable arguments")
+    local wrapper = wrap(fn, T)
+    local cfn = wrapper:getpointer()
+    local rt, call = T.returntype
+    if byreference(rt) then
+        call = caller(#T.parameters, "aggregate")(cfn, ffi.typeof(rt:cstring()), ffi.new)
+    else
+        call = caller(#T.parameters, rt:isunit() and "unit" or "value")(cfn)
+    end
+    entries[fn] = call
+    return call
+end
+
+return entrypoint
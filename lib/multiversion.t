@@ -0,0 +1,122 @@
+-- Function multiversioning: compile a function once per CPU level and call the
+-- best version the running machine supports.
+--
+--   local multiversion = require("multiversion")
+--   local fast = multiversion(f, { "x86-64-v3", "x86-64-v4" })
+--
+-- Versions are listed from least to most preferred; f itself, compiled for the
+-- compilation unit's target, is the fallback. The returned function has f's type.
+-- On its first call it checks the CPU once and then always calls the chosen
+-- version, both in the JIT and in objects written by terralib.saveobj.
+-- A version can also be a table { cpu = ..., features = ..., supported = fn }
+-- where supported is a Terra function of type {} -> bool.
+-- multiversion.x86decode(ecx1, ecx81, ebx7, xcr0) returns the x86-64 level (1-4)
+-- that the named versions are selected by, for the given CPUID.1:ECX,
+-- CPUID.80000001h:ECX, CPUID.(7,0):EBX and XCR0 values.
+
+local C = terralib.includecstring [[
+/* x86-64 microarchitecture level (1-4) given CPUID.1:ECX, CPUID.80000001h:ECX,
+   CPUID.(EAX=7,ECX=0):EBX and XCR0 */
+static int terra_multiversion_x86decode(unsigned int ecx1, unsigned int ecx81,
+                                        unsigned int ebx7, unsigned int xcr0) {
+#define HAS(r, bits) (((r) & (bits)) == (bits))
+    /* SSE3 SSSE3 CX16 SSE4.1 SSE4.2 POPCNT, LAHF */
+    if (!HAS(ecx1, 0x00982201u) || !HAS(ecx81, 0x1u)) return 1;
+    /* FMA MOVBE OSXSAVE AVX F16C, BMI1 AVX2 BMI2, LZCNT, XMM/YMM state */
+    if (!HAS(ecx1, 0x38401000u) || !HAS(ebx7, 0x00000128u) || !HAS(ecx81, 0x20u) ||
+        !HAS(xcr0, 0x6u))
+        return 2;
+    /* AVX512F AVX512DQ AVX512CD AVX512BW AVX512VL, opmask/ZMM state */
+    if (!HAS(ebx7, 0xd0030000u) || !HAS(xcr0, 0xe6u)) return 3;
+#undef HAS
+    return 4;
+}
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+/* highest x86-64 microarchitecture level (1-4) supported by the CPU and the OS */
+static int terra_multiversion_x86level(void) {
+    unsigned int eax, ebx, edx, ecx1, ecx81, ebx7 = 0, ecx7, edx7, xcr0 = 0, xcr0hi;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx1, &edx)) return 1;
+    if (!__get_cpuid(0x80000001, &eax, &ebx, &ecx81, &edx)) ecx81 = 0;
+    if (__get_cpuid_max(0, 0) >= 7) __cpuid_count(7, 0, eax, ebx7, ecx7, edx7);
+    if (ecx1 & (1u << 27)) /* OSXSAVE */
+        __asm__ volatile("xgetbv" : "=a"(xcr0), "=d"(xcr0hi) : "c"(0));
+    return terra_multiversion_x86decode(ecx1, ecx81, ebx7, xcr0);
+}
+#else
+static int terra_multiversion_x86level(void) { return 0; }
+#endif
+]]
+
+local levels = { ["x86-64-v2"] = 2, ["x86-64-v3"] = 3, ["x86-64-v4"] = 4 }
+
+local function supportsx86level(n)
+    return terra() : bool return C.terra_multiversion_x86level() >= n end
+end
+
+local function newversion(fn, v)
+    if type(v) == "string" then
+        local n = levels[v]
+        if not n then
+            error(("unknown CPU level '%s', expected one of x86-64-v2, x86-64-v3 or x86-64-v4, or a table { cpu = ..., supported = ... }"):format(v))
+        end
+        v = { cpu = v, supported = supportsx86level(n) }
+    end
+    if type(v) ~= "table" or type(v.cpu) ~= "string" or not terralib.isfunction(v.supported) then
+        error("expected a CPU level name or a table { cpu = string, features = string?, supported = terra function }")
+    end
+    -- the versions share the typechecked body but need their own definition,
+    -- since the definition carries the name and the target attributes
+    local copy = setmetatable({}, getmetatable(fn.definition))
+    for k, e in pairs(fn.definition) do copy[k] = e end
+    local version = terralib.irtypes.terrafunction(nil, fn.name .. "." .. v.cpu, fn.type, fn.anchor)
+    version:adddefinition(copy)
+    version:settarget(v.cpu, v.features)
+    return { fn = version, supported = v.supported }
+end
+
+local function multiversion(fn, versions)
+    assert(terralib.isfunction(fn) and fn:isdefined(), "expected a defined terra function")
+    local T = fn:gettype()
+    assert(not T.isvararg, "cannot multiversion a function with variable arguments")
+    versions = terralib.newlist(versions):map(function(v) return newversion(fn, v) end)
+
+    local choice = global(int, -1)
+    local terra choose() : int
+        escape
+            for i = #versions, 1, -1 do
+                emit quote if [versions[i].supported]() then return i end end
+            end
+        end
+        return 0
+    end
+    choose:setinlined(false)
+
+    local params = T.parameters:map(symbol)
+    local function call(f)
+        if T.returntype:isunit() then
+            return quote f([params]) return end
+        end
+        return quote return f([params]) end
+    end
+    local terra dispatch([params]) : T.returntype
+        -- racing first calls all store the same choice, so monotonic accesses suffice;
+        -- they only keep the racing load and store from being a data race
+        var chosen = terralib.attrload(&choice, { ordering = "monotonic" })
+        if chosen < 0 then
+            chosen = choose()
+            terralib.attrstore(&choice, chosen, { ordering = "monotonic" })
+        end
+        escape
+            for i, v in ipairs(versions) do
+                emit quote if chosen == i then [call(v.fn)] end end
+            end
+        end
+        [call(fn)]
+    end
+    dispatch:setname(fn.name .. ".dispatch")
+    return dispatch, versions:map(function(v) return v.fn end)
+end
+
+return setmetatable({ x86decode = C.terra_multiversion_x86decode },
+                    { __call = function(_, ...) return multiversion(...) end })
@@ -0,0 +1,68 @@
+-- Patchable functions: a stable entry point whose implementation can be replaced
+-- while the program runs.
+--
+--   local patchable = require("patchable")
+--   local kernel = patchable.new(kernel_v1)  -- call or reference kernel as usual
+--   ...
+--   patchable.patch(kernel, kernel_v2)       -- later calls run kernel_v2
+--
+-- Code compiled against kernel calls a small stub that loads the current
+-- implementation from a pointer-sized slot, like a call through the GOT. patch
+-- compiles the new implementation first and then swaps the slot with a single
+-- atomic exchange, so concurrent callers never take a lock and see either the old
+-- or the new implementation. The JIT never unmaps machine code while the
+-- compilation unit is alive, so calls still running the old implementation finish
+-- safely and there is nothing to reclaim after them; patch only drops the
+-- reference to the old definition so its IR can be collected.
+
+local patchable = {}
+
+local entries = setmetatable({}, { __mode = "k" })
+
+local terra exchange(slot : &intptr, value : intptr) : intptr
+    return terralib.atomicrmw("xchg", slot, value, { ordering = "acq_rel" })
+end
+
+function patchable.new(impl)
+    assert(terralib.isfunction(impl) and impl:isdefined(), "expected a defined terra function")
+    local T = impl:gettype()
+    assert(not T.isvararg, "cannot make a function with variable arguments patchable")
+
+    local slot = global(intptr, `[intptr](impl), impl.name .. ".slot")
+    local params = T.parameters:map(symbol)
+    local terra stub([params]) : T.returntype
+        -- one acquire load per call, which pairs with the release half of exchange so
+        -- that everything the new implementation depends on is visible before it is
+        -- called; on x86 this is an ordinary load
+        var fn = [&T](terralib.attrload(&slot, { ordering = "acquire" }))
+        return fn([params])
+    end
+    stub:setname(impl.name .. ".patchable")
+    entries[stub] = { slot = slot, current = impl, patches = 0 }
+    return stub
+end
+
+function patchable.ispatchable(fn)
+    return entries[fn] ~= nil
+end
+
+-- the implementation currently installed in fn, and how often it was patched
+function patchable.current(fn)
+    local entry = assert(entries[fn], "expected a function created by patchable.new")
+    return entry.current, entry.patches
+end
+
+function patchable.patch(fn, impl)
+    local entry = assert(entries[fn], "expected a function created by patchable.new")
+    assert(terralib.isfunction(impl) and impl:isdefined(), "expected a defined terra function")
+    if impl:gettype() ~= fn:gettype() then
+        error(("cannot patch a function of type %s with a function of type %s"):format(
+            tostring(fn:gettype()), tostring(impl:gettype())), 2)
+    end
+    -- compile before publishing so callers never wait on the JIT
+    local address = terralib.cast(intptr, impl:getpointer())
+    exchange(entry.slot:getpointer(), address)
+    entry.current, entry.patches = impl, entry.patches + 1
+end
+
+return patchable
@@ -143,7 +143,7 @@ function S.Vector(T,debug)
     
     terra Vector:get(i : uint64)
         assert(i < self._size) 
-        return &self._data[i]
+        return &self._data[terralib.boundscheck(i, self._size)]
     end
     Vector.metamethods.__apply = macro(function(self,idx)
         return `@self:get(idx)
@@ -187,7 +187,7 @@ function S.Vector(T,debug)
     Vector.methods.remove = terralib.overloadedfunction("remove")
     Vector.methods.remove:adddefinition(terra(self : &Vector, idx : uint64) : T
         assert(idx < self._size)
-        var v = self._data[idx]
+        var v = self._data[terralib.boundscheck(idx, self._size)]
         self._size = self._size - 1
         for i = idx,self._size do
             self._data[i] = self._data[i + 1]
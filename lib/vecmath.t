@@ -0,0 +1,513 @@
+-- Vector math in the style of SLEEF: exp, log, sin, cos, pow, tanh and erf for
+-- float, double and vectors of either of any width. Each function is straight-line
+-- code over all lanes, generated once per type.
+--
+--   local vecmath = require("vecmath")
+--   terra damped(t : vector(double, 4)) return vecmath.exp(-t) * vecmath.cos(t) end
+--
+-- The functions are macros that dispatch on the type of their argument; integers
+-- are treated as doubles and pow converts its exponent to the type of its base.
+-- vecmath.generate(name, T) returns the Terra function itself. tests/vecmath.t
+-- measures the error against the C library evaluated in double precision, which is
+-- itself not correctly rounded, and checks that it is at most
+--   2 ULP  exp, log, sin, cos
+--   3 ULP  pow, tanh, erf
+-- and infinities, NaNs and signed zeros are handled as in C99 Annex F. float exp and
+-- log use single-precision kernels; float sin, cos, pow, tanh and erf are evaluated
+-- in double precision and rounded. sin and cos reduce arguments up to 823549.6 in
+-- vector code and call the C library for lanes beyond that. No fused multiply-add
+-- is assumed, and the bounds do not hold in compilation units using fastmath.
+--
+-- vecmath.register(widths) adds the functions as vector variants of the C library's
+-- exp, log, sin, cos, pow, tanh and erf and of expf, logf, ... (see
+-- terralib.addvectorvariant), so that the loop vectorizer turns loops calling them
+-- into calls on whole vectors. widths defaults to
+--   { [double] = { 2, 4, 8 }, [float] = { 4, 8, 16 } }
+-- A compilation unit looks the variants up when it first compiles a call to the C
+-- function, so register before then.
+
+local C = terralib.includecstring [[
+#include <math.h>
+]]
+
+local vecmath = {}
+
+local function element(T) return T:isvector() and T.type or T end
+local function withelement(T, E) return T:isvector() and vector(E, T.N) or E end
+-- the integer type with the size of the floating-point type T
+local function bitstype(T) return withelement(T, element(T) == double and int64 or int32) end
+
+local function K(E, c) return terralib.constant(E, c) end
+-- c in every lane of T
+local function splat(T, c) return `[T]([K(element(T), c)]) end
+
+local function llvmintrinsic(name)
+    return terralib.intrinsic(function(types)
+        local T = types[1]
+        local suffix = element(T) == float and "f32" or "f64"
+        if T:isvector() then suffix = ("v%d%s"):format(T.N, suffix) end
+        return ("llvm.%s.%s"):format(name, suffix), types -> T
+    end)
+end
+local floor, fabs, copysign = llvmintrinsic("floor"), llvmintrinsic("fabs"), llvmintrinsic("copysign")
+
+local bitcast = terralib.memoize(function(from, to)
+    local struct Bits { union { a : from; b : to } }
+    local terra cast(x : from) : to
+        var u : Bits
+        u.a = x
+        return u.b
+    end
+    cast:setinlined(true)
+    return cast
+end)
+
+-- c[1] + x*(c[2] + x*(c[3] + ...))
+local function horner(T, x, c)
+    local E = element(T)
+    local r = splat(T, c[#c])
+    for i = #c - 1, 1, -1 do
+        r = `[r] * [x] + [K(E, c[i])]
+    end
+    return r
+end
+
+-- s = a + b exactly as s + e
+local function twosum(a, b)
+    return quote
+        var x, y = [a], [b]
+        var s = x + y
+        var bb = s - x
+    in
+        s, (x - (s - bb)) + (y - bb)
+    end
+end
+
+-- p = a * b exactly as p + e (Dekker, for |a|, |b| < 2^995)
+local function twoprod(T, a, b)
+    local split = K(element(T), 134217729)
+    return quote
+        var x, y = [a], [b]
+        var p = x * y
+        var cx, cy = split * x, split * y
+        var xh, yh = cx - (cx - x), cy - (cy - y)
+        var xl, yl = x - xh, y - yh
+    in
+        p, ((xh * yh - p) + xh * yl + xl * yh) + xl * yl
+    end
+end
+
+-- exp
+
+local function taylor(terms) -- 1/2!, 1/3!, ...
+    local c, f = terralib.newlist(), 1
+    for k = 2, terms do
+        f = f * k
+        c:insert(1 / f)
+    end
+    return c
+end
+
+local expconstants = {
+    [double] = { min = -746, max = 710, log2e = 1.44269504088896338700e+00,
+                 ln2hi = 6.93147180369123816490e-01, ln2lo = 1.90821492927058770002e-10,
+                 taylor = taylor(13), bias = 1023, mantissa = 52 },
+    [float] = { min = -104, max = 89, log2e = 1.4426950409,
+                ln2hi = 6.9314575195e-01, ln2lo = 1.4286067653e-06,
+                taylor = taylor(7), bias = 127, mantissa = 23 },
+}
+
+-- e^x as (y, n) with the result y * 2^n, x being at most 89 (float) or 710 (double)
+-- and l a correction to it much smaller than an ULP of x
+local function expreduced(T, x, l)
+    local E, c = element(T), expconstants[element(T)]
+    return quote
+        var y : T = [x]
+        var n = floor(y * [K(E, c.log2e)] + [K(E, 0.5)])
+        var r = (y - n * [K(E, c.ln2hi)]) - n * [K(E, c.ln2lo)]
+        [l and quote r = r + [l] end or {}]
+        var p = [horner(T, r, c.taylor)]
+        p = r + (r * r) * p
+    in
+        p, [bitstype(T)](n)
+    end
+end
+
+-- 2^n for n in the normal exponent range
+local function pow2(T, n)
+    local c = expconstants[element(T)]
+    return `[bitcast(bitstype(T), T)](([n] + c.bias) << c.mantissa)
+end
+
+-- e^(h + l)
+local function expk(T, h, l)
+    local E, c = element(T), expconstants[element(T)]
+    return quote
+        var x0 : T = [h]
+        var nan = x0 ~= x0
+        var x = terralib.select(nan, [splat(T, 0)], x0)
+        x = terralib.select(x < [K(E, c.min)], [splat(T, c.min)], x)
+        x = terralib.select(x > [K(E, c.max)], [splat(T, c.max)], x)
+        var p, n = [expreduced(T, x, l)]
+        -- 2^n in two steps, so that results near overflow and underflow are exact
+        var n1 = n >> 1
+        var y = ([K(E, 1)] + p) * [pow2(T, n1)] * [pow2(T, `n - n1)]
+    in
+        terralib.select(nan, x0, y)
+    end
+end
+
+-- log
+
+local logconstants = {
+    [double] = { tiny = 2.2250738585072014e-308, scale = 2^54, scaleexponent = 54,
+                 ln2hi = 6.93147180369123816490e-01, ln2lo = 1.90821492927058770002e-10,
+                 lg = { 6.666666666666735130e-01, 3.999999999940941908e-01,
+                        2.857142874366239149e-01, 2.222219843214978396e-01,
+                        1.818357216161805012e-01, 1.531383769920937332e-01,
+                        1.479819860511658591e-01 } },
+    [float] = { tiny = 1.1754943508222875e-38, scale = 2^25, scaleexponent = 25,
+                ln2hi = 6.9313812256e-01, ln2lo = 9.0580006145e-06,
+                lg = { 0.66666662693, 0.40000972152, 0.28498786688, 0.24279078841 } },
+}
+
+-- positive finite x as m * 2^e with m in [sqrt(2)/2, sqrt(2)]
+local function decompose(T, x)
+    local E, IT = element(T), bitstype(T)
+    local c, ec = logconstants[E], expconstants[E]
+    return quote
+        var y : T = [x]
+        var subnormal = y < [K(E, c.tiny)]
+        y = terralib.select(subnormal, y * [K(E, c.scale)], y)
+        var bits = [bitcast(T, IT)](y)
+        var exponent = terralib.select(subnormal, [splat(T, -c.scaleexponent)], [splat(T, 0)])
+        exponent = exponent + [T]((bits >> ec.mantissa) - ec.bias)
+        var mantissa = ([IT](1) << ec.mantissa) - 1
+        var m = [bitcast(IT, T)]((bits and mantissa) or ([IT](ec.bias) << ec.mantissa))
+        var big = m > [K(E, math.sqrt(2))]
+        m = terralib.select(big, m * [K(E, 0.5)], m)
+        exponent = terralib.select(big, exponent + 1, exponent)
+    in
+        m, exponent
+    end
+end
+
+local function log(T)
+    local E, c = element(T), logconstants[element(T)]
+    return terra(x : T) : T
+        var m, e = [decompose(T, x)]
+        var f = m - 1
+        var s = f / (2 + f)
+        var z = s * s
+        var R = z * [horner(T, z, c.lg)]
+        var hfsq = [K(E, 0.5)] * f * f
+        var r = e * [K(E, c.ln2hi)] - ((hfsq - (s * (hfsq + R) + e * [K(E, c.ln2lo)])) - f)
+        r = terralib.select(x == 0, [splat(T, -math.huge)], r)
+        r = terralib.select(x < 0 or x ~= x, [splat(T, 0/0)], r)
+        return terralib.select(x == [K(E, math.huge)], x, r)
+    end
+end
+
+-- sin and cos
+
+local INVPIO2 = 6.36619772367581382433e-01
+-- pi/2 in four parts
+local PIO2_1 = 1.57079632673412561417e+00
+local PIO2_2 = 6.07710050630396597660e-11
+local PIO2_3 = 2.02226624871116645580e-21
+local PIO2_3T = 8.47842766036889956997e-32
+-- largest argument reduced in vector code
+local TRIGMAX = 823549.6
+local SIN = { -1.66666666666666324348e-01, 8.33333333332248946124e-03, -1.98412698298579493134e-04,
+              2.75573137070700676789e-06, -2.50507602534068634195e-08, 1.58969099521155010221e-10 }
+local COS = { 4.16666666666666019037e-02, -1.38888888888741095749e-03, 2.48015872894767294178e-05,
+              -2.75573143513906633035e-07, 2.08757232129817482790e-09, -1.13596475577881948265e-11 }
+
+-- sin(x + y) for |x + y| <= pi/4 and |y| much smaller than |x|
+local function ksin(T, x, y)
+    local E = element(T)
+    return quote
+        var z = x * x
+        var v = z * x
+        var r = [horner(T, z, { unpack(SIN, 2) })]
+    in
+        x - ((z * ([K(E, 0.5)] * y - v * r) - y) - v * [K(E, SIN[1])])
+    end
+end
+
+-- cos(x + y), likewise
+local function kcos(T, x, y)
+    local E = element(T)
+    return quote
+        var z = x * x
+        var r = z * [horner(T, z, COS)]
+        var hz = [K(E, 0.5)] * z
+        var w = 1 - hz
+    in
+        w + (((1 - w) - hz) + (z * r - x * y))
+    end
+end
+
+-- r = fn(x) in the lanes where fast is false
+local function slowlanes(T, fast, r, fn, x)
+    if not T:isvector() then
+        return quote if not [fast] then [r] = fn([x]) end end
+    end
+    local any, lanes = `not [fast][0], terralib.newlist()
+    for i = 0, T.N - 1 do
+        if i > 0 then any = `[any] or not [fast][i] end
+        lanes:insert(`terralib.select([fast][i], [r][i], fn([x][i])))
+    end
+    return quote if [any] then [r] = vector([lanes]) end end
+end
+
+local function trig(T, cosine)
+    local E, IT = element(T), bitstype(T)
+    return terra(x : T) : T
+        var ax = fabs(x)
+        var fast = ax <= [K(E, TRIGMAX)]
+        var xs = terralib.select(fast, x, [splat(T, 0)])
+        -- x - q*pi/2 in double-double
+        var q = floor(xs * [K(E, INVPIO2)] + [K(E, 0.5)])
+        var s, e1 = [twosum(`xs - q * [K(E, PIO2_1)], `-(q * [K(E, PIO2_2)]))]
+        var s2, e2 = [twosum(s, `-(q * [K(E, PIO2_3)]))]
+        var lo = (e1 + e2) - q * [K(E, PIO2_3T)]
+        var y0 = s2 + lo
+        var y1 = (s2 - y0) + lo
+        var sn, cs = [ksin(T, y0, y1)], [kcos(T, y0, y1)]
+        var k = [IT](q) + [cosine and 1 or 0]
+        var r = terralib.select((k and 1) == 0, sn, cs)
+        r = terralib.select((k and 2) == 0, r, -r)
+        [not cosine and quote r = terralib.select(ax < [K(E, 2^-27)], x, r) end or {}]
+        [slowlanes(T, fast, r, cosine and C.cos or C.sin, x)]
+        return r
+    end
+end
+
+-- pow
+
+local TWO3H = 2 / 3
+local TWO3L = 3.700743415417188e-17 -- 2/3 - TWO3H
+local LOGQ = {} -- 2/5, 2/7, 2/9, ...
+for k = 0, 12 do LOGQ[k + 1] = 2 / (2 * k + 5) end
+
+-- log(x) as a double-double (h, l), for positive finite x
+local function logk(T, x)
+    local E, c = element(T), logconstants[element(T)]
+    return quote
+        var m, e = [decompose(T, x)]
+        var f = m - 1
+        var d = 2 + f
+        var dl = (2 - d) + f
+        -- s = f/(2 + f) and log(m) = 2s + 2s^3/3 + 2s^5/5 + ...
+        var sh = f / d
+        var ph, pl = [twoprod(T, sh, d)]
+        var sl = (((f - ph) - pl) - sh * dl) / d
+        var zh, zl = [twoprod(T, sh, sh)]
+        zl = zl + 2 * sh * sl
+        var ch, cl = [twoprod(T, sh, zh)]
+        cl = cl + (sh * zl + sl * zh)
+        var th, tl = [twoprod(T, ch, K(E, TWO3H))]
+        tl = tl + (ch * [K(E, TWO3L)] + cl * [K(E, TWO3H)])
+        var t5 = ch * zh * [horner(T, zh, LOGQ)]
+        var A, a = [twosum(`2 * sh, th)]
+        var lo = a + (2 * sl + (tl + t5))
+        var S, b = [twosum(`e * [K(E, c.ln2hi)], A)]
+        lo = lo + (b + e * [K(E, c.ln2lo)])
+        var h = S + lo
+    in
+        h, (S - h) + lo
+    end
+end
+
+local function pow(T)
+    local E = element(T)
+    local inf, nan = splat(T, math.huge), splat(T, 0/0)
+    return terra(x : T, y : T) : T
+        var ax = fabs(x)
+        var finite = ax > 0 and ax < [K(E, math.huge)]
+        var lh, ll = [logk(T, `terralib.select(finite, ax, [splat(T, 1)]))]
+        var ph, pl = [twoprod(T, y, lh)]
+        pl = pl + y * ll
+        pl = terralib.select(fabs(ph) < [K(E, 1000)], pl, [splat(T, 0)])
+        var r = [expk(T, ph, pl)]
+        var integer = floor(y) == y
+        var half = y * [K(E, 0.5)]
+        var odd = integer and floor(half) ~= half
+        r = terralib.select(x < 0, terralib.select(integer, terralib.select(odd, -r, r), [nan]), r)
+        -- zero and infinite x; the sign of -0 and -inf survives odd exponents
+        var edge = terralib.select((ax == [K(E, math.huge)]) == (y > 0), [inf], [splat(T, 0)])
+        edge = terralib.select(copysign([splat(T, 1)], x) < 0 and odd, -edge, edge)
+        edge = terralib.select(y ~= y, y, edge)
+        r = terralib.select(ax == 0 or ax == [K(E, math.huge)], edge, r)
+        -- infinite y
+        var limit = terralib.select((ax > 1) == (y > 0), [inf], [splat(T, 0)])
+        limit = terralib.select(ax == 1, [splat(T, 1)], limit)
+        r = terralib.select(fabs(y) == [K(E, math.huge)], limit, r)
+        r = terralib.select(x ~= x or y ~= y, [nan], r)
+        return terralib.select(y == 0 or x == 1, [splat(T, 1)], r)
+    end
+end
+
+-- tanh and erf, with polynomials fitted by minimax for double precision
+
+local TANH = { -0.3333333333333333, 0.13333333333332714, -0.053968253967434016,
+               0.021869488493666944, -0.008863234397814355, 0.003592110378689024,
+               -0.001455661830100716, 0.0005889360520074057, -0.0002346347410887237,
+               8.511313685577671e-05, -2.060276537636634e-05 }
+
+local function tanh(T)
+    local E = element(T)
+    return terra(x : T) : T
+        var ax = fabs(x)
+        ax = terralib.select(ax < 22, ax, [splat(T, 22)])
+        var z = ax * ax
+        var small = ax + ax * z * [horner(T, z, TANH)]
+        -- (e^2x - 1)/(e^2x + 1) with e^2x - 1 = 2^n - 1 + 2^n p
+        var p, n = [expreduced(T, `2 * ax)]
+        var sc = [pow2(T, n)]
+        var e = (sc - 1) + sc * p
+        var t = terralib.select(ax < [K(E, 0.55)], small, e / (e + 2))
+        return terralib.select(x ~= x, x, copysign(t, x))
+    end
+end
+
+local ERFSMALL = { 1.1283791670955126, -0.37612638903183715, 0.11283791670952596,
+                   -0.026866170644428485, 0.005223977615420539, -0.0008548326188759752,
+                   0.00012055289567541706, -1.4924196305569617e-05, 1.643068417974155e-06,
+                   -1.5940066854661717e-07, 1.1472499701094691e-08 }
+-- erfc(x) e^(x^2) on [0.75, 1.25], [1.25, 2.25], [2.25, 4.25] and [4.25, 6.25] in
+-- t = (x - mid)*scale
+local ERFMID = { 1, 1.75, 3.25, 5.25 }
+local ERFSCALE = { 4, 2, 1, 1 }
+local ERFC = terralib.newlist {
+    { 0.427583576155807, -0.06830300369597464, 0.009648222585744277, -0.0012379213897082304,
+      0.00014676678209097987, -1.6271356533607403e-05, 1.7016949157614066e-06,
+      -1.6901030126237315e-07, 1.6025839230182715e-08, -1.457040885827008e-09,
+      1.2747094515301794e-10, -1.0763163688654159e-11, 8.793588331307676e-13,
+      -6.965456005895701e-14, 5.362081796289239e-15, -4.1080876786478515e-16,
+      2.996939677536019e-17 },
+    { 0.2849722347374364, -0.0654881727572426, 0.013940907521771817, -0.0027824994051736463,
+      0.000525269950458066, -9.440545785556161e-05, 1.6237570663020877e-05,
+      -2.683854333240321e-06, 4.277550342173039e-07, -6.592839745656103e-08,
+      9.85027292239454e-09, -1.429715260792872e-09, 2.0194365654275616e-10,
+      -2.7740965149447336e-11, 3.728986614637476e-12, -5.258769812694719e-13,
+      6.740559269897313e-14 },
+    { 0.16633534842682188, -0.047199402321169544, 0.012937290883017996, -0.0034354713009473754,
+      0.0008860045775420563, -0.00022238256901231562, 5.442040870345988e-05,
+      -1.3004643749659475e-05, 3.0388326690402915e-06, -6.951965151720267e-07,
+      1.55878893111284e-07, -3.431153420474132e-08, 7.410747266613488e-09,
+      -1.5491354650748564e-09, 3.2366637365527384e-10, -8.01381913035701e-11,
+      1.6128699800214236e-11 },
+    { 0.1056127354688918, -0.01944544467214865, 0.0035241509401113965, -0.0006291014910426204,
+      0.00011068405606903394, -1.9204078670991496e-05, 3.2875476800561164e-06,
+      -5.555581070327659e-07, 9.271691447087272e-08, -1.5287600759121164e-08,
+      2.491374910876744e-09, -4.0147635889355743e-10, 6.398126029666773e-11,
+      -1.0041873018688928e-11, 1.5672299369895485e-12, -2.684776030921192e-13,
+      4.098921222776986e-14 },
+}
+
+local function erf(T)
+    local E = element(T)
+    -- the value for each lane's interval
+    local function interval(b1, b2, b3, values)
+        return `terralib.select([b1], [splat(T, values[1])],
+                    terralib.select([b2], [splat(T, values[2])],
+                        terralib.select([b3], [splat(T, values[3])], [splat(T, values[4])])))
+    end
+    return terra(x : T) : T
+        var ax = fabs(x)
+        var z = ax * ax
+        var small = ax * [horner(T, z, ERFSMALL)]
+        var xc = terralib.select(ax < 6, ax, [splat(T, 6)])
+        var b1, b2, b3 = xc < [K(E, 1.25)], xc < [K(E, 2.25)], xc < [K(E, 4.25)]
+        var t = (xc - [interval(b1, b2, b3, ERFMID)]) * [interval(b1, b2, b3, ERFSCALE)]
+        var g = [interval(b1, b2, b3, ERFC:map(function(c) return c[#ERFC[1]] end))]
+        escape
+            for i = #ERFC[1] - 1, 1, -1 do
+                local c = ERFC:map(function(c) return c[i] end)
+                emit quote g = g * t + [interval(b1, b2, b3, c)] end
+            end
+        end
+        var h, l = [twoprod(T, xc, xc)]
+        var big = 1 - [expk(T, `-h, `-l)] * g
+        var r = terralib.select(ax < [K(E, 0.75)], small, terralib.select(ax < 6, big, [splat(T, 1)]))
+        return terralib.select(x ~= x, x, copysign(r, x))
+    end
+end
+
+-- the generators, and whether float is computed in double
+local generators = {
+    exp = { function(T) return terra(x : T) : T return [expk(T, x)] end end, false },
+    log = { log, false },
+    sin = { function(T) return trig(T, false) end, true },
+    cos = { function(T) return trig(T, true) end, true },
+    pow = { pow, true },
+    tanh = { tanh, true },
+    erf = { erf, true },
+}
+
+local function typename(T)
+    local name = element(T) == float and "f32" or "f64"
+    return T:isvector() and ("%sx%d"):format(name, T.N) or name
+end
+
+vecmath.generate = terralib.memoize(function(name, T)
+    local generator = generators[name]
+    if not generator then error("vecmath has no function " .. tostring(name), 2) end
+    local E = element(T)
+    if E ~= float and E ~= double then
+        error("vecmath functions take float, double or vectors of them, not " .. tostring(T), 2)
+    end
+    local fn
+    if E == float and generator[2] then
+        local D = withelement(T, double)
+        local dfn = vecmath.generate(name, D)
+        if name == "pow" then
+            fn = terra(x : T, y : T) : T return [T](dfn([D](x), [D](y))) end
+        else
+            fn = terra(x : T) : T return [T](dfn([D](x))) end
+        end
+    else
+        fn = generator[1](T)
+    end
+    fn:setname(("vecmath_%s_%s"):format(name, typename(T)))
+    return fn
+end)
+
+local function argumenttype(x)
+    local T = x:gettype()
+    if element(T):isintegral() then T = withelement(T, double) end
+    return T
+end
+for name in pairs(generators) do
+    if name == "pow" then
+        vecmath.pow = macro(function(x, y)
+            local T = argumenttype(x)
+            return `[vecmath.generate("pow", T)](x, y)
+        end)
+    else
+        vecmath[name] = macro(function(x)
+            return `[vecmath.generate(name, argumenttype(x))](x)
+        end)
+    end
+end
+
+local registered = {}
+function vecmath.register(widths)
+    widths = widths or { [double] = { 2, 4, 8 }, [float] = { 4, 8, 16 } }
+    for name in pairs(generators) do
+        for E, ns in pairs(widths) do
+            local cname = E == float and name .. "f" or name
+            for _, N in ipairs(ns) do
+                local fn = vecmath.generate(name, vector(E, N))
+                if not registered[fn] then
+                    terralib.addvectorvariant(cname, fn)
+                    registered[fn] = true
+                end
+            end
+        end
+    end
+end
+
+return vecmath
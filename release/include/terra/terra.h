@@ -26,6 +26,17 @@ int terra_loadbuffer(lua_State *L, const char *buf, size_t size, const char *nam
 int terra_loadstring(lua_State *L, const char *s);
 void terra_llvmshutdown();
 
+/* A compilation service is a JIT shared by several Terra states, e.g. one per worker
+   thread. Functions that do not depend on state-local globals are compiled once per
+   process and their code is shared by every attached state. The service must outlive
+   all states attached to it. */
+typedef struct terra_CompilationService terra_CompilationService;
+terra_CompilationService *terra_newcompilationservice();
+int terra_attachcompilationservice(lua_State *L, terra_CompilationService *S);
+void terra_compilationservicestats(terra_CompilationService *S, size_t *ncompiled,
+                                   size_t *nreused);
+void terra_freecompilationservice(terra_CompilationService *S);
+
 #define terra_dofile(L, fn) (terra_loadfile(L, fn) || lua_pcall(L, 0, LUA_MULTRET, 0))
 
 #define terra_dostring(L, s) (terra_loadstring(L, s) || lua_pcall(L, 0, LUA_MULTRET, 0))
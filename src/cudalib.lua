@@ -26,6 +26,9 @@ terralib.CUDAParams.entries = { { "gridDimX", uint },
                                 { "sharedMemBytes", uint },
                                 {"hStream" , terra.types.pointer(opaque) } }
                                 
+-- directory where generated PTX is kept between runs, keyed on a hash of the module
+terralib.ptxcache = os.getenv("TERRA_PTX_CACHE")
+
 function cudalib.toptx(module,dumpmodule,version,profile)
     dumpmodule,version = not not dumpmodule,assert(tonumber(version))
     profile = profile or {fastmath=false}
@@ -98,9 +101,9 @@ function cudalib.toptx(module,dumpmodule,version,profile)
     pfile:close()
 
     --call into tcuda.cpp to perform compilation
-    local r = terralib.toptximpl(cu,annotations,dumpmodule,version,libdevice)
+    local r,cached,nlowered = terralib.toptximpl(cu,annotations,dumpmodule,version,libdevice,terralib.ptxcache)
     cu:free()
-    return r
+    return r,cached,nlowered
 end
 
 cudalib.useculink = false
@@ -351,10 +354,10 @@ local function dumpsass(data,sz)
 end
 dumpsass = terralib.cast({&opaque,uint64} -> {},dumpsass)
 
-function cudalib.compile(module,dumpmodule,version,jitload)
+function cudalib.compile(module,dumpmodule,version,jitload,profile)
     version = version or cudalib.localversion()
     if jitload == nil then jitload = true end
-    local ptx = cudalib.toptx(module,dumpmodule,version)
+    local ptx = cudalib.toptx(module,dumpmodule,version,profile)
     local m,loader,fnhandles = cudalib.wrapptx(module,ptx,dumpmodule)
     if jitload then
         cudalib.linkruntime()
@@ -387,10 +387,78 @@ static int skip_sep(LexState *ls) {
     return (ls->current == s) ? count : (-count) - 1;
 }
 
+/*
+** Consume the n characters starting at ls->current directly from the input chunk.
+** The caller guarantees they are all inside the chunk. They still go to the output
+** buffer, but in one copy rather than one next() per character.
+*/
+static void skip_inplace(LexState *ls, size_t n) {
+    ZIO *z = ls->z;
+    const char *begin = z->p - 1; /* ls->current */
+    OutputBuffer_puts(&ls->output_buffer, (int)(n - 1), begin + 1);
+    ls->currentoffset += (int)(n - 1);
+    z->p += n - 1;
+    z->n -= n - 1;
+    next(ls);
+}
+
+/*
+** When the whole input is available in one chunk (strings, and files loaded through
+** terra_loadfile, which maps them), most names end inside the current chunk. Those are
+** interned straight from the source bytes instead of being copied into ls->buff.
+*/
+static TString *read_name(LexState *ls) {
+    ZIO *z = ls->z;
+    const char *begin = z->p - 1; /* ls->current */
+    const char *end = z->p + z->n;
+    const char *q = begin + 1;
+    while (q < end && lislalnum(*q)) q++;
+    if (q < end) {
+        skip_inplace(ls, q - begin);
+        return luaX_newstring(ls, begin, q - begin);
+    }
+    do {
+        save_and_next(ls);
+    } while (lislalnum(ls->current));
+    return luaX_newstring(ls, luaZ_buffer(ls->buff), luaZ_bufflen(ls->buff));
+}
+
+/*
+** Same idea for long strings: if the closing bracket is in the current chunk and the
+** contents have no '\r' (which would need newline normalization), the string is taken
+** from the source directly. Returns false if the slow path must be used.
+*/
+static bool read_long_string_inplace(LexState *ls, SemInfo *seminfo, int sep) {
+    if (ls->current == EOZ) return false;
+    ZIO *z = ls->z;
+    const char *begin = z->p - 1; /* ls->current */
+    const char *end = z->p + z->n;
+    int nlines = 0;
+    for (const char *q = begin; q < end; q++) {
+        if (*q == '\r') return false;
+        if (*q == '\n') {
+            nlines++;
+        } else if (*q == ']') {
+            const char *e = q + 1;
+            while (e < end && *e == '=') e++;
+            if (e < end && *e == ']' && e - q - 1 == sep) {
+                if (ls->linenumber + nlines >= MAX_INT)
+                    luaX_syntaxerror(ls, "chunk has too many lines");
+                ls->linenumber += nlines;
+                skip_inplace(ls, e + 1 - begin);
+                seminfo->ts = luaX_newstring(ls, begin, q - begin);
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
 static void read_long_string(LexState *ls, SemInfo *seminfo, int sep) {
     save_and_next(ls);     /* skip 2nd `[' */
     if (currIsNewline(ls)) /* string starts with a newline? */
         inclinenumber(ls); /* skip it */
+    if (seminfo && read_long_string_inplace(ls, seminfo, sep)) return;
     for (;;) {
         switch (ls->current) {
             case EOZ:
@@ -696,12 +764,7 @@ static int llex(LexState *ls, SemInfo *seminfo) {
             }
             default: {
                 if (lislalpha(ls->current)) { /* identifier or reserved word? */
-                    TString *ts;
-                    do {
-                        save_and_next(ls);
-                    } while (lislalnum(ls->current));
-                    ts = luaX_newstring(ls, luaZ_buffer(ls->buff),
-                                        luaZ_bufflen(ls->buff));
+                    TString *ts = read_name(ls);
                     seminfo->ts = ts;
                     if (ts->reserved > 0) /* reserved word? */
                         return ts->reserved - 1 + FIRST_RESERVED;
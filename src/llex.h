@@ -146,6 +146,7 @@ static inline void OutputBuffer_puts(OutputBuffer *buf, int N, const char *str)
 }
 
 struct TerraCnt;
+struct TreeArena;
 /* state of the lexer plus state of the parser when shared by all
    functions */
 typedef struct LexState {
@@ -167,6 +168,7 @@ typedef struct LexState {
     char decpoint;   /* locale decimal point */
 
     int in_terra;
+    TreeArena *trees; /* trees under construction, see lparser.cpp */
     OutputBuffer output_buffer;
 
     struct {
@@ -209,6 +211,8 @@ enum TA_Globals {
     TA_ENTRY_POINT_TABLE,
     TA_LANGUAGES_TABLE,
     TA_TYPE_TABLE,
+    TA_FILENAME,
+    TA_TREE_VALUES,
     TA_LAST_GLOBAL
 };
 // accessors for lua state assocated with the Terra lexer
@@ -27,20 +27,22 @@
 // #include "ltable.h"
 #include <vector>
 #include <set>
+#include <string>
 #include <sstream>
 #include "llvm/ADT/SmallSet.h"
+#include "llvm/ADT/StringMap.h"
 #include "treadnumber.h"
 
 static void dump_stack(lua_State *L, int elem);
 
-// helpers to ensure that the lua stack contains the right number of arguments after a
+// helpers to ensure that the tree stack contains the right number of arguments after a
 // call
 #define RETURNS_N(x, n)                                                           \
     do {                                                                          \
         if (ls->in_terra) {                                                       \
-            int begin = lua_gettop(ls->L);                                        \
+            int begin = tree_top(ls);                                             \
             (x);                                                                  \
-            int end = lua_gettop(ls->L);                                          \
+            int end = tree_top(ls);                                               \
             if (begin + n != end) {                                               \
                 fprintf(stderr, "%s:%d: unmatched return\n", __FILE__, __LINE__); \
                 luaX_syntaxerror(ls, "error");                                    \
@@ -79,51 +81,294 @@ struct TerraCnt {
     TerraCnt *previous;
 };
 
+// Trees are built in a native arena while parsing and converted to Lua tables in one
+// pass when they are stored in terra._trees (see store_value). Going through the Lua API
+// for every node costs a constructor call, a table and a handful of stack operations
+// each, which dominated the time spent parsing large files. The arena keeps a stack of
+// values that mirrors the one the Lua API would have used, so the grammar rules refer to
+// tables, lists and objects by their index on it just as they would on the Lua stack.
+struct TreeValue {
+    enum Kind : uint8_t { NIL, BOOLEAN, NUMBER, INTEGER, STRING, LUAVALUE, NODE } kind;
+    union {
+        bool b;
+        double d;
+        int64_t i;
+        struct {
+            uint32_t offset, length; /* in TreeArena::strings */
+        } s;
+        int ref;       /* index of a Lua value in the TA_TREE_VALUES table */
+        uint32_t node; /* in TreeArena::nodes */
+    };
+};
+
+static const uint32_t NO_ENTRY = UINT32_MAX;
+
+struct TreeEntry {
+    TreeValue value;
+    int32_t name;  /* offset of the field name in TreeArena::strings, or -1 for list
+                      elements and the positional arguments of objects */
+    uint32_t next; /* next entry of the same node */
+};
+
+struct TreeNode {
+    enum Kind : uint8_t { TABLE, LIST, OBJECT } kind;
+    uint32_t objectkind; /* in TreeArena::kinds */
+    int linenumber, offset;
+    uint32_t first, last, size; /* entries, chained through TreeEntry::next */
+};
+
+// an object kind of terra.irtypes, whose class and field names are looked up the first
+// time an object of that kind is converted
+struct TreeKind {
+    std::string name;
+    int classref = 0;
+    bool hasinit = false;
+    std::vector<int> fieldrefs;
+};
+
+struct TreeArena {
+    std::vector<TreeValue> stack;
+    std::vector<TreeNode> nodes;
+    std::vector<TreeEntry> entries;
+    std::vector<char> strings;
+    std::vector<TreeKind> kinds;
+    llvm::StringMap<uint32_t> kindindex;
+    llvm::StringMap<int> typerefs;
+    int nrefs = 0;
+    /* TA_TREE_VALUES indices of values every conversion needs */
+    int listref = 0, linenumberref = 0, offsetref = 0, filenamekeyref = 0, filenameref = 0;
+};
+
+static int tree_top(LexState *ls) { return (int)ls->trees->stack.size(); }
+
+static int tree_absindex(LexState *ls, int idx) {
+    return (idx < 0) ? idx + tree_top(ls) + 1 : idx;
+}
+
+static TreeValue &tree_at(LexState *ls, int idx) {
+    return ls->trees->stack[tree_absindex(ls, idx) - 1];
+}
+
+static TreeValue tree_pop(LexState *ls) {
+    TreeValue v = ls->trees->stack.back();
+    ls->trees->stack.pop_back();
+    return v;
+}
+
+static void tree_swaptop(LexState *ls) {
+    std::vector<TreeValue> &s = ls->trees->stack;
+    std::swap(s[s.size() - 1], s[s.size() - 2]);
+}
+
+static uint32_t tree_string(LexState *ls, const char *str, size_t len) {
+    std::vector<char> &s = ls->trees->strings;
+    uint32_t offset = s.size();
+    s.insert(s.end(), str, str + len);
+    s.push_back('\0');
+    return offset;
+}
+
+static int tree_pushnode(LexState *ls, TreeNode::Kind kind) {
+    TreeArena *a = ls->trees;
+    TreeNode n;
+    n.kind = kind;
+    n.objectkind = 0;
+    n.linenumber = n.offset = 0;
+    n.first = n.last = NO_ENTRY;
+    n.size = 0;
+    TreeValue v;
+    v.kind = TreeValue::NODE;
+    v.node = a->nodes.size();
+    a->nodes.push_back(n);
+    a->stack.push_back(v);
+    return tree_top(ls);
+}
+
+static void tree_append(TreeArena *a, uint32_t node, TreeValue v, int32_t name) {
+    TreeNode &n = a->nodes[node];
+    TreeEntry e = {v, name, NO_ENTRY};
+    uint32_t i = a->entries.size();
+    a->entries.push_back(e);
+    if (n.last == NO_ENTRY)
+        n.first = i;
+    else
+        a->entries[n.last].next = i;
+    n.last = i;
+    n.size++;
+}
+
+// move the Lua value on top of the Lua stack into the TA_TREE_VALUES table, returning its
+// index there
+static int tree_ref(LexState *ls) {
+    lua_State *L = ls->L;
+    int ref = ++ls->trees->nrefs;
+    luaX_globalpush(ls, TA_TREE_VALUES);
+    lua_insert(L, -2);
+    lua_rawseti(L, -2, ref);
+    lua_pop(L, 1);
+    return ref;
+}
+
+static TreeKind &tree_resolvekind(LexState *ls, uint32_t k) {
+    TreeKind &kind = ls->trees->kinds[k];
+    if (kind.classref) return kind;
+    lua_State *L = ls->L;
+    luaX_globalgetfield(ls, TA_TYPE_TABLE, kind.name.c_str());
+    lua_getfield(L, -1, "init");
+    kind.hasinit = !lua_isnil(L, -1);
+    lua_pop(L, 1);
+    lua_getfield(L, -1, "__fields");
+    int nfields = lua_istable(L, -1) ? (int)lua_objlen(L, -1) : 0;
+    for (int i = 1; i <= nfields; i++) {
+        lua_rawgeti(L, -1, i);
+        lua_getfield(L, -1, "name");
+        kind.fieldrefs.push_back(tree_ref(ls));
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 1); /* __fields */
+    kind.classref = tree_ref(ls);
+    return kind;
+}
+
+// push the Lua value of v, creating the tables of the nodes it refers to; values is the
+// stack index of the TA_TREE_VALUES table. Objects get their fields, position and
+// metatable set directly, the same table their irtypes constructor would have returned.
+static void tree_tolua(LexState *ls, const TreeValue &v, int values) {
+    lua_State *L = ls->L;
+    TreeArena *a = ls->trees;
+    switch (v.kind) {
+        case TreeValue::NIL:
+            lua_pushnil(L);
+            return;
+        case TreeValue::BOOLEAN:
+            lua_pushboolean(L, v.b);
+            return;
+        case TreeValue::NUMBER:
+            lua_pushnumber(L, v.d);
+            return;
+        case TreeValue::INTEGER: {
+            void *data = lua_newuserdata(L, sizeof(int64_t));
+            *(int64_t *)data = v.i;
+            return;
+        }
+        case TreeValue::STRING:
+            lua_pushlstring(L, &a->strings[v.s.offset], v.s.length);
+            return;
+        case TreeValue::LUAVALUE:
+            lua_rawgeti(L, values, v.ref);
+            return;
+        case TreeValue::NODE:
+            break;
+    }
+    if (!lua_checkstack(L, 4)) luaX_syntaxerror(ls, "tree too deeply nested");
+    const TreeNode &n = a->nodes[v.node];
+    if (n.kind == TreeNode::LIST) {
+        lua_createtable(L, n.size, 0);
+        int i = 1;
+        for (uint32_t e = n.first; e != NO_ENTRY; e = a->entries[e].next) {
+            tree_tolua(ls, a->entries[e].value, values);
+            lua_rawseti(L, -2, i++);
+        }
+        lua_rawgeti(L, values, a->listref);
+        lua_setmetatable(L, -2);
+        return;
+    }
+    TreeKind *kind = (n.kind == TreeNode::OBJECT) ? &tree_resolvekind(ls, n.objectkind) : NULL;
+    lua_createtable(L, 0, n.size + (kind ? 3 : 0));
+    int t = lua_gettop(L);
+    size_t field = 0;
+    for (uint32_t e = n.first; e != NO_ENTRY; e = a->entries[e].next) {
+        const TreeEntry &entry = a->entries[e];
+        if (entry.name < 0) {
+            assert(kind && field < kind->fieldrefs.size());
+            lua_rawgeti(L, values, kind->fieldrefs[field++]);
+        } else {
+            lua_pushstring(L, &a->strings[entry.name]);
+        }
+        tree_tolua(ls, entry.value, values);
+        lua_rawset(L, t);
+    }
+    if (!kind) return;
+    lua_rawgeti(L, values, a->linenumberref);
+    lua_pushinteger(L, n.linenumber);
+    lua_rawset(L, t);
+    lua_rawgeti(L, values, a->offsetref);
+    lua_pushinteger(L, n.offset);
+    lua_rawset(L, t);
+    lua_rawgeti(L, values, a->filenamekeyref);
+    lua_rawgeti(L, values, a->filenameref);
+    lua_rawset(L, t);
+    lua_rawgeti(L, values, kind->classref);
+    lua_setmetatable(L, t);
+    if (kind->hasinit) {
+        lua_getfield(L, t, "init");
+        lua_pushvalue(L, t);
+        lua_call(L, 1, 0);
+    }
+}
+
+// push the Lua value of the tree at index idx of the arena's stack
+static void push_tree(LexState *ls, int idx) {
+    luaX_globalpush(ls, TA_TREE_VALUES);
+    tree_tolua(ls, tree_at(ls, idx), lua_gettop(ls->L));
+    lua_remove(ls->L, -2);
+}
+
+// move the tree on top of the arena's stack to the Lua stack. Once nothing is left on
+// the arena's stack, no node can be referenced again and its storage is reused.
+static void pop_tree(LexState *ls) {
+    push_tree(ls, -1);
+    TreeArena *a = ls->trees;
+    a->stack.pop_back();
+    if (a->stack.empty()) {
+        a->nodes.clear();
+        a->entries.clear();
+        a->strings.clear();
+    }
+}
+
 static int new_table(LexState *ls) {
-    if (ls->in_terra) {
-        // printf("(new table)\n");
-        lua_newtable(ls->L);
-        return lua_gettop(ls->L);
-    } else
+    if (ls->in_terra)
+        return tree_pushnode(ls, TreeNode::TABLE);
+    else
         return 0;
 }
 static int new_list(LexState *ls) {
-    if (ls->in_terra) {
-        luaX_globalpush(ls, TA_NEWLIST);
-        lua_call(ls->L, 0, 1);
-        return lua_gettop(ls->L);
-    } else
+    if (ls->in_terra)
+        return tree_pushnode(ls, TreeNode::LIST);
+    else
         return 0;
 }
 
 static int new_list_before(LexState *ls) {
     if (ls->in_terra) {
         int t = new_list(ls);
-        lua_insert(ls->L, -2);
+        tree_swaptop(ls);
         return t - 1;
     } else
         return 0;
 }
-static void push_string_before(LexState *ls, const char *str) {
+static void push_string(LexState *ls, const char *str) {
     if (ls->in_terra) {
-        lua_pushstring(ls->L, str);
-        lua_insert(ls->L, -2);
+        TreeValue v;
+        v.kind = TreeValue::STRING;
+        v.s.length = strlen(str);
+        v.s.offset = tree_string(ls, str, v.s.length);
+        ls->trees->stack.push_back(v);
     }
 }
-// this should eventually be optimized to use 'add_field' with tokens already on the stack
-static void add_field(LexState *ls, int table, const char *field) {
+static void push_string_before(LexState *ls, const char *str) {
     if (ls->in_terra) {
-        table = (table < 0) ? (table + lua_gettop(ls->L) + 1)
-                            : table;  // otherwise table is wrong once we modify the stack
-        // printf("consume field\n");
-
-        lua_setfield(ls->L, table, field);
+        push_string(ls, str);
+        tree_swaptop(ls);
     }
 }
-static void push_string(LexState *ls, const char *str) {
+static void add_field(LexState *ls, int table, const char *field) {
     if (ls->in_terra) {
-        // printf("push string: %s\n",str);
-        lua_pushstring(ls->L, str);
+        table = tree_absindex(ls, table);  // otherwise table is wrong once we pop the value
+        TreeValue v = tree_pop(ls);
+        tree_append(ls->trees, tree_at(ls, table).node, v,
+                    tree_string(ls, field, strlen(field)));
     }
 }
 
@@ -137,53 +382,64 @@ static Position getposition(LexState *ls) {
     return p;
 }
 
+// Tree objects get their position when they are converted (tree_tolua); this sets the
+// position of the token tables handed to language extensions. The filename is pushed
+// from the lexer's global table (interned once per parse) rather than re-hashed from the
+// C string each time.
 static void table_setposition(LexState *ls, int t, Position p) {
-    lua_pushinteger(ls->L, p.linenumber);
-    lua_setfield(ls->L, t, "linenumber");
-    lua_pushinteger(ls->L, p.offset);
-    lua_setfield(ls->L, t, "offset");
-    lua_pushstring(ls->L, getstr(ls->source));
-    lua_setfield(ls->L, t, "filename");
-}
-
-static int newobjecterror(lua_State *L) {
-    printf("newobjecterror: %s\n", lua_tostring(L, -1));
-    exit(1);
-}
-
+    lua_State *L = ls->L;
+    lua_pushliteral(L, "linenumber");
+    lua_pushinteger(L, p.linenumber);
+    lua_rawset(L, t);
+    lua_pushliteral(L, "offset");
+    lua_pushinteger(L, p.offset);
+    lua_rawset(L, t);
+    lua_pushliteral(L, "filename");
+    luaX_globalpush(ls, TA_FILENAME);
+    lua_rawset(L, t);
+}
+
+// pops the N values on top of the arena's stack as the fields of a new object of kind k,
+// in the order of its irtypes definition, and pushes the object
 static int new_object(LexState *ls, const char *k, int N, Position *p) {
     if (ls->in_terra) {
-        luaX_globalgetfield(ls, TA_TYPE_TABLE, k);
-        lua_insert(ls->L, -(N + 1));
-
-        lua_pushcfunction(ls->L, newobjecterror);
-        lua_insert(ls->L, -(N + 2));
-
-        lua_pcall(ls->L, N, 1, -(N + 2));
-
-        table_setposition(ls, lua_gettop(ls->L), *p);
-
-        lua_remove(ls->L, -2);
-
-        return lua_gettop(ls->L);
+        TreeArena *a = ls->trees;
+        std::pair<llvm::StringMap<uint32_t>::iterator, bool> r =
+                a->kindindex.try_emplace(k, (uint32_t)a->kinds.size());
+        if (r.second) {
+            a->kinds.push_back(TreeKind());
+            a->kinds.back().name = k;
+        }
+        size_t base = a->stack.size() - N;
+        tree_pushnode(ls, TreeNode::OBJECT);
+        uint32_t node = a->stack.back().node;
+        TreeNode &n = a->nodes[node];
+        n.objectkind = r.first->second;
+        n.linenumber = p->linenumber;
+        n.offset = p->offset;
+        for (size_t i = base; i < base + N; i++) tree_append(a, node, a->stack[i], -1);
+        a->stack[base] = a->stack.back();
+        a->stack.resize(base + 1);
+        return tree_top(ls);
     } else
         return 0;
 }
 
-static void add_index(LexState *ls, int table, int n) {
-    if (ls->in_terra) {
-        // printf("consume index\n");
-        lua_pushinteger(ls->L, n);
-        lua_pushvalue(ls->L, -2);
-        lua_settable(ls->L, table);
-        lua_pop(ls->L, 1);
-    }
+static bool is_object(LexState *ls, int idx, const char *k) {
+    TreeArena *a = ls->trees;
+    TreeValue &v = tree_at(ls, idx);
+    if (v.kind != TreeValue::NODE) return false;
+    TreeNode &n = a->nodes[v.node];
+    return n.kind == TreeNode::OBJECT && a->kinds[n.objectkind].name == k;
 }
+
 static int add_entry(LexState *ls, int table) {
     if (ls->in_terra) {
-        int n = lua_objlen(ls->L, table);
-        add_index(ls, table, n + 1);
-        return n + 1;
+        table = tree_absindex(ls, table);
+        TreeValue v = tree_pop(ls);
+        uint32_t node = tree_at(ls, table).node;
+        tree_append(ls->trees, node, v, -1);
+        return ls->trees->nodes[node].size;
     } else
         return 0;
 }
@@ -191,8 +447,19 @@ static int add_entry(LexState *ls, int table) {
 static void push_string(LexState *ls, TString *str) { push_string(ls, getstr(str)); }
 static void push_boolean(LexState *ls, int b) {
     if (ls->in_terra) {
-        // printf("push boolean\n");
-        lua_pushboolean(ls->L, b);
+        TreeValue v;
+        v.kind = TreeValue::BOOLEAN;
+        v.b = b;
+        ls->trees->stack.push_back(v);
+    }
+}
+// moves the Lua value on top of the Lua stack into the tree
+static void push_luavalue(LexState *ls) {
+    if (ls->in_terra) {
+        TreeValue v;
+        v.kind = TreeValue::LUAVALUE;
+        v.ref = tree_ref(ls);
+        ls->trees->stack.push_back(v);
     }
 }
 static void check_no_terra(LexState *ls, const char *thing) {
@@ -463,11 +730,25 @@ static void statlist(LexState *ls) {
     }
 }
 
+static void push_luatype(LexState *ls, const char *typ) {
+    luaX_globalgetfield(ls, TA_TERRA_OBJECT, "types");
+    lua_getfield(ls->L, -1, typ);
+    lua_remove(ls->L, -2);  // types object
+}
+
 static void push_type(LexState *ls, const char *typ) {
     if (ls->in_terra) {
-        luaX_globalgetfield(ls, TA_TERRA_OBJECT, "types");
-        lua_getfield(ls->L, -1, typ);
-        lua_remove(ls->L, -2);  // types object
+        TreeArena *a = ls->trees;
+        llvm::StringMap<int>::iterator it = a->typerefs.find(typ);
+        TreeValue v;
+        v.kind = TreeValue::LUAVALUE;
+        if (it != a->typerefs.end()) {
+            v.ref = it->second;
+        } else {
+            push_luatype(ls, typ);
+            v.ref = a->typerefs[typ] = tree_ref(ls);
+        }
+        a->stack.push_back(v);
     }
 }
 
@@ -480,18 +761,27 @@ static void push_literal(LexState *ls, const char *typ) {
 }
 static void push_double(LexState *ls, double d) {
     if (ls->in_terra) {
-        lua_pushnumber(ls->L, d);
+        TreeValue v;
+        v.kind = TreeValue::NUMBER;
+        v.d = d;
+        ls->trees->stack.push_back(v);
     }
 }
 
 static void push_integer(LexState *ls, int64_t i) {
     if (ls->in_terra) {
-        void *data = lua_newuserdata(ls->L, sizeof(int64_t));
-        *(int64_t *)data = i;
+        TreeValue v;
+        v.kind = TreeValue::INTEGER;
+        v.i = i;
+        ls->trees->stack.push_back(v);
     }
 }
 static void push_nil(LexState *ls) {
-    if (ls->in_terra) lua_pushnil(ls->L);
+    if (ls->in_terra) {
+        TreeValue v;
+        v.kind = TreeValue::NIL;
+        ls->trees->stack.push_back(v);
+    }
 }
 
 static void yindex(LexState *ls) {
@@ -527,10 +817,8 @@ static void recfield(LexState *ls, struct ConsControl *cc) {
         } else {
             RETURNS_1(expr(ls));
             if (ls->t.token == '=') {
-                lua_getfield(ls->L, -1, "kind");
-                lua_pushstring(ls->L, "luaexpression");
-                if (!lua_equal(ls->L, -1, -2)) luaX_syntaxerror(ls, "unexpected symbol");
-                lua_pop(ls->L, 2);  // kind and luaexpression
+                if (!is_object(ls, -1, "luaexpression"))
+                    luaX_syntaxerror(ls, "unexpected symbol");
                 new_object(ls, "escapedident", 1, &pos);
             } else {
                 /* oops! this wasn't a recfield, but a listfield with an escape */
@@ -657,14 +945,15 @@ static void print_stack(lua_State * L, int idx) {
 }
 #endif
 
-// store the lua object on the top of the stack to to the _G.terra._trees table, returning
+// store the tree on the top of the stack to to the _G.terra._trees table, returning
 // its index in the table
 static int store_value(LexState *ls) {
     int i = 0;
     if (ls->in_terra) {
         luaX_globalpush(ls, TA_FUNCTION_TABLE);
-        lua_insert(ls->L, -2);
-        i = add_entry(ls, lua_gettop(ls->L) - 1);
+        i = lua_objlen(ls->L, -1) + 1;
+        pop_tree(ls);
+        lua_rawseti(ls->L, -2, i);
         lua_pop(ls->L, 1); /*remove function table*/
     }
     return i;
@@ -911,7 +1200,7 @@ static void print_captured_locals(LexState *ls, TerraCnt *tc) {
          i != end; ++i) {
         TString *iv = *i;
         const char *str = getstr(iv);
-        lua_pushboolean(ls->L, true);
+        push_boolean(ls, true);
         add_field(ls, tbl, str);
         OutputBuffer_printf(&ls->output_buffer, "%s = %s;", str, str);
     }
@@ -1017,7 +1306,7 @@ static void simpleexp(LexState *ls) {
             break;
         }
         case TK_NIL: {
-            if (ls->in_terra) lua_pushnil(ls->L);
+            push_nil(ls);
             push_literal(ls, "niltype");
             break;
         }
@@ -1384,6 +1673,7 @@ static void embeddedcode(LexState *ls, int isterra, int isexp) {
                                            aftererror + 1));
     }
 
+    push_luavalue(ls);
     push_boolean(ls, isexp);
     new_object(ls, "luaexpression", 2, &pos);
 }
@@ -1711,11 +2001,10 @@ static int funcname(LexState *ls) {
 static void dump(LexState *ls) {
     lua_State *L = ls->L;
     printf("object is:\n");
-    int tree = lua_gettop(L);
     lua_getfield(L, LUA_GLOBALSINDEX, "terra");
     lua_getfield(L, -1, "tree");
     lua_getfield(L, -1, "printraw");
-    lua_pushvalue(L, tree);
+    push_tree(ls, -1);
     lua_call(L, 1, 0);
 
     lua_pop(L, 2);
@@ -2054,7 +2343,7 @@ static void converttokentolua(LexState *ls, Token *t) {
             lua_setfield(ls->L, -2, "type");
             int flags = t->seminfo.flags;
             number_type(ls, flags, &buf[0], sizeof(buf));
-            push_type(ls, buf);
+            push_luatype(ls, buf);
             lua_setfield(ls->L, -2, "valuetype");
             if (flags & F_IS8BYTES && flags & F_ISINTEGER) {
                 uint64_t *ip = (uint64_t *)lua_newuserdata(ls->L, sizeof(uint64_t));
@@ -2109,6 +2398,7 @@ static int le_embeddedcode(lua_State *L) {
     } catch (...) {
         le_handleerror(ls);
     }
+    pop_tree(ls);
     lua_getfield(ls->L, -1, "expression");
     lua_remove(ls->L,
                -2); /* remove original object, we just want to return the function */
@@ -2184,6 +2474,7 @@ static void languageextension(LexState *ls, int isstatement, int islocal) {
     lua_pop(L, 1); /* no longer need names, top of stack is now the user's function */
 
     // object on top of stack
+    push_luavalue(ls);
     int n = store_value(ls);
 
     leaveterra(ls);
@@ -2228,6 +2519,9 @@ static void cleanup(LexState *ls) {
         ls->patchinfo.space = 0;
     }
 
+    delete ls->trees;
+    ls->trees = NULL;
+
     // clear the registry index entry for our state
     lua_pushlightuserdata(ls->L, &ls->lextable);
     lua_pushnil(ls->L);
@@ -2259,6 +2553,7 @@ int luaY_parser(terra_State *T, ZIO *z, const char *name, int firstchar) {
     lexstate.buff = buff;
     lexstate.n_lua_objects = 0;
     lexstate.rethrow = 0;
+    lexstate.trees = new TreeArena();
     OutputBuffer_init(&lexstate.output_buffer);
     if (!lua_checkstack(L, 1 + LUAI_MAXCCALLS)) {
         abort();
@@ -2284,6 +2579,23 @@ int luaY_parser(terra_State *T, ZIO *z, const char *name, int firstchar) {
     lua_getfield(L, to, "newlist");
     luaX_globalset(&lexstate, TA_NEWLIST);
 
+    lua_pushstring(L, getstr(tname));
+    luaX_globalset(&lexstate, TA_FILENAME);
+
+    lua_newtable(L);
+    luaX_globalset(&lexstate, TA_TREE_VALUES);
+    TreeArena *trees = lexstate.trees;
+    luaX_globalpush(&lexstate, TA_NEWLIST);
+    trees->listref = tree_ref(&lexstate);
+    lua_pushliteral(L, "linenumber");
+    trees->linenumberref = tree_ref(&lexstate);
+    lua_pushliteral(L, "offset");
+    trees->offsetref = tree_ref(&lexstate);
+    lua_pushliteral(L, "filename");
+    trees->filenamekeyref = tree_ref(&lexstate);
+    luaX_globalpush(&lexstate, TA_FILENAME);
+    trees->filenameref = tree_ref(&lexstate);
+
     lua_newtable(L);
     luaX_globalset(&lexstate, TA_ENTRY_POINT_TABLE);
     lua_newtable(L);
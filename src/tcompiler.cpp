@@ -12,6 +12,7 @@ extern "C" {
 #include <inttypes.h>
 
 #include <algorithm>
+#include <atomic>
 #include <cmath>
 #include <sstream>
 #include "llvmheaders.h"
@@ -23,6 +24,15 @@ extern "C" {
 // FIXME (Elliott): need to restore the manual inliner in LLVM 17
 #include "tinline.h"
 #endif
+#include "llvm/ADT/Hashing.h"
+#include "llvm/ADT/SetVector.h"
+#include "llvm/IR/DiagnosticHandler.h"
+#include "llvm/IR/DiagnosticInfo.h"
+#include "llvm/IR/GetElementPtrTypeIterator.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/IR/Operator.h"
+#include "llvm/Support/Regex.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
 #include "llvm/Support/ManagedStatic.h"
 
 #include "llvm/ExecutionEngine/MCJIT.h"
@@ -67,7 +77,9 @@ using namespace llvm;
     _(currenttimeinseconds, 0)                                                           \
     _(isintegral, 0)                                                                     \
     _(intrinsicid, 0)                                                                    \
-    _(dumpmodule, 1)
+    _(dumpmodule, 1)                                                                     \
+    _(compilationunitstats, 0)                                                           \
+    _(compilationunitremarks, 0)
 
 #define DEF_LIBFUNCTION(nm, isclo) static int terra_##nm(lua_State *L);
 TERRALIB_FUNCTIONS(DEF_LIBFUNCTION)
@@ -206,7 +218,7 @@ struct DisassembleFunctionListener : public JITEventListener {
     // RuntimeDyld only hands back a copy of the object relocated to where the
     // code was loaded for ELF. Otherwise take the debug sections as emitted and
     // rebase the rows by hand.
-    std::shared_ptr<TerraDebugInfo> readdebuginfo(
+    static std::shared_ptr<TerraDebugInfo> readdebuginfo(
             const object::ObjectFile &Obj, const RuntimeDyld::LoadedObjectInfo &L) {
         // The context holds references into whichever of these it is built over,
         // so both are declared first and destroyed after it.
@@ -260,6 +272,34 @@ struct DisassembleFunctionListener : public JITEventListener {
     }
 };
 
+// Records the functions of the objects loaded by an engine of a compilation service.
+// The service keeps them with the code, and each state that uses the code adds them to
+// its own functioninfo, for disas, lookupsymbol and backtraces.
+struct ServiceFunctionListener : public JITEventListener {
+    ExecutionEngine *ee = NULL;
+    bool readdebug = false;  // whether the module being added has line tables
+    std::vector<TerraFunctionInfo> loaded;
+
+    virtual void notifyObjectLoaded(ObjectKey K, const object::ObjectFile &Obj,
+                                    const RuntimeDyld::LoadedObjectInfo &L) override {
+        std::shared_ptr<TerraDebugInfo> debug;
+        if (readdebug) debug = DisassembleFunctionListener::readdebuginfo(Obj, L);
+        auto size_map = llvm::object::computeSymbolSizes(Obj);
+        for (auto &S : size_map) {
+            object::SymbolRef sym = S.first;
+            auto name = sym.getName();
+            auto type = sym.getType();
+            if (!name || !type || type.get() != object::SymbolRef::ST_Function) continue;
+            StringRef n = name.get();
+#if defined(__APPLE__)
+            n = n.substr(1);
+#endif
+            void *addr = (void *)ee->getFunctionAddress(n.str());
+            if (addr) loaded.push_back({n.str(), addr, S.second, debug});
+        }
+    }
+};
+
 static double CurrentTimeInSeconds() {
 #ifdef _WIN32
     static uint64_t freq = 0;
@@ -465,6 +505,8 @@ int terra_inittarget(lua_State *L) {
     return 1;
 }
 
+static void freecompilationunit(TerraCompilationUnit *CU);
+
 int terra_initcompilationunit(lua_State *L) {
     terra_State *T = terra_getstate(L, 1);
     TerraCompilationUnit *CU = new TerraCompilationUnit();
@@ -515,6 +557,33 @@ int terra_initcompilationunit(lua_State *L) {
         }
 
         CU->fastmath = fastmath;
+
+        if (profile.hasfield("pgo")) {
+            const char *mode = profile.string("pgo");
+            CU->pgo.mode = strcmp(mode, "generate") == 0 ? llvmutil_PGOOptions::Generate
+                                                         : llvmutil_PGOOptions::Use;
+            if (profile.hasfield("profilefile"))
+                CU->pgo.profilefile = profile.string("profilefile");
+        }
+        CU->boundscheck = profile.boolean("boundscheck");
+        CU->strictaliasing = profile.boolean("strictaliasing");
+        if (profile.hasfield("remarks")) {
+            CU->collectremarks = true;
+            CU->remarkfilter = profile.string("remarks");
+        }
+        if (profile.hasfield("threads")) {
+            CU->threads = (int)profile.number("threads");
+        }
+        llvmutil_PipelineOptions &pipeline = CU->pipeline;
+        if (profile.hasfield("optlevel")) pipeline.optlevel = profile.number("optlevel");
+        if (profile.hasfield("sizelevel")) pipeline.sizelevel = profile.number("sizelevel");
+        if (profile.hasfield("unroll")) pipeline.unroll = profile.boolean("unroll");
+        if (profile.hasfield("vectorize")) pipeline.vectorize = profile.boolean("vectorize");
+        if (profile.hasfield("vectorwidth"))
+            pipeline.vectorwidth = profile.number("vectorwidth");
+        if (profile.hasfield("inlinethreshold"))
+            pipeline.inlinethreshold = profile.number("inlinethreshold");
+        if (profile.hasfield("passes")) pipeline.passes = profile.string("passes");
     }
     lobj_removereftable(L, ref_table);
 
@@ -529,27 +598,34 @@ int terra_initcompilationunit(lua_State *L) {
     CU->M->setDataLayout(TT->tm->createDataLayout());
 
 #if LLVM_VERSION < 170
-    CU->mi = new ManualInliner(TT->tm, CU->M);
+    CU->mi = new ManualInliner(TT->tm, CU->M, &CU->pipeline);
     CU->fpm = new FunctionPassManagerT(CU->M);
     llvmutil_addtargetspecificpasses(CU->fpm, TT->tm);
-    llvmutil_addoptimizationpasses(CU->fpm);
+    llvmutil_addoptimizationpasses(CU->fpm, &CU->pipeline);
     CU->fpm->doInitialization();
 #else
     // Must build the pass manager first: it is what registers the analyses in
     // the managers the inliner reads from.
+    std::string err;
     CU->fpm = new FunctionPassManager(llvmutil_createoptimizationpasses(
-            TT->tm, CU->lam, CU->fam, CU->cgam, CU->mam));
-    CU->mi = new ManualInliner(TT->tm, CU->M, CU->fam, CU->mam);
+            TT->tm, CU->lam, CU->fam, CU->cgam, CU->mam, &CU->pipeline, &err));
+    CU->mi = new ManualInliner(TT->tm, CU->M, CU->fam, CU->mam, &CU->pipeline);
+    if (!err.empty()) {
+        std::string passes = CU->pipeline.passes;
+        freecompilationunit(CU);
+        terra_reporterror(T, "invalid pass pipeline '%s': %s\n", passes.c_str(),
+                          err.c_str());
+    }
 #endif
     lua_pushlightuserdata(L, CU);
     return 1;
 }
 
-static void InitializeJIT(TerraCompilationUnit *CU) {
-    if (CU->ee) return;  // already initialized
-    Module *topeemodule = new Module("terra", *CU->TT->ctx);
+static ExecutionEngine *CreateExecutionEngine(TerraTarget *TT, LLVMContext *ctx,
+                                              std::string *err) {
+    Module *topeemodule = new Module("terra", *ctx);
 #ifdef _WIN32
-    std::string MCJITTriple = CU->TT->Triple;
+    std::string MCJITTriple = TT->Triple;
     MCJITTriple.append("-elf");  // on windows we need to use an elf container because
                                  // coff is not supported yet
     topeemodule->setTargetTriple(
@@ -562,22 +638,21 @@ static void InitializeJIT(TerraCompilationUnit *CU) {
 #else
     topeemodule->setTargetTriple(
 #if LLVM_VERSION < 210
-            CU->TT->Triple
+            TT->Triple
 #else
-            llvm::Triple(CU->TT->Triple)
+            llvm::Triple(TT->Triple)
 #endif
     );
 #endif
 
-    std::string err;
     std::vector<std::string> mattrs;
-    if (!CU->TT->Features.empty()) mattrs.push_back(CU->TT->Features);
+    if (!TT->Features.empty()) mattrs.push_back(TT->Features);
     EngineBuilder eb(UNIQUEIFY(Module, topeemodule));
-    eb.setErrorStr(&err)
-            .setMCPU(CU->TT->CPU)
+    eb.setErrorStr(err)
+            .setMCPU(TT->CPU)
             .setMAttrs(mattrs)
             .setEngineKind(EngineKind::JIT)
-            .setTargetOptions(CU->TT->tm->Options)
+            .setTargetOptions(TT->tm->Options)
             .setOptLevel(
 #if LLVM_VERSION < 180
                     CodeGenOpt::Aggressive
@@ -586,8 +661,13 @@ static void InitializeJIT(TerraCompilationUnit *CU) {
 #endif
                     )
             .setMCJITMemoryManager(std::make_unique<SectionMemoryManager>());
+    return eb.create();
+}
 
-    CU->ee = eb.create();
+static void InitializeJIT(TerraCompilationUnit *CU) {
+    if (CU->ee) return;  // already initialized
+    std::string err;
+    CU->ee = CreateExecutionEngine(CU->TT, CU->TT->ctx, &err);
     if (!CU->ee) terra_reporterror(CU->T, "llvm: %s\n", err.c_str());
     CU->jiteventlistener = new DisassembleFunctionListener(CU);
     CU->ee->RegisterJITEventListener(CU->jiteventlistener);
@@ -614,6 +694,8 @@ int terra_compilerinit(struct terra_State *T) {
 void freetarget(TerraTarget *TT) {
     assert(TT->nreferences > 0);
     if (0 == --TT->nreferences) {
+        for (sys::MemoryBlock &block : TT->constants.blocks)
+            sys::Memory::releaseMappedMemory(block);
         delete TT->external;
         delete TT->tm;
         delete TT->ctx;
@@ -646,6 +728,22 @@ int terra_freecompilationunit(lua_State *L) {
     freecompilationunit((TerraCompilationUnit *)terra_tocdatapointer(L, 1));
     return 0;
 }
+static int terra_compilationunitstats(lua_State *L) {
+    TerraCompilationUnit *CU = (TerraCompilationUnit *)terra_tocdatapointer(L, 1);
+    lua_newtable(L);
+    lua_pushnumber(L, CU->functioncache.nemitted);
+    lua_setfield(L, -2, "emitted");
+    lua_pushnumber(L, CU->functioncache.nreused);
+    lua_setfield(L, -2, "reused");
+    // shared by all units of the target
+    lua_pushnumber(L, CU->TT->constants.ntables);
+    lua_setfield(L, -2, "constants");
+    lua_pushnumber(L, CU->TT->constants.bytes);
+    lua_setfield(L, -2, "constantbytes");
+    lua_pushnumber(L, CU->TT->constants.bytessaved);
+    lua_setfield(L, -2, "constantbytessaved");
+    return 1;
+}
 
 int terra_compilerfree(struct terra_CompilerState *C) {
     assert(C->nreferences > 0);
@@ -1582,8 +1680,19 @@ struct CCallingConv {
     }
     // Scratch space to convert between the two, big enough to be accessed as
     // either one.
+    Type *CoercionScratchType(Type *type, Type *cctype) {
+        return IsCoercionPadded(type, cctype) ? cctype : type;
+    }
     Value *CreateCoercionAlloca(IRBuilder<> *B, Type *type, Type *cctype) {
-        return CreateAlloca(B, IsCoercionPadded(type, cctype) ? cctype : type);
+        return CreateAlloca(B, CoercionScratchType(type, cctype));
+    }
+    // Scratch space used only until the call it is built for; its lifetime is marked
+    // so that the stack slots of consecutive calls can be shared.
+    Value *CreateScratch(IRBuilder<> *B, Type *type, std::vector<Value *> *scratches) {
+        AllocaInst *scratch = CreateAlloca(B, type);
+        B->CreateLifetimeStart(scratch);
+        scratches->push_back(scratch);
+        return scratch;
     }
     // View such scratch space as a pointer to t (a no-op with opaque pointers).
     Value *CoercionPtr(IRBuilder<> *B, Value *scratch, Type *t) {
@@ -1633,7 +1742,7 @@ struct CCallingConv {
         }
     }
     void EmitEntry(IRBuilder<> *B, Obj *ftype, Function *func,
-                   std::vector<Value *> *variables) {
+                   std::vector<Value *> *variables, Obj *noalias = NULL) {
         Classification *info = ClassifyFunction(ftype, func->getCallingConv());
         assert(info->paramtypes.size() == variables->size());
         Function::arg_iterator ai = func->arg_begin();
@@ -1645,6 +1754,9 @@ struct CCallingConv {
             Value *v = (*variables)[i];
             switch (p->kind) {
                 case C_PRIMITIVE: {
+                    if (noalias && noalias->hasfield(i + 1) &&
+                        ai->getType()->isPointerTy())
+                        ai->addAttr(Attribute::NoAlias);
                     Value *a =
                             ConvertPrimitive(B, &*ai, p->type->type, p->type->issigned);
                     B->CreateStore(a, v);
@@ -1739,11 +1851,13 @@ struct CCallingConv {
     }
 
     Value *EmitCall(IRBuilder<> *B, Obj *ftype, CallingConv::ID cconv, Obj *paramtypes,
-                    Value *callee, std::vector<Value *> *actuals) {
+                    Value *callee, std::vector<Value *> *actuals,
+                    StringRef vectorvariants = StringRef()) {
         Classification info;
         Classify(ftype, cconv, paramtypes, &info);
 
         std::vector<Value *> arguments;
+        std::vector<Value *> scratches;  // argument copies, dead after the call
 
         if (C_AGGREGATE_MEM == info.returntype.kind) {
             arguments.push_back(CreateAlloca(B, info.returntype.type->type));
@@ -1758,19 +1872,21 @@ struct CCallingConv {
                             ConvertPrimitive(B, actual, a->cctype, a->type->issigned));
                     break;
                 case C_AGGREGATE_MEM: {
-                    Value *scratch = CreateAlloca(B, a->type->type);
+                    Value *scratch = CreateScratch(B, a->type->type, &scratches);
                     emitStoreAgg(B, a->type->type, actual, scratch);
                     arguments.push_back(scratch);
                 } break;
                 case C_AGGREGATE_REG: {
-                    Value *scratch = CreateCoercionAlloca(B, a->type->type, a->cctype);
+                    Value *scratch = CreateScratch(
+                            B, CoercionScratchType(a->type->type, a->cctype), &scratches);
                     emitStoreAgg(B, a->type->type, actual,
                                  CoercionPtr(B, scratch, a->type->type));
                     EmitCallAggReg(B, CoercionPtr(B, scratch, a->cctype), a->cctype,
                                    arguments);
                 } break;
                 case C_ARRAY_REG: {
-                    Value *scratch = CreateCoercionAlloca(B, a->type->type, a->cctype);
+                    Value *scratch = CreateScratch(
+                            B, CoercionScratchType(a->type->type, a->cctype), &scratches);
                     emitStoreAgg(B, a->type->type, actual,
                                  CoercionPtr(B, scratch, a->type->type));
                     EmitCallAggReg(B, CoercionPtr(B, scratch, a->cctype), a->cctype,
@@ -1793,6 +1909,16 @@ struct CCallingConv {
         CallInst *call = B->CreateCall(info.fntype, callee, arguments);
         // annotate call with byval and sret
         AttributeFnOrCall(call, &info);
+        if (!vectorvariants.empty()) {
+            Attribute variants = Attribute::get(*CU->TT->ctx, "vector-function-abi-variant",
+                                                vectorvariants);
+#if LLVM_VERSION >= 140
+            call->addFnAttr(variants);
+#else
+            call->addAttribute(AttributeList::FunctionIndex, variants);
+#endif
+        }
+        for (Value *scratch : scratches) B->CreateLifetimeEnd(scratch);
 
         // unstage results
         if (C_PRIMITIVE == info.returntype.kind) {
@@ -1909,6 +2035,55 @@ struct CCallingConv {
 
 static Constant *EmitConstantInitializer(TerraCompilationUnit *CU, Obj *v);
 
+// Rebuild the constant of type typ stored in memory at data, following the
+// target's layout, so that loads from it can be folded like any other constant.
+static Constant *EmitConstantData(TerraCompilationUnit *CU, Type *typ, const char *data) {
+    const DataLayout &DL = CU->getDataLayout();
+    if (IntegerType *it = dyn_cast<IntegerType>(typ)) {
+        APInt integer(it->getBitWidth(), 0);
+        LoadIntFromMemory(integer, (const uint8_t *)data, DL.getTypeStoreSize(it));
+        return ConstantInt::get(it, integer);
+    } else if (typ->isFloatingPointTy()) {
+        // from the bits, so that every format is covered and NaN payloads, including
+        // signaling NaNs, survive unchanged
+        const fltSemantics &semantics = typ->getFltSemantics();
+        APInt bits(APFloat::semanticsSizeInBits(semantics), 0);
+        LoadIntFromMemory(bits, (const uint8_t *)data, DL.getTypeStoreSize(typ));
+        return ConstantFP::get(*CU->TT->ctx, APFloat(semantics, bits));
+    } else if (PointerType *pt = dyn_cast<PointerType>(typ)) {
+        intptr_t address;
+        memcpy(&address, data, sizeof(address));
+        if (address == 0) return ConstantPointerNull::get(pt);
+        return ConstantExpr::getIntToPtr(
+                ConstantInt::get(DL.getIntPtrType(*CU->TT->ctx), address), pt);
+    } else if (StructType *st = dyn_cast<StructType>(typ)) {
+        const StructLayout *layout = DL.getStructLayout(st);
+        std::vector<Constant *> fields;
+        for (unsigned i = 0; i < st->getNumElements(); i++)
+            fields.push_back(EmitConstantData(CU, st->getElementType(i),
+                                              data + layout->getElementOffset(i)));
+        return ConstantStruct::get(st, fields);
+    } else if (ArrayType *at = dyn_cast<ArrayType>(typ)) {
+        Type *et = at->getElementType();
+        uint64_t stride = DL.getTypeAllocSize(et);
+        std::vector<Constant *> elements;
+        for (uint64_t i = 0; i < at->getNumElements(); i++)
+            elements.push_back(EmitConstantData(CU, et, data + i * stride));
+        return ConstantArray::get(at, elements);
+    } else if (VectorType *vt = dyn_cast<VectorType>(typ)) {
+        // Terra vectors only hold byte-sized elements, which are packed
+        Type *et = vt->getElementType();
+        uint64_t stride = DL.getTypeStoreSize(et);
+        std::vector<Constant *> elements;
+        for (unsigned i = 0; i < cast<FixedVectorType>(vt)->getNumElements(); i++)
+            elements.push_back(EmitConstantData(CU, et, data + i * stride));
+        return ConstantVector::get(elements);
+    }
+    TERRA_DUMP_TYPE(typ);
+    assert(!"NYI - constant data");
+    return UndefValue::get(typ);
+}
+
 static GlobalVariable *CreateGlobalVariable(TerraCompilationUnit *CU, Obj *global,
                                             const char *name) {
     Obj t;
@@ -1925,10 +2100,24 @@ static GlobalVariable *CreateGlobalVariable(TerraCompilationUnit *CU, Obj *globa
             (global->boolean("constant") && !global->boolean("extern"))
                     ? GlobalValue::InternalLinkage
                     : GlobalValue::ExternalLinkage;
+    GlobalVariable::ThreadLocalMode tls = GlobalVariable::NotThreadLocal;
+    if (global->hasfield("threadlocal")) {
+        std::string model = global->string("threadlocal");
+        if (model == "local-dynamic")
+            tls = GlobalVariable::LocalDynamicTLSModel;
+        else if (model == "initial-exec")
+            tls = GlobalVariable::InitialExecTLSModel;
+        else if (model == "local-exec")
+            tls = GlobalVariable::LocalExecTLSModel;
+        else
+            tls = GlobalVariable::GeneralDynamicTLSModel;
+    }
     GlobalVariable *gv = new GlobalVariable(*CU->M, typ, global->boolean("constant"),
-                                            linkage, llvmconstant, name, NULL,
-                                            GlobalVariable::NotThreadLocal, as);
+                                            linkage, llvmconstant, name, NULL, tls, as);
     if (!global->boolean("extern")) gv->setDSOLocal(true);
+    // the address of a constant is not significant, so identical ones can share it
+    if (linkage == GlobalValue::InternalLinkage)
+        gv->setUnnamedAddr(GlobalValue::UnnamedAddr::Global);
     return gv;
 }
 
@@ -2099,14 +2288,315 @@ static SyncScope::ID ParseAtomicSyncScope(Module *M, const char *syncscope) {
     return entry->second;
 }
 
+// Records the optimization remarks of passes whose name matches the unit's filter.
+// Other diagnostics go on to LLVM's default handling.
+struct RemarkCollector : public DiagnosticHandler {
+    TerraCompilationUnit *CU;
+    Regex filter;
+    RemarkCollector(TerraCompilationUnit *CU_) : CU(CU_), filter(CU_->remarkfilter) {}
+    bool enabled(StringRef pass) const { return filter.match(pass); }
+    bool isAnalysisRemarkEnabled(StringRef pass) const override { return enabled(pass); }
+    bool isMissedOptRemarkEnabled(StringRef pass) const override { return enabled(pass); }
+    bool isPassedOptRemarkEnabled(StringRef pass) const override { return enabled(pass); }
+    bool isAnyRemarkEnabled() const override { return true; }
+    bool handleDiagnostics(const DiagnosticInfo &DI) override {
+        const DiagnosticInfoOptimizationBase *R =
+                dyn_cast<DiagnosticInfoOptimizationBase>(&DI);
+        if (!R) return false;
+        if (!enabled(R->getPassName())) return true;
+        TerraRemark remark;
+        switch (R->getKind()) {
+            case DK_OptimizationRemark:
+            case DK_MachineOptimizationRemark:
+                remark.kind = "passed";
+                break;
+            case DK_OptimizationRemarkMissed:
+            case DK_MachineOptimizationRemarkMissed:
+                remark.kind = "missed";
+                break;
+            default:
+                remark.kind = "analysis";
+                break;
+        }
+        remark.func = &R->getFunction();
+        remark.function = R->getFunction().getName().ltrim('$').str();
+        remark.pass = R->getPassName().str();
+        remark.name = R->getRemarkName().str();
+        remark.message = R->getMsg();
+        remark.line = remark.column = 0;
+        if (R->isLocationAvailable()) {
+            DiagnosticLocation loc = R->getLocation();
+            remark.filename = loc.getRelativePath().str();
+            remark.line = loc.getLine();
+            remark.column = loc.getColumn();
+        }
+        CU->remarks.push_back(remark);
+        return true;
+    }
+};
+
+// Installs a RemarkCollector on the unit's context while in scope, if the unit's
+// profile asks for remarks. The context is shared with the other units of the target,
+// so the previous handler is restored afterwards.
+struct RemarkScope {
+    LLVMContext *ctx;
+    std::unique_ptr<DiagnosticHandler> previous;
+    RemarkScope(TerraCompilationUnit *CU) : ctx(NULL) {
+        if (!CU->collectremarks) return;
+        ctx = CU->TT->ctx;
+        previous = ctx->getDiagnosticHandler();
+        ctx->setDiagnosticHandler(std::unique_ptr<DiagnosticHandler>(new RemarkCollector(CU)));
+    }
+    ~RemarkScope() {
+        if (ctx) ctx->setDiagnosticHandler(std::move(previous));
+    }
+};
+
+static void PushRemark(lua_State *L, const TerraRemark &remark) {
+    lua_newtable(L);
+    lua_pushstring(L, remark.kind.c_str());
+    lua_setfield(L, -2, "kind");
+    lua_pushstring(L, remark.pass.c_str());
+    lua_setfield(L, -2, "pass");
+    lua_pushstring(L, remark.name.c_str());
+    lua_setfield(L, -2, "name");
+    lua_pushstring(L, remark.function.c_str());
+    lua_setfield(L, -2, "functionname");
+    lua_pushstring(L, remark.message.c_str());
+    lua_setfield(L, -2, "message");
+    if (remark.line > 0) {
+        lua_pushstring(L, remark.filename.c_str());
+        lua_setfield(L, -2, "filename");
+        lua_pushnumber(L, remark.line);
+        lua_setfield(L, -2, "linenumber");
+        lua_pushnumber(L, remark.column);
+        lua_setfield(L, -2, "column");
+    }
+}
+
+// The remarks recorded for a function of the unit, or for all of them.
+static int terra_compilationunitremarks(lua_State *L) {
+    TerraCompilationUnit *CU = (TerraCompilationUnit *)terra_tocdatapointer(L, 1);
+    const Function *func = (const Function *)lua_touserdata(L, 2);
+    lua_newtable(L);
+    int n = 0;
+    for (const TerraRemark &remark : CU->remarks) {
+        if (func && remark.func != func) continue;
+        PushRemark(L, remark);
+        lua_rawseti(L, -2, ++n);
+    }
+    return 1;
+}
+
 const int COMPILATION_UNIT_POS = 1;
 static int terra_deletefunction(lua_State *L);
 
 Function *EmitFunction(TerraCompilationUnit *CU, Obj *funcobj, TerraFunctionState *user);
 
+static void CollectReferencedFunctions(Value *v, SmallPtrSetImpl<Value *> &visited,
+                                       SetVector<Function *> &refs) {
+    if (!visited.insert(v).second) return;
+    if (Function *fn = dyn_cast<Function>(v)) {
+        refs.insert(fn);
+    } else if (isa<Constant>(v) && !isa<GlobalValue>(v)) {
+        for (Value *op : cast<Constant>(v)->operands())
+            CollectReferencedFunctions(op, visited, refs);
+    }
+}
+
+static bool IsIdentifierChar(char c) {
+    return isalnum((unsigned char)c) || c == '$' || c == '.' || c == '_' || c == '-';
+}
+
+// The printed IR of one function of a strongly connected component, normalized so
+// that two emissions of the same definition print the same text: functions of the
+// component are named by position, other functions of the unit by their fingerprint,
+// and module-wide attribute group and metadata numbers are replaced by the attributes
+// and alias tags.
+static bool NormalizedIR(TerraCompilationUnit *CU, Function *F,
+                         const std::vector<Function *> &scc, std::string *out) {
+    SmallPtrSet<Value *, 16> visited;
+    SetVector<Function *> refs;
+    std::string attrs = F->getAttributes().getAsString(AttributeList::FunctionIndex);
+    SmallVector<std::pair<unsigned, MDNode *>, 2> mds;
+    for (BasicBlock &BB : *F) {
+        for (Instruction &I : BB) {
+            // metadata is numbered module-wide as well, so do not reuse code with it,
+            // except for alias tags, which the emitter derives from the accessed type
+            I.getAllMetadataOtherThanDebugLoc(mds);
+            for (auto &md : mds) {
+                if (md.first != LLVMContext::MD_tbaa) return false;
+                attrs += "|" + cast<MDString>(cast<MDNode>(md.second->getOperand(1))
+                                                      ->getOperand(0))
+                                       ->getString()
+                                       .str();
+            }
+            if (CallBase *call = dyn_cast<CallBase>(&I))
+                attrs += "|" + call->getAttributes().getAsString(
+                                       AttributeList::FunctionIndex);
+            for (Value *op : I.operands()) CollectReferencedFunctions(op, visited, refs);
+        }
+    }
+    refs.insert(F);
+
+    std::string text;
+    raw_string_ostream os(text);
+    F->print(os);
+    os.flush();
+
+    std::vector<std::pair<std::string, std::string>> names;
+    for (Function *fn : refs) {
+        std::string replacement;
+        auto pos = std::find(scc.begin(), scc.end(), fn);
+        if (pos != scc.end()) {
+            replacement = "@scc" + std::to_string(pos - scc.begin());
+        } else if (CU->functioncache.fingerprints.count(fn)) {
+            replacement = "@fp" + std::to_string(CU->functioncache.fingerprints[fn]);
+        } else {
+            continue;  // externals keep their names
+        }
+        std::string name;
+        raw_string_ostream nos(name);
+        fn->printAsOperand(nos, false);
+        names.push_back(std::make_pair(nos.str(), replacement));
+    }
+    // longest names first so that a name is never replaced inside a longer one
+    std::sort(names.begin(), names.end(),
+              [](const std::pair<std::string, std::string> &a,
+                 const std::pair<std::string, std::string> &b) {
+                  return a.first.size() > b.first.size();
+              });
+
+    // module-wide numbers are only replaced where a token starts, and nothing is
+    // replaced inside string constants, which print quotes as \22
+    out->reserve(out->size() + text.size() + attrs.size());
+    bool instring = false;
+    for (size_t i = 0; i < text.size();) {
+        if (instring) {
+            if (text[i] == '"') instring = false;
+        } else if (text[i] == '"') {
+            instring = true;
+        } else if (text[i] == '@') {
+            bool replaced = false;
+            for (auto &n : names) {
+                size_t end = i + n.first.size();
+                if (text.compare(i, n.first.size(), n.first) == 0 &&
+                    (end == text.size() || !IsIdentifierChar(text[end]))) {
+                    *out += n.second;
+                    i = end;
+                    replaced = true;
+                    break;
+                }
+            }
+            if (replaced) continue;
+        } else if ((text[i] == '#' || text[i] == '!') && i + 1 < text.size() &&
+                   isdigit(text[i + 1]) && (i == 0 || !IsIdentifierChar(text[i - 1]))) {
+            i++;
+            while (i < text.size() && isdigit(text[i])) i++;
+            continue;
+        }
+        *out += text[i++];
+    }
+    *out += attrs;
+    return true;
+}
+
+// Fingerprint an unoptimized strongly connected component. The fingerprint covers
+// the functions it calls, whose code may be inlined into it, through their own
+// fingerprints. texts receives the normalized IR of each function, which is compared
+// before reusing code, so that a hash collision cannot reuse a different function.
+static bool FingerprintSCC(TerraCompilationUnit *CU, const std::vector<Function *> &scc,
+                           uint64_t *fingerprint, std::vector<std::string> *texts) {
+    // debug info is per definition, and remarks are only collected when optimizing
+    if (CU->T->options.debug > 0 || CU->collectremarks) return false;
+    std::string text;
+    for (Function *F : scc) {
+        texts->emplace_back();
+        if (!NormalizedIR(CU, F, scc, &texts->back())) return false;
+        text += texts->back();
+        text += '\0';
+    }
+    *fingerprint = hash_value(StringRef(text));
+    return true;
+}
+
+static uint64_t FunctionFingerprint(uint64_t sccfingerprint, size_t i) {
+    return hash_combine(sccfingerprint, i);
+}
+
+// Look for an identical, already optimized component. If there is one, the states of
+// the new component are pointed at its functions and the new ones are deleted.
+static bool ReuseSCC(TerraCompilationUnit *CU, uint64_t fingerprint,
+                     const std::vector<std::string> &texts,
+                     const std::vector<TerraFunctionState *> &states) {
+    TerraFunctionCache &cache = CU->functioncache;
+    std::vector<Function *> existing;
+    for (size_t i = 0; i < states.size(); i++) {
+        uint64_t fp = FunctionFingerprint(fingerprint, i);
+        auto it = cache.functions.find(fp);
+        if (it == cache.functions.end() ||
+            it->second->getFunctionType() != states[i]->func->getFunctionType() ||
+            cache.texts[fp] != texts[i])
+            return false;
+        existing.push_back(it->second);
+    }
+    for (size_t i = 0; i < states.size(); i++) {
+        Function *F = states[i]->func;
+        VERBOSE_ONLY(CU->T) {
+            printf("reusing %s for %s\n", existing[i]->getName().str().c_str(),
+                   F->getName().str().c_str());
+        }
+        F->replaceAllUsesWith(existing[i]);
+#if LLVM_VERSION >= 170
+        CU->fam.clear(*F, F->getName());
+#endif
+        F->eraseFromParent();
+        states[i]->func = existing[i];
+        cache.users[existing[i]]++;
+    }
+    cache.nreused += states.size();
+    return true;
+}
+
+static void RecordSCC(TerraCompilationUnit *CU, uint64_t fingerprint,
+                      std::vector<std::string> &texts,
+                      const std::vector<TerraFunctionState *> &states) {
+    TerraFunctionCache &cache = CU->functioncache;
+    // a different component with the same fingerprint keeps its entries
+    for (size_t i = 0; i < states.size(); i++)
+        if (cache.functions.count(FunctionFingerprint(fingerprint, i))) return;
+    for (size_t i = 0; i < states.size(); i++) {
+        uint64_t fp = FunctionFingerprint(fingerprint, i);
+        cache.texts[fp] = std::move(texts[i]);
+        cache.fingerprints[states[i]->func] = fp;
+        cache.functions[fp] = states[i]->func;
+        cache.users[states[i]->func] = 1;
+    }
+}
+
+// Called when a function state is collected. Returns true if no other state still
+// uses the function, in which case it is also dropped from the cache.
+static bool ReleaseCachedFunction(TerraCompilationUnit *CU, Function *F) {
+    TerraFunctionCache &cache = CU->functioncache;
+    auto users = cache.users.find(F);
+    if (users == cache.users.end()) return true;
+    if (--users->second > 0) return false;
+    cache.users.erase(users);
+    auto fp = cache.fingerprints.find(F);
+    if (fp != cache.fingerprints.end()) {
+        cache.functions.erase(fp->second);
+        cache.texts.erase(fp->second);
+        cache.fingerprints.erase(fp);
+    }
+    return true;
+}
+
 struct Locals {
     Obj cur;
     Locals *prev;
+    // variables declared in a block, whose lifetimes end with it; NULL for scopes
+    // such as let-in expressions whose variables may outlive them
+    std::vector<AllocaInst *> *lifetimes;
 };  // stack of local environment
 
 struct FunctionEmitter {
@@ -2134,11 +2624,19 @@ struct FunctionEmitter {
 
     Obj *funcobj;
     TerraFunctionState *fstate;
+    bool uselifetimes;  // mark block-scoped variables for LLVM's stack coloring
+    SmallPtrSet<Type *, 4> uniontypes;  // unions selected from in this function
+    DenseMap<Type *, MDNode *> tbaatags;
     std::vector<BasicBlock *> deferred;
 
     Obj labeltbl;
     Locals basescope;
 
+    // in functions created with terralib.coroutine: the coroutine's id and handle, and
+    // the blocks that finish it, free its frame, and return to its caller or resumer
+    Value *coroid = NULL, *corohandle = NULL;
+    BasicBlock *corofinal = NULL, *corocleanup = NULL, *cororeturn = NULL;
+
     FunctionEmitter(TerraCompilationUnit *CU_)
             : CU(CU_),
               T(CU_->T),
@@ -2147,7 +2645,8 @@ struct FunctionEmitter {
               Ty(CU_->Ty),
               CC(CU_->CC),
               M(CU_->M),
-              locals(NULL) {
+              locals(NULL),
+              uselifetimes(false) {
         B = new IRBuilder<>(*CU->TT->ctx);
         enterScope(&basescope);
         labels = newMap(&labeltbl);
@@ -2175,7 +2674,10 @@ struct FunctionEmitter {
                         assert(fstate->func);
                     }
                 }
-                if (fstate->func) return fstate;
+                if (fstate->func) {
+                    emitVectorVariants(name, fstate->func);
+                    return fstate;
+                }
             }
 
             CallingConv::ID callingconv = CallingConv::MaxID;
@@ -2193,6 +2695,7 @@ struct FunctionEmitter {
             if (isextern) {
                 // Set external linkage for extern functions.
                 fstate->func->setLinkage(GlobalValue::ExternalLinkage);
+                emitVectorVariants(name, fstate->func);
             }
             if (callingconv != CallingConv::MaxID) {
                 fstate->func->setCallingConv(callingconv);
@@ -2220,6 +2723,20 @@ struct FunctionEmitter {
                     fstate->func->addFnAttr(Attribute::NoReturn);
                 }
             }
+            if (CU->pipeline.sizelevel > 0) {
+                fstate->func->addFnAttr(Attribute::OptimizeForSize);
+                if (CU->pipeline.sizelevel > 1) fstate->func->addFnAttr(Attribute::MinSize);
+            }
+            if (CU->pipeline.vectorwidth > 0) {
+                fstate->func->addFnAttr("prefer-vector-width",
+                                        std::to_string(CU->pipeline.vectorwidth));
+            }
+            if (funcobj->hasfield("targetcpu")) {
+                // per-function subtarget, e.g. one version of a multiversioned function
+                fstate->func->addFnAttr("target-cpu", funcobj->string("targetcpu"));
+                fstate->func->addFnAttr("target-features",
+                                        funcobj->string("targetfeatures"));
+            }
 
             if (!isextern) {
                 if (CU->optimize) {
@@ -2236,29 +2753,39 @@ struct FunctionEmitter {
                     VERBOSE_ONLY(T) { printf("optimizing scc containing: "); }
                     TerraFunctionState *f;
                     std::vector<Function *> scc;
+                    std::vector<TerraFunctionState *> states;
                     do {
                         f = CU->tooptimize->back();
                         CU->tooptimize->pop_back();
                         scc.push_back(f->func);
+                        states.push_back(f);
                         f->onstack = false;
                         VERBOSE_ONLY(T) {
                             std::string s = f->func->getName().str();
                             printf("%s%s", s.c_str(), (fstate == f) ? "\n" : " ");
                         }
                     } while (fstate != f);
-                    CU->mi->run(scc.begin(), scc.end());
-                    for (size_t i = 0; i < scc.size(); i++) {
-                        VERBOSE_ONLY(T) {
-                            std::string s = scc[i]->getName().str();
-                            printf("optimizing %s\n", s.c_str());
-                        }
-                        CU->fpm->run(*scc[i]
+                    uint64_t fingerprint;
+                    std::vector<std::string> texts;
+                    bool fingerprinted = FingerprintSCC(CU, scc, &fingerprint, &texts);
+                    if (!fingerprinted || !ReuseSCC(CU, fingerprint, texts, states)) {
+                        if (fingerprinted) RecordSCC(CU, fingerprint, texts, states);
+                        CU->functioncache.nemitted += scc.size();
+                        RemarkScope remarkscope(CU);
+                        CU->mi->run(scc.begin(), scc.end());
+                        for (size_t i = 0; i < scc.size(); i++) {
+                            VERBOSE_ONLY(T) {
+                                std::string s = scc[i]->getName().str();
+                                printf("optimizing %s\n", s.c_str());
+                            }
+                            CU->fpm->run(*scc[i]
 #if LLVM_VERSION >= 170
-                                     ,
-                                     CU->fam
+                                         ,
+                                         CU->fam
 #endif
-                        );
-                        VERBOSE_ONLY(T) { TERRA_DUMP_FUNCTION(scc[i]); }
+                            );
+                            VERBOSE_ONLY(T) { TERRA_DUMP_FUNCTION(scc[i]); }
+                        }
                     }
                 }
             }
@@ -2282,6 +2809,55 @@ struct FunctionEmitter {
         }
         return fstate;
     }
+    // Emit the vector variants registered for the external function name with
+    // terralib.addvectorvariant, and record the vector-function-abi-variant attribute
+    // that lets the loop vectorizer replace calls to scalar with calls to them. The
+    // variants are kept in llvm.compiler.used so they survive until the vectorizer
+    // runs, as with the declarations LLVM's InjectTLIMappings adds. Calls inside the
+    // variants are never mapped, so a variant may fall back to the scalar function.
+    void emitVectorVariants(const char *name, Function *scalar) {
+        if (!CU->pipeline.vectorize || CU->vectorvariants.count(scalar)) return;
+        // calls emitted before the variants are done, such as those in the variants
+        // themselves, stay scalar
+        CU->vectorvariants[scalar] = "";
+        lua_getfield(L, COMPILATION_UNIT_POS, "vectorvariants");
+        if (lua_istable(L, -1))
+            lua_getfield(L, -1, name);
+        else
+            lua_pushnil(L);
+        lua_remove(L, -2);
+        if (lua_isnil(L, -1)) {
+            lua_pop(L, 1);
+            return;
+        }
+        Obj variants;
+        funcobj->fromStack(&variants);
+        std::string mappings;
+        std::vector<GlobalValue *> used;
+        for (int i = 0; i < variants.size(); i++) {
+            Obj variant;
+            variants.objAt(i, &variant);
+            Function *vf = ::EmitFunction(CU, &variant, NULL);
+            // the vectorizer passes one vector for each scalar argument, so the
+            // variant's signature must be the scalar one widened
+            FixedVectorType *vt = dyn_cast<FixedVectorType>(vf->getReturnType());
+            bool widened = vt && vt->getElementType() == scalar->getReturnType() &&
+                           vf->arg_size() == scalar->arg_size();
+            for (unsigned a = 0; widened && a < vf->arg_size(); a++)
+                widened = vf->getArg(a)->getType() ==
+                          FixedVectorType::get(scalar->getArg(a)->getType(),
+                                               vt->getNumElements());
+            if (!widened) continue;
+            if (!mappings.empty()) mappings += ",";
+            mappings += "_ZGV_LLVM_N" + std::to_string(vt->getNumElements()) +
+                        std::string(scalar->arg_size(), 'v') + "_" +
+                        scalar->getName().str() + "(" + vf->getName().str() + ")";
+            used.push_back(vf);
+            CU->vectorvariantfunctions.insert(vf);
+        }
+        if (!used.empty()) appendToCompilerUsed(*M, used);
+        CU->vectorvariants[scalar] = mappings;
+    }
     Constant *emitConstantExpression(Obj *exp) {
         TerraFunctionState state;
         fstate = &state;
@@ -2293,12 +2869,16 @@ struct FunctionEmitter {
         B->SetInsertPoint(entry);
         B->CreateRet(emitExp(exp));
         endDebug();
-        CU->fpm->run(*fstate->func
+        // the builder folds most expressions already; fixed passes fold the rest,
+        // whatever the unit's pipeline is
+        if (!isa<Constant>(fstate->func->getEntryBlock().getTerminator()->getOperand(0))) {
+            llvmutil_foldconstants(fstate->func
 #if LLVM_VERSION >= 170
-                     ,
-                     CU->fam
+                                   ,
+                                   CU->fam
 #endif
-        );
+            );
+        }
         ReturnInst *term =
                 cast<ReturnInst>(fstate->func->getEntryBlock().getTerminator());
         Constant *r = dyn_cast<Constant>(term->getReturnValue());
@@ -2309,6 +2889,83 @@ struct FunctionEmitter {
         fstate->func->eraseFromParent();
         return r;
     }
+#if LLVM_VERSION >= 170
+    Function *getIntrinsic(Intrinsic::ID id, ArrayRef<Type *> types = {}) {
+#if LLVM_VERSION >= 200
+        return Intrinsic::getOrInsertDeclaration(M, id, types);
+#else
+        return Intrinsic::getDeclaration(M, id, types);
+#endif
+    }
+    // Coroutines use LLVM's switched-resume lowering. The ramp, which is the function
+    // itself, allocates the frame unless CoroElide can put it in the caller's frame,
+    // runs the body up to the first suspend and returns the handle. CoroSplit later
+    // moves the rest of the body into separate resume and destroy functions.
+    void emitCoroutinePrologue() {
+        LLVMContext &ctx = *CU->TT->ctx;
+        PointerType *ptrty = PointerType::getUnqual(ctx);
+        Type *intptrty = M->getDataLayout().getIntPtrType(ctx);
+        Constant *null = ConstantPointerNull::get(ptrty);
+        fstate->func->setPresplitCoroutine();
+
+        BasicBlock *entry = B->GetInsertBlock();
+        BasicBlock *alloc = createAndInsertBB("coro.alloc");
+        BasicBlock *begin = createAndInsertBB("coro.begin");
+        coroid = B->CreateCall(getIntrinsic(Intrinsic::coro_id),
+                               {B->getInt32(16), null, null, null});
+        B->CreateCondBr(B->CreateCall(getIntrinsic(Intrinsic::coro_alloc), {coroid}), alloc,
+                        begin);
+        setInsertBlock(alloc);
+        FunctionCallee mallocfn =
+                M->getOrInsertFunction("malloc", FunctionType::get(ptrty, {intptrty}, false));
+        Value *size = B->CreateCall(getIntrinsic(Intrinsic::coro_size, {intptrty}));
+        Value *mem = B->CreateCall(mallocfn, {size});
+        B->CreateBr(begin);
+        setInsertBlock(begin);
+        PHINode *frame = B->CreatePHI(ptrty, 2);
+        frame->addIncoming(null, entry);
+        frame->addIncoming(mem, alloc);
+        corohandle = B->CreateCall(getIntrinsic(Intrinsic::coro_begin), {coroid, frame});
+
+        // suspending returns the handle to whoever started or resumed the coroutine
+        cororeturn = createAndInsertBB("coro.return");
+        setInsertBlock(cororeturn);
+        Function *end = getIntrinsic(Intrinsic::coro_end);
+        std::vector<Value *> endargs = {corohandle, B->getFalse()};
+        if (end->arg_size() == 3) endargs.push_back(ConstantTokenNone::get(ctx));
+        B->CreateCall(end, endargs);
+        B->CreateRet(corohandle);
+
+        corocleanup = createAndInsertBB("coro.cleanup");
+        setInsertBlock(corocleanup);
+        FunctionCallee freefn = M->getOrInsertFunction(
+                "free", FunctionType::get(Type::getVoidTy(ctx), {ptrty}, false));
+        B->CreateCall(freefn, {B->CreateCall(getIntrinsic(Intrinsic::coro_free),
+                                           {coroid, corohandle})});
+        B->CreateBr(cororeturn);
+
+        // the final suspend keeps the frame alive until the coroutine is destroyed, so
+        // its owner can still ask whether it is done; resuming it from there is undefined
+        corofinal = createAndInsertBB("coro.final");
+        BasicBlock *unreachable = createAndInsertBB("coro.unreachable");
+        setInsertBlock(corofinal);
+        emitSuspend(true, unreachable, corocleanup);
+        setInsertBlock(unreachable);
+        B->CreateUnreachable();
+
+        BasicBlock *body = createAndInsertBB("coro.body");
+        setInsertBlock(begin);
+        B->CreateBr(body);
+        setInsertBlock(body);
+    }
+    void emitSuspend(bool final, BasicBlock *resume, BasicBlock *destroy) {
+        Value *r = B->CreateCall(getIntrinsic(Intrinsic::coro_suspend),
+                                 {ConstantTokenNone::get(*CU->TT->ctx), B->getInt1(final)});
+        SwitchInst *sw = B->CreateSwitch(r, cororeturn, 2);
+        sw->addCase(B->getInt8(0), resume);
+        sw->addCase(B->getInt8(1), destroy);
+    }
+#endif
     Obj *newMap(Obj *buf) {
         lua_newtable(L);
         CU->symbols->fromStack(buf);
@@ -2327,17 +2984,30 @@ struct FunctionEmitter {
         funcobj->obj("type", &ftype);
         funcobj->obj("labeldepths", &labeldepthtbl);
         labeldepth = &labeldepthtbl;
+        // a goto can jump over a declaration into the middle of a variable's lifetime,
+        // so only mark lifetimes in functions without labels
+        uselifetimes = !hasEntries(&labeldepthtbl);
+
+#if LLVM_VERSION >= 170
+        if (funcobj->hasfield("coroutine") && funcobj->boolean("coroutine"))
+            emitCoroutinePrologue();
+#endif
 
         std::vector<Value *> parametervars;
         emitExpressionList(&parameters, false, &parametervars);
-        CC->EmitEntry(B, &ftype, fstate->func, &parametervars);
+        Obj noalias;
+        CC->EmitEntry(B, &ftype, fstate->func, &parametervars,
+                      funcobj->obj("noalias", &noalias) ? &noalias : NULL);
 
         Obj body;
         funcobj->obj("body", &body);
         emitStmt(&body);
         // if there no terminating return statment, we need to insert one
         // if there was a Return, then this block is dead and will be cleaned up
-        emitReturnUndef();
+        if (corohandle)
+            B->CreateBr(corofinal);
+        else
+            emitReturnUndef();
         assert(breakpoints.size() == 0);
 
         VERBOSE_ONLY(T) { TERRA_DUMP_FUNCTION(fstate->func); }
@@ -2370,8 +3040,19 @@ struct FunctionEmitter {
         v->obj("symbol", &sym);
         AllocaInst *a = CreateAlloca(B, typeOfValue(v)->type, 0, v->string("name"));
         mapSymbol(&locals->cur, &sym, a);
+        if (uselifetimes && locals->lifetimes) {
+            B->CreateLifetimeStart(a);
+            locals->lifetimes->push_back(a);
+        }
         return a;
     }
+    bool hasEntries(Obj *tbl) {
+        tbl->push();
+        lua_pushnil(L);
+        bool r = lua_next(L, -2) != 0;
+        lua_pop(L, r ? 3 : 1);
+        return r;
+    }
 
     Value *emitAddressOf(Obj *exp, Obj *as_type = NULL) {
         Value *v = emitExp(exp, false);
@@ -2774,6 +3455,7 @@ struct FunctionEmitter {
         // in all cases we simply bitcast cast the resulting pointer to the expected type
         entry.obj("type", entryType);
         TType *entryTType = getType(entryType);
+        if (entry.boolean("inunion")) uniontypes.insert(getType(structType)->type);
         if (entry.boolean("inunion")
 #if LLVM_VERSION < 170
             || isPointerToFunction(entryTType->type)
@@ -2791,6 +3473,62 @@ struct FunctionEmitter {
         return addr;
     }
 
+    // Type-based alias information for a load or store of a scalar. Terra's primitive
+    // types hang off their own root, so they never disagree with TBAA in IR that
+    // Clang generated. Like C's char, 8-bit integers may alias anything and get no
+    // tag, and neither do accesses through a union, whose fields share storage.
+    MDNode *getTBAATag(Type *t) {
+        if (!(t->isIntegerTy() || t->isFloatingPointTy() || t->isPointerTy()) ||
+            t->isIntegerTy(8) || t->isIntegerTy(1))
+            return NULL;
+        MDNode *&tag = tbaatags[t];
+        if (!tag) {
+            MDBuilder MDB(*CU->TT->ctx);
+            MDNode *root = MDB.createTBAARoot("Terra TBAA");
+            std::string name;
+            if (t->isPointerTy()) {
+                name = "any pointer";
+            } else {
+                raw_string_ostream os(name);
+                t->print(os);
+                os.flush();
+            }
+            MDNode *node = MDB.createTBAAScalarTypeNode(name, root);
+            tag = MDB.createTBAAStructTagNode(node, node, 0);
+        }
+        return tag;
+    }
+    bool isUnionAccess(Value *addr) {
+        if (uniontypes.empty()) return false;
+        while (true) {
+            if (BitCastOperator *bc = dyn_cast<BitCastOperator>(addr)) {
+                addr = bc->getOperand(0);
+            } else if (GEPOperator *gep = dyn_cast<GEPOperator>(addr)) {
+                for (gep_type_iterator it = gep_type_begin(gep), end = gep_type_end(gep);
+                     it != end; ++it) {
+                    StructType *st = it.getStructTypeOrNull();
+                    if (st && uniontypes.count(st)) return true;
+                }
+                addr = gep->getPointerOperand();
+            } else if (GlobalVariable *gv = dyn_cast<GlobalVariable>(addr)) {
+                // selecting the first field of a global folds away the GEP
+                return uniontypes.count(gv->getValueType()) != 0;
+            } else {
+                return false;
+            }
+        }
+    }
+    template <typename LoadOrStore>
+    void addTBAA(LoadOrStore *I, Type *t) {
+        if (!CU->strictaliasing || isUnionAccess(I->getPointerOperand())) return;
+        if (MDNode *tag = getTBAATag(t)) I->setMetadata(LLVMContext::MD_tbaa, tag);
+    }
+    Value *emitLoad(Type *t, Value *addr) {
+        LoadInst *l = B->CreateLoad(t, addr);
+        addTBAA(l, t);
+        return l;
+    }
+
     Value *emitStore(Value *value, Value *addr, bool isVolatile, MaybeAlign alignment) {
         LoadInst *l = dyn_cast<LoadInst>(&*value);
         Type *t1 = value->getType();
@@ -2853,12 +3591,16 @@ struct FunctionEmitter {
     }
     Value *emitExp(Obj *exp, bool loadlvalue = true) {
         Value *raw = emitExpRaw(exp);
+        if (loadlvalue && exp->kind("kind") == T_constant && isa<GlobalVariable>(raw)) {
+            // the value of an aggregate constant is its initializer
+            return cast<GlobalVariable>(raw)->getInitializer();
+        }
         if (loadlvalue && exp->boolean("lvalue")) {
             Obj type;
             exp->obj("type", &type);
             Ty->EnsureTypeIsComplete(&type);
             Type *ttype = getType(&type)->type;
-            raw = B->CreateLoad(ttype, raw);
+            raw = emitLoad(ttype, raw);
         }
         return raw;
     }
@@ -2882,16 +3624,22 @@ struct FunctionEmitter {
                 if (T_globalvariable == global.kind("kind")) {
                     GlobalVariable *gv =
                             EmitGlobalVariable(CU, &global, exp->string("name"));
+                    Value *addr = gv;
+#if LLVM_VERSION >= 160
+                    // the address of the calling thread's copy, which LLVM can reuse
+                    // within the function, e.g. by hoisting it out of loops
+                    if (gv->isThreadLocal()) addr = B->CreateThreadLocalAddress(gv);
+#endif
 #if LLVM_VERSION < 170
                     // Clang (as of LLVM 7) changes the types of certain globals
                     // (like arrays). Change the type back to what we expect
                     // here so we don't cause issues downstream in the compiler.
                     return B->CreateBitCast(
-                            gv,
+                            addr,
                             PointerType::get(typeOfValue(exp)->type,
                                              gv->getType()->getPointerAddressSpace()));
 #else
-                    return gv;
+                    return addr;
 #endif
                 } else {
 #if LLVM_VERSION < 170
@@ -2989,8 +3737,7 @@ struct FunctionEmitter {
                     std::vector<Value *> idxs;
                     Ty->EnsurePointsToCompleteType(&aggTypeO);
                     Value *result = B->CreateGEP(objTType->type, valueExp, idxExp);
-                    if (!exp->boolean("lvalue"))
-                        result = B->CreateLoad(objTType->type, result);
+                    if (!exp->boolean("lvalue")) result = emitLoad(objTType->type, result);
                     return result;
                 }
             } break;
@@ -3050,7 +3797,21 @@ struct FunctionEmitter {
                 assert(data);
                 size_t size = CU->getDataLayout().getTypeAllocSize(typ->type);
                 Value *r;
-                if (typ->type->isIntegerTy()) {
+                if (typ->type->isAggregateType() || typ->type->isVectorTy()) {
+                    // aggregates are lvalues referring to a constant global, so
+                    // lookup tables can be indexed without copying them
+                    exp->obj("value", &value);
+                    r = lookupSymbol<Value>(CU->symbols, &value);
+                    if (!r) {
+                        GlobalVariable *gv = new GlobalVariable(
+                                *M, typ->type, true, GlobalValue::PrivateLinkage,
+                                EmitConstantData(CU, typ->type, (const char *)data),
+                                "$constant");
+                        gv->setUnnamedAddr(GlobalValue::UnnamedAddr::Global);
+                        r = gv;
+                        mapSymbol(CU->symbols, &value, r);
+                    }
+                } else if (typ->type->isIntegerTy()) {
                     uint64_t integer = 0;
                     memcpy(&integer, data, size);  // note: assuming little endian, there
                                                    // is probably a better way to do this
@@ -3168,7 +3929,7 @@ struct FunctionEmitter {
                 Obj entryType;
                 Value *result = emitStructSelect(&typ, v, offset, &entryType);
                 if (!exp->boolean("lvalue"))
-                    result = B->CreateLoad(getType(&entryType)->type, result);
+                    result = emitLoad(getType(&entryType)->type, result);
                 return result;
             } break;
             case T_constructor:
@@ -3210,6 +3971,27 @@ struct FunctionEmitter {
                 Value *call = B->CreateCall(fn->getFunctionType(), fn, values);
                 return (isvoid) ? UndefValue::get(ttype) : call;
             } break;
+            case T_boundscheck: {
+                Obj idx, extent;
+                exp->obj("index", &idx);
+                exp->obj("extent", &extent);
+                Value *index = emitExp(&idx);
+                if (!CU->boundscheck) return index;
+                // an unsigned compare also catches negative indices; the trap block is
+                // noreturn, so LLVM treats it as cold and may hoist or remove the check
+                Value *inbounds = B->CreateICmpULT(
+                        emitIndex(typeOfValue(&idx), 64, index), emitExp(&extent));
+                BasicBlock *fail = createAndInsertBB("boundscheck.fail");
+                BasicBlock *ok = createAndInsertBB("boundscheck.ok");
+                B->CreateCondBr(inbounds, ok, fail);
+                setInsertBlock(fail);
+                FunctionCallee trap = M->getOrInsertFunction(
+                        "llvm.trap", FunctionType::get(Type::getVoidTy(*CU->TT->ctx), false));
+                B->CreateCall(trap)->setDoesNotReturn();
+                B->CreateUnreachable();
+                setInsertBlock(ok);
+                return index;
+            } break;
             case T_attrload: {
                 Obj addr, type, attr;
                 exp->obj("type", &type);
@@ -3229,6 +4011,12 @@ struct FunctionEmitter {
                     l->setMetadata("nontemporal", MDNode::get(*CU->TT->ctx, list));
                 }
                 l->setVolatile(attr.boolean("isvolatile"));
+                if (attr.hasfield("ordering")) {
+                    l->setAtomic(ParseAtomicOrdering(attr.string("ordering")),
+                                 ParseAtomicSyncScope(M, attr.hasfield("syncscope")
+                                                                 ? attr.string("syncscope")
+                                                                 : NULL));
+                }
                 return l;
             } break;
             case T_attrstore: {
@@ -3251,8 +4039,50 @@ struct FunctionEmitter {
                             ConstantInt::get(Type::getInt32Ty(*CU->TT->ctx), 1));
                     store->setMetadata("nontemporal", MDNode::get(*CU->TT->ctx, list));
                 }
+                if (attr.hasfield("ordering")) {
+                    assert(store && "atomic store of an aggregate");
+                    store->setAtomic(ParseAtomicOrdering(attr.string("ordering")),
+                                     ParseAtomicSyncScope(M, attr.hasfield("syncscope")
+                                                                     ? attr.string("syncscope")
+                                                                     : NULL));
+                }
                 return Constant::getNullValue(typeOfValue(exp)->type);
             } break;
+            case T_coroutineop: {
+#if LLVM_VERSION >= 170
+                std::string op = exp->string("operation");
+                // terralib.lua only compiles these in coroutines
+                assert(corohandle || (op != "suspend" && op != "self"));
+                if (op == "self") return corohandle;
+                Value *unit = Constant::getNullValue(typeOfValue(exp)->type);
+                if (op == "suspend") {
+                    BasicBlock *resume = createAndInsertBB("coro.resume");
+                    BasicBlock *destroy = createAndInsertBB("coro.destroy");
+                    emitSuspend(false, resume, destroy);
+                    // destroying a suspended coroutine runs the defers of its live scopes
+                    setInsertBlock(destroy);
+                    emitDeferred(deferred.size());
+                    B->CreateBr(corocleanup);
+                    setInsertBlock(resume);
+                    return unit;
+                }
+                Obj handle;
+                exp->obj("handle", &handle);
+                Value *h = emitExp(&handle);
+                if (op == "resume") {
+                    B->CreateCall(getIntrinsic(Intrinsic::coro_resume), {h});
+                } else if (op == "destroy") {
+                    B->CreateCall(getIntrinsic(Intrinsic::coro_destroy), {h});
+                } else {
+                    assert(op == "done");
+                    Value *done = B->CreateCall(getIntrinsic(Intrinsic::coro_done), {h});
+                    return B->CreateZExt(done, typeOfValue(exp)->type);
+                }
+                return unit;
+#else
+                terra_reporterror(T, "coroutines require LLVM 17 or later\n");
+#endif
+            } break;
             case T_fence: {
                 Obj attr;
                 exp->obj("attrs", &attr);
@@ -3433,16 +4263,21 @@ struct FunctionEmitter {
         filenamecache[filename] = block;
         return block;
     }
+    // remarks refer to source positions through the debug locations, so a unit
+    // that collects them gets line tables even without debug info
+    bool emitsDebugLocations() { return T->options.debug != 0 || CU->collectremarks; }
     void initDebug(const char *filename, int lineno) {
         customfilename = NULL;
         customlinenumber = 0;
-        DEBUG_ONLY(T) {
+        if (emitsDebugLocations()) {
             DB = new DIBuilder(*M);
 
             DIFileP file = createDebugInfoForFile(filename);
             DICompileUnit *CU = DB->createCompileUnit(
                     dwarf::DW_LANG_C89, DB->createFile("compilationunit", "."), "terra",
-                    true, "", 0);
+                    true, "", 0, "",
+                    T->options.debug != 0 ? DICompileUnit::FullDebug
+                                          : DICompileUnit::LineTablesOnly);
 
             auto TA = DB->getOrCreateTypeArray(ArrayRef<Metadata *>());
 
@@ -3466,14 +4301,14 @@ struct FunctionEmitter {
         }
     }
     void endDebug() {
-        DEBUG_ONLY(T) {
+        if (emitsDebugLocations()) {
             DB->finalize();
             delete DB;
             DB = nullptr;
         }
     }
     void setDebugPoint(Obj *obj) {
-        DEBUG_ONLY(T) {
+        if (emitsDebugLocations()) {
             MDNode *scope = debugScopeForFile(customfilename ? customfilename
                                                              : obj->string("filename"));
             B->SetCurrentDebugLocation(DILocation::get(
@@ -3538,7 +4373,14 @@ struct FunctionEmitter {
             setInsertBlock(bb);
             deferred.push_back(bb);
         }
-        Value *r = CC->EmitCall(B, &fntyp, callingconv, &paramtypes, fn, &actuals);
+        StringRef vectorvariants;
+        Function *callee = dyn_cast<Function>(fn->stripPointerCasts());
+        if (callee && !CU->vectorvariantfunctions.count(fstate->func)) {
+            auto it = CU->vectorvariants.find(callee);
+            if (it != CU->vectorvariants.end()) vectorvariants = it->second;
+        }
+        Value *r = CC->EmitCall(B, &fntyp, callingconv, &paramtypes, fn, &actuals,
+                                vectorvariants);
         setInsertBlock(cur);  // defer may have changed it
         return r;
     }
@@ -3644,8 +4486,9 @@ struct FunctionEmitter {
             setInsertBlock(bb);
         }
     }
-    void enterScope(Locals *buf) {
+    void enterScope(Locals *buf, std::vector<AllocaInst *> *lifetimes = NULL) {
         buf->prev = locals;
+        buf->lifetimes = lifetimes;
         newMap(&buf->cur);
         locals = buf;
     }
@@ -3659,12 +4502,16 @@ struct FunctionEmitter {
         switch (kind) {
             case T_block: {
                 Locals buf;
-                enterScope(&buf);
+                std::vector<AllocaInst *> lifetimes;
+                enterScope(&buf, &lifetimes);
                 size_t N = deferred.size();
                 Obj stmts;
                 stmt->obj("statements", &stmts);
                 emitStmtList(&stmts);
                 unwindDeferred(N);
+                // exits through return, break or goto skip these, which only makes
+                // the variables look live for longer
+                for (AllocaInst *a : lifetimes) B->CreateLifetimeEnd(a);
                 leaveScope();
             } break;
             case T_returnstat: {
@@ -3675,7 +4522,10 @@ struct FunctionEmitter {
                 Obj ftype;
                 funcobj->obj("type", &ftype);
                 emitDeferred(deferred.size());
-                CC->EmitReturn(B, &ftype, fstate->func, result);
+                if (corohandle)
+                    B->CreateBr(corofinal);  // a coroutine's return finishes it
+                else
+                    CC->EmitReturn(B, &ftype, fstate->func, result);
                 startDeadCode();
             } break;
             case T_label: {
@@ -3855,8 +4705,10 @@ struct FunctionEmitter {
                         B->CreateStore(rhsexps[i], rhsvarV);
                         emitExp(&setter);
                     } else {
-                        emitStore(rhsexps[i], emitExp(&lhs, false),
-                                  /* isVolatile */ false, MaybeAlign());
+                        Value *st = emitStore(rhsexps[i], emitExp(&lhs, false),
+                                              /* isVolatile */ false, MaybeAlign());
+                        if (StoreInst *si = dyn_cast<StoreInst>(st))
+                            addTBAA(si, rhsexps[i]->getType());
                     }
                 }
             } break;
@@ -3919,18 +4771,30 @@ static int terra_compilationunitaddvalue(
         } else {
             gv = EmitFunction(CU, &value, NULL);
         }
+        // function definitions are internal until exported, so an external one
+        // already has the name of an earlier export
+        bool exported =
+                isa<Function>(gv) && !gv->isDeclaration() && gv->hasExternalLinkage();
         gv->setLinkage(
                 GlobalValue::ExternalLinkage);  // User explicitly exported this function.
         CU->Ty = NULL;
         CU->CC = NULL;
         CU->symbols = NULL;
         CU->tooptimize = NULL;
-        if (modulename) {
+        if (modulename && gv->getName() != modulename) {
             if (GlobalValue *gv2 = CU->M->getNamedValue(modulename))
                 gv2->setName(
                         Twine(StringRef(modulename),
                               "_renamed"));  // rename anything else that has this name
-            gv->setName(modulename);         // and set our function to this name
+            if (exported) {
+                // e.g. identical functions share one definition (see ReuseSCC), so
+                // keep the earlier export's name and add this one as an alias
+                gv = GlobalAlias::create(gv->getValueType(), gv->getAddressSpace(),
+                                         GlobalValue::ExternalLinkage, modulename, gv,
+                                         CU->M);
+            } else {
+                gv->setName(modulename);  // and set our function to this name
+            }
             assert(gv->getName() == modulename);  // make sure it worked
         }
         // cleanup -- ensure we left the stack the way we started
@@ -3980,9 +4844,423 @@ static bool MCJITShouldCopy(GlobalValue *G, void *data) {
 static bool SaveSharedObject(TerraCompilationUnit *CU, Module *M,
                              std::vector<const char *> *args, const char *filename);
 
+static void ShareConstantTables(TerraConstantPool &pool, ExecutionEngine *ee, Module *m,
+                                StringRef root);
+
+// Make the code compiled by the compilation service usable from CU's state: add its
+// functions to the state's functioninfo, and map its symbols into the unit's engine, so
+// that getpointer returns the service's code and later modules call it instead of
+// copying it. The code lives as long as the service, not the unit, so the functions are
+// not forgotten with the unit's own.
+static void UseServiceCode(TerraCompilationUnit *CU,
+                           const terra_CompilationService::Code &code) {
+    for (const TerraFunctionInfo &fi : code.functions) CU->T->C->functioninfo[fi.addr] = fi;
+    for (const auto &sym : code.symbols) {
+        std::string mangled;
+        {
+            raw_string_ostream out(mangled);
+            Mangler::getNameWithPrefix(out, sym.first, CU->ee->getDataLayout());
+        }
+        CU->ee->updateGlobalMapping(mangled, (uint64_t)sym.second);
+        CU->servicesymbols[sym.first] = sym.second;
+    }
+}
+
+// Parse the bitcode of a module into the fresh context of code, and compile it in an
+// engine of its own. Runs without the service's lock.
+static void CompileServiceCode(TerraCompilationUnit *CU, terra_CompilationService *S,
+                               terra_CompilationService::Code &code,
+                               const std::string &bitcode, StringRef name) {
+    code.ctx.reset(new LLVMContext());
+#if LLVM_VERSION >= 150 && LLVM_VERSION < 170
+    code.ctx->setOpaquePointers(false);  // must match the contexts of TerraTargets
+#endif
+    Expected<std::unique_ptr<Module>> SM =
+            parseBitcodeFile(MemoryBufferRef(bitcode, "terra"), *code.ctx);
+    if (!SM) {
+        consumeError(SM.takeError());
+        return;
+    }
+    std::string err;
+    code.ee = CreateExecutionEngine(CU->TT, code.ctx.get(), &err);
+    if (!code.ee) return;  // the state's own engine will report the error
+    ServiceFunctionListener *listener = new ServiceFunctionListener();
+    listener->ee = code.ee;
+    listener->readdebug = (*SM)->getNamedMetadata("llvm.dbg.cu") != NULL;
+    code.listener = listener;
+    code.ee->RegisterJITEventListener(listener);
+    for (GlobalValue &G : (*SM)->global_values()) {
+        if (G.hasLocalLinkage()) continue;
+        if (!G.isDeclaration()) {
+            code.symbols.push_back({G.getName().str(), NULL});
+            continue;
+        }
+        // code the state got from the service earlier
+        auto served = CU->servicesymbols.find(G.getName().str());
+        if (served != CU->servicesymbols.end())
+            code.ee->updateGlobalMapping(&G, served->second);
+    }
+    {
+        std::lock_guard<std::mutex> guard(S->lock);
+        ShareConstantTables(S->constants, code.ee, SM->get(), name);
+    }
+    code.ee->addModule(std::move(*SM));
+    code.ptr = (void *)code.ee->getGlobalValueAddress(name.str());
+    for (auto &sym : code.symbols)
+        sym.second = (void *)code.ee->getGlobalValueAddress(sym.first);
+    code.functions.swap(listener->loaded);
+}
+
+// Compile M in the compilation service attached to CU's state and return the address
+// of name, or NULL if M has to stay in the state's own engine. That is the case when it
+// defines mutable globals (each state needs its own storage), uses thread-local ones
+// (whose copies belong to the state, see LowerThreadLocals) or refers to something this
+// state has JIT'd on its own, whose address is only meaningful in this state.
+static void *JITInCompilationService(TerraCompilationUnit *CU, Module *M,
+                                     StringRef name) {
+    terra_CompilationService *S = CU->T->service;
+    // code the state got from the service is valid everywhere, but the callers of
+    // different definitions must not share a cache entry, so its address is in the key
+    std::string served;
+    for (GlobalValue &G : M->global_values()) {
+        GlobalVariable *GV = dyn_cast<GlobalVariable>(&G);
+        if (GV && (GV->isThreadLocal() || (!GV->isDeclaration() && !GV->isConstant())))
+            return NULL;
+        if (!G.isDeclaration() || (!GV && !isa<Function>(G)) ||
+            GetGlobalValueAddress(CU, G.getName()) == NULL)
+            continue;
+        auto symbol = CU->servicesymbols.find(G.getName().str());
+        if (symbol == CU->servicesymbols.end()) return NULL;
+        char addr[32];
+        snprintf(addr, sizeof(addr), "=%p\n", symbol->second);
+        served += G.getName().str() + addr;
+    }
+
+    std::string target = CU->TT->Triple + "\n" + CU->TT->CPU + "\n" + CU->TT->Features;
+    std::string bitcode;
+    {
+        raw_string_ostream out(bitcode);
+        WriteBitcodeToFile(*M, out);
+    }
+    std::string key = target + "\n" + name.str() + "\n" + served + bitcode;
+
+    std::unique_lock<std::mutex> guard(S->lock);
+    auto entry = S->code.emplace(key, terra_CompilationService::Code());
+    terra_CompilationService::Code &code = entry.first->second;
+    if (!entry.second) {  // compiled, or being compiled by another state
+        S->ready.wait(guard, [&] { return code.done; });
+        if (!code.ptr) return NULL;
+        S->nreused++;
+        guard.unlock();
+        UseServiceCode(CU, code);
+        return code.ptr;
+    }
+    guard.unlock();
+    CompileServiceCode(CU, S, code, bitcode, name);
+    guard.lock();
+    code.done = true;
+    if (code.ptr) S->ncompiled++;
+    guard.unlock();
+    S->ready.notify_all();
+    if (!code.ptr) return NULL;
+    UseServiceCode(CU, code);
+    return code.ptr;
+}
+
+terra_CompilationService *terra_newcompilationservice() {
+    return new terra_CompilationService();
+}
+
+void terra_compilationservicestats(terra_CompilationService *S, size_t *ncompiled,
+                                   size_t *nreused) {
+    std::lock_guard<std::mutex> guard(S->lock);
+    *ncompiled = S->ncompiled;
+    *nreused = S->nreused;
+}
+
+void terra_freecompilationservice(terra_CompilationService *S) {
+    for (auto &e : S->code) {
+        terra_CompilationService::Code &code = e.second;
+        if (code.ee) {
+            code.ee->UnregisterJITEventListener(code.listener);
+            delete code.listener;
+            delete code.ee;
+        }
+        code.ctx.reset();  // after the engine, which owns modules of it
+    }
+    for (sys::MemoryBlock &block : S->constants.blocks)
+        sys::Memory::releaseMappedMemory(block);
+    delete S;
+}
+
+// Write the value of C as it is laid out in memory to out, which is zeroed and
+// as large as C's type. Fails for constants that need relocations, like the
+// addresses of functions.
+static bool ConstantBytes(const DataLayout &DL, Constant *C, char *out) {
+    Type *typ = C->getType();
+    if (isa<ConstantAggregateZero>(C) || isa<ConstantPointerNull>(C) || isa<UndefValue>(C)) {
+        return true;
+    } else if (ConstantInt *ci = dyn_cast<ConstantInt>(C)) {
+        StoreIntToMemory(ci->getValue(), (uint8_t *)out, DL.getTypeStoreSize(typ));
+        return true;
+    } else if (ConstantFP *cf = dyn_cast<ConstantFP>(C)) {
+        StoreIntToMemory(cf->getValueAPF().bitcastToAPInt(), (uint8_t *)out,
+                         DL.getTypeStoreSize(typ));
+        return true;
+    } else if (ConstantDataSequential *cd = dyn_cast<ConstantDataSequential>(C)) {
+        Type *et = cd->getElementType();
+        if (isa<VectorType>(typ) ||
+            DL.getTypeAllocSize(et) == DL.getTypeStoreSize(et)) {  // no padding
+            StringRef raw = cd->getRawDataValues();
+            memcpy(out, raw.data(), raw.size());
+            return true;
+        }
+        uint64_t stride = DL.getTypeAllocSize(et);
+        for (unsigned i = 0; i < cd->getNumElements(); i++)
+            if (!ConstantBytes(DL, cd->getElementAsConstant(i), out + i * stride))
+                return false;
+        return true;
+    } else if (StructType *st = dyn_cast<StructType>(typ)) {
+        const StructLayout *layout = DL.getStructLayout(st);
+        for (unsigned i = 0; i < st->getNumElements(); i++)
+            if (!ConstantBytes(DL, C->getAggregateElement(i),
+                               out + layout->getElementOffset(i)))
+                return false;
+        return true;
+    } else if (ArrayType *at = dyn_cast<ArrayType>(typ)) {
+        uint64_t stride = DL.getTypeAllocSize(at->getElementType());
+        for (uint64_t i = 0; i < at->getNumElements(); i++)
+            if (!ConstantBytes(DL, C->getAggregateElement(i), out + i * stride))
+                return false;
+        return true;
+    } else if (VectorType *vt = dyn_cast<VectorType>(typ)) {
+        uint64_t stride = DL.getTypeStoreSize(vt->getElementType());
+        for (unsigned i = 0; i < cast<FixedVectorType>(vt)->getNumElements(); i++)
+            if (!ConstantBytes(DL, C->getAggregateElement(i), out + i * stride))
+                return false;
+        return true;
+    }
+    return false;
+}
+
+// constant tables at least this large are shared between the units of a target
+static const size_t SHARED_CONSTANT_MIN_SIZE = 4096;
+
+// Replace the large constant tables of a module that is about to be JIT'd by ee with
+// references to read-only copies in a constant pool (the target's, or that of a
+// compilation service), adding the tables the pool does not have yet. Units that
+// include the same table, and functions of one unit that are JIT'd separately, then
+// share one copy instead of each getting its own in writable data. Only tables local
+// to the module are shared: root, the global being JIT'd, and anything else that is
+// looked up by name must keep its definition.
+static void ShareConstantTables(TerraConstantPool &pool, ExecutionEngine *ee, Module *m,
+                                StringRef root) {
+    const DataLayout &DL = m->getDataLayout();
+    std::vector<GlobalVariable *> candidates;
+    for (GlobalVariable &GV : m->globals()) {
+        if (GV.getName() == root || !GV.hasLocalLinkage()) continue;
+        if (GV.hasInitializer() && GV.isConstant() && GV.hasGlobalUnnamedAddr() &&
+            !GV.isThreadLocal() && GV.getAddressSpace() == 0 &&
+            DL.getTypeAllocSize(GV.getValueType()) >= SHARED_CONSTANT_MIN_SIZE)
+            candidates.push_back(&GV);
+    }
+    for (GlobalVariable *GV : candidates) {
+        size_t size = DL.getTypeAllocSize(GV->getValueType());
+        std::vector<char> bytes(size, 0);
+        if (!ConstantBytes(DL, GV->getInitializer(), bytes.data())) continue;
+        uint64_t hash = hash_value(StringRef(bytes.data(), size));
+        std::vector<TerraConstantPool::Table> &tables = pool.tables[hash];
+        const TerraConstantPool::Table *table = NULL;
+        for (const TerraConstantPool::Table &t : tables) {
+            if (t.size == size && memcmp(t.addr, bytes.data(), size) == 0) table = &t;
+        }
+        if (table) {
+            pool.bytessaved += size;
+        } else {
+            // pages are aligned well enough for any type
+            std::error_code ec;
+            sys::MemoryBlock block = sys::Memory::allocateMappedMemory(
+                    size, NULL, sys::Memory::MF_READ | sys::Memory::MF_WRITE, ec);
+            if (ec) continue;  // the table stays in the module
+            memcpy(block.base(), bytes.data(), size);
+            sys::Memory::protectMappedMemory(block, sys::Memory::MF_READ);
+            pool.blocks.push_back(block);
+            char name[64];
+            snprintf(name, sizeof(name), "$sharedconstant.%016" PRIx64 ".%d", hash,
+                     (int)tables.size());
+            tables.push_back({block.base(), size, name});
+            table = &tables.back();
+            pool.ntables++;
+            pool.bytes += size;
+        }
+        // refer to the pool's copy through an external declaration, which is
+        // addressed through the GOT since the pool may be far from the code
+        if (GlobalVariable *existing = m->getNamedGlobal(table->name)) {
+            GV->replaceAllUsesWith(ConstantExpr::getBitCast(existing, GV->getType()));
+            GV->eraseFromParent();
+            continue;
+        }
+        GV->setInitializer(NULL);
+        GV->setLinkage(GlobalValue::ExternalLinkage);
+        GV->setUnnamedAddr(GlobalValue::UnnamedAddr::None);
+        GV->setDSOLocal(false);
+        GV->setName(table->name);
+        ee->updateGlobalMapping(GV, const_cast<void *>(table->addr));
+    }
+}
+
+// The copies of the thread-local globals of JIT'd code that the calling thread
+// has accessed, indexed by TerraThreadLocal::index
+struct ThreadLocalCopies {
+    std::vector<std::unique_ptr<char[]>> storage;
+    std::vector<void *> copies;  // aligned into storage
+};
+static thread_local ThreadLocalCopies threadlocalcopies;
+static std::atomic<size_t> nthreadlocals(0);
+
+static void *ThreadLocalAddress(TerraThreadLocal *var) {
+    ThreadLocalCopies &tl = threadlocalcopies;
+    if (var->index < tl.copies.size() && tl.copies[var->index])
+        return tl.copies[var->index];
+    if (var->index >= tl.copies.size()) {
+        tl.copies.resize(var->index + 1);
+        tl.storage.resize(var->index + 1);
+    }
+    char *raw = new char[var->size + var->align];
+    tl.storage[var->index].reset(raw);
+    char *copy = raw + (var->align - (uintptr_t)raw % var->align) % var->align;
+    memcpy(copy, var->init.data(), var->size);
+    tl.copies[var->index] = copy;
+    return copy;
+}
+
+// The unit's TerraThreadLocal for the thread-local global named name
+static TerraThreadLocal *ThreadLocalVariable(TerraCompilationUnit *CU, StringRef name) {
+    std::unique_ptr<TerraThreadLocal> &var = CU->threadlocals[name.str()];
+    if (var) return var.get();
+    GlobalVariable *GV = CU->M->getNamedGlobal(name);
+    if (!GV || GV->isDeclaration())
+        terra_reporterror(CU->T,
+                          "the JIT cannot access thread-local variable %s, which is "
+                          "defined outside of Terra\n",
+                          name.str().c_str());
+    const DataLayout &DL = CU->getDataLayout();
+    Type *typ = GV->getValueType();
+    std::unique_ptr<TerraThreadLocal> nvar(new TerraThreadLocal());
+    nvar->index = nthreadlocals++;
+    nvar->size = DL.getTypeAllocSize(typ);
+    nvar->align = std::max<size_t>(DL.getPrefTypeAlign(typ).value(), 1);
+    nvar->init.resize(nvar->size, 0);
+    if (!ConstantBytes(DL, GV->getInitializer(), nvar->init.data()))
+        terra_reporterror(CU->T,
+                          "the JIT does not support the initializer of thread-local "
+                          "variable %s\n",
+                          name.str().c_str());
+    var = std::move(nvar);
+    return var.get();
+}
+
+// Turn the constant expressions built on C that instructions use, such as the GEPs
+// IRBuilder folds for constant field and element indices, into instructions placed
+// before their users, so that C is only used by instructions. Constant expressions
+// used by other constants, e.g. initializers, are left alone.
+static void ExpandConstantExprUsers(Constant *C) {
+    std::vector<User *> users(C->user_begin(), C->user_end());
+    for (User *U : users)
+        if (ConstantExpr *CE = dyn_cast<ConstantExpr>(U)) ExpandConstantExprUsers(CE);
+    ConstantExpr *CE = dyn_cast<ConstantExpr>(C);
+    if (!CE) return;
+    users.assign(CE->user_begin(), CE->user_end());
+    for (User *U : users) {
+        if (PHINode *phi = dyn_cast<PHINode>(U)) {
+            // entries for the same block must carry the same value
+            DenseMap<BasicBlock *, Instruction *> expanded;
+            for (unsigned i = 0; i < phi->getNumIncomingValues(); i++) {
+                if (phi->getIncomingValue(i) != CE) continue;
+                Instruction *&I = expanded[phi->getIncomingBlock(i)];
+                if (!I) {
+                    I = CE->getAsInstruction();
+                    I->insertBefore(phi->getIncomingBlock(i)->getTerminator());
+                }
+                phi->setIncomingValue(i, I);
+            }
+        } else if (Instruction *user = dyn_cast<Instruction>(U)) {
+            Instruction *I = CE->getAsInstruction();
+            I->insertBefore(user);
+            user->replaceUsesOfWith(CE, I);
+        }
+    }
+    if (CE->use_empty()) CE->destroyConstant();
+}
+
+// Replace the thread-local globals of a module that is about to be JIT'd with
+// calls to ThreadLocalAddress. With LLVM 16 and newer the globals are only used by
+// llvm.threadlocal.address, which the optimizer has already hoisted. Older versions
+// use the globals directly, so each function that does gets one call on entry.
+static void LowerThreadLocals(TerraCompilationUnit *CU, Module *m) {
+    std::vector<GlobalVariable *> tlvs;
+    for (GlobalVariable &GV : m->globals())
+        if (GV.isThreadLocal()) tlvs.push_back(&GV);
+    if (tlvs.empty()) return;
+    LLVMContext &ctx = m->getContext();
+    Type *ptrty = PointerType::getUnqual(Type::getInt8Ty(ctx));
+    FunctionType *fty = FunctionType::get(ptrty, {ptrty}, false);
+    Function *address = Function::Create(fty, Function::ExternalLinkage,
+                                         "$terra_threadlocaladdress", m);
+    CU->ee->updateGlobalMapping(address, (void *)&ThreadLocalAddress);
+    Type *intptr = m->getDataLayout().getIntPtrType(ctx);
+    for (GlobalVariable *GV : tlvs) {
+        TerraThreadLocal *var = ThreadLocalVariable(CU, GV->getName());
+        Constant *arg = ConstantExpr::getIntToPtr(
+                ConstantInt::get(intptr, (uintptr_t)var), ptrty);
+        auto copyat = [&](Instruction *before) -> Value * {
+            Value *copy = CallInst::Create(fty, address, {arg}, "", before);
+            if (copy->getType() != GV->getType())
+                copy = new BitCastInst(copy, GV->getType(), "", before);
+            return copy;
+        };
+        // the address in F, computed after F's allocas, which dominates every use
+        DenseMap<Function *, Value *> entries;
+        auto copyin = [&](Function *F) -> Value * {
+            Value *&copy = entries[F];
+            if (!copy) {
+                BasicBlock::iterator it = F->getEntryBlock().getFirstInsertionPt();
+                while (isa<AllocaInst>(&*it)) ++it;
+                copy = copyat(&*it);
+            }
+            return copy;
+        };
+        ExpandConstantExprUsers(GV);
+        std::vector<User *> users(GV->user_begin(), GV->user_end());
+        for (User *U : users) {
+#if LLVM_VERSION >= 160
+            if (IntrinsicInst *II = dyn_cast<IntrinsicInst>(U)) {
+                if (II->getIntrinsicID() == Intrinsic::threadlocal_address) {
+                    II->replaceAllUsesWith(copyat(II));
+                    II->eraseFromParent();
+                    continue;
+                }
+            }
+#endif
+            if (Instruction *I = dyn_cast<Instruction>(U))
+                I->replaceUsesOfWith(GV, copyin(I->getFunction()));
+        }
+        if (!GV->use_empty())
+            terra_reporterror(CU->T,
+                              "the JIT does not support the use of thread-local "
+                              "variable %s in a constant expression\n",
+                              GV->getName().str().c_str());
+        GV->eraseFromParent();
+    }
+}
+
 static void *JITGlobalValue(TerraCompilationUnit *CU, GlobalValue *gv) {
     InitializeJIT(CU);
     ExecutionEngine *ee = CU->ee;
+    if (gv->isThreadLocal() && CU->T->options.debug <= 1) {
+        // Lua gets the copy of the thread it runs on
+        return ThreadLocalAddress(ThreadLocalVariable(CU, gv->getName()));
+    }
     if (gv->isDeclaration()) {
         StringRef name = gv->getName();
 #if LLVM_VERSION < 160
@@ -4001,6 +5279,17 @@ static void *JITGlobalValue(TerraCompilationUnit *CU, GlobalValue *gv) {
     llvm::ValueToValueMapTy VMap;
     Module *m = llvmutil_extractmodulewithproperties(gv->getName(), gv->getParent(), &gv,
                                                      1, MCJITShouldCopy, CU, VMap);
+#if LLVM_VERSION >= 170
+    // the extracted module is complete, unlike CU->M while functions are emitted
+    llvmutil_lowercoroutines(m, CU->TT->tm, CU->optimize);
+#endif
+
+    if (CU->T->service && CU->T->options.debug <= 1) {
+        if (void *ptr = JITInCompilationService(CU, m, gv->getName())) {
+            delete m;
+            return ptr;
+        }
+    }
 
     if (CU->T->options.debug > 1) {
         llvm::SmallString<256> tmpname;
@@ -4011,6 +5300,8 @@ static void *JITGlobalValue(TerraCompilationUnit *CU, GlobalValue *gv) {
         assert(result);
         return result;
     }
+    LowerThreadLocals(CU, m);
+    ShareConstantTables(CU->TT->constants, ee, m, gv->getName());
     ee->addModule(UNIQUEIFY(Module, m));
     return (void *)ee->getGlobalValueAddress(gv->getName().str());
 }
@@ -4034,6 +5325,14 @@ static int terra_deletefunction(lua_State *L) {
     assert(fstate);
     Function *func = fstate->func;
     assert(func);
+    if (!ReleaseCachedFunction(CU, func)) {  // still used by an identical definition
+        fstate->func = NULL;
+        freecompilationunit(CU);
+        return 0;
+    }
+    CU->remarks.erase(std::remove_if(CU->remarks.begin(), CU->remarks.end(),
+                                     [func](const TerraRemark &r) { return r.func == func; }),
+                      CU->remarks.end());
     VERBOSE_ONLY(CU->T) {
         printf("deleting function: %s\n", func->getName().str().c_str());
     }
@@ -4087,35 +5386,75 @@ static bool FindLinker(terra_State *T, LLVM_PATH_TYPE *linker, const char *targe
 #endif
 }
 
-static bool SaveAndLink(TerraCompilationUnit *CU, Module *M,
-                        std::vector<const char *> *linkargs, const char *filename) {
-    llvm::SmallString<256> tmpname;
-    llvmutil_createtemporaryfile("terra", "o", tmpname);
-    const char *tmpnamebuf = tmpname.c_str();
-    FD_ERRTYPE err;
-    raw_fd_ostream tmp(tmpnamebuf, err, RAW_FD_OSTREAM_BINARY);
-    if (FD_ISERR(err)) {
-        terra_pusherror(CU->T, "llvm: %s", FD_ERRSTR(err));
-        unlink(tmpnamebuf);
-        return true;
+// Whether linker is the Clang driver, judged by what it prints for --version. Only
+// Clang knows where its profiling runtime is, so gcc rejects -fprofile-instr-generate.
+static bool IsClangDriver(const LLVM_PATH_TYPE &linker) {
+#ifndef _WIN32
+    std::string command = "'" + std::string(linker.c_str()) + "' --version 2>/dev/null";
+    FILE *out = popen(command.c_str(), "r");
+    if (!out) return false;
+    std::string version;
+    char buf[256];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), out)) > 0) version.append(buf, n);
+    pclose(out);
+    return version.find("clang") != std::string::npos;
+#else
+    return false;
+#endif
+}
+
+// Emit M into temporary object files, one per partition when CU->threads > 1.
+static bool EmitTemporaryObjects(TerraCompilationUnit *CU, Module *M,
+                                 std::vector<std::string> *objects) {
+    double begin = CurrentTimeInSeconds();
+    std::vector<std::unique_ptr<raw_fd_ostream> > streams;
+    std::vector<emitobjfile_t *> dests;
+    for (int i = 0; i < std::max(CU->threads, 1); i++) {
+        llvm::SmallString<256> tmpname;
+        llvmutil_createtemporaryfile("terra", "o", tmpname);
+        objects->push_back(tmpname.str().str());
+        FD_ERRTYPE err;
+        streams.emplace_back(
+                new raw_fd_ostream(objects->back(), err, RAW_FD_OSTREAM_BINARY));
+        if (FD_ISERR(err)) {
+            terra_pusherror(CU->T, "llvm: %s", FD_ERRSTR(err));
+            return true;
+        }
+        dests.push_back(streams.back().get());
     }
-    if (llvmutil_emitobjfile(M, CU->TT->tm, true, tmp)) {
+    if (dests.size() > 1 ? llvmutil_emitobjfilesparallel(M, CU->TT->tm, dests)
+                         : llvmutil_emitobjfile(M, CU->TT->tm, true, *dests[0])) {
         terra_pusherror(CU->T, "llvm: llvmutil_emitobjfile");
-        unlink(tmpnamebuf);
         return true;
     }
-    tmp.close();
+    CU->codegentime = CurrentTimeInSeconds() - begin;
+    return false;
+}
+
+static void RemoveFiles(const std::vector<std::string> &files) {
+    for (const std::string &file : files) unlink(file.c_str());
+}
+
+static bool SaveAndLink(TerraCompilationUnit *CU, Module *M,
+                        std::vector<const char *> *linkargs, const char *filename) {
+    std::vector<std::string> objects;
+    if (EmitTemporaryObjects(CU, M, &objects)) {
+        RemoveFiles(objects);
+        return true;
+    }
+    double begin = CurrentTimeInSeconds();
     LLVM_PATH_TYPE linker;
     std::string arch(CU->TT->Triple);
     arch.erase(arch.find_first_of('-'));
     if (FindLinker(CU->T, &linker, arch.c_str())) {
-        unlink(tmpnamebuf);
+        RemoveFiles(objects);
         terra_pusherror(CU->T, "llvm: failed to find linker");
         return true;
     }
     std::vector<const char *> cmd;
     cmd.push_back(linker.c_str());
-    cmd.push_back(tmpnamebuf);
+    for (const std::string &object : objects) cmd.push_back(object.c_str());
     if (linkargs) cmd.insert(cmd.end(), linkargs->begin(), linkargs->end());
 
 #ifndef _WIN32
@@ -4132,21 +5471,25 @@ static bool SaveAndLink(TerraCompilationUnit *CU, Module *M,
     cmd.push_back(NULL);
     std::string errstr;
     if (llvmutil_executeandwait(linker, &cmd[0], &errstr)) {
-        unlink(tmpnamebuf);
+        RemoveFiles(objects);
         unlink(filename);
         terra_pusherror(CU->T, "llvm: %s\n", errstr.c_str());
         return true;
     }
+    RemoveFiles(objects);
+    CU->linktime = CurrentTimeInSeconds() - begin;
     return false;
 }
 
 static bool SaveObject(TerraCompilationUnit *CU, Module *M, const std::string &filekind,
                        emitobjfile_t &dest) {
     if (filekind == "object" || filekind == "asm") {
+        double begin = CurrentTimeInSeconds();
         if (llvmutil_emitobjfile(M, CU->TT->tm, filekind == "object", dest)) {
             terra_pusherror(CU->T, "llvm: llvmutil_emitobjfile");
             return true;
         }
+        CU->codegentime = CurrentTimeInSeconds() - begin;
     } else if (filekind == "bitcode") {
         llvm::WriteBitcodeToFile(*M, dest);
     } else if (filekind == "llvmir") {
@@ -4191,9 +5534,23 @@ static int terra_saveobjimpl(lua_State *L) {
     lua_getfield(L, 3, "llvm_cu");
     TerraCompilationUnit *CU = (TerraCompilationUnit *)terra_tocdatapointer(L, -1);
     assert(CU);
+    CU->optimizetime = CU->codegentime = CU->linktime = 0;
+    size_t firstremark = CU->remarks.size();
     if (optimize) {
-        llvmutil_optimizemodule(CU->M, CU->TT->tm);
+        double begin = CurrentTimeInSeconds();
+        RemarkScope remarkscope(CU);
+        std::string err;
+        if (llvmutil_optimizemodule(CU->M, CU->TT->tm, &CU->pgo, &CU->pipeline, &err)) {
+            terra_pusherror(T, "invalid pass pipeline '%s': %s",
+                            CU->pipeline.passes.c_str(), err.c_str());
+            lua_error(L);
+        }
+        CU->optimizetime = CurrentTimeInSeconds() - begin;
     }
+#if LLVM_VERSION >= 170
+    // the default pipelines lower coroutines already, custom ones may not
+    llvmutil_lowercoroutines(CU->M, CU->TT->tm, false);
+#endif
     // TODO: interialize the non-exported functions?
     std::vector<const char *> args;
     int nargs = lua_objlen(L, argument_index);
@@ -4202,6 +5559,23 @@ static int terra_saveobjimpl(lua_State *L) {
         args.push_back(luaL_checkstring(L, -1));
         lua_pop(L, 1);
     }
+    // instrumented code calls into the profiling runtime, which the Clang driver adds
+    // when linking an executable or shared library
+    if (optimize && CU->pgo.mode == llvmutil_PGOOptions::Generate &&
+        (filekind == "executable" || filekind == "sharedlibrary")) {
+        LLVM_PATH_TYPE linker;
+        std::string arch(CU->TT->Triple);
+        arch.erase(arch.find_first_of('-'));
+        if (!FindLinker(T, &linker, arch.c_str()) && !IsClangDriver(linker)) {
+            terra_pusherror(T,
+                            "pgo = \"generate\" links the profiling runtime with "
+                            "-fprofile-instr-generate, which needs the Clang driver, but "
+                            "the linker %s is not Clang; set CC to clang",
+                            linker.c_str());
+            lua_error(L);
+        }
+        args.push_back("-fprofile-instr-generate");
+    }
 
     bool result = false;
     int N = 0;
@@ -4210,6 +5584,12 @@ static int terra_saveobjimpl(lua_State *L) {
         result = SaveAndLink(CU, CU->M, &args, filename);
     } else if (filekind == "sharedlibrary") {
         result = SaveSharedObject(CU, CU->M, &args, filename);
+#ifndef _WIN32
+    } else if (filekind == "object" && filename != NULL && CU->threads > 1) {
+        // combine the partitions into one relocatable object
+        args.insert(args.begin(), {"-r", "-nostdlib"});
+        result = SaveAndLink(CU, CU->M, &args, filename);
+#endif
     } else {
         if (filename != NULL) {
             FD_ERRTYPE err;
@@ -4234,6 +5614,30 @@ static int terra_saveobjimpl(lua_State *L) {
     }
     if (result) lua_error(CU->T->L);
 
+    lua_newtable(L);
+    lua_pushnumber(L, CU->optimizetime);
+    lua_setfield(L, -2, "optimize");
+    lua_pushnumber(L, CU->codegentime);
+    lua_setfield(L, -2, "codegen");
+    lua_pushnumber(L, CU->linktime);
+    lua_setfield(L, -2, "link");
+    lua_pushnumber(L, std::max(CU->threads, 1));
+    lua_setfield(L, -2, "threads");
+    if (CU->collectremarks) {
+        lua_newtable(L);
+        for (size_t i = firstremark; i < CU->remarks.size(); i++) {
+            PushRemark(L, CU->remarks[i]);
+            lua_rawseti(L, -2, i - firstremark + 1);
+        }
+        lua_setfield(L, -2, "remarks");
+    }
+    lua_setfield(L, 3, "stats");
+    VERBOSE_ONLY(T) {
+        printf("saveobj: optimize %f s, codegen %f s (%d threads), link %f s\n",
+               CU->optimizetime, CU->codegentime, std::max(CU->threads, 1),
+               CU->linktime);
+    }
+
     return N;
 }
 
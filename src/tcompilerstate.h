@@ -3,9 +3,13 @@
 
 #include "llvmheaders.h"
 #include "tinline.h"
+#include "tllvmutil.h"
 
+#include <condition_variable>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 // One row of a line table, at the address the code was actually loaded at. A
@@ -35,6 +39,29 @@ class Types;
 struct CCallingConv;
 struct Obj;
 
+// Large constant tables of JIT'd code, shared by every compilation unit of a
+// target. A table is copied once into read-only pages, and the modules of all
+// units that contain an identical table refer to that copy instead.
+struct TerraConstantPool {
+    struct Table {
+        const void *addr;
+        size_t size;
+        std::string name;  // the symbol JIT'd modules use to refer to it
+    };
+    std::unordered_map<uint64_t, std::vector<Table>> tables;  // by content hash
+    std::vector<llvm::sys::MemoryBlock> blocks;
+    size_t ntables = 0, bytes = 0, bytessaved = 0;
+};
+
+// A thread-local global of JIT'd code. MCJIT cannot allocate native thread-local
+// storage, so each thread gets its own copy of the variable, created from init on
+// the thread's first access.
+struct TerraThreadLocal {
+    size_t index;  // of the thread's copy, unique in the process
+    size_t size, align;
+    std::vector<char> init;
+};
+
 struct TerraTarget {
     TerraTarget()
             : nreferences(0), tm(NULL), ctx(NULL), external(NULL), next_unused_id(0) {}
@@ -46,6 +73,7 @@ struct TerraTarget {
                              // includec or linkllvm)
     size_t next_unused_id;   // for creating names for dummy functions
     size_t id;
+    TerraConstantPool constants;
 };
 
 struct TerraFunctionState {  // compilation state
@@ -54,10 +82,34 @@ struct TerraFunctionState {  // compilation state
     bool onstack;
 };
 
+// Optimized functions of a unit indexed by the fingerprint of their unoptimized IR,
+// so that an identical redefinition (e.g. from a reloaded file) reuses the code
+// instead of being optimized and JIT'd again.
+struct TerraFunctionCache {
+    TerraFunctionCache() : nemitted(0), nreused(0) {}
+    llvm::DenseMap<llvm::Function *, uint64_t> fingerprints;
+    std::unordered_map<uint64_t, llvm::Function *> functions;
+    std::unordered_map<uint64_t, std::string> texts;  // normalized IR, by fingerprint
+    llvm::DenseMap<llvm::Function *, int> users;  // function states sharing a function
+    size_t nemitted, nreused;                     // in strongly connected components
+};
+
+// An optimization remark LLVM reported while optimizing a function of the unit.
+// The location is only known when the function has debug locations.
+struct TerraRemark {
+    const llvm::Function *func;
+    std::string kind;  // "passed", "missed" or "analysis"
+    std::string pass, name, function, message, filename;
+    unsigned line, column;
+};
+
 struct TerraCompilationUnit {
     TerraCompilationUnit()
             : nreferences(0),
               optimize(false),
+              boundscheck(false),
+              strictaliasing(false),
+              collectremarks(false),
               fastmath(),
               T(NULL),
               C(NULL),
@@ -69,11 +121,21 @@ struct TerraCompilationUnit {
               Ty(NULL),
               CC(NULL),
               symbols(NULL),
-              functioncount(0) {}
+              functioncount(0),
+              threads(1),
+              optimizetime(0),
+              codegentime(0),
+              linktime(0) {}
     int nreferences;
     // configuration
     bool optimize;
+    bool boundscheck;  // trap on out-of-range array and checked container indices
+    bool strictaliasing;  // tag loads and stores with type-based alias information
+    bool collectremarks;  // keep optimization remarks of passes matching remarkfilter
+    std::string remarkfilter;
     llvm::FastMathFlags fastmath;
+    llvmutil_PGOOptions pgo;  // applied when the unit is saved with optimization
+    llvmutil_PipelineOptions pipeline;
 
     // LLVM state used in compiltion unit
     terra_State *T;
@@ -96,6 +158,21 @@ struct TerraCompilationUnit {
     Obj *symbols;
     int functioncount;  // for assigning unique indexes to functions;
     std::vector<TerraFunctionState *> *tooptimize;
+    TerraFunctionCache functioncache;
+    std::vector<TerraRemark> remarks;
+    // external functions with vector variants (terralib.addvectorvariant), and the
+    // vector-function-abi-variant attribute given to calls to them
+    llvm::DenseMap<llvm::Function *, std::string> vectorvariants;
+    // the variants themselves; their calls to the scalar function stay scalar
+    llvm::SmallPtrSet<llvm::Function *, 8> vectorvariantfunctions;
+    // JIT: the thread-local globals of the unit, by name
+    std::unordered_map<std::string, std::unique_ptr<TerraThreadLocal>> threadlocals;
+    // JIT: the code of the compilation service that ee refers to, by symbol
+    std::unordered_map<std::string, void *> servicesymbols;
+    // saveobj: number of partitions emitted in parallel, and the timings in
+    // seconds of the last save
+    int threads;
+    double optimizetime, codegentime, linktime;
     const llvm::DataLayout &getDataLayout() { return M->getDataLayout(); }
 };
 
@@ -106,4 +183,30 @@ struct terra_CompilerState {
     llvm::DenseMap<const void *, TerraFunctionInfo> functioninfo;
 };
 
+// A process-wide JIT that several terra_States can attach to
+// (terra_attachcompilationservice). Modules are handed over as bitcode, and that
+// bitcode is also the key of the code cache: a kernel that several states build
+// identically is compiled and mapped only once. Each cached module gets its own
+// LLVMContext and engine, so workers compile different modules in parallel; lock is
+// only held to look up or claim an entry. Only the back end is shared; each state
+// still typechecks and emits IR with its own TerraTargets.
+struct terra_CompilationService {
+    std::mutex lock;  // guards everything below, except the fields of a Code that is
+                      // not done, which belong to the thread compiling it
+    std::condition_variable ready;  // notified when a Code is done
+    struct Code {
+        bool done = false;
+        void *ptr = NULL;  // NULL if the module could not be compiled
+        std::unique_ptr<llvm::LLVMContext> ctx;
+        llvm::ExecutionEngine *ee = NULL;
+        llvm::JITEventListener *listener = NULL;   // records the functions it loads
+        std::vector<TerraFunctionInfo> functions;  // added to each user's functioninfo
+        // the exported definitions of the module, mapped into each user's own engine
+        std::vector<std::pair<std::string, void *>> symbols;
+    };
+    std::unordered_map<std::string, Code> code;  // by target, symbol and bitcode
+    TerraConstantPool constants;  // large constant tables of the code of all targets
+    size_t ncompiled = 0, nreused = 0;
+};
+
 #endif
@@ -9,6 +9,10 @@ extern "C" {
 #include "lualib.h"
 }
 
+#include <atomic>
+#include <set>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
 #include "cuda.h"
@@ -24,6 +28,7 @@ extern "C" {
 #include "llvm/IR/AutoUpgrade.h"
 #endif
 #include <fstream>
+#include <inttypes.h>
 #include <sstream>
 #ifndef _WIN32
 #include <unistd.h>
@@ -55,6 +60,10 @@ struct terra_CUDAState {
 #define INIT_SYM(x) decltype(&::x) x;
     CUDA_SYM(INIT_SYM)
 #undef INIT_SYM
+    // libdevice files by path, read once and parsed lazily into each module
+    std::unordered_map<std::string, std::unique_ptr<llvm::MemoryBuffer> > libdevices;
+    // generated PTX by the hash of its module and target, see terra_toptx
+    std::unordered_map<uint64_t, std::string> ptxcache;
 };
 
 void initializeNVVMState(terra_State *T) {
@@ -87,18 +96,28 @@ static const char *cudadatalayout =
         "e-p:64:64:64-i1:8:8-i8:8:8-i16:16:16-i32:32:32-i64:64:64-f32:32:32-f64:64:64-"
         "v16:16:16-v32:32:32-v64:64:64-v128:128:128-n16:32:64";
 
-void moduleToPTX(terra_State *T, llvm::Module *M, int major, int minor, std::string *buf,
-                 const char *libdevice) {
-    int nmajor, nminor;
-    CUDA_DO(T->cuda->nvvmVersion(&nmajor, &nminor));
-    int nversion = nmajor * 10 + nminor;
+// What a module is lowered for. Everything here is plain data, so partitions can
+// be lowered on other threads without touching the Terra state.
+struct PTXTarget {
+    int major, minor;
+    int nvvmversion;
+    llvm::MemoryBufferRef libdevice;
+};
+
+// Link the libdevice functions M uses into it, optimize it and emit PTX into buf.
+// When exported is given, M is one partition of a larger module: every definition
+// not named in exported becomes internal, and is renamed with suffix so that its
+// copies in other partitions do not collide once the PTX is merged.
+static bool moduleToPTX(llvm::Module *M, const PTXTarget &target,
+                        const std::set<std::string> *exported, const std::string &suffix,
+                        std::string *buf) {
 #if LLVM_VERSION < 210
-    if (nversion >= 12)
+    if (target.nvvmversion >= 12)
         M->setTargetTriple("nvptx64-nvidia-cuda");
     else
         M->setTargetTriple("");  // clear these because nvvm doesn't like them
 #else
-    if (nversion >= 12)
+    if (target.nvvmversion >= 12)
         M->setTargetTriple(llvm::Triple("nvptx64-nvidia-cuda"));
     else
         M->setTargetTriple(
@@ -107,7 +126,7 @@ void moduleToPTX(terra_State *T, llvm::Module *M, int major, int minor, std::str
     M->setDataLayout("");  // nvvm doesn't like data layout either
 
     std::stringstream cpu;
-    cpu << "sm_" << major << minor;
+    cpu << "sm_" << target.major << target.minor;
     std::string cpuopt = cpu.str();
 
     auto Features = "";
@@ -126,17 +145,15 @@ void moduleToPTX(terra_State *T, llvm::Module *M, int major, int minor, std::str
     // TargetRegistry or we have a bogus target triple.
     if (!Target) {
         llvm::errs() << Error;
-        return;
+        return true;
     }
 
-    llvm::SmallString<2048> ErrMsg;
-    auto MB = llvm::MemoryBuffer::getFile(libdevice);
-    auto E_LDEVICE =
-            llvm::parseBitcodeFile(MB->get()->getMemBufferRef(), M->getContext());
+    // only the functions that are materialized for the link are read from libdevice
+    auto E_LDEVICE = llvm::getLazyBitcodeModule(target.libdevice, M->getContext());
 
     if (auto Err = E_LDEVICE.takeError()) {
         llvm::logAllUnhandledErrors(std::move(Err), llvm::errs(), "[CUDA Error] ");
-        return;
+        return true;
     }
 
     auto &LDEVICE = *E_LDEVICE;
@@ -147,13 +164,13 @@ void moduleToPTX(terra_State *T, llvm::Module *M, int major, int minor, std::str
 #else
     std::optional<llvm::Reloc::Model> RM = std::nullopt;
 #endif
-    auto TargetMachine = Target->createTargetMachine(
+    std::unique_ptr<llvm::TargetMachine> TargetMachine(Target->createTargetMachine(
 #if LLVM_VERSION < 210
             "nvptx64-nvidia-cuda",
 #else
             llvm::Triple("nvptx64-nvidia-cuda"),
 #endif
-            cpuopt, Features, opt, RM);
+            cpuopt, Features, opt, RM));
 
 #if LLVM_VERSION < 210
     LDEVICE->setTargetTriple("nvptx64-nvidia-cuda");
@@ -167,6 +184,16 @@ void moduleToPTX(terra_State *T, llvm::Module *M, int major, int minor, std::str
         assert(false && "failed to link libdevice.bc");
     }
 
+    if (exported) {
+        for (llvm::GlobalObject &G : M->global_objects()) {
+            if (G.isDeclaration() || G.getName().substr(0, 5) == "llvm." ||
+                exported->count(G.getName().str()))
+                continue;
+            G.setLinkage(llvm::GlobalValue::InternalLinkage);
+            if (!suffix.empty()) G.setName(G.getName() + suffix);
+        }
+    }
+
     M->setDataLayout(TargetMachine->createDataLayout());
 
     llvm::SmallString<2048> dest;
@@ -199,24 +226,17 @@ void moduleToPTX(terra_State *T, llvm::Module *M, int major, int minor, std::str
     // addPassesToEmitFile populates, so optimize the module here, up front,
     // rather than scheduling the passes alongside code generation.
     M->setDataLayout(TargetMachine->createDataLayout());
-    llvmutil_optimizedevicemodule(M, TargetMachine);
+    llvmutil_optimizedevicemodule(M, TargetMachine.get());
 #endif
 
     if (TargetMachine->addPassesToEmitFile(PM, str_dest, nullptr, FileType)) {
         llvm::errs() << "TargetMachine can't emit a file of this type\n";
-        return;
+        return true;
     }
 
     PM.run(*M);
-    buf->resize(dest.size());
-
-    // {
-    // 	std::stringstream outs;
-    // 	outs << dest.size() << std::endl;
-    // 	printf("[CUDA] Result size: %s\n", outs.str().c_str());
-    // }
-
     (*buf) = dest.str().str();
+    return false;
 }
 
 // cuda doesn't like llvm generic names, so we replace non-identifier symbols here
@@ -234,6 +254,241 @@ static std::string sanitizeName(std::string name) {
     return s;
 }
 
+static uint64_t hashbytes(uint64_t h, const char *data, size_t size) {
+    for (size_t i = 0; i < size; i++) {  // FNV-1a, stable between processes
+        h ^= (unsigned char)data[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+// Add the globals that V refers to, directly or through the code and initializers of
+// other globals, to reached.
+static void collectReachable(llvm::Value *V, std::set<llvm::GlobalValue *> *reached) {
+    std::vector<llvm::Value *> work = {V};
+    while (!work.empty()) {
+        llvm::Value *v = work.back();
+        work.pop_back();
+        if (llvm::GlobalValue *G = llvm::dyn_cast<llvm::GlobalValue>(v)) {
+            if (!reached->insert(G).second) continue;
+            if (llvm::Function *F = llvm::dyn_cast<llvm::Function>(G)) {
+                for (llvm::BasicBlock &BB : *F)
+                    for (llvm::Instruction &I : BB)
+                        for (llvm::Value *op : I.operands())
+                            if (llvm::isa<llvm::Constant>(op)) work.push_back(op);
+            } else if (llvm::GlobalVariable *GV = llvm::dyn_cast<llvm::GlobalVariable>(G)) {
+                if (GV->hasInitializer()) work.push_back(GV->getInitializer());
+            }
+        } else if (llvm::Constant *C = llvm::dyn_cast<llvm::Constant>(v)) {
+            for (llvm::Value *op : C->operands()) work.push_back(op);
+        }
+    }
+}
+
+static bool isVisibleVariable(llvm::GlobalValue *G) {
+    return llvm::isa<llvm::GlobalVariable>(G) && !G->isDeclaration() && !G->hasLocalLinkage() &&
+           G->getName().substr(0, 5) != "llvm.";
+}
+
+// A group of kernels lowered to PTX on its own, with everything they reach
+struct PTXPartition {
+    std::vector<llvm::Function *> kernels;
+    std::set<llvm::GlobalValue *> reached;
+    std::set<std::string> exported;  // the kernels and visible globals it defines
+};
+
+// Group the kernels of M so that every visible global variable, which the loader
+// looks up by name, is defined in exactly one group. Device functions and private
+// constants that several groups use are copied into each of them.
+static std::vector<PTXPartition> partitionKernels(llvm::Module *M,
+                                                  const std::vector<llvm::Function *> &kernels) {
+    size_t N = kernels.size();
+    std::vector<std::set<llvm::GlobalValue *> > reached(N);
+    std::vector<size_t> parent(N);
+    std::unordered_map<llvm::GlobalValue *, size_t> owner;
+    auto find = [&](size_t i) {
+        while (parent[i] != i) i = parent[i] = parent[parent[i]];
+        return i;
+    };
+    for (size_t i = 0; i < N; i++) {
+        parent[i] = i;
+        collectReachable(kernels[i], &reached[i]);
+        for (llvm::GlobalValue *G : reached[i]) {
+            if (!isVisibleVariable(G)) continue;
+            auto it = owner.find(G);
+            if (it == owner.end())
+                owner[G] = i;
+            else
+                parent[find(i)] = find(it->second);
+        }
+    }
+    std::vector<PTXPartition> partitions;
+    std::unordered_map<size_t, size_t> index;
+    for (size_t i = 0; i < N; i++) {
+        auto it = index.insert(std::make_pair(find(i), partitions.size())).first;
+        if (it->second == partitions.size()) partitions.emplace_back();
+        PTXPartition &P = partitions[it->second];
+        P.kernels.push_back(kernels[i]);
+        P.reached.insert(reached[i].begin(), reached[i].end());
+        P.exported.insert(kernels[i]->getName().str());
+    }
+    // globals no kernel uses are still part of the module the loader sees
+    for (llvm::GlobalVariable &G : M->globals())
+        if (isVisibleVariable(&G) && !owner.count(&G)) partitions[0].reached.insert(&G);
+    for (PTXPartition &P : partitions)
+        for (llvm::GlobalValue *G : P.reached)
+            if (isVisibleVariable(G)) P.exported.insert(G->getName().str());
+    return partitions;
+}
+
+// Copy the part of M that P reaches into a module of its own, as bitcode, so that it
+// can be read back into a separate LLVMContext on another thread.
+static std::string partitionBitcode(llvm::Module *M, const PTXPartition &P) {
+    llvm::ValueToValueMapTy VMap;
+    std::unique_ptr<llvm::Module> part =
+            llvm::CloneModule(*M, VMap, [&P](const llvm::GlobalValue *G) {
+                return P.reached.count(const_cast<llvm::GlobalValue *>(G)) > 0;
+            });
+    // keep only the annotations of the partition's own kernels
+    if (llvm::NamedMDNode *annot = part->getNamedMetadata("nvvm.annotations")) {
+        std::vector<llvm::MDNode *> keep;
+        for (llvm::MDNode *node : annot->operands()) {
+            llvm::ValueAsMetadata *V =
+                    node->getNumOperands() > 0
+                            ? llvm::dyn_cast_or_null<llvm::ValueAsMetadata>(node->getOperand(0))
+                            : NULL;
+            llvm::Function *F = V ? llvm::dyn_cast<llvm::Function>(V->getValue()) : NULL;
+            if (F && !F->isDeclaration() && P.exported.count(F->getName().str()))
+                keep.push_back(node);
+        }
+        annot->clearOperands();
+        for (llvm::MDNode *node : keep) annot->addOperand(node);
+    }
+    // drop the declarations of what the other partitions define
+    for (auto it = part->begin(); it != part->end();) {
+        llvm::Function &F = *it++;
+        if (F.isDeclaration() && F.use_empty()) F.eraseFromParent();
+    }
+    for (auto it = part->global_begin(); it != part->global_end();) {
+        llvm::GlobalVariable &G = *it++;
+        if (G.isDeclaration() && G.use_empty()) G.eraseFromParent();
+    }
+    std::string bitcode;
+    llvm::raw_string_ostream out(bitcode);
+    llvm::WriteBitcodeToFile(*part, out);
+    out.flush();
+    return bitcode;
+}
+
+// Join the PTX of several partitions into one module: the header of the first one,
+// then the bodies of all of them, with each .extern declaration kept once.
+static std::string mergePTX(const std::vector<std::string> &parts) {
+    std::string out;
+    std::set<std::string> externs;
+    for (size_t i = 0; i < parts.size(); i++) {
+        std::istringstream in(parts[i]);
+        std::string line, decl;
+        while (std::getline(in, line)) {
+            if (!decl.empty() || line.compare(0, 7, ".extern") == 0) {
+                decl += line + "\n";
+                if (line.find(';') != std::string::npos) {
+                    if (externs.insert(decl).second) out += decl;
+                    decl.clear();
+                }
+                continue;
+            }
+            if (i > 0 && (line.compare(0, 8, ".version") == 0 ||
+                          line.compare(0, 7, ".target") == 0 ||
+                          line.compare(0, 13, ".address_size") == 0))
+                continue;
+            out += line + "\n";
+        }
+    }
+    return out;
+}
+
+// Lower the partitions on up to nthreads threads, each in its own LLVMContext, and
+// set *nlowered to the number of modules lowered.
+static bool partitionsToPTX(llvm::Module *M, const std::vector<llvm::Function *> &kernels,
+                            const PTXTarget &target, int nthreads, std::string *ptx,
+                            size_t *nlowered) {
+    std::vector<PTXPartition> partitions = partitionKernels(M, kernels);
+    *nlowered = partitions.size() < 2 ? 1 : partitions.size();
+    if (partitions.size() < 2) return moduleToPTX(M, target, NULL, "", ptx);
+    std::vector<std::string> bitcodes, parts(partitions.size());
+    for (PTXPartition &P : partitions) bitcodes.push_back(partitionBitcode(M, P));
+    std::atomic<size_t> next(0);
+    std::atomic<bool> failed(false);
+    auto worker = [&]() {
+        for (size_t i; (i = next++) < partitions.size();) {
+            llvm::LLVMContext ctx;
+            auto part = llvm::parseBitcodeFile(
+                    llvm::MemoryBufferRef(bitcodes[i], "partition"), ctx);
+            if (!part) {
+                llvm::logAllUnhandledErrors(part.takeError(), llvm::errs(),
+                                            "[CUDA Error] ");
+                failed = true;
+                continue;
+            }
+            std::string suffix = i == 0 ? "" : "$p" + std::to_string(i);
+            if (moduleToPTX(part->get(), target, &partitions[i].exported, suffix, &parts[i]))
+                failed = true;
+        }
+    };
+    std::vector<std::thread> threads;
+    for (size_t t = 1; t < std::min((size_t)nthreads, partitions.size()); t++)
+        threads.emplace_back(worker);
+    worker();
+    for (std::thread &t : threads) t.join();
+    if (failed) return true;
+    *ptx = mergePTX(parts);
+    return false;
+}
+
+#ifndef _WIN32
+// When terralib.ptxcache names a directory, PTX is also stored there under its hash,
+// so that later processes building the same kernels skip code generation.
+static std::string cachedPTXPath(const char *dir, uint64_t h) {
+    char name[32];
+    snprintf(name, sizeof(name), "/%016" PRIx64 ".ptx", h);
+    return std::string(dir) + name;
+}
+
+static bool readCachedPTX(const char *dir, uint64_t h, std::string *ptx) {
+    std::ifstream in(cachedPTXPath(dir, h), std::ios::binary);
+    if (!in) return false;
+    std::stringstream contents;
+    contents << in.rdbuf();
+    *ptx = contents.str();
+    return !ptx->empty();
+}
+
+static void writeCachedPTX(const char *dir, uint64_t h, const std::string &ptx) {
+    // write to a temporary name first so concurrent builds never see a partial file
+    std::string path = cachedPTXPath(dir, h);
+    std::string tmp = path + "." + std::to_string((int)getpid()) + ".tmp";
+    {
+        std::ofstream out(tmp, std::ios::binary);
+        out << ptx;
+        if (!out.flush()) {
+            remove(tmp.c_str());
+            return;
+        }
+    }
+    if (rename(tmp.c_str(), path.c_str()) != 0) remove(tmp.c_str());
+}
+#endif
+
+static llvm::MemoryBuffer *getLibdevice(terra_State *T, const char *path) {
+    std::unique_ptr<llvm::MemoryBuffer> &entry = T->cuda->libdevices[path];
+    if (!entry) {
+        auto MB = llvm::MemoryBuffer::getFile(path);
+        if (!MB) return NULL;
+        entry = std::move(*MB);
+    }
+    return entry.get();
+}
+
 int terra_toptx(lua_State *L) {
     terra_State *T = terra_getstate(L, 1);
     initializeNVVMState(T);
@@ -246,7 +501,9 @@ int terra_toptx(lua_State *L) {
     int major = version / 10;
     int minor = version % 10;
     const char *libdevice = lua_tostring(L, 5);
+    const char *cachedir = lua_tostring(L, 6);
 
+    std::vector<llvm::Function *> kernels;
     int N = lua_objlen(L, annotations);
     for (int i = 0; i < N; i++) {
         lua_rawgeti(L, annotations, i + 1);  // {kernel,annotation,value}
@@ -259,6 +516,7 @@ int terra_toptx(lua_State *L) {
         llvm::Function *kernel = M->getFunction(kernelname);
         assert(kernel);
         annotateKernel(T, M, kernel, annotationname, annotationvalue);
+        if (!strcmp(annotationname, "kernel")) kernels.push_back(kernel);
         lua_pop(L, 4);  // annotation table and 3 values in it
     }
 
@@ -284,15 +542,58 @@ int terra_toptx(lua_State *L) {
         it->setName(sanitizeName(it->getName().str()));
     }
 
+    int nmajor, nminor;
+    CUDA_DO(T->cuda->nvvmVersion(&nmajor, &nminor));
+    llvm::MemoryBuffer *libdevicebuf = libdevice ? getLibdevice(T, libdevice) : NULL;
+    if (!libdevicebuf)
+        terra_reporterror(T, "failed to read libdevice at %s\n",
+                          libdevice ? libdevice : "(not found)");
+    PTXTarget target = {major, minor, nmajor * 10 + nminor, libdevicebuf->getMemBufferRef()};
+    bool split = CU->threads > 1 && kernels.size() > 1;
+
+    // the same module lowered for the same target always gives the same PTX
+    std::string bitcode;
+    llvm::raw_string_ostream bitcodeout(bitcode);
+    llvm::WriteBitcodeToFile(*M, bitcodeout);
+    bitcodeout.flush();
+    char key[128];
+    snprintf(key, sizeof(key), "%d %d %d %d %s", LLVM_VERSION, version, target.nvvmversion,
+             (int)split, TERRA_VERSION_STRING);
+    uint64_t h = 14695981039346656037ULL;
+    h = hashbytes(h, key, strlen(key) + 1);
+    h = hashbytes(h, libdevice, strlen(libdevice) + 1);
+    h = hashbytes(h, bitcode.data(), bitcode.size());
+
     std::string ptx;
-    moduleToPTX(T, M, major, minor, &ptx, libdevice);
+    bool cached = true;
+    size_t nlowered = 0;  // modules lowered to PTX, more than 1 when split
+    auto found = T->cuda->ptxcache.find(h);
+    if (found != T->cuda->ptxcache.end()) {
+        ptx = found->second;
+#ifndef _WIN32
+    } else if (cachedir && readCachedPTX(cachedir, h, &ptx)) {
+        T->cuda->ptxcache[h] = ptx;
+#endif
+    } else {
+        cached = false;
+        nlowered = 1;
+        if (split ? partitionsToPTX(M, kernels, target, CU->threads, &ptx, &nlowered)
+                  : moduleToPTX(M, target, NULL, "", &ptx))
+            terra_reporterror(T, "failed to generate PTX\n");
+        T->cuda->ptxcache[h] = ptx;
+#ifndef _WIN32
+        if (cachedir) writeCachedPTX(cachedir, h, ptx);
+#endif
+    }
     if (dumpmodule) {
         fprintf(stderr, "CUDA Module:\n");
         M->print(llvm::errs(), nullptr);
         fprintf(stderr, "Generated PTX:\n%s\n", ptx.c_str());
     }
     lua_pushstring(L, ptx.c_str());
-    return 1;
+    lua_pushboolean(L, cached);
+    lua_pushinteger(L, nlowered);
+    return 3;
 }
 
 int terra_cudainit(struct terra_State *T) {
@@ -310,7 +611,7 @@ int terra_cudainit(struct terra_State *T) {
         lua_pop(T->L, 1);  // terralib
         return 0;          // couldn't find the libnvvm library, do not load cudalib.lua
     }
-    T->cuda = (terra_CUDAState *)malloc(sizeof(terra_CUDAState));
+    T->cuda = new terra_CUDAState();
     T->cuda->initialized =
             0; /* actual CUDA initalization is done on first call to terra_cudacompile */
                /* this function just registers all the Lua state associated with CUDA */
@@ -333,6 +634,9 @@ int terra_cudainit(struct terra_State *T) { return 0; }
 #endif
 
 int terra_cudafree(struct terra_State *T) {
-    // currently nothing to clean up
+#ifdef TERRA_ENABLE_CUDA
+    delete T->cuda;  // libdevice buffers and cached PTX
+    T->cuda = NULL;
+#endif
     return 0;
 }
@@ -13,9 +13,15 @@ extern "C" {
 #include "tobj.h"
 
 #include <cstdio>
+#include <fstream>
+#include <inttypes.h>
 #include <string>
 #include <sstream>
+#include <map>
 #include <iostream>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
 
 #include "llvmheaders.h"
 #include "tllvmutil.h"
@@ -674,12 +680,22 @@ static llvm::sys::TimePoint<> ZeroTime() {
     return llvm::sys::TimePoint<>(std::chrono::nanoseconds::zero());
 }
 
+// identifies the version of a header on disk: it changes whenever the file's
+// modification time or size does
+static std::string HeaderStamp(llvm::sys::TimePoint<> mtime, uint64_t size) {
+    return std::to_string(mtime.time_since_epoch().count()) + ":" + std::to_string(size);
+}
+
 class LuaOverlayFileSystem : public llvm::vfs::FileSystem {
 private:
     IntrusiveRefCntPtr<llvm::vfs::FileSystem> RFS;
     lua_State *L;
 
 public:
+    // stamps of the headers read from disk, by path; those from the header
+    // provider are internalized into the binary and cannot change
+    std::map<std::string, std::string> headers;
+
     LuaOverlayFileSystem(lua_State *L_) : RFS(llvm::vfs::getRealFileSystem()), L(L_) {}
 
     bool GetFile(const llvm::Twine &Path, llvm::vfs::Status *status,
@@ -735,7 +751,15 @@ public:
     virtual llvm::ErrorOr<std::unique_ptr<llvm::vfs::File>> openFileForRead(
             const llvm::Twine &Path) override {
         llvm::ErrorOr<std::unique_ptr<llvm::vfs::File>> ec = RFS->openFileForRead(Path);
-        if (ec || ec.getError() != llvm::errc::no_such_file_or_directory) return ec;
+        if (ec) {
+            llvm::ErrorOr<llvm::vfs::Status> st = (*ec)->status();
+            if (st) {
+                headers[Path.str()] =
+                        HeaderStamp(st->getLastModificationTime(), st->getSize());
+            }
+            return ec;
+        }
+        if (ec.getError() != llvm::errc::no_such_file_or_directory) return ec;
         llvm::vfs::Status Status;
         StringRef Buffer;
         if (GetFile(Path, &Status, &Buffer)) {
@@ -1001,12 +1025,13 @@ static void optimizemodule(TerraTarget *TT, llvm::Module *M) {
 #endif
 }
 static int dofile(terra_State *T, TerraTarget *TT, const char *code,
-                  const std::vector<const char *> &args, Obj *result) {
+                  const std::vector<const char *> &args, bool savebitcode, Obj *result) {
     // CompilerInstance will hold the instance of the Clang compiler for us,
     // managing the various objects needed to run the compiler.
     CompilerInstance TheCompInst;
 
-    llvm::IntrusiveRefCntPtr<llvm::vfs::FileSystem> FS = new LuaOverlayFileSystem(T->L);
+    LuaOverlayFileSystem *overlay = new LuaOverlayFileSystem(T->L);
+    llvm::IntrusiveRefCntPtr<llvm::vfs::FileSystem> FS = overlay;
 
     llvm::MemoryBuffer *membuffer =
             llvm::MemoryBuffer::getMemBuffer(code, "<buffer>").release();
@@ -1063,6 +1088,13 @@ static int dofile(terra_State *T, TerraTarget *TT, const char *code,
         AddMacro(T, PP, II, MD, &macros);
     }
 
+    Obj headers;
+    CreateTableWithName(result, "headers", &headers);
+    for (auto &header : overlay->headers) {
+        lua_pushstring(T->L, header.second.c_str());
+        headers.setfield(header.first.c_str());
+    }
+
 #if LLVM_VERSION < 220
     llvm::Module *M = codegen->ReleaseModule();
 #else
@@ -1073,6 +1105,16 @@ static int dofile(terra_State *T, TerraTarget *TT, const char *code,
         terra_reporterror(T, "compilation of included c code failed\n");
     }
     optimizemodule(TT, M);
+    if (savebitcode) {  // for terralib.includeccache, see include_c_linkbitcode
+        std::string bitcode;
+        llvm::raw_string_ostream out(bitcode);
+        llvm::WriteBitcodeToFile(*M, out);
+        out.flush();
+        lua_pushlstring(T->L, bitcode.data(), bitcode.size());
+        result->setfield("bitcode");
+        lua_pushstring(T->L, livenessfunction.c_str());
+        result->setfield("livenessfunction");
+    }
     if (LLVMLinkModules2(llvm::wrap(TT->external), llvm::wrap(M))) {
         terra_pusherror(T, "linker reported error");
         lua_error(T->L);
@@ -1080,6 +1122,19 @@ static int dofile(terra_State *T, TerraTarget *TT, const char *code,
     return 0;
 }
 
+// the current stamp of the header at path, or nil if it can no longer be read
+static int header_stamp(lua_State *L) {
+    const char *path = luaL_checkstring(L, 1);
+    llvm::sys::fs::file_status st;
+    if (llvm::sys::fs::status(path, st)) {
+        lua_pushnil(L);
+        return 1;
+    }
+    std::string stamp = HeaderStamp(st.getLastModificationTime(), st.getSize());
+    lua_pushstring(L, stamp.c_str());
+    return 1;
+}
+
 int include_c(lua_State *L) {
     terra_State *T = terra_getstate(L, 1);
     (void)T;
@@ -1087,6 +1142,7 @@ int include_c(lua_State *L) {
     TerraTarget *TT = (TerraTarget *)terra_tocdatapointer(L, -1);
     const char *code = luaL_checkstring(L, 2);
     int N = lua_objlen(L, 3);
+    bool savebitcode = lua_toboolean(L, 5);
     std::vector<const char *> args;
 
     args.push_back("-triple");
@@ -1123,13 +1179,123 @@ int include_c(lua_State *L) {
         lua_pushvalue(L, -2);
         result.initFromStack(L, ref_table);
 
-        dofile(T, TT, code, args, &result);
+        dofile(T, TT, code, args, savebitcode, &result);
     }
 
     lobj_removereftable(L, ref_table);
     return 1;
 }
 
+// Link the module of an includec result read from terralib.includeccache into the
+// target's external module. Its liveness function is renamed, since its name was only
+// unique in the process that generated it. Returns the new name and the target's id, or
+// nothing if the bitcode cannot be read.
+static int include_c_linkbitcode(lua_State *L) {
+    terra_State *T = terra_getstate(L, 1);
+    lua_getfield(L, TARGET_POS, "llvm_target");
+    TerraTarget *TT = (TerraTarget *)terra_tocdatapointer(L, -1);
+    size_t size;
+    const char *bitcode = luaL_checklstring(L, 2, &size);
+    const char *livenessfunction = luaL_checkstring(L, 3);
+    llvm::Expected<std::unique_ptr<llvm::Module>> M = llvm::parseBitcodeFile(
+            llvm::MemoryBufferRef(llvm::StringRef(bitcode, size), "<includec>"), *TT->ctx);
+    if (!M) {
+        llvm::consumeError(M.takeError());
+        return 0;
+    }
+    std::stringstream ss;
+    ss << "__makeeverythinginclanglive_";
+    ss << TT->next_unused_id++;
+    std::string name = ss.str();
+    if (llvm::Function *F = (*M)->getFunction(livenessfunction)) F->setName(name);
+    if (LLVMLinkModules2(llvm::wrap(TT->external), llvm::wrap(M->release()))) {
+        terra_pusherror(T, "linker reported error");
+        lua_error(T->L);
+    }
+    lua_pushstring(L, name.c_str());
+    lua_pushinteger(L, TT->id);
+    return 2;
+}
+
+#ifndef _WIN32
+static uint64_t hashbytes(uint64_t h, const char *data, size_t size) {
+    for (size_t i = 0; i < size; i++) {  // FNV-1a
+        h ^= (unsigned char)data[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+// When terralib.includeccache names a directory, includec results are also stored
+// there, so that later processes including the same code skip clang. An entry is keyed
+// by a hash of the code, the clang arguments, the target and the LLVM and Terra
+// versions, and holds a Lua description of the result followed by the bitcode of its
+// module. terralib.lua checks the stamps of the headers it was built from before
+// using it. Arguments are the target, the directory, the code and the arguments.
+static std::string CachedIncludePath(lua_State *L) {
+    lua_getfield(L, TARGET_POS, "llvm_target");
+    TerraTarget *TT = (TerraTarget *)terra_tocdatapointer(L, -1);
+    lua_pop(L, 1);
+    char key[64];
+    snprintf(key, sizeof(key), "%d %s", LLVM_VERSION, TERRA_VERSION_STRING);
+    uint64_t h = 14695981039346656037ULL;
+    h = hashbytes(h, key, strlen(key) + 1);
+    for (const std::string *s : {&TT->Triple, &TT->CPU, &TT->Features})
+        h = hashbytes(h, s->c_str(), s->size() + 1);
+    size_t size;
+    const char *code = luaL_checklstring(L, 3, &size);
+    h = hashbytes(h, code, size + 1);
+    int N = lua_objlen(L, 4);
+    for (int i = 0; i < N; i++) {
+        lua_rawgeti(L, 4, i + 1);
+        const char *arg = luaL_checklstring(L, -1, &size);
+        h = hashbytes(h, arg, size + 1);
+        lua_pop(L, 1);
+    }
+    char name[32];
+    snprintf(name, sizeof(name), "/%016" PRIx64 ".includec", h);
+    return std::string(luaL_checkstring(L, 2)) + name;
+}
+
+// returns the description and the bitcode of the entry, or nothing
+static int include_c_readcache(lua_State *L) {
+    std::ifstream in(CachedIncludePath(L), std::ios::binary);
+    if (!in) return 0;
+    std::stringstream contents;
+    contents << in.rdbuf();
+    std::string entry = contents.str();
+    size_t newline = entry.find('\n');
+    if (newline == std::string::npos) return 0;
+    size_t size = strtoul(entry.c_str(), NULL, 10);
+    if (size > entry.size() - newline - 1) return 0;  // truncated
+    lua_pushlstring(L, entry.data() + newline + 1, size);
+    lua_pushlstring(L, entry.data() + newline + 1 + size, entry.size() - newline - 1 - size);
+    return 2;
+}
+
+// arguments 5 and 6 are the description and the bitcode of the entry
+static int include_c_writecache(lua_State *L) {
+    std::string path = CachedIncludePath(L);
+    size_t descriptionsize, bitcodesize;
+    const char *description = luaL_checklstring(L, 5, &descriptionsize);
+    const char *bitcode = luaL_checklstring(L, 6, &bitcodesize);
+    // write to a temporary name first so concurrent processes never see a partial file
+    std::string tmp = path + "." + std::to_string((int)getpid()) + ".tmp";
+    {
+        std::ofstream out(tmp, std::ios::binary);
+        out << descriptionsize << "\n";
+        out.write(description, descriptionsize);
+        out.write(bitcode, bitcodesize);
+        if (!out.flush()) {
+            remove(tmp.c_str());
+            return 0;
+        }
+    }
+    if (rename(tmp.c_str(), path.c_str()) != 0) remove(tmp.c_str());
+    return 0;
+}
+#endif
+
 void terra_cwrapperinit(terra_State *T) {
     lua_getfield(T->L, LUA_GLOBALSINDEX, "terra");
 
@@ -1137,5 +1303,20 @@ void terra_cwrapperinit(terra_State *T) {
     lua_pushcclosure(T->L, include_c, 1);
     lua_setfield(T->L, -2, "registercfile");
 
+    lua_pushcfunction(T->L, header_stamp);
+    lua_setfield(T->L, -2, "headerstamp");
+
+    lua_pushlightuserdata(T->L, (void *)T);
+    lua_pushcclosure(T->L, include_c_linkbitcode, 1);
+    lua_setfield(T->L, -2, "linkcbitcode");
+
+#ifndef _WIN32
+    lua_pushcfunction(T->L, include_c_readcache);
+    lua_setfield(T->L, -2, "readincludeccache");
+
+    lua_pushcfunction(T->L, include_c_writecache);
+    lua_setfield(T->L, -2, "writeincludeccache");
+#endif
+
     lua_pop(T->L, -1);  // terra object
 }
@@ -15,9 +15,13 @@
 #include <stdio.h>
 #include <stdarg.h>
 #include <assert.h>
+#include <inttypes.h>
 #ifndef _WIN32
 #include <dlfcn.h>
+#include <fcntl.h>
 #include <libgen.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #else
 #include "twindows.h"
@@ -496,6 +500,11 @@ int terra_initwithoptions(lua_State *L, terra_Options *options) {
     return 0;
 }
 
+int terra_attachcompilationservice(lua_State *L, terra_CompilationService *S) {
+    getterra(L)->service = S;
+    return 0;
+}
+
 // Called when the lua state object is free'd during lua_close
 static int terra_free(lua_State *L) {
     terra_State *T = (terra_State *)lua_touserdata(L, -1);
@@ -553,7 +562,125 @@ static const char *reader_string(lua_State *L, void *ud, size_t *size) {
 }
 // end helper functions
 
+#ifndef _WIN32
+static uint64_t hashbytes(uint64_t h, const char *data, size_t size) {
+    for (size_t i = 0; i < size; i++) {  // FNV-1a
+        h ^= (unsigned char)data[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static int writer_file(lua_State *L, const void *p, size_t size, void *ud) {
+    return fwrite(p, 1, size, (FILE *)ud) != size;
+}
+
+// When terra.bytecodecache names a directory, chunks are looked up there by a hash of
+// their contents, chunk name and the Terra version before being lexed and parsed.
+// The cache is limited to pure Lua chunks: only chunks that produced no parse trees are
+// stored, as anything containing Terra code refers to entries of terra._trees that
+// exist only after the parser has run. It is compiled out on Windows, where the setting
+// has no effect.
+static int loadcachedbuffer(lua_State *L, const char *buf, size_t size, const char *name) {
+    lua_getfield(L, LUA_GLOBALSINDEX, "terra");
+    lua_getfield(L, -1, "bytecodecache");
+    if (!lua_isstring(L, -1)) {
+        lua_pop(L, 2);
+        StringReaderCtx ctx = {buf, size};
+        return terra_load(L, reader_string, &ctx, name);
+    }
+    uint64_t h = 14695981039346656037ULL;
+    h = hashbytes(h, TERRA_VERSION_STRING, strlen(TERRA_VERSION_STRING) + 1);
+    h = hashbytes(h, name, strlen(name) + 1);
+    h = hashbytes(h, buf, size);
+    const char *dir = lua_tostring(L, -1);
+    size_t path_size = strlen(dir) + 64;
+    char *path = (char *)malloc(path_size);
+    snprintf(path, path_size, "%s/%016" PRIx64 "-%zu.bc", dir, h, size);
+    lua_getfield(L, -2, "_trees");
+    size_t ntrees = lua_objlen(L, -1);
+    lua_pop(L, 3);
+
+    if (FILE *f = fopen(path, "rb")) {
+        fseek(f, 0, SEEK_END);
+        long n = ftell(f);
+        fseek(f, 0, SEEK_SET);
+        char *bytecode = (char *)malloc(n > 0 ? n : 1);
+        bool ok = n > 0 && fread(bytecode, 1, n, f) == (size_t)n;
+        fclose(f);
+        if (ok && luaL_loadbuffer(L, bytecode, n, name) == 0) {
+            free(bytecode);
+            free(path);
+            return 0;
+        }
+        if (ok) lua_pop(L, 1);  // corrupt entry, fall through and overwrite it
+        free(bytecode);
+    }
+
+    StringReaderCtx ctx = {buf, size};
+    int r = terra_load(L, reader_string, &ctx, name);
+    lua_getfield(L, LUA_GLOBALSINDEX, "terra");
+    lua_getfield(L, -1, "_trees");
+    bool cacheable = r == 0 && lua_objlen(L, -1) == ntrees;
+    lua_pop(L, 2);
+    if (cacheable) {
+        // write to a temporary name first so concurrent loads never see a partial file
+        size_t tmp_size = path_size + 32;
+        char *tmp = (char *)malloc(tmp_size);
+        snprintf(tmp, tmp_size, "%s.%d.tmp", path, (int)getpid());
+        if (FILE *f = fopen(tmp, "wb")) {
+            bool ok = lua_dump(L, writer_file, f) == 0;
+            ok = fclose(f) == 0 && ok;
+            if (!ok || rename(tmp, path) != 0) remove(tmp);
+        }
+        free(tmp);
+    }
+    free(path);
+    return r;
+}
+
+// Regular files are mapped and handed to the lexer as a single chunk, so it can scan
+// names and long strings in place instead of copying them out of 512-byte fread
+// buffers. Returns -1 if the file cannot be mapped and the stdio path should be used.
+static int loadmappedfile(lua_State *L, const char *file, const char *name) {
+    int fd = open(file, O_RDONLY);
+    if (fd < 0) return -1;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+        close(fd);
+        return -1;
+    }
+    size_t size = st.st_size;
+    void *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return -1;
+    madvise(data, size, MADV_SEQUENTIAL);
+
+    StringReaderCtx ctx;
+    ctx.str = (const char *)data;
+    ctx.size = size;
+    if (ctx.str[0] == '#') { /* skip the POSIX comment, but keep its newline */
+        const char *nl = (const char *)memchr(ctx.str, '\n', size);
+        ctx.size = nl ? size - (nl - ctx.str) : 0;
+        ctx.str = nl;
+    }
+    int r = loadcachedbuffer(L, ctx.str, ctx.size, name);
+    munmap(data, size);
+    return r;
+}
+#endif
+
 int terra_loadfile(lua_State *L, const char *file) {
+#ifndef _WIN32
+    if (file) {
+        size_t name_size = strlen(file) + 2;
+        char *name = (char *)malloc(name_size);
+        snprintf(name, name_size, "@%s", file);
+        int r = loadmappedfile(L, file, name);
+        free(name);
+        if (r >= 0) return r;
+    }
+#endif
     FileReaderCtx ctx;
     ctx.fp = file ? fopen(file, "r") : stdin;
     if (!ctx.fp) {
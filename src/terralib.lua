@@ -56,7 +56,7 @@ param = unevaluatedparam(ident name, luaexpression? type)
 
 structdef = (luaexpression? metatype, structlist records)
 
-attr = (boolean nontemporal, number? alignment, boolean isvolatile)
+attr = (boolean nontemporal, number? alignment, boolean isvolatile, string? ordering, string? syncscope)
 fenceattr = (string? syncscope, string ordering)
 cmpxchgattr = (string? syncscope, string success_ordering, string failure_ordering, number? alignment, boolean isvolatile, boolean isweak)
 atomicattr = (string? syncscope, string ordering, number? alignment, boolean isvolatile)
@@ -103,9 +103,11 @@ tree =
      | constant(cdata value, Type type)
      | attrstore(tree address, tree value, attr attrs)
      | attrload(tree address, attr attrs)
+     | boundscheck(tree index, tree extent) # index, trapping if outside [0,extent) when the profile enables bounds checks
      | fence(fenceattr attrs)
      | cmpxchg(tree address, tree cmp, tree new, cmpxchgattr attrs)
      | atomicrmw(string operator, tree address, tree value, atomicattr attrs)
+     | coroutineop(string operation, tree? handle) # suspend, self, resume, destroy or done
      | debuginfo(string customfilename, number customlinenumber)
      | arrayconstructor(Type? oftype,tree* expressions)
      | vectorconstructor(Type? oftype,tree* expressions)
@@ -511,6 +513,9 @@ local function readytocompile(root)
                 erroratlocation(gv.anchor,"function "..gv:getname().." is not defined.")
             end
             gv.type:completefunction()
+            if gv.definition.suspendsat and not gv.definition.coroutine then
+                erroratlocation(gv.definition.suspendsat,"terralib.suspend and terralib.currentcoroutine can only be used in functions created with terralib.coroutine")
+            end
             if gv.definition.kind == "functiondef" then
                 for i,g in ipairs(gv.definition.globalsused) do
                     visit(g)
@@ -571,6 +576,39 @@ function T.terrafunction:setnoreturn(v)
     assert(self:isdefined(), "attempting to set the noreturn state of an undefined function")
     self.definition.noreturn = not not v
 end
+function T.terrafunction:settarget(cpu,features)
+    assert(self:isdefined(), "attempting to set the target of an undefined function")
+    assert(type(cpu) == "string" and (features == nil or type(features) == "string"),
+           "expected a CPU name and an optional feature string")
+    self.definition.targetcpu,self.definition.targetfeatures = cpu,features or ""
+end
+function T.terrafunction:setnoalias(...)
+    assert(self:isdefined() and not self:isextern(), "attempting to set noalias parameters of an undefined function")
+    local parameters = self.definition.parameters
+    local noalias = {}
+    local args = {...}
+    if #args == 0 then
+        for i,p in ipairs(parameters) do
+            if p.symbol.type:ispointer() then noalias[i] = true end
+        end
+    end
+    for _,a in ipairs(args) do
+        local index = a
+        if type(a) == "string" then
+            for i,p in ipairs(parameters) do
+                if p.name == a then index = i end
+            end
+        end
+        local p = type(index) == "number" and parameters[index]
+        if not p then
+            error(("%s has no parameter %s"):format(self.name,tostring(a)),2)
+        elseif not p.symbol.type:ispointer() then
+            error(("parameter %s of %s is not a pointer"):format(p.name,self.name),2)
+        end
+        noalias[index] = true
+    end
+    self.definition.noalias = noalias
+end
 function T.terrafunction:disas()
     print("definition ", self:gettype())
     terra.disassemble(terra.jitcompilationunit:addvalue(self),self:compile())
@@ -581,6 +619,16 @@ function T.terrafunction:printstats()
     for k,v in pairs(self.stats) do
         print("",k,v)
     end
+    for _,r in ipairs(self:remarks()) do
+        print("",("%s:%s: %s (%s): %s"):format(r.filename or "?",r.linenumber or "?",r.kind,r.pass,r.message))
+    end
+end
+function T.terrafunction:remarks()
+    self:compile()
+    return terra.jitcompilationunit:remarks(self)
+end
+function T.terrafunction:batch(options)
+    return require("batch").batch(self,options)
 end
 function T.terrafunction:isextern() return self.definition and self.definition.kind == "functionextern" end
 function T.terrafunction:isdefined() return self.definition ~= nil end
@@ -616,6 +664,31 @@ end
 function terra.isfunction(obj)
     return T.terrafunction:isclassof(obj)
 end
+
+-- A coroutine started by calling the returned function with fn's arguments. The call
+-- runs fn's body up to its first terralib.suspend() and returns a handle (&opaque);
+-- terralib.resume(h) continues it up to the next suspend or the end of the body.
+-- The body cannot return values, so coroutines pass results through their arguments.
+function terra.coroutine(fn)
+    if terra.llvm_version < 170 then
+        error("coroutines require LLVM 17 or later",2)
+    end
+    if not terra.isfunction(fn) or not fn:isdefined() or fn:isextern() then
+        error("expected a defined terra function",2)
+    end
+    local typ = fn:gettype()
+    if not typ.returntype:isunit() then
+        error(("the body of coroutine %s returns %s, but coroutines return their handle"):format(fn.name,tostring(typ.returntype)),2)
+    end
+    -- like a multiversioned function, the coroutine shares the typechecked body
+    local definition = setmetatable({}, getmetatable(fn.definition))
+    for k,v in pairs(fn.definition) do definition[k] = v end
+    definition.type = terra.types.functype(typ.parameters,terra.types.pointer(terra.types.opaque),false)
+    definition.coroutine, definition.alwaysinline = true, nil
+    local co = T.terrafunction(nil,fn.name .. ".coroutine",definition.type,fn.anchor)
+    co:adddefinition(definition)
+    return co
+end
 -- END FUNCTION
 
 function terra.isoverloadedfunction(obj) return T.overloadedterrafunction:isclassof(obj) end
@@ -701,7 +774,7 @@ end
 function terra.global(...)
     local typ = select(1,...)
     typ = terra.types.istype(typ) and typ or nil
-    local c,name,isextern,isconstant,addressspace = select(typ and 2 or 1,...)
+    local c,name,isextern,isconstant,addressspace,threadlocal = select(typ and 2 or 1,...)
     local anchor = terra.newanchor(2)
     c = createglobalinitializer(anchor,typ,c)
     if not typ then --set type if not set
@@ -710,12 +783,30 @@ function terra.global(...)
         end
         typ = c.type
     end
-    return T.globalvariable(c,tonumber(addressspace) or 0, isextern or false, isconstant or false, name or "<global>", typ, anchor)
+    local gv = T.globalvariable(c,tonumber(addressspace) or 0, isextern or false, isconstant or false, name or "<global>", typ, anchor)
+    if threadlocal then gv:setthreadlocal(threadlocal) end
+    return gv
 end
 function T.globalvariable:setinitializer(init)
     if self.readytocompile then error("cannot change global variable initializer after it has been compiled.",2) end
     self.initializer = createglobalinitializer(self.anchor,self.type,init)
 end
+local tlsmodels = { ["general"] = true, ["local-dynamic"] = true, ["initial-exec"] = true, ["local-exec"] = true }
+function T.globalvariable:setthreadlocal(model)
+    if self.readytocompile then error("cannot make a global variable thread-local after it has been compiled.",2) end
+    if model == true or model == nil then model = "general" end
+    if model == false then
+        self.threadlocal = nil
+        return self
+    end
+    if not tlsmodels[model] then
+        error(("unknown thread-local storage model '%s', expected general, local-dynamic, initial-exec or local-exec"):format(tostring(model)),2)
+    end
+    if self:isconstant() then error("constant globals cannot be thread-local",2) end
+    self.threadlocal = model
+    return self
+end
+function T.globalvariable:isthreadlocal() return self.threadlocal ~= nil end
 function T.globalvariable:get()
     local ptr = self:getpointer()
     return ptr[0]
@@ -726,7 +817,7 @@ function T.globalvariable:set(v)
 end
 function T.globalvariable:__tostring()
     local kind = self:isconstant() and "constant" or "global"
-    local extern = self:isextern() and "extern " or ""
+    local extern = (self:isextern() and "extern " or "")..(self.threadlocal and "threadlocal " or "")
     local r = ("%s%s %s : %s"):format(extern,kind,self.name,tostring(self.type))
     if self.initializer then
         r = ("%s = %s"):format(r,prettystring(self.initializer,false))
@@ -801,6 +892,88 @@ local function createoptimizationprofile(profile)
     end
     profile["fastmath"] = fastmath -- Write it back.
 
+    -- Handle profile-guided optimization.
+    local pgo, profilefile = profile["pgo"], profile["profilefile"]
+    if pgo ~= nil then
+        if pgo ~= "generate" and pgo ~= "use" then
+            error("expected pgo to be \"generate\" or \"use\" but found " .. tostring(pgo))
+        end
+        if terra.llvm_version < 170 then
+            error("profile-guided optimization requires LLVM 17 or newer")
+        end
+    end
+    if profilefile ~= nil and type(profilefile) ~= "string" then
+        error("expected profilefile to be a string but found " .. type(profilefile))
+    end
+    if pgo == "use" then
+        local f = profilefile and io.open(profilefile, "rb")
+        if not f then
+            error("pgo = \"use\" requires a readable profilefile but found " .. tostring(profilefile))
+        end
+        f:close()
+    end
+
+    -- Handle bounds checks.
+    local boundscheck = profile["boundscheck"]
+    if boundscheck ~= nil and type(boundscheck) ~= "boolean" then
+        error("expected boundscheck to be a boolean but found " .. type(boundscheck))
+    end
+
+    -- Handle type-based alias analysis.
+    local strictaliasing = profile["strictaliasing"]
+    if strictaliasing ~= nil and type(strictaliasing) ~= "boolean" then
+        error("expected strictaliasing to be a boolean but found " .. type(strictaliasing))
+    end
+
+    -- Handle optimization remarks, given as a regular expression over pass names.
+    local remarks = profile["remarks"]
+    if remarks == true then
+        profile["remarks"] = ".*"
+    elseif remarks == false then
+        profile["remarks"] = nil
+    elseif remarks ~= nil and type(remarks) ~= "string" then
+        error("expected remarks to be a boolean or string but found " .. type(remarks))
+    end
+
+    -- Handle the optimization pipeline. Os and Oz are level 2 optimizing for size.
+    local optlevel = profile["optlevel"]
+    if optlevel == "s" or optlevel == "z" then
+        profile["optlevel"], profile["sizelevel"] = 2, optlevel == "s" and 1 or 2
+    elseif optlevel ~= nil and optlevel ~= 0 and optlevel ~= 1 and optlevel ~= 2 and optlevel ~= 3 then
+        error("expected optlevel to be 0, 1, 2, 3, \"s\" or \"z\" but found " .. tostring(optlevel))
+    end
+    for _,key in ipairs { "unroll", "vectorize" } do
+        if profile[key] ~= nil and type(profile[key]) ~= "boolean" then
+            error("expected " .. key .. " to be a boolean but found " .. type(profile[key]))
+        end
+    end
+    for _,key in ipairs { "vectorwidth", "inlinethreshold" } do
+        local v = profile[key]
+        if v ~= nil and (type(v) ~= "number" or v < 0 or v % 1 ~= 0) then
+            error("expected " .. key .. " to be a non-negative integer but found " .. tostring(v))
+        end
+    end
+    local passes = profile["passes"]
+    if passes ~= nil then
+        if type(passes) ~= "string" then
+            error("expected passes to be a string but found " .. type(passes))
+        end
+        if terra.llvm_version < 170 then
+            error("custom pass pipelines require LLVM 17 or newer")
+        end
+    end
+
+    -- Handle parallel code generation in saveobj.
+    local threads = profile["threads"]
+    if threads ~= nil then
+        if type(threads) ~= "number" or threads < 1 or threads % 1 ~= 0 then
+            error("expected threads to be a positive integer but found " .. tostring(threads))
+        end
+        if threads > 1 and terra.llvm_version < 130 then
+            error("parallel code generation requires LLVM 13 or newer")
+        end
+    end
+
     return profile
 end
 
@@ -812,6 +985,7 @@ function terra.newcompilationunit(target,opt,profile)
     profile = createoptimizationprofile(profile)
     return setmetatable({ symbols = newweakkeytable(), 
                           collectfunctions = opt,
+                          vectorvariants = terra.vectorvariants,
                           llvm_cu = cdatawithdestructor(terra.initcompilationunit(target.llvm_target,opt,profile),terra.freecompilationunit) },compilationunit) -- mapping from Types,Functions,Globals,Constants -> llvm value associated with them for this compilation
 end
 function compilationunit:addvalue(k,v)
@@ -829,9 +1003,34 @@ function compilationunit:free()
     terra.freecompilationunit(self.llvm_cu)
 end
 function compilationunit:dump() terra.dumpmodule(self.llvm_cu) end
+function compilationunit:reusestats() return terra.compilationunitstats(self.llvm_cu) end
+function compilationunit:remarks(fn)
+    return terra.compilationunitremarks(self.llvm_cu,fn and self:addvalue(fn))
+end
+
+local remarktags = { passed = "!Passed", missed = "!Missed", analysis = "!Analysis" }
+local function yamlstring(s) return "'"..tostring(s):gsub("'","''").."'" end
+-- remarks in the YAML format of LLVM's -fsave-optimization-record, for opt-viewer and similar tools
+function terra.remarkstoyaml(remarks)
+    local lines = terra.newlist()
+    for _,r in ipairs(remarks) do
+        lines:insert("--- "..remarktags[r.kind])
+        lines:insert("Pass:            "..yamlstring(r.pass))
+        lines:insert("Name:            "..yamlstring(r.name))
+        if r.filename then
+            lines:insert(("DebugLoc:        { File: %s, Line: %d, Column: %d }"):format(
+                         yamlstring(r.filename),r.linenumber,r.column))
+        end
+        lines:insert("Function:        "..yamlstring(r.functionname))
+        lines:insert("Args:")
+        lines:insert("  - String:          "..yamlstring(r.message))
+        lines:insert("...")
+    end
+    return lines:concat("\n").."\n"
+end
 
 terra.nativetarget = terra.newtarget {}
-terra.jitcompilationunit = terra.newcompilationunit(terra.nativetarget,true,{fastmath=false}) -- compilation unit used for JIT compilation, will eventually specify the native architecture
+terra.jitcompilationunit = terra.newcompilationunit(terra.nativetarget,true,{fastmath=false,boundscheck=os.getenv("TERRA_BOUNDSCHECK") == "1",remarks=os.getenv("TERRA_REMARKS")}) -- compilation unit used for JIT compilation, will eventually specify the native architecture
 
 terra.llvm_gcdebugmetatable = { __gc = function(obj)
     print("GC IS CALLED")
@@ -1202,6 +1401,31 @@ function terra.externfunction(name,typ,anchor)
     return T.terrafunction(newobject(anchor,T.functionextern,name,typ),name,typ,anchor)
 end
 
+-- vector variants of external functions by function name, which the loop vectorizer
+-- may call instead of the scalar function (see tcompiler.cpp:emitVectorVariants)
+terra.vectorvariants = {}
+function terra.addvectorvariant(scalar,variant)
+    if terra.isfunction(scalar) then
+        assert(scalar:isextern(),"vector variants can only be added to external functions")
+        scalar = scalar.definition.name
+    end
+    assert(type(scalar) == "string","expected an external function or its name")
+    assert(terra.isfunction(variant) and variant:isdefined() and not variant:isextern(),
+           "expected a defined terra function as the vector variant")
+    local typ = variant:gettype()
+    local N = typ.returntype:isvector() and typ.returntype.N
+    for _,p in ipairs(typ.parameters) do
+        if not (p:isvector() and p.N == N) then N = nil end
+    end
+    if not N then
+        error(("vector variant %s must take and return vectors of one width"):format(variant:getname()),2)
+    end
+    variant:checkreadytocompile()
+    local variants = terra.vectorvariants[scalar] or terra.newlist()
+    variants:insert(variant)
+    terra.vectorvariants[scalar] = variants
+end
+
 function terra.definequote(tree,envfn)
     return terra.newquote(typecheck(tree,envfn()))
 end
@@ -1912,6 +2136,7 @@ local function semanticcheck(diag,parameters,block)
     
     local labelstates = {} -- map from label value to labelstate object, either representing a defined or undefined label
     local globalsused = List() 
+    local suspendsat -- the first use of an operation only allowed in coroutines
     
     local loopdepth = 0
     local function enterloop() loopdepth = loopdepth + 1 end
@@ -2035,6 +2260,8 @@ local function semanticcheck(diag,parameters,block)
                 scopeposition[#scopeposition] = scopeposition[#scopeposition] + 1
             elseif e:is "operator" and (e.operator == "and" or e.operator == "or") and e.operands[1].type:islogical() then
                 visitnolocaldefers(e,e.operands)
+            elseif e:is "coroutineop" and (e.operation == "suspend" or e.operation == "self") then
+                suspendsat = suspendsat or e
             else --generic traversal
                 for _,field in ipairs(e.__fields) do
                     visit(e[field.name])
@@ -2055,9 +2282,13 @@ local function semanticcheck(diag,parameters,block)
         end
     end
     
-    return labeldepths, globalsused
+    return labeldepths, globalsused, suspendsat
 end
 
+-- orderings allowed for atomic loads and stores
+local loadorderings = { unordered = true, monotonic = true, acquire = true, seq_cst = true }
+local storeorderings = { unordered = true, monotonic = true, release = true, seq_cst = true }
+
 function typecheck(topexp,luaenv,simultaneousdefinitions)
     local env = terra.newenvironment(luaenv or {})
     local diag = terra.newdiagnostics()
@@ -2981,6 +3212,10 @@ function typecheck(topexp,luaenv,simultaneousdefinitions)
                     typ = v.type.type
                     if not idx.type:isintegral() and idx.type ~= terra.types.error then
                         diag:reporterror(e,"expected integral index but found ",idx.type)
+                    elseif not v.type:ispointer() and v.type.N ~= 0 then -- the extent is known
+                        -- (a zero-length array is the C idiom for a trailing flexible array)
+                        local N = newobject(e,T.constant,terra.cast(terra.types.uint64,v.type.N),terra.types.uint64)
+                        idx = newobject(e,T.boundscheck,idx,N):withtype(idx.type)
                     end
                     if v.type:isarray() then
                         v = insertcast(v,terra.types.pointer(typ))
@@ -3035,13 +3270,33 @@ function typecheck(topexp,luaenv,simultaneousdefinitions)
                     diag:reporterror(e,"address must be a pointer but found ",addr.type)
                     return e:aserror()
                 end
+                local ordering = e.attrs.ordering
+                if ordering and not loadorderings[ordering] then
+                    diag:reporterror(e,"atomic loads cannot have ordering ",ordering)
+                elseif ordering and not addr.type.type:isprimitive() and not addr.type.type:ispointer() then
+                    diag:reporterror(e,"atomic loads need a primitive or pointer type but found ",addr.type.type)
+                end
                 return e:copy { address = addr }:withtype(addr.type.type)
+            elseif e:is "boundscheck" then
+                local idx = checkexp(e.index)
+                if not idx.type:isintegral() then
+                    diag:reporterror(e,"expected integral index but found ",idx.type)
+                    return e:aserror()
+                end
+                local extent = insertcast(checkexp(e.extent),terra.types.uint64)
+                return e:copy { index = idx, extent = extent }:withtype(idx.type)
             elseif e:is "attrstore" then
                 local addr = checkexp(e.address)
                 if not addr.type:ispointer() then
                     diag:reporterror(e,"address must be a pointer but found ",addr.type)
                     return e:aserror()
                 end
+                local ordering = e.attrs.ordering
+                if ordering and not storeorderings[ordering] then
+                    diag:reporterror(e,"atomic stores cannot have ordering ",ordering)
+                elseif ordering and not addr.type.type:isprimitive() and not addr.type.type:ispointer() then
+                    diag:reporterror(e,"atomic stores need a primitive or pointer type but found ",addr.type.type)
+                end
                 local value = insertcast(checkexp(e.value),addr.type.type)
                 return e:copy { address = addr, value = value }:withtype(terra.types.unit)
             elseif e:is "fence" then
@@ -3083,6 +3338,10 @@ function typecheck(topexp,luaenv,simultaneousdefinitions)
                 end
                 local value = insertcast(checkexp(e.value),addr.type.type)
                 return e:copy { address = addr, value = value }:withtype(addr.type.type)
+            elseif e:is "coroutineop" then
+                local handle = e.handle and insertcast(checkexp(e.handle),terra.types.pointer(terra.types.opaque))
+                local types = { self = terra.types.pointer(terra.types.opaque), done = bool }
+                return e:copy { handle = handle }:withtype(types[e.operation] or terra.types.unit)
             elseif e:is "apply" then
                 return checkapply(e,location)
             elseif e:is "method" then
@@ -3438,8 +3697,9 @@ function typecheck(topexp,luaenv,simultaneousdefinitions)
         
         local fntype = terra.types.functype(parameter_types,returntype,topexp.is_varargs):tcompletefunction(topexp)
         diag:finishandabortiferrors("Errors reported during typechecking.",2)
-        local labeldepths,globalsused = semanticcheck(diag,typed_parameters,body)
+        local labeldepths,globalsused,suspendsat = semanticcheck(diag,typed_parameters,body)
         result = newobject(topexp,T.functiondef,nil,fntype,typed_parameters,topexp.is_varargs, body, labeldepths, globalsused)
+        result.suspendsat = suspendsat
     else
         result = checkexp(topexp)
     end
@@ -3504,6 +3764,222 @@ end
 
 
 
+-- Parsing headers with clang dominates the start-up time of most programs, and many
+-- libraries include the same headers, so the results for identical code, arguments and
+-- target are remembered within a Terra state, and in terra.includeccache across
+-- processes. An entry is reused only while every header clang read from disk has the
+-- same modification time and size, and each caller gets its own copies of the
+-- namespace tables.
+local includecmemo = setmetatable({},{ __mode = "k" })
+local function headersunchanged(headers)
+    for path,stamp in pairs(headers) do
+        if terra.headerstamp(path) ~= stamp then
+            return false
+        end
+    end
+    return true
+end
+local function copyincludetable(tbl)
+    local r = {}
+    for k,v in pairs(tbl) do
+        r[k] = v
+    end
+    return setmetatable(r,getmetatable(tbl))
+end
+local function finishincludec(general,tagged,errors,macros,headers)
+    local mt = { __index = includetableindex, errors = errors }
+    local function addtogeneral(tbl)
+        for k,v in pairs(tbl) do
+            if not general[k] then
+                general[k] = v
+            end
+        end
+    end
+    addtogeneral(tagged)
+    addtogeneral(macros)
+    setmetatable(general,mt)
+    setmetatable(tagged,mt)
+    return { general = general, tagged = tagged, macros = macros, headers = headers }
+end
+
+-- An entry of terra.includeccache holds the module clang generated and a Lua chunk
+-- describing the namespace tables, which rebuilds the types, external functions and
+-- globals that registercfile created. Types are numbered so that every type only
+-- refers to types with lower numbers, except for the entries of structs, which are
+-- filled in once all types exist.
+local includecnamedtypes = {}
+for _,name in ipairs {"int8","int16","int32","int64","uint8","uint16","uint32","uint64",
+                      "float","double","bool","opaque","unit"} do
+    includecnamedtypes[terra.types[name]] = name
+end
+local function serializeincludecvalue(v)
+    if type(v) == "table" then
+        local entries = terra.newlist()
+        for k,e in pairs(v) do
+            entries:insert("["..serializeincludecvalue(k).."]="..serializeincludecvalue(e))
+        end
+        return "{"..entries:concat(",").."}"
+    elseif type(v) == "number" then
+        if v ~= v then return "0/0"
+        elseif v == math.huge then return "1/0"
+        elseif v == -math.huge then return "-1/0" end
+        return string.format("%.17g",v)
+    elseif type(v) == "string" then
+        return string.format("%q",v)
+    else
+        return tostring(v)
+    end
+end
+local function describeincludec(target,result)
+    local structnames = {}
+    for _,tagged in ipairs {true,false} do
+        local namespace = tagged and target.cnametostruct.tagged or target.cnametostruct.general
+        for name,typ in pairs(namespace) do
+            structnames[typ] = { name = name, tagged = tagged }
+        end
+    end
+    local types,numbers,structs = terra.newlist(),{},terra.newlist()
+    local function describetype(t)
+        if numbers[t] then return numbers[t] end
+        local d
+        if includecnamedtypes[t] then
+            d = { kind = "named", name = includecnamedtypes[t] }
+        elseif t:ispointer() then
+            d = { kind = "pointer", type = describetype(t.type), addressspace = t.addressspace }
+        elseif t:isarray() or t:isvector() then
+            d = { kind = t:isarray() and "array" or "vector", type = describetype(t.type), N = t.N }
+        elseif t:isfunction() then
+            d = { kind = "functype", parameters = t.parameters:map(describetype),
+                  returntype = describetype(t.returntype), isvararg = t.isvararg }
+        else
+            assert(t:isstruct(),"unexpected type in includec result")
+            local named = structnames[t]
+            d = { kind = "struct", name = named and named.name or "", tagged = named and named.tagged,
+                  defined = not t.undefined, complete = not t.incomplete }
+            structs:insert({t,d})
+        end
+        types:insert(d)
+        numbers[t] = #types
+        return #types
+    end
+    local function describevalue(v)
+        if type(v) == "number" then
+            return v
+        elseif terra.types.istype(v) then
+            return { type = describetype(v) }
+        elseif terra.isfunction(v) then
+            return { func = v.definition.name, type = describetype(v.definition.type) }
+        else
+            assert(terra.isglobalvar(v),"unexpected value in includec result")
+            return { global = v.name, type = describetype(v.type) }
+        end
+    end
+    local general,tagged = {},{}
+    for k,v in pairs(result.general) do general[k] = describevalue(v) end
+    for k,v in pairs(result.tagged) do tagged[k] = describevalue(v) end
+    -- describing entries may add more structs to the list
+    local i = 1
+    while i <= #structs do
+        local t,d = unpack(structs[i])
+        if d.defined then
+            local function describeentry(e)
+                if type(e.field) == "string" then
+                    return { field = e.field, type = describetype(e.type) }
+                end
+                return terra.newlist(e):map(describeentry)
+            end
+            d.entries = terra.newlist(t.entries):map(describeentry)
+        end
+        i = i + 1
+    end
+    return "return "..serializeincludecvalue {
+        types = types, general = general, tagged = tagged, macros = result.macros,
+        errors = result.errors, headers = result.headers,
+        livenessfunction = result.livenessfunction,
+    }
+end
+local function restoreincludec(target,d,bitcode)
+    local livenessfunction,targetid = terra.linkcbitcode(target,bitcode,d.livenessfunction)
+    if not livenessfunction then return nil end
+    local types = {}
+    for i,td in ipairs(d.types) do
+        local t
+        if td.kind == "named" then
+            t = terra.types[td.name]
+        elseif td.kind == "pointer" then
+            t = terra.types.pointer(types[td.type],td.addressspace)
+        elseif td.kind == "array" then
+            t = terra.types.array(types[td.type],td.N)
+        elseif td.kind == "vector" then
+            t = terra.types.vector(types[td.type],td.N)
+        elseif td.kind == "functype" then
+            local parameters = terra.newlist()
+            for _,p in ipairs(td.parameters) do parameters:insert(types[p]) end
+            t = terra.types.functype(parameters,types[td.returntype],td.isvararg)
+        else
+            t = target:getorcreatecstruct(td.name,td.tagged)
+            if not t.llvm_definingfunction then
+                t.llvm_definingfunction,t.llvm_definingtarget = livenessfunction,targetid
+            end
+        end
+        types[i] = t
+    end
+    -- as in GetRecordTypeFromDecl, only structs that are still undefined are filled in
+    local tocomplete = terra.newlist()
+    for i,td in ipairs(d.types) do
+        local t = types[i]
+        if td.kind == "struct" and td.defined and t.undefined then
+            t.undefined = nil
+            if td.complete then
+                local function restoreentry(e)
+                    if type(e.field) == "string" then
+                        return { field = e.field, type = types[e.type] }
+                    end
+                    return terra.newlist(e):map(restoreentry)
+                end
+                t.entries = terra.newlist(td.entries):map(restoreentry)
+                tocomplete:insert(t)
+            end
+        end
+    end
+    for _,t in ipairs(tocomplete) do t:complete() end
+    local function restorevalue(v)
+        if type(v) == "number" then
+            return v
+        elseif v.func then
+            return terra.externfunction(v.func,types[v.type])
+        elseif v.global then
+            return terra.global(types[v.type],nil,v.global,true)
+        else
+            return types[v.type]
+        end
+    end
+    local general,tagged = {},{}
+    for k,v in pairs(d.general) do general[k] = restorevalue(v) end
+    for k,v in pairs(d.tagged) do tagged[k] = restorevalue(v) end
+    return finishincludec(general,tagged,d.errors,d.macros,d.headers)
+end
+
+local function includecuncached(code,args,target)
+    local cachedir = ffi.os ~= "Windows" and terra.includeccache
+    if cachedir then
+        local description,bitcode = terra.readincludeccache(target,cachedir,code,args)
+        local chunk = description and loadstring(description)
+        local ok,d = pcall(chunk or error)
+        if ok and type(d) == "table" and headersunchanged(d.headers) then
+            local entry = restoreincludec(target,d,bitcode)
+            if entry then return entry end
+        end
+    end
+    local result = terra.registercfile(target,code,args,headerprovider,not not cachedir)
+    if cachedir then
+        local ok,description = pcall(describeincludec,target,result)
+        if ok then
+            terra.writeincludeccache(target,cachedir,code,args,description,result.bitcode)
+        end
+    end
+    return finishincludec(result.general,result.tagged,result.errors,result.macros,result.headers)
+end
 function terra.includecstring(code,cargs,target)
     local args = terra.newlist {"-O3","-Wno-deprecated","-resource-dir",clangresourcedirectory}
     target = target or terra.nativetarget
@@ -3535,21 +4011,18 @@ function terra.includecstring(code,cargs,target)
         args:insert(p)
     end
     assert(terra.istarget(target),"expected a target or nil to specify the native target")
-    local result = terra.registercfile(target,code,args,headerprovider)
-    local general,tagged,errors,macros = result.general,result.tagged,result.errors,result.macros
-    local mt = { __index = includetableindex, errors = result.errors }
-    local function addtogeneral(tbl)
-        for k,v in pairs(tbl) do
-            if not general[k] then
-                general[k] = v
-            end
-        end
+    local cache = includecmemo[target]
+    if not cache then
+        cache = {}
+        includecmemo[target] = cache
     end
-    addtogeneral(tagged)
-    addtogeneral(macros)
-    setmetatable(general,mt)
-    setmetatable(tagged,mt)
-    return general,tagged,macros
+    local key = code.."\0"..args:concat("\0")
+    local entry = cache[key]
+    if not entry or not headersunchanged(entry.headers) then
+        entry = includecuncached(code,args,target)
+        cache[key] = entry
+    end
+    return copyincludetable(entry.general),copyincludetable(entry.tagged),copyincludetable(entry.macros)
 end
 function terra.includec(fname,cargs,target)
     return terra.includecstring("#include \""..fname.."\"\n",cargs,target)
@@ -3651,9 +4124,17 @@ local function createattributetable(q)
     if attr.align ~= nil and type(attr.align) ~= "number" then
         error("align attribute must be a number, not a " .. type(attr.align))
     end
+    if attr.ordering ~= nil and type(attr.ordering) ~= "string" then
+        error("ordering attribute must be a string, not a " .. type(attr.ordering))
+    end
+    if attr.syncscope ~= nil and type(attr.syncscope) ~= "string" then
+        error("syncscope attribute must be a string, not a " .. type(attr.syncscope))
+    end
     return T.attr(attr.nontemporal and true or false, 
                   attr.align or nil,
-                  attr.isvolatile and true or false)
+                  attr.isvolatile and true or false,
+                  attr.ordering or nil,
+                  attr.syncscope or nil)
 end
 
 terra.attrload = terra.internalmacro( function(diag,tree,addr,attr)
@@ -3663,6 +4144,13 @@ terra.attrload = terra.internalmacro( function(diag,tree,addr,attr)
     return typecheck(newobject(tree,T.attrload,addr,createattributetable(attr)))
 end)
 
+terra.boundscheck = terra.internalmacro( function(diag,tree,idx,extent)
+    if not idx or not extent then
+        error("boundscheck requires two arguments")
+    end
+    return typecheck(newobject(tree,T.boundscheck,idx,extent))
+end)
+
 terra.attrstore = terra.internalmacro( function(diag,tree,addr,value,attr)
     if not addr or not value or not attr then
         error("attrstore requires three arguments")
@@ -3770,6 +4258,23 @@ terra.atomicrmw = terra.internalmacro( function(diag,tree,op,addr,value,attr)
     return typecheck(newobject(tree,T.atomicrmw,op_value,addr,value,createatomicattributetable(attr)))
 end)
 
+-- operations on coroutines, see terra.coroutine
+local function coroutinemacro(name,operation,takeshandle)
+    return terra.internalmacro(function(diag,tree,handle)
+        if takeshandle and not handle then
+            error(name .. " requires a coroutine handle")
+        elseif not takeshandle and handle then
+            error(name .. " takes no arguments")
+        end
+        return typecheck(newobject(tree,T.coroutineop,operation,handle))
+    end)
+end
+terra.suspend = coroutinemacro("suspend","suspend",false)
+terra.currentcoroutine = coroutinemacro("currentcoroutine","self",false)
+terra.resume = coroutinemacro("resume","resume",true)
+terra.destroycoroutine = coroutinemacro("destroycoroutine","destroy",true)
+terra.coroutinedone = coroutinemacro("coroutinedone","done",true)
+
 -- END GLOBAL MACROS
 
 -- DEBUG
@@ -3882,7 +4387,10 @@ function prettystring(toptree,breaklines)
         end
     end
     local function emitAttr(a)
-        emit("{ nontemporal = %s, align = %s, isvolatile = %s }",a.nontemporal,a.alignment or "native",a.isvolatile)
+        emit("{ nontemporal = %s, align = %s, isvolatile = %s",a.nontemporal,a.alignment or "native",a.isvolatile)
+        if a.ordering then emit(', ordering = "%s"',a.ordering) end
+        if a.syncscope then emit(', syncscope = "%s"',a.syncscope) end
+        emit(" }")
     end
     local function emitFenceAttr(a)
         emit('{ syncscope = "%s", ordering = "%s" }',a.syncscope or "",a.ordering)
@@ -4142,6 +4650,12 @@ function prettystring(toptree,breaklines)
             emit(", ")
             emitAttr(e.attrs)
             emit(")")
+        elseif e:is "boundscheck" then
+            emit("boundscheck(")
+            emitExp(e.index)
+            emit(", ")
+            emitExp(e.extent)
+            emit(")")
         elseif e:is "attrstore" then
             emit("attrstore(")
             emitExp(e.address)
@@ -4174,6 +4688,10 @@ function prettystring(toptree,breaklines)
             emit(", ")
             emitAtomicAttr(e.attrs)
             emit(")")
+        elseif e:is "coroutineop" then
+            emit("coroutine%s(",e.operation)
+            if e.handle then emitExp(e.handle) end
+            emit(")")
         elseif e:is "luaobject" then
             if terra.types.istype(e.value) then
                 emit("[%s]",e.value)
@@ -4323,8 +4841,9 @@ function terra.saveobj(filename,filekind,env,arguments,target,optimize)
         cu:addvalue(k,v)
     end
     local r = cu:saveobj(filename,filekind,arguments,optimize)
+    local stats = cu.stats
     cu:free()
-    return r
+    return r,stats
 end
 
 
@@ -4495,6 +5014,10 @@ local terradefaultpath =  ffi.os == "Windows" and ";.\\?.t;"..terra.terrahome.."
                           or ";./?.t;"..terra.terrahome.."/share/terra/?.t;"
 
 package.terrapath = (os.getenv("TERRA_PATH") or ";;"):gsub(";;",terradefaultpath)
+-- directory for cached bytecode of pure Lua files, ignored on Windows (see terra_loadfile)
+terra.bytecodecache = os.getenv("TERRA_BYTECODE_CACHE")
+-- directory for includec results saved across processes, ignored on Windows
+terra.includeccache = os.getenv("TERRA_INCLUDEC_CACHE")
 
 local function terraloader(name)
     local fname = name:gsub("%.","/")
@@ -4544,6 +5067,9 @@ function terra.new(terratype,...)
     local typ = terratype:cstring()
     return ffi.new(typ,...)
 end
+function terra.mapcall(fn,...)
+    return require("batch").mapcall(fn,...)
+end
 function terra.offsetof(terratype,field)
     terratype:complete()
     local typ = terratype:cstring()
@@ -4589,14 +5115,12 @@ function terra.constant(typ,init)
     if type(init) ~= "cdata" or terra.typeof(init) ~= typ then
         init = terra.cast(typ,init)
     end
-    if not typ:isaggregate() then
+    if not typ:isaggregate() and not typ:isvector() then
         return terra.newquote(newobject(anchor,T.constant,init,typ))
-    end -- otherwise this is an aggregate pack it into a string literal
-    local str,ptyp = ffi.string(init,terra.sizeof(typ)),terra.types.pointer(typ)
-    local tree = newobject(anchor,T.literal,str,terra.types.rawstring) -- "literal"
-    tree = newobject(anchor,T.cast,ptyp,tree):withtype(ptyp) -- [&typ](literal)
-    tree = newobject(anchor,T.operator,"@", List { tree }):withtype(typ):setlvalue(true) -- @[&typ](literal)
-    return terra.newquote(tree)
+    end
+    -- aggregates and vectors become typed constant globals in the backend. The tree
+    -- is an lvalue naming the global, so elements can be indexed without a copy
+    return terra.newquote(newobject(anchor,T.constant,init,typ):setlvalue(true))
 end
 function terra.isconstant(obj)
     if T.globalvariable:isclassof(obj) then return obj:isconstant()
@@ -10,6 +10,7 @@
 
 struct terra_CompilerState;
 struct terra_CUDAState;
+struct terra_CompilationService;
 struct TerraTarget;
 
 typedef struct terra_State {
@@ -18,6 +19,7 @@ typedef struct terra_State {
     struct terra_CUDAState *cuda;
     terra_Options options;
     std::vector<TerraTarget *> targets;
+    terra_CompilationService *service;  // shared JIT, if attached
     // for parser
     int nCcalls;
     char tstring_table;  //&tstring_table is used as the key into the lua registry that
@@ -5,14 +5,21 @@
 
 using namespace llvm;
 
-ManualInliner::ManualInliner(TargetMachine *TM, Module *m) {
+ManualInliner::ManualInliner(TargetMachine *TM, Module *m,
+                             const llvmutil_PipelineOptions *opts) {
     // Trick the Module-at-a-time inliner into running on a single SCC
     // First we run it on the (currently empty) module to initialize
     // the inlining pass with the Analysis passes it needs.
 
     PM.add(createTargetTransformInfoWrapperPass(TM->getTargetIRAnalysis()));
 
-    SI = (CallGraphSCCPass *)createFunctionInliningPass();
+    if (opts && opts->inlinethreshold >= 0)
+        SI = (CallGraphSCCPass *)createFunctionInliningPass(opts->inlinethreshold);
+    else if (opts && (opts->optlevel != 3 || opts->sizelevel != 0))
+        SI = (CallGraphSCCPass *)createFunctionInliningPass(opts->optlevel,
+                                                            opts->sizelevel, false);
+    else
+        SI = (CallGraphSCCPass *)createFunctionInliningPass();
     PM.add(SI);
     PM.run(*m);
     // save the call graph so we can keep it up to date
@@ -89,11 +96,18 @@ void ManualInliner::run(std::vector<Function *>::iterator fbegin,
 
 using namespace llvm;
 
-// Terra's function pipeline is built at -O3, so match the inlining thresholds
-// LLVM would use for a -O3 module pipeline.
+// Match the inlining thresholds LLVM would use for a module pipeline at the level
+// Terra's function pipeline is built at, -O3 by default.
 ManualInliner::ManualInliner(TargetMachine *TM, Module *m, FunctionAnalysisManager &fam,
-                             ModuleAnalysisManager &mam)
-        : M(m), FAM(&fam), MAM(&mam), Params(getInlineParams(3, 0)) {}
+                             ModuleAnalysisManager &mam,
+                             const llvmutil_PipelineOptions *opts)
+        : M(m),
+          FAM(&fam),
+          MAM(&mam),
+          Params(!opts                         ? getInlineParams(3, 0)
+                 : opts->inlinethreshold >= 0 ? getInlineParams(opts->inlinethreshold)
+                                              : getInlineParams(opts->optlevel,
+                                                                opts->sizelevel)) {}
 
 // Return true if the given inline history includes F. A call site inherits the
 // history of the call that exposed it, so this is what stops us from inlining a
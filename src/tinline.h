@@ -2,6 +2,7 @@
 #define tinline_h
 
 #include "llvmheaders.h"
+#include "tllvmutil.h"
 
 #if LLVM_VERSION >= 170
 #include "llvm/Analysis/InlineCost.h"
@@ -19,7 +20,8 @@ class ManualInliner {
     PassManager PM;
 
 public:
-    ManualInliner(llvm::TargetMachine *tm, llvm::Module *m);
+    ManualInliner(llvm::TargetMachine *tm, llvm::Module *m,
+                  const llvmutil_PipelineOptions *opts = NULL);
     void eraseFunction(llvm::Function *f);
 #else
     llvm::Module *M;
@@ -29,7 +31,8 @@ public:
 
 public:
     ManualInliner(llvm::TargetMachine *tm, llvm::Module *m,
-                  llvm::FunctionAnalysisManager &fam, llvm::ModuleAnalysisManager &mam);
+                  llvm::FunctionAnalysisManager &fam, llvm::ModuleAnalysisManager &mam,
+                  const llvmutil_PipelineOptions *opts = NULL);
 #endif
     void run(std::vector<llvm::Function *>::iterator fbegin,
              std::vector<llvm::Function *>::iterator fend);
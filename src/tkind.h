@@ -18,11 +18,13 @@ struct terra_State;
     _(attrload, "attrload")                   \
     _(attrstore, "attrstore")                 \
     _(block, "block")                         \
+    _(boundscheck, "boundscheck")             \
     _(breakstat, "breakstat")                 \
     _(cast, "cast")                           \
     _(cmpxchg, "cmpxchg")                     \
     _(constant, "constant")                   \
     _(constructor, "constructor")             \
+    _(coroutineop, "coroutineop")             \
     _(debuginfo, "debuginfo")                 \
     _(defer, "defer")                         \
     _(dereference, "@")                       \
@@ -7,6 +7,7 @@
 #include "tllvmutil.h"
 
 #include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/CodeGen/ParallelCG.h"
 #include "llvm/MC/MCAsmInfo.h"
 #include "llvm/MC/MCDisassembler/MCDisassembler.h"
 #include "llvm/MC/MCInst.h"
@@ -15,9 +16,11 @@
 #include "llvm/MC/MCRegisterInfo.h"
 #include "llvm/MC/MCSubtargetInfo.h"
 #include "llvm/MC/MCContext.h"
+#include "llvm/Transforms/InstCombine/InstCombine.h"
 
 #if LLVM_VERSION >= 170
-#include "llvm/Transforms/InstCombine/InstCombine.h"
+#include "llvm/Support/PGOOptions.h"
+#include "llvm/Support/VirtualFileSystem.h"
 #include "llvm/Transforms/IPO/GlobalDCE.h"
 #include "llvm/Transforms/Scalar/AlignmentFromAssumptions.h"
 #include "llvm/Transforms/Scalar/BDCE.h"
@@ -73,16 +76,30 @@ public:
             PM->add(P);
     }
 };
-void llvmutil_addoptimizationpasses(PassManagerBase *fpm) {
+void llvmutil_addoptimizationpasses(PassManagerBase *fpm,
+                                    const llvmutil_PipelineOptions *opts) {
+    llvmutil_PipelineOptions defaults;
+    if (!opts) opts = &defaults;
     PassManagerBuilder PMB;
-    PMB.OptLevel = 3;
-    PMB.SizeLevel = 0;
-    PMB.LoopVectorize = true;
-    PMB.SLPVectorize = true;
+    PMB.OptLevel = opts->optlevel;
+    PMB.SizeLevel = opts->sizelevel;
+    PMB.LoopVectorize = opts->vectorize;
+    PMB.SLPVectorize = opts->vectorize;
+    PMB.DisableUnrollLoops = !opts->unroll;
 
     PassManagerWrapper W(fpm);
     PMB.populateModulePassManager(W);
 }
+
+void llvmutil_foldconstants(Function *F) {
+    FunctionPassManagerT fpm(F->getParent());
+    fpm.add(createSROAPass());
+    fpm.add(createEarlyCSEPass());
+    fpm.add(createInstructionCombiningPass());
+    fpm.doInitialization();
+    fpm.run(*F);
+    fpm.doFinalization();
+}
 #else
 // Adapted from PassBuilder::addVectorPasses. LLVM doesn't expose this, and
 // the function pipeline doesn't do vectorization by default, so we have to
@@ -257,14 +274,39 @@ void addVectorPasses(PipelineTuningOptions PTO, OptimizationLevel Level,
     FPM.addPass(AlignmentFromAssumptionsPass());
 }
 
-FunctionPassManager llvmutil_createoptimizationpasses(TargetMachine *TM,
-                                                      LoopAnalysisManager &LAM,
-                                                      FunctionAnalysisManager &FAM,
-                                                      CGSCCAnalysisManager &CGAM,
-                                                      ModuleAnalysisManager &MAM) {
+static OptimizationLevel GetOptimizationLevel(const llvmutil_PipelineOptions *opts) {
+    if (opts->sizelevel == 1) return OptimizationLevel::Os;
+    if (opts->sizelevel >= 2) return OptimizationLevel::Oz;
+    switch (opts->optlevel) {
+        case 0:
+            return OptimizationLevel::O0;
+        case 1:
+            return OptimizationLevel::O1;
+        case 2:
+            return OptimizationLevel::O2;
+        default:
+            return OptimizationLevel::O3;
+    }
+}
+
+static PipelineTuningOptions GetTuningOptions(const llvmutil_PipelineOptions *opts) {
     PipelineTuningOptions PTO;
-    PTO.LoopVectorization = true;
-    PTO.SLPVectorization = true;
+    PTO.LoopVectorization = opts->vectorize;
+    PTO.SLPVectorization = opts->vectorize;
+    // as in Clang, interleaving vectorized loops counts as unrolling
+    PTO.LoopUnrolling = opts->unroll;
+    PTO.LoopInterleaving = opts->unroll;
+    if (opts->inlinethreshold >= 0) PTO.InlinerThreshold = opts->inlinethreshold;
+    return PTO;
+}
+
+FunctionPassManager llvmutil_createoptimizationpasses(
+        TargetMachine *TM, LoopAnalysisManager &LAM, FunctionAnalysisManager &FAM,
+        CGSCCAnalysisManager &CGAM, ModuleAnalysisManager &MAM,
+        const llvmutil_PipelineOptions *opts, std::string *err) {
+    llvmutil_PipelineOptions defaults;
+    if (!opts) opts = &defaults;
+    PipelineTuningOptions PTO = GetTuningOptions(opts);
     PassBuilder PB(TM, PTO);
 
     PB.registerModuleAnalyses(MAM);
@@ -273,12 +315,24 @@ FunctionPassManager llvmutil_createoptimizationpasses(TargetMachine *TM,
     PB.registerLoopAnalyses(LAM);
     PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
 
+    if (!opts->passes.empty()) {
+        FunctionPassManager FPM;
+        if (Error e = PB.parsePassPipeline(FPM, opts->passes)) {
+            std::string msg = toString(std::move(e));
+            if (err) *err = msg;
+            return FunctionPassManager();
+        }
+        return FPM;
+    }
+    OptimizationLevel Level = GetOptimizationLevel(opts);
+    if (Level == OptimizationLevel::O0) return FunctionPassManager();
+
     // FIXME (Elliott): is this the right pipeline to build? Not obvious if
     // it's equivalent to the old code path
-    FunctionPassManager FPM = PB.buildFunctionSimplificationPipeline(
-            OptimizationLevel::O3, ThinOrFullLTOPhase::None);
+    FunctionPassManager FPM =
+            PB.buildFunctionSimplificationPipeline(Level, ThinOrFullLTOPhase::None);
 
-    addVectorPasses(PTO, OptimizationLevel::O3, FPM, /*IsFullLTO*/ false,
+    addVectorPasses(PTO, Level, FPM, /*IsFullLTO*/ false,
                     /*EnableUnrollAndJam*/ false, /*ExtraVectorizerPasses*/ true);
 
     // Debugging code for printing the set of pipelines
@@ -294,6 +348,14 @@ FunctionPassManager llvmutil_createoptimizationpasses(TargetMachine *TM,
     return FPM;
 }
 
+void llvmutil_foldconstants(Function *F, FunctionAnalysisManager &FAM) {
+    FunctionPassManager FPM;
+    FPM.addPass(SROAPass(SROAOptions::ModifyCFG));
+    FPM.addPass(EarlyCSEPass());
+    FPM.addPass(InstCombinePass());
+    FPM.run(*F, FAM);
+}
+
 // Optimize a device module (currently NVPTX) before handing it to the code
 // generator. This is the same -O3 module pipeline llvmutil_optimizemodule runs
 // for the host, with two differences:
@@ -324,6 +386,31 @@ void llvmutil_optimizedevicemodule(Module *M, TargetMachine *TM) {
     ModulePassManager MPM = PB.buildPerModuleDefaultPipeline(OptimizationLevel::O3);
     MPM.run(*M, MAM);
 }
+
+void llvmutil_lowercoroutines(Module *M, TargetMachine *TM, bool optimize) {
+    bool hascoroutines = false;
+    for (Function &F : M->functions())
+        hascoroutines |= F.isIntrinsic() && F.getName().starts_with("llvm.coro.");
+    if (!hascoroutines) return;
+
+    LoopAnalysisManager LAM;
+    FunctionAnalysisManager FAM;
+    CGSCCAnalysisManager CGAM;
+    ModuleAnalysisManager MAM;
+    PassBuilder PB(TM);
+    PB.registerModuleAnalyses(MAM);
+    PB.registerCGSCCAnalyses(CGAM);
+    PB.registerFunctionAnalyses(FAM);
+    PB.registerLoopAnalyses(LAM);
+    PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+
+    ModulePassManager MPM;
+    cantFail(PB.parsePassPipeline(
+            MPM, optimize ? "coro-early,cgscc(coro-split,inline,function(coro-elide,sroa,"
+                            "early-cse,instcombine,simplifycfg)),coro-cleanup"
+                          : "coro-early,cgscc(coro-split),coro-cleanup"));
+    MPM.run(*M, MAM);
+}
 #endif
 
 void llvmutil_disassemblefunction(void *data, size_t numBytes, size_t numInst) {
@@ -448,6 +535,31 @@ bool llvmutil_emitobjfile(Module *Mod, TargetMachine *TM, bool outputobjectfile,
     return false;
 }
 
+bool llvmutil_emitobjfilesparallel(Module *Mod, TargetMachine *TM,
+                                   ArrayRef<emitobjfile_t *> dests) {
+#if LLVM_VERSION < 130
+    return true;
+#else
+    // every thread needs its own TargetMachine, configured like the one for the unit
+    auto createtm = [TM]() {
+        return std::unique_ptr<TargetMachine>(TM->getTarget().createTargetMachine(
+#if LLVM_VERSION < 210
+                TM->getTargetTriple().str(),
+#else
+                TM->getTargetTriple(),
+#endif
+                TM->getTargetCPU(), TM->getTargetFeatureString(), TM->Options,
+                TM->getRelocationModel(), TM->getCodeModel(), TM->getOptLevel()));
+    };
+    Mod->setDataLayout(TM->createDataLayout());
+    // partitions are round-tripped through bitcode into fresh contexts, so the
+    // threads do not share any LLVM state
+    splitCodeGen(*Mod, dests, {}, createtm);
+    for (emitobjfile_t *dest : dests) dest->flush();
+    return false;
+#endif
+}
+
 struct CopyConnectedComponent : public ValueMaterializer {
     Module *dest;
     Module *src;
@@ -638,8 +750,14 @@ void llvmutil_copyfrommodule(llvm::Module *Dest, llvm::Module *Src,
     llvmutil_removeemptydebugcus(Dest);
 }
 
-void llvmutil_optimizemodule(Module *M, TargetMachine *TM) {
+bool llvmutil_optimizemodule(Module *M, TargetMachine *TM, const llvmutil_PGOOptions *pgo,
+                             const llvmutil_PipelineOptions *opts, std::string *err) {
+    llvmutil_PipelineOptions defaults;
+    if (!opts) opts = &defaults;
 #if LLVM_VERSION < 170
+    // the legacy pass manager's PGO passes are gone from the LLVM versions that still
+    // use this path; terralib.lua rejects PGO profiles before we get here
+    assert(!pgo || pgo->mode == llvmutil_PGOOptions::None);
     PassManagerT MPM;
     llvmutil_addtargetspecificpasses(&MPM, TM);
 
@@ -649,26 +767,39 @@ void llvmutil_optimizemodule(Module *M, TargetMachine *TM) {
                                      // will remove dead functions
 
     PassManagerBuilder PMB;
-    PMB.OptLevel = 3;
-    PMB.SizeLevel = 0;
-    PMB.Inliner = createFunctionInliningPass(PMB.OptLevel, 0, false);
+    PMB.OptLevel = opts->optlevel;
+    PMB.SizeLevel = opts->sizelevel;
+    PMB.Inliner = opts->inlinethreshold >= 0
+                          ? createFunctionInliningPass(opts->inlinethreshold)
+                          : createFunctionInliningPass(PMB.OptLevel, PMB.SizeLevel, false);
 
-    PMB.LoopVectorize = true;
-    PMB.SLPVectorize = true;
+    PMB.LoopVectorize = opts->vectorize;
+    PMB.SLPVectorize = opts->vectorize;
+    PMB.DisableUnrollLoops = !opts->unroll;
 
     PMB.populateModulePassManager(MPM);
 
     MPM.run(*M);
+    return false;
 #else
     LoopAnalysisManager LAM;
     FunctionAnalysisManager FAM;
     CGSCCAnalysisManager CGAM;
     ModuleAnalysisManager MAM;
 
-    PipelineTuningOptions PTO;
-    PTO.LoopVectorization = true;
-    PTO.SLPVectorization = true;
-    PassBuilder PB(TM, PTO);
+    PipelineTuningOptions PTO = GetTuningOptions(opts);
+    // With PGO options the default pipeline inserts the instrumentation (or reads the
+    // profile) itself, after early simplification and before the inliner, so the
+    // counters line up between the generate and use builds.
+    std::optional<PGOOptions> PGOOpt;
+    if (pgo && pgo->mode != llvmutil_PGOOptions::None) {
+        PGOOpt = PGOOptions(pgo->profilefile, "", "", /*MemoryProfile=*/"",
+                            vfs::getRealFileSystem(),
+                            pgo->mode == llvmutil_PGOOptions::Generate
+                                    ? PGOOptions::IRInstr
+                                    : PGOOptions::IRUse);
+    }
+    PassBuilder PB(TM, PTO, PGOOpt);
 
     PB.registerModuleAnalyses(MAM);
     PB.registerCGSCCAnalyses(CGAM);
@@ -681,7 +812,20 @@ void llvmutil_optimizemodule(Module *M, TargetMachine *TM) {
     MPM.addPass(GlobalDCEPass());  // run this early since anything not in the table of
                                    // exported functions is still in this module this
                                    // will remove dead functions
-    MPM.addPass(PB.buildPerModuleDefaultPipeline(OptimizationLevel::O3));
+    OptimizationLevel Level = GetOptimizationLevel(opts);
+    if (!opts->passes.empty()) {
+        // a pipeline of function passes, which was checked as one when the unit was
+        // created but may still be rejected as a module pipeline
+        if (Error e = PB.parsePassPipeline(MPM, opts->passes)) {
+            std::string msg = toString(std::move(e));
+            if (err) *err = msg;
+            return true;
+        }
+    } else if (Level == OptimizationLevel::O0) {
+        MPM.addPass(PB.buildO0DefaultPipeline(Level));
+    } else {
+        MPM.addPass(PB.buildPerModuleDefaultPipeline(Level));
+    }
 
     // Debugging code for printing the set of pipelines
     /*
@@ -694,6 +838,7 @@ void llvmutil_optimizemodule(Module *M, TargetMachine *TM) {
     */
 
     MPM.run(*M, MAM);
+    return false;
 #endif
 }
 
@@ -3,20 +3,53 @@
 
 #include "llvmheaders.h"
 
+// How to optimize, set by the optimization profile of a compilation unit. The levels
+// follow Clang: -Os and -Oz are optlevel 2 with sizelevel 1 and 2. A negative
+// inlinethreshold uses the level's default, and vectorwidth (in bits, 0 to let the
+// target decide) is applied to each function as the "prefer-vector-width" attribute.
+// With the new pass manager, passes may hold a pipeline of function passes in
+// PassBuilder::parsePassPipeline syntax, which replaces the level's default passes.
+struct llvmutil_PipelineOptions {
+    unsigned optlevel = 3;
+    unsigned sizelevel = 0;
+    bool unroll = true;
+    bool vectorize = true;
+    unsigned vectorwidth = 0;
+    int inlinethreshold = -1;
+    std::string passes;
+};
+
 #if LLVM_VERSION < 170
 void llvmutil_addtargetspecificpasses(llvm::PassManagerBase *fpm,
                                       llvm::TargetMachine *tm);
-void llvmutil_addoptimizationpasses(llvm::PassManagerBase *fpm);
+void llvmutil_addoptimizationpasses(llvm::PassManagerBase *fpm,
+                                    const llvmutil_PipelineOptions *opts = NULL);
+// Fold what is left of a constant expression in F with a fixed set of passes, so that
+// the result does not depend on the optimization profile.
+void llvmutil_foldconstants(llvm::Function *F);
 #else
+// Returns an empty pass manager and sets *err if opts->passes does not parse.
 llvm::FunctionPassManager llvmutil_createoptimizationpasses(
         llvm::TargetMachine *TM, llvm::LoopAnalysisManager &LAM,
         llvm::FunctionAnalysisManager &FAM, llvm::CGSCCAnalysisManager &CGAM,
-        llvm::ModuleAnalysisManager &MAM);
+        llvm::ModuleAnalysisManager &MAM, const llvmutil_PipelineOptions *opts = NULL,
+        std::string *err = NULL);
+void llvmutil_foldconstants(llvm::Function *F, llvm::FunctionAnalysisManager &FAM);
 void llvmutil_optimizedevicemodule(llvm::Module *M, llvm::TargetMachine *TM);
+// Split the coroutines in M and lower the remaining coroutine intrinsics, which the
+// code generator cannot handle. With optimize, split ramps are also inlined into
+// their callers so CoroElide can move frames that do not escape onto the stack.
+// Does nothing if M uses no coroutine intrinsics.
+void llvmutil_lowercoroutines(llvm::Module *M, llvm::TargetMachine *TM, bool optimize);
 #endif
 extern "C" void llvmutil_disassemblefunction(void *data, size_t sz, size_t inst);
 bool llvmutil_emitobjfile(llvm::Module *Mod, llvm::TargetMachine *TM,
                           bool outputobjectfile, emitobjfile_t &dest);
+// Split Mod into dests.size() partitions and emit each as an object file on its own
+// thread. Locals are promoted to hidden globals so the partitions link together as
+// one object would. Returns true if the module cannot be emitted in parallel.
+bool llvmutil_emitobjfilesparallel(llvm::Module *Mod, llvm::TargetMachine *TM,
+                                   llvm::ArrayRef<emitobjfile_t *> dests);
 
 typedef bool (*llvmutil_Property)(llvm::GlobalValue *, void *);
 llvm::Module *llvmutil_extractmodulewithproperties(
@@ -25,7 +58,18 @@ llvm::Module *llvmutil_extractmodulewithproperties(
 void llvmutil_copyfrommodule(llvm::Module *Dest, llvm::Module *Src,
                              llvm::GlobalValue **gvs, size_t N,
                              llvmutil_Property copyGlobal, void *data);
-void llvmutil_optimizemodule(llvm::Module *M, llvm::TargetMachine *TM);
+// Profile-guided optimization for llvmutil_optimizemodule: either instrument the
+// module so that running it writes a raw profile to profilefile, or optimize it using
+// the indexed profile (merged with llvm-profdata) in profilefile.
+struct llvmutil_PGOOptions {
+    enum Mode { None, Generate, Use } mode = None;
+    std::string profilefile;
+};
+// Returns true and sets *err if opts->passes does not parse as a module pipeline.
+bool llvmutil_optimizemodule(llvm::Module *M, llvm::TargetMachine *TM,
+                             const llvmutil_PGOOptions *pgo = NULL,
+                             const llvmutil_PipelineOptions *opts = NULL,
+                             std::string *err = NULL);
 using std::error_code;
 error_code llvmutil_createtemporaryfile(const llvm::Twine &Prefix, llvm::StringRef Suffix,
                                         llvm::SmallVectorImpl<char> &ResultPath);
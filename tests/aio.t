@@ -0,0 +1,125 @@
+local ffi = require("ffi")
+if ffi.os ~= "Linux" then
+    print("Not running aio tests, they need Linux")
+    return
+end
+
+local aio = require("aio")
+local C = terralib.includecstring [[
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+]]
+
+struct Result {
+    count : int;
+    last : int64;
+}
+terra record(data : &opaque, result : int64)
+    var r = [&Result](data)
+    r.count, r.last = r.count + 1, result
+end
+
+terra pipes(backend : int) : bool
+    var ring : aio.Ring
+    if not ring:init(8, backend) then return backend == aio.URING end
+    var fds : int[2]
+    C.pipe(&fds[0])
+    aio.setnonblocking(fds[0])
+    aio.setnonblocking(fds[1])
+    var w, r = Result { 0, 0 }, Result { 0, 0 }
+    var out : int8[6]
+    -- one batch; the read completes with what the write wrote
+    var ok = ring:write(fds[1], "hello", 5, -1, record, &w) and ring:read(fds[0], &out[0], 6, -1, record, &r)
+    ok = ok and ring:wait(2) == 2 and w.count == 1 and w.last == 5 and r.count == 1 and r.last == 5
+    ok = ok and C.memcmp(&out[0], "hello", 5) == 0
+    -- a read that has to wait for a later write
+    ok = ok and ring:read(fds[0], &out[0], 6, -1, record, &r) and ring:submit() >= 0
+    ok = ok and ring:write(fds[1], "abc", 3, -1, record, &w) and ring:wait(2) == 2
+    ok = ok and r.count == 2 and r.last == 3 and w.count == 2
+    -- a batch larger than the submission queue
+    for i = 0, 16 do ok = ok and ring:write(fds[1], "x", 1, -1, record, &w) end
+    ok = ok and ring:wait(16) == 16 and w.count == 18 and w.last == 1
+    ok = ok and ring:read(fds[0], &out[0], 6, -1, record, &r) and ring:wait(1) == 1 and r.last == 6
+    -- errors are reported as -errno
+    ok = ok and ring:read(-1, &out[0], 6, -1, record, &r) and ring:wait(1) == 1 and r.last < 0
+    -- nothing in flight
+    ok = ok and ring:wait(1) == 0
+    C.close(fds[0])
+    C.close(fds[1])
+    ring:destroy()
+    return ok
+end
+assert(pipes(aio.EPOLL))
+assert(pipes(aio.URING))
+assert(pipes(aio.AUTO))
+
+-- registered buffers and offsets on a file
+terra files(backend : int) : bool
+    var ring : aio.Ring
+    if not ring:init(8, backend) then return backend == aio.URING end
+    var name : int8[32]
+    C.strcpy(&name[0], "/tmp/terraaioXXXXXX")
+    var fd = C.mkstemp(&name[0])
+    C.unlink(&name[0])
+    var buf = [&int8](C.malloc(4096))
+    var iov = aio.iovec { buf, 4096 }
+    var w, r = Result { 0, 0 }, Result { 0, 0 }
+    var ok = fd >= 0 and ring:registerbuffers(&iov, 1)
+    C.memcpy(buf, "0123456789", 10)
+    ok = ok and ring:writefixed(fd, buf, 10, 0, 0, record, &w) and ring:wait(1) == 1 and w.last == 10
+    C.memset(buf, 0, 10)
+    ok = ok and ring:readfixed(fd, buf + 100, 4, 3, 0, record, &r) and ring:wait(1) == 1
+    ok = ok and r.last == 4 and C.memcmp(buf + 100, "3456", 4) == 0
+    ok = ok and ring:read(fd, buf, 10, 8, record, &r) and ring:wait(1) == 1 and r.last == 2
+    C.close(fd)
+    C.free(buf)
+    ring:destroy()
+    return ok
+end
+assert(files(aio.EPOLL))
+assert(files(aio.URING))
+
+if terralib.llvm_version < 170 then
+    print("Not running aio coroutine tests with LLVM " .. terralib.llvm_version)
+    return
+end
+
+-- a coroutine pumps bytes from one pipe to another
+terra pump(ring : &aio.Ring, from : int, to : int, total : &int64)
+    var buf : int8[16]
+    while true do
+        var n = aio.awaitread(ring, from, &buf[0], 16, -1)
+        if n <= 0 then break end
+        if aio.awaitwrite(ring, to, &buf[0], n, -1) ~= n then break end
+        @total = @total + n
+    end
+end
+local startpump = terralib.coroutine(pump)
+
+terra pumped(backend : int) : bool
+    var ring : aio.Ring
+    if not ring:init(8, backend) then return backend == aio.URING end
+    var a : int[2]
+    var b : int[2]
+    C.pipe(&a[0])
+    C.pipe(&b[0])
+    for i = 0, 2 do aio.setnonblocking(a[i]) aio.setnonblocking(b[i]) end
+    var total : int64 = 0
+    aio.spawn(startpump(&ring, a[0], b[1], &total))
+    var w, r = Result { 0, 0 }, Result { 0, 0 }
+    var out : int8[64]
+    var ok = ring:write(a[1], "coroutines", 10, -1, record, &w) and ring:wait(1) >= 1
+    while total < 10 and ring:wait(1) > 0 do end
+    ok = ok and total == 10 and ring:read(b[0], &out[0], 64, -1, record, &r)
+    while r.count == 0 and ring:wait(1) > 0 do end
+    ok = ok and r.last == 10 and C.memcmp(&out[0], "coroutines", 10) == 0
+    -- closing the input ends the coroutine, which destroys itself
+    C.close(a[1])
+    while ring:wait(1) > 0 do end
+    C.close(a[0]) C.close(b[0]) C.close(b[1])
+    ring:destroy()
+    return ok
+end
+assert(pumped(aio.EPOLL))
+assert(pumped(aio.URING))
@@ -0,0 +1,60 @@
+local ffi = require("ffi")
+
+local function ir(fn, profile)
+    return terralib.saveobj(nil, "llvmir", { fn = fn }, nil, nil, profile)
+end
+
+-- without type information a store to p[i] might change @n, so n is reloaded
+-- on every iteration; with it the loop becomes a memset
+terra clear(p : &float, n : &int)
+    var i = 0
+    while i < @n do
+        p[i] = 0
+        i = i + 1
+    end
+end
+assert(not ir(clear, {}):find("!tbaa", 1, true))
+local strict = ir(clear, { strictaliasing = true })
+assert(strict:find("!tbaa", 1, true) and strict:find("llvm.memset", 1, true))
+
+-- fields of a union share storage, so accesses through them are not tagged
+struct U {
+    union {
+        f : float
+        i : int
+    }
+}
+terra pun(u : &U) : int
+    u.f = 1
+    return u.i
+end
+local punir = ir(pun, { strictaliasing = true })
+assert(not punir:find('!"float"', 1, true) and not punir:find('!"i32"', 1, true))
+
+local cu = terralib.newcompilationunit(terralib.nativetarget, true, { strictaliasing = true })
+local jitpun = ffi.cast("int (*)(void *)", cu:jitvalue(pun))
+assert(jitpun(ffi.new("int[1]")) == 0x3f800000)
+
+-- noalias parameters
+terra add(a : &float, b : &float, c : &float, n : int)
+    for i = 0, n do a[i] = b[i] + c[i] end
+end
+local function define(fn)
+    return ir(fn, false):match("define[^\n]*")
+end
+assert(not define(add):find("noalias", 1, true))
+add:setnoalias("a", 3)
+assert(select(2, define(add):gsub("noalias", "")) == 2)
+add:setnoalias()
+assert(select(2, define(add):gsub("noalias", "")) == 3)
+assert(not pcall(function() add:setnoalias("n") end))
+assert(not pcall(function() add:setnoalias(5) end))
+
+terra testadd()
+    var a : float[16]
+    var b : float[16]
+    for i = 0, 16 do b[i] = i end
+    add(a, b, b, 16)
+    return a[15]
+end
+assert(testadd() == 30)
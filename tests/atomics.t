@@ -0,0 +1,227 @@
+local atomics = require("atomics")
+local ffi = require("ffi")
+
+-- attrload and attrstore with an ordering are atomic
+terra orderedcopy(a : &int, b : &int)
+    terralib.attrstore(b, terralib.attrload(a, { ordering = "acquire" }), { ordering = "release" })
+end
+local ir = terralib.saveobj(nil, "llvmir", { orderedcopy = orderedcopy }, nil, nil, false)
+assert(ir:find("load atomic i32, ptr %S+ acquire") or ir:find("load atomic i32, i32%* %S+ acquire"))
+assert(ir:find("store atomic i32 %S+, ptr %S+ release") or ir:find("store atomic i32 %S+, i32%* %S+ release"))
+assert(not pcall(terralib.compile, terra(a : &int) return terralib.attrload(a, { ordering = "release" }) end))
+assert(not pcall(terralib.compile, terra(a : &int) terralib.attrstore(a, 1, { ordering = "acquire" }) end))
+
+local AI, AF, AP = atomics.Atomic(int32), atomics.Atomic(double), atomics.Atomic(&int)
+assert(atomics.Atomic(int32) == AI and tostring(AI) == "Atomic(int32)")
+assert(not pcall(atomics.Atomic, int[4]))
+
+terra single() : bool
+    var a = AI { 5 }
+    var ok = a:load() == 5 and a:fetchadd(3) == 5 and a:fetchsub(1, "acq_rel") == 8
+    ok = ok and a:exchange(10, "acquire") == 7 and a:fetchmax(20) == 10 and a:fetchmin(-1) == 20
+    ok = ok and a:fetchor(6) == -1 and a:fetchand(3) == -1 and a:fetchxor(1) == 3 and a:load() == 2
+    ok = ok and not a:cas(3, 4) and a:cas(2, 4, "release")
+    var r = a:compareexchange(7, 8, "monotonic")
+    ok = ok and r._0 == 4 and not r._1
+    a:store(-7, "seq_cst")
+    var u = [atomics.Atomic(uint8)] { 200 }
+    ok = ok and u:fetchmax(100) == 200 and u:load() == 200
+    var f = AF { 1.5 }
+    ok = ok and f:fetchadd(2.0) == 1.5 and f:exchange(0.25) == 3.5 and f:cas(0.25, 0.5) and f:load("monotonic") == 0.5
+    var x, y = 1, 2
+    var p = AP { &x }
+    ok = ok and p:exchange(&y) == &x and p:cas(&y, &x) and @p:load() == 1
+    return ok and a:load() == -7
+end
+assert(single())
+assert(not pcall(terralib.compile, terra() var p : AP p:fetchadd(nil) end))
+assert(not pcall(terralib.compile, terra() var a : AI a:load("whenever") end))
+
+local Queue = atomics.Queue(int)
+terra queue() : bool
+    var q : Queue
+    q:init(5)
+    var ok = true
+    for i = 0, 8 do ok = ok and q:push(i) end
+    ok = ok and not q:push(8)
+    var v : int
+    for i = 0, 8 do ok = ok and q:pop(&v) and v == i end
+    ok = ok and not q:pop(&v)
+    -- wrap around the ring
+    for i = 0, 100 do ok = ok and q:push(i) and q:pop(&v) and v == i end
+    q:destroy()
+    return ok
+end
+assert(queue())
+
+local Stack = atomics.Stack(int)
+local freed = global(int, 0)
+terra freecount(r : &atomics.Retired) freed = freed + 1 end
+terra stack() : bool
+    var domain : atomics.EpochDomain
+    domain:init()
+    var p = domain:register()
+    var s : Stack
+    s:init(&domain)
+    var ok = p ~= nil
+    for i = 0, 1000 do ok = ok and s:push(i) end
+    var v : int
+    for i = 999, -1, -1 do ok = ok and s:pop(p, &v) and v == i end
+    ok = ok and not s:pop(p, &v)
+    -- retired nodes are freed only after the epoch moved on twice
+    var r : atomics.Retired[200]
+    for i = 0, 200 do
+        r[i].free = freecount
+        domain:enter(p)
+        domain:exit(p)
+        domain:retire(p, &r[i])
+    end
+    ok = ok and freed < 200
+    domain:unregister(p)
+    ok = ok and freed == 200
+    s:destroy()
+    return ok
+end
+assert(stack())
+
+terra counter() : int64
+    var c : atomics.ShardedCounter
+    c:init()
+    for i = 0, 1000 do c:add(i) end
+    return c:read()
+end
+assert(counter() == 499500)
+
+if ffi.os == "Windows" then
+    print("Not running threaded atomics tests on Windows")
+    return
+end
+
+local C = terralib.includecstring [[
+#include <pthread.h>
+#include <stdlib.h>
+]]
+
+local NTHREADS, N = 8, 20000
+
+-- each primitive under contention: threads run body(i, state) N times
+local function contend(State, body)
+    local terra worker(arg : &opaque) : &opaque
+        var state = [&State](arg)
+        for i = 0, N do [body(i, state)] end
+        return nil
+    end
+    return terra(state : &State)
+        var threads : C.pthread_t[NTHREADS]
+        for t = 0, NTHREADS do C.pthread_create(&threads[t], nil, worker, state) end
+        for t = 0, NTHREADS do C.pthread_join(threads[t], nil) end
+    end
+end
+
+struct Locked {
+    spin : atomics.SpinLock;
+    ticket : atomics.TicketLock;
+    spincount : int;
+    ticketcount : int;
+    atomiccount : atomics.Atomic(int);
+    sharded : atomics.ShardedCounter;
+}
+local locked = contend(Locked, function(i, s)
+    return quote
+        s.spin:lock() s.spincount = s.spincount + 1 s.spin:unlock()
+        s.ticket:lock() s.ticketcount = s.ticketcount + 1 s.ticket:unlock()
+        s.atomiccount:fetchadd(1, "monotonic")
+        s.sharded:add(1)
+    end
+end)
+terra testlocks() : bool
+    var s : Locked
+    s.spin:init() s.ticket:init() s.sharded:init()
+    s.spincount, s.ticketcount = 0, 0
+    s.atomiccount:store(0)
+    locked(&s)
+    var total = NTHREADS * N
+    return s.spincount == total and s.ticketcount == total and s.atomiccount:load() == total
+        and s.sharded:read() == total
+end
+assert(testlocks())
+
+-- readers never see a half-written pair
+struct Sequenced {
+    lock : atomics.SeqLock;
+    a : int;
+    b : int;
+    torn : atomics.Atomic(int);
+}
+local sequenced = contend(Sequenced, function(i, s)
+    return quote
+        if i % 4 == 0 then
+            s.lock:writebegin()
+            s.a = s.a + 1
+            s.b = -s.a
+            s.lock:writeend()
+        else
+            var q = s.lock:readbegin()
+            var a, b = terralib.attrload(&s.a, { isvolatile = true }), terralib.attrload(&s.b, { isvolatile = true })
+            while s.lock:readretry(q) do
+                q = s.lock:readbegin()
+                a, b = terralib.attrload(&s.a, { isvolatile = true }), terralib.attrload(&s.b, { isvolatile = true })
+            end
+            if a ~= -b then s.torn:fetchadd(1) end
+        end
+    end
+end)
+terra testseqlock() : bool
+    var s : Sequenced
+    s.lock:init()
+    s.a, s.b = 0, 0
+    s.torn:store(0)
+    sequenced(&s)
+    return s.torn:load() == 0 and s.a == NTHREADS * N / 4
+end
+assert(testseqlock())
+
+-- every value pushed is popped exactly once
+struct Shared {
+    queue : Queue;
+    stack : Stack;
+    domain : atomics.EpochDomain;
+    next : atomics.Atomic(int);
+    seen : atomics.Atomic(int)[NTHREADS * N];
+    missing : atomics.Atomic(int);
+}
+terra sharedworker(arg : &opaque) : &opaque
+    var s = [&Shared](arg)
+    var p = s.domain:register()
+    for i = 0, N do
+        var v = s.next:fetchadd(1)
+        while not s.queue:push(v) do atomics.pause() end
+        var w : int
+        while not s.queue:pop(&w) do atomics.pause() end
+        s.stack:push(w)
+        if s.stack:pop(p, &w) then s.seen[w]:fetchadd(1) else s.missing:fetchadd(1) end
+    end
+    s.domain:unregister(p)
+    return nil
+end
+terra shared(s : &Shared)
+    var threads : C.pthread_t[NTHREADS]
+    for t = 0, NTHREADS do C.pthread_create(&threads[t], nil, sharedworker, s) end
+    for t = 0, NTHREADS do C.pthread_join(threads[t], nil) end
+end
+terra testshared() : bool
+    var s = [&Shared](C.malloc(sizeof(Shared)))
+    s.queue:init(64)
+    s.domain:init()
+    s.stack:init(&s.domain)
+    s.next:store(0) s.missing:store(0)
+    for i = 0, NTHREADS * N do s.seen[i]:store(0) end
+    shared(s)
+    var ok = s.missing:load() == 0
+    for i = 0, NTHREADS * N do ok = ok and s.seen[i]:load() == 1 end
+    s.queue:destroy()
+    s.stack:destroy()
+    C.free(s)
+    return ok
+end
+assert(testshared())
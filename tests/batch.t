@@ -0,0 +1,57 @@
+local ffi = require("ffi")
+
+struct vec2 { x : double, y : double }
+
+terra axpy(a : double, x : double, y : double) return a * x + y end
+terra len2(v : vec2) return v.x * v.x + v.y * v.y end
+terra bump(p : &int) @p = @p + 1 end
+
+-- one call from Lua runs the whole loop
+local xs, ys = terralib.new(double[100]), terralib.new(double[100])
+for i = 0, 99 do xs[i], ys[i] = i, 1 end
+local batched = axpy:batch { uniform = { 1 } }
+assert(batched == axpy:batch { uniform = { 1 } } and batched ~= axpy:batch())
+local out = terralib.new(double[100])
+batched(100, out, 2, xs, ys)
+for i = 0, 99 do assert(out[i] == 2 * i + 1) end
+
+-- batches are Terra functions and can be called from Terra
+terra twice(n : int64, out : &double, xs : &double, ys : &double)
+    batched(n, out, 3, xs, ys)
+end
+twice(10, out, xs, ys)
+assert(out[9] == 28 and out[10] == 21)
+
+-- mapcall allocates the results and accepts tables
+local r = terralib.mapcall(axpy, { 1, 2, 3 }, { 10, 20, 30 }, { 1, 1, 1 })
+assert(r[0] == 11 and r[1] == 41 and r[2] == 91)
+local vs = terralib.new(vec2[2], { { 3, 4 }, { 1, 1 } })
+r = terralib.mapcall(len2, vs)
+assert(r[0] == 25 and r[1] == 2)
+
+-- functions without results
+local counters = terralib.new(int[3], { 1, 2, 3 })
+local ptrs = terralib.new((&int)[3], { counters + 0, counters + 1, counters + 2 })
+assert(terralib.mapcall(bump, ptrs) == nil)
+assert(counters[0] == 2 and counters[1] == 3 and counters[2] == 4)
+
+assert(not pcall(axpy.batch, axpy, { uniform = { 4 } }))
+assert(not pcall(axpy.batch, axpy, { threads = 0 }))
+assert(not pcall(terralib.mapcall, axpy, { 1 }, { 1, 2 }, { 1 }))
+assert(not pcall(terralib.mapcall, axpy, { 1 }))
+assert(not pcall(terralib.mapcall, len2, ffi.cast("void *", nil)))
+
+if ffi.os == "Windows" then return end
+
+-- threaded batches give the same results, also when there are fewer elements
+-- than threads would be worth
+local N = 100000
+local a, b = terralib.new(double[N]), terralib.new(double[N])
+for i = 0, N - 1 do a[i], b[i] = i, -i end
+local threaded = axpy:batch { uniform = { 1 }, threads = 4, grain = 1000 }
+local c = terralib.new(double[N])
+threaded(N, c, 0.5, a, b)
+for i = 0, N - 1 do assert(c[i] == -0.5 * i) end
+threaded(10, c, 1, a, b)
+assert(c[9] == 0 and c[10] == -5)
+
@@ -0,0 +1,195 @@
+-- A TCP echo server on the loopback interface built on lib/aio.t, run with the
+-- epoll backend, with io_uring, and with io_uring reading into registered
+-- buffers. Client threads send small messages on blocking sockets and wait for
+-- each echo; the result is round trips per second on one server thread.
+
+local ffi = require("ffi")
+if ffi.os ~= "Linux" then
+    print("Not running aio benchmark, it needs Linux")
+    return
+end
+
+local aio = require("aio")
+
+local CONNECTIONS = tonumber((...)) or 64
+local ROUNDS = tonumber(select(2, ...)) or 20000
+local MESSAGE = 64
+local BUFFER = 4096
+
+local C = terralib.includecstring [[
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+static void nodelay(int fd) {
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+/* a listening socket on an unused loopback port */
+static int listenloopback(int *port) {
+    struct sockaddr_in a;
+    socklen_t len = sizeof(a);
+    memset(&a, 0, sizeof(a));
+    a.sin_family = AF_INET;
+    a.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (fd < 0 || bind(fd, (struct sockaddr *)&a, sizeof(a)) != 0 || listen(fd, 1024) != 0 ||
+        getsockname(fd, (struct sockaddr *)&a, &len) != 0)
+        return -1;
+    *port = ntohs(a.sin_port);
+    return fd;
+}
+static int connectloopback(int port) {
+    struct sockaddr_in a;
+    memset(&a, 0, sizeof(a));
+    a.sin_family = AF_INET;
+    a.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    a.sin_port = htons(port);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&a, sizeof(a)) != 0) return -1;
+    nodelay(fd);
+    return fd;
+}
+]]
+
+local terra now() : double
+    var ts : C.timespec
+    C.clock_gettime(C.CLOCK_MONOTONIC, &ts)
+    return ts.tv_sec + ts.tv_nsec * 1e-9
+end
+
+-- a client sends ROUNDS messages, each after the previous echo
+terra client(arg : &opaque) : &opaque
+    var fd = C.connectloopback([int64](arg))
+    if fd < 0 then return nil end
+    var buf : int8[MESSAGE]
+    for i = 0, MESSAGE do buf[i] = i end
+    for r = 0, ROUNDS do
+        C.write(fd, &buf[0], MESSAGE)
+        var got = 0
+        while got < MESSAGE do
+            var n = C.read(fd, &buf[got], MESSAGE - got)
+            if n <= 0 then return nil end
+            got = got + n
+        end
+    end
+    C.close(fd)
+    return nil
+end
+
+-- a connection reads a message, writes it back, and reads the next one
+struct Connection {
+    ring : &aio.Ring;
+    fixed : bool;
+    finished : &int;
+    fd : int;
+    buf : &int8;
+    pending : int64;
+    written : int64;
+}
+
+struct Server {
+    ring : aio.Ring;
+    listenfd : int;
+    fixed : bool;
+    accepted : int;
+    finished : int;
+    connections : &Connection;
+    buffers : &int8;
+}
+
+local terra onevent :: {&opaque, int64} -> {}
+
+terra Connection:issue()
+    if self.pending == 0 then
+        if self.fixed then
+            self.ring:readfixed(self.fd, self.buf, BUFFER, -1, 0, onevent, self)
+        else
+            self.ring:read(self.fd, self.buf, BUFFER, -1, onevent, self)
+        end
+    else
+        var p, n = self.buf + self.written, self.pending - self.written
+        if self.fixed then
+            self.ring:writefixed(self.fd, p, n, -1, 0, onevent, self)
+        else
+            self.ring:write(self.fd, p, n, -1, onevent, self)
+        end
+    end
+end
+
+terra onevent(data : &opaque, result : int64)
+    var c = [&Connection](data)
+    if result <= 0 and (c.pending == 0 or result < 0) then
+        C.close(c.fd)
+        @c.finished = @c.finished + 1
+        return
+    end
+    if c.pending == 0 then
+        c.pending, c.written = result, 0
+    else
+        c.written = c.written + result
+        if c.written == c.pending then c.pending = 0 end
+    end
+    c:issue()
+end
+
+terra onaccept(data : &opaque, result : int64)
+    var s = [&Server](data)
+    if result < 0 then
+        s.finished = s.finished + 1 -- a client that will not be served
+    else
+        C.nodelay(result)
+        var c = &s.connections[s.accepted]
+        c.ring, c.fixed, c.finished = &s.ring, s.fixed, &s.finished
+        c.fd, c.buf, c.pending = result, s.buffers + s.accepted * BUFFER, 0
+        c:issue()
+    end
+    s.accepted = s.accepted + 1
+    if s.accepted < CONNECTIONS then s.ring:accept(s.listenfd, onaccept, s) end
+end
+
+-- the seconds taken, or -1 if the backend is not available
+terra serve(backend : int, fixed : bool) : double
+    var s : Server
+    if not s.ring:init(2 * CONNECTIONS, backend) then return -1 end
+    var port : int
+    s.listenfd = C.listenloopback(&port)
+    s.fixed, s.accepted, s.finished = fixed, 0, 0
+    s.connections = [&Connection](C.malloc(CONNECTIONS * sizeof(Connection)))
+    s.buffers = [&int8](C.malloc(CONNECTIONS * BUFFER))
+    var iov = aio.iovec { s.buffers, CONNECTIONS * BUFFER }
+    if fixed then s.ring:registerbuffers(&iov, 1) end
+
+    var begin = now()
+    var threads : C.pthread_t[CONNECTIONS]
+    for i = 0, CONNECTIONS do
+        C.pthread_create(&threads[i], nil, client, [&opaque]([int64](port)))
+    end
+    s.ring:accept(s.listenfd, onaccept, &s)
+    while s.finished < CONNECTIONS and s.ring:wait(1) >= 0 do end
+    for i = 0, CONNECTIONS do C.pthread_join(threads[i], nil) end
+    var elapsed = now() - begin
+
+    C.close(s.listenfd)
+    s.ring:destroy()
+    C.free(s.connections)
+    C.free(s.buffers)
+    return elapsed
+end
+
+local total = CONNECTIONS * ROUNDS
+print(("%d connections, %d round trips of %d bytes each"):format(CONNECTIONS, ROUNDS, MESSAGE))
+for _, v in ipairs { { "epoll", aio.EPOLL, false }, { "io_uring", aio.URING, false },
+                     { "io_uring fixed", aio.URING, true } } do
+    local seconds = serve(v[2], v[3])
+    if seconds < 0 then
+        print(("%-16s not available"):format(v[1]))
+    else
+        print(("%-16s %12.0f round trips/s"):format(v[1], total / seconds))
+    end
+end
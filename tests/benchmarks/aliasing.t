@@ -0,0 +1,68 @@
+-- Reports which kernels LLVM vectorizes, and how fast they run, without alias
+-- information, with noalias parameters, and with strictaliasing type tags.
+
+local ffi = require("ffi")
+
+local N = 4096
+
+-- every variant gets its own functions, since setnoalias changes the definition
+local function kernels()
+    -- the scale factor and length are reread after every store unless LLVM knows
+    -- that float stores cannot change them
+    local terra scale(p : &float, s : &float, n : &int)
+        var i = 0
+        while i < @n do
+            p[i] = p[i] * @s
+            i = i + 1
+        end
+    end
+    -- the outputs may overlap the inputs unless the parameters are noalias
+    local terra triad(a : &float, b : &float, c : &float, s : float, n : int)
+        for i = 0, n do a[i] = b[i] + s * c[i] end
+    end
+    local terra run(iterations : int) : float
+        var a : float[N]
+        var b : float[N]
+        var c : float[N]
+        var s : float = 1.0001
+        var n = N
+        for i = 0, N do a[i], b[i], c[i] = 0, i, N - i end
+        for it = 0, iterations do
+            triad(a, b, c, 0.5, N)
+            scale(a, &s, &n)
+        end
+        return a[N / 2]
+    end
+    return { scale = scale, triad = triad, run = run }
+end
+
+local iterations = tonumber((...)) or 20000
+local function time(fn)
+    local best = math.huge
+    for i = 1, 3 do
+        local begin = terralib.currenttimeinseconds()
+        fn(iterations)
+        best = math.min(best, terralib.currenttimeinseconds() - begin)
+    end
+    return best
+end
+
+local function report(name, fns, profile)
+    local ir = terralib.saveobj(nil, "llvmir", { scale = fns.scale, triad = fns.triad },
+                                nil, nil, profile)
+    local function vectorized(fn)
+        local body = ir:match("define[^\n]*@" .. fn .. "%(.-\n}")
+        return body:find("<%d+ x float>") and "vectorized" or "scalar"
+    end
+    local cu = terralib.newcompilationunit(terralib.nativetarget, true, profile)
+    local run = ffi.cast("float (*)(int)", cu:jitvalue(fns.run))
+    print(("%-14s scale: %-10s triad: %-10s %.3f s"):format(
+        name, vectorized("scale"), vectorized("triad"), time(run)))
+end
+
+report("plain", kernels(), {})
+local restricted = kernels()
+restricted.scale:setnoalias()
+restricted.triad:setnoalias()
+report("noalias", restricted, {})
+report("strictaliasing", kernels(), { strictaliasing = true })
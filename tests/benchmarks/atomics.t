@@ -0,0 +1,126 @@
+-- Throughput of the primitives in lib/atomics.t with 1 to N threads: a shared
+-- atomic counter against a sharded counter, the two locks around a tiny critical
+-- section, the MPMC queue and the Treiber stack.
+
+local ffi = require("ffi")
+if ffi.os == "Windows" then
+    print("Not running atomics benchmark on Windows")
+    return
+end
+
+local atomics = require("atomics")
+
+local OPS = tonumber((...)) or 4000000
+local MAXTHREADS = tonumber(select(2, ...)) or 8
+
+local C = terralib.includecstring [[
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+]]
+
+local terra now() : double
+    var ts : C.timespec
+    C.clock_gettime(C.CLOCK_MONOTONIC, &ts)
+    return ts.tv_sec + ts.tv_nsec * 1e-9
+end
+
+local Queue, Stack = atomics.Queue(int64), atomics.Stack(int64)
+
+struct State {
+    counter : atomics.Atomic(int64);
+    pad : uint8[56];
+    sharded : atomics.ShardedCounter;
+    spin : atomics.SpinLock;
+    pad1 : uint8[60];
+    ticket : atomics.TicketLock;
+    pad2 : uint8[56];
+    protected : int64;
+    pad3 : uint8[56];
+    queue : Queue;
+    domain : atomics.EpochDomain;
+    stack : Stack;
+    ops : int64;
+}
+
+-- one benchmark: threads run body(state, participant) state.ops times between them
+local function kernel(body)
+    local s, p = symbol(&State, "s"), symbol(&atomics.Participant, "p")
+    local terra worker(arg : &opaque) : &opaque
+        var [s] = [&State](arg)
+        var [p] = s.domain:register()
+        for i = 0, s.ops do [body(s, p)] end
+        s.domain:unregister(p)
+        return nil
+    end
+    return terra(state : &State, nthreads : int) : double
+        var threads : C.pthread_t[MAXTHREADS]
+        var begin = now()
+        for t = 0, nthreads do C.pthread_create(&threads[t], nil, worker, state) end
+        for t = 0, nthreads do C.pthread_join(threads[t], nil) end
+        return now() - begin
+    end
+end
+
+local benchmarks = terralib.newlist {
+    { "atomic counter", kernel(function(s) return quote s.counter:fetchadd(1, "monotonic") end end) },
+    { "sharded counter", kernel(function(s) return quote s.sharded:add(1) end end) },
+    { "spin lock", kernel(function(s)
+        return quote s.spin:lock() s.protected = s.protected + 1 s.spin:unlock() end
+    end) },
+    { "ticket lock", kernel(function(s)
+        return quote s.ticket:lock() s.protected = s.protected + 1 s.ticket:unlock() end
+    end) },
+    { "queue push+pop", kernel(function(s)
+        return quote
+            while not s.queue:push(1) do atomics.pause() end
+            var v : int64
+            while not s.queue:pop(&v) do atomics.pause() end
+        end
+    end) },
+    { "stack push+pop", kernel(function(s, p)
+        return quote
+            s.stack:push(1)
+            var v : int64
+            s.stack:pop(p, &v)
+        end
+    end) },
+}
+
+local terra newstate() : &State
+    var s = [&State](C.calloc(1, sizeof(State)))
+    s.sharded:init()
+    s.spin:init()
+    s.ticket:init()
+    s.queue:init(1024)
+    s.domain:init()
+    s.stack:init(&s.domain)
+    return s
+end
+
+local terra freestate(s : &State)
+    s.queue:destroy()
+    s.stack:destroy()
+    C.free(s)
+end
+
+io.write(("%-18s"):format("threads"))
+local counts = {}
+local n = 1
+while n <= MAXTHREADS do
+    table.insert(counts, n)
+    io.write(("%12d"):format(n))
+    n = n * 2
+end
+print("   (Mops/s)")
+for _, b in ipairs(benchmarks) do
+    io.write(("%-18s"):format(b[1]))
+    for _, nthreads in ipairs(counts) do
+        local state = newstate()
+        state.ops = OPS / nthreads
+        local seconds = b[2](state, nthreads)
+        freestate(state)
+        io.write(("%12.1f"):format(OPS / seconds / 1e6))
+    end
+    print()
+end
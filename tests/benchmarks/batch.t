@@ -0,0 +1,36 @@
+-- Per-element cost of running a small Terra kernel over an array from Lua: one
+-- call per element, an entry point per element, one batched call, and a batched
+-- call split between threads.
+
+local entrypoint = require("entrypoint")
+
+local N = tonumber((...)) or 10000000
+local threads = tonumber((select(2, ...))) or 4
+
+terra saxpy(a : float, x : float, y : float) return a * x + y end
+
+local xs, ys, out = terralib.new(float[N]), terralib.new(float[N]), terralib.new(float[N])
+for i = 0, N - 1 do xs[i], ys[i] = i % 100, 1 end
+
+local function time(name, loop)
+    local best = math.huge
+    for i = 1, 3 do
+        local begin = terralib.currenttimeinseconds()
+        loop()
+        best = math.min(best, terralib.currenttimeinseconds() - begin)
+    end
+    print(("%-22s %7.3f ns/element"):format(name, best / N * 1e9))
+end
+
+time("__call per element", function()
+    for i = 0, N - 1 do out[i] = saxpy(2, xs[i], ys[i]) end
+end)
+local fast = entrypoint(saxpy)
+time("entry point", function()
+    for i = 0, N - 1 do out[i] = fast(2, xs[i], ys[i]) end
+end)
+local batched = saxpy:batch { uniform = { 1 } }
+time("batch", function() batched(N, out, 2, xs, ys) end)
+local threaded = saxpy:batch { uniform = { 1 }, threads = threads }
+time(("batch, %d threads"):format(threads), function() threaded(N, out, 2, xs, ys) end)
+assert(out[N - 1] == 2 * ((N - 1) % 100) + 1)
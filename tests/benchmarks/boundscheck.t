@@ -0,0 +1,61 @@
+-- Compares a stencil over arrays and std.Vector compiled without bounds checks,
+-- with checks, and with checks disabled again, to show that disabled checks cost
+-- nothing and enabled ones are mostly hoisted.
+
+local ffi = require("ffi")
+local std = require("std")
+
+local N = 1024
+local DV = std.Vector(double)
+
+terra stencil(a : &double[N], b : &double[N], iterations : int)
+    for it = 0, iterations do
+        for i = 1, N - 1 do
+            (@b)[i] = ((@a)[i - 1] + (@a)[i] + (@a)[i + 1]) / 3
+        end
+        a, b = b, a
+    end
+end
+
+terra vectorsum(v : &DV, iterations : int)
+    var s = 0.0
+    for it = 0, iterations do
+        for i = 0ULL, v:size() do s = s + v(i) end
+    end
+    return s
+end
+
+terra run(iterations : int)
+    var a : double[N]
+    var b : double[N]
+    var v : DV
+    v:init()
+    for i = 0, N do a[i], b[i] = i, 0; v:insert(i) end
+    stencil(&a, &b, iterations)
+    var r = a[N / 2] + vectorsum(&v, iterations)
+    v:destruct()
+    return r
+end
+
+local function compile(profile)
+    local cu = terralib.newcompilationunit(terralib.nativetarget, true, profile)
+    local fn = ffi.cast("double (*)(int)", cu:jitvalue(run))
+    return fn
+end
+
+local iterations = tonumber((...)) or 20000
+local function time(fn)
+    local best = math.huge
+    for i = 1, 3 do
+        local begin = terralib.currenttimeinseconds()
+        fn(iterations)
+        best = math.min(best, terralib.currenttimeinseconds() - begin)
+    end
+    return best
+end
+
+local unchecked = time(compile({ fastmath = false }))
+local checked = time(compile({ fastmath = false, boundscheck = true }))
+local disabled = time(compile({ fastmath = false, boundscheck = false }))
+print(("unchecked %.3f s, checked %.3f s (%.2fx), disabled %.3f s (%.2fx)"):format(
+    unchecked, checked, checked / unchecked, disabled, disabled / unchecked))
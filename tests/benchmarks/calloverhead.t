@@ -0,0 +1,62 @@
+-- Measures the cost of calling small Terra functions from Lua: through a raw
+-- FFI function pointer, through the function's __call (fn(...)), and through an
+-- entry point from require("entrypoint").
+
+local ffi = require("ffi")
+local entrypoint = require("entrypoint")
+
+local N = tonumber((...)) or 10000000
+
+struct vec3 { x : double, y : double, z : double }
+
+terra add(a : int, b : int) return a + b end
+terra addvec(a : vec3, b : vec3) : vec3
+    return vec3 { a.x + b.x, a.y + b.y, a.z + b.z }
+end
+
+local function time(name, loop)
+    local best = math.huge
+    for i = 1, 3 do
+        local begin = terralib.currenttimeinseconds()
+        loop()
+        best = math.min(best, terralib.currenttimeinseconds() - begin)
+    end
+    print(("%-24s %6.2f ns/call"):format(name, best / N * 1e9))
+end
+
+local rawadd = ffi.cast("int (*)(int, int)", add:getpointer())
+local fastadd = entrypoint(add)
+time("add, ffi pointer", function()
+    local s = 0
+    for i = 1, N do s = rawadd(s, 1) end
+    assert(s == N)
+end)
+time("add, __call", function()
+    local s = 0
+    for i = 1, N do s = add(s, 1) end
+    assert(s == N)
+end)
+time("add, entry point", function()
+    local s = 0
+    for i = 1, N do s = fastadd(s, 1) end
+    assert(s == N)
+end)
+
+local one = terralib.new(vec3, { 1, 1, 1 })
+local rawaddvec = addvec:getpointer()
+local fastaddvec = entrypoint(addvec)
+time("addvec, ffi pointer", function()
+    local v = terralib.new(vec3)
+    for i = 1, N do v = rawaddvec(v, one) end
+    assert(v.x == N)
+end)
+time("addvec, __call", function()
+    local v = terralib.new(vec3)
+    for i = 1, N do v = addvec(v, one) end
+    assert(v.x == N)
+end)
+time("addvec, entry point", function()
+    local v = terralib.new(vec3)
+    for i = 1, N do fastaddvec(v, v, one) end
+    assert(v.x == N)
+end)
@@ -0,0 +1,159 @@
+-- An echo server over epoll written twice: with a coroutine per connection on
+-- the scheduler in lib/async.t, and as a hand-written state machine with a
+-- callback per event. Client threads send small messages over socket pairs and
+-- wait for each echo; the result is round trips per second.
+
+local ffi = require("ffi")
+if ffi.os ~= "Linux" or terralib.llvm_version < 170 then
+    print("Not running echo server benchmark, it needs Linux and LLVM 17 or later")
+    return
+end
+
+local async = require("async")
+
+local CONNECTIONS = tonumber((...)) or 64
+local ROUNDS = tonumber(select(2, ...)) or 20000
+local MESSAGE = 64
+
+local C = terralib.includecstring [[
+#include <pthread.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+static int watchonce(int epfd, int fd, unsigned events, void *data) {
+    struct epoll_event ev;
+    ev.events = events | EPOLLONESHOT;
+    ev.data.ptr = data;
+    if (epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev) == 0) return 0;
+    return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+static int pollready(int epfd, void **ready, int max) {
+    struct epoll_event ev[64];
+    int n = epoll_wait(epfd, ev, max < 64 ? max : 64, -1);
+    for (int i = 0; i < n; i++) ready[i] = ev[i].data.ptr;
+    return n < 0 ? 0 : n;
+}
+static int wouldblock(void) { return errno == EAGAIN || errno == EWOULDBLOCK; }
+]]
+
+local terra now() : double
+    var ts : C.timespec
+    C.clock_gettime(C.CLOCK_MONOTONIC, &ts)
+    return ts.tv_sec + ts.tv_nsec * 1e-9
+end
+
+-- a client sends ROUNDS messages on a blocking socket, each after the previous echo
+terra client(arg : &opaque) : &opaque
+    var fd = [int64](arg)
+    var buf : int8[MESSAGE]
+    for i = 0, MESSAGE do buf[i] = i end
+    for r = 0, ROUNDS do
+        C.write(fd, &buf[0], MESSAGE)
+        var got = 0
+        while got < MESSAGE do
+            var n = C.read(fd, &buf[got], MESSAGE - got)
+            if n <= 0 then return nil end
+            got = got + n
+        end
+    end
+    C.close(fd)
+    return nil
+end
+
+-- start the clients and hand the server ends of their socket pairs to serve
+local function benchmark(serve)
+    return terra() : double
+        var threads : C.pthread_t[CONNECTIONS]
+        var fds : int[CONNECTIONS]
+        var begin = now()
+        for i = 0, CONNECTIONS do
+            var pair : int[2]
+            C.socketpair(C.AF_UNIX, C.SOCK_STREAM, 0, &pair[0])
+            async.setnonblocking(pair[0])
+            fds[i] = pair[0]
+            C.pthread_create(&threads[i], nil, client, [&opaque]([int64](pair[1])))
+        end
+        serve(&fds[0])
+        for i = 0, CONNECTIONS do C.pthread_join(threads[i], nil) end
+        return now() - begin
+    end
+end
+
+terra echo(s : &async.Scheduler, fd : int)
+    var buf : int8[4096]
+    while true do
+        var n = async.read(s, fd, &buf[0], 4096)
+        if n <= 0 or async.write(s, fd, &buf[0], n) < 0 then break end
+    end
+    async.close(fd)
+end
+local startecho = terralib.coroutine(echo)
+
+local coroutines = benchmark(terra(fds : &int)
+    var s : async.Scheduler
+    s:init()
+    for i = 0, CONNECTIONS do s:spawn(startecho(&s, fds[i])) end
+    s:run()
+    s:destroy()
+end)
+
+-- the same server as a state machine: a connection is reading, or writing
+-- back what it read
+struct Connection {
+    fd : int;
+    pending : int64;
+    written : int64;
+    buf : int8[4096];
+}
+
+-- handle an event on the connection; false once it is closed
+terra Connection:ready(epfd : int) : bool
+    while true do
+        if self.pending == 0 then
+            var n = C.read(self.fd, &self.buf[0], 4096)
+            if n < 0 and C.wouldblock() ~= 0 then
+                return C.watchonce(epfd, self.fd, C.EPOLLIN, self) == 0
+            end
+            if n <= 0 then break end
+            self.pending, self.written = n, 0
+        else
+            var n = C.write(self.fd, &self.buf[self.written], self.pending - self.written)
+            if n < 0 and C.wouldblock() ~= 0 then
+                return C.watchonce(epfd, self.fd, C.EPOLLOUT, self) == 0
+            end
+            if n < 0 then break end
+            self.written = self.written + n
+            if self.written == self.pending then self.pending = 0 end
+        end
+    end
+    C.close(self.fd)
+    return false
+end
+
+local callbacks = benchmark(terra(fds : &int)
+    var epfd = C.epoll_create1(0)
+    var connections = [&Connection](C.malloc(CONNECTIONS * sizeof(Connection)))
+    var live = 0
+    for i = 0, CONNECTIONS do
+        var c = &connections[i]
+        c.fd, c.pending = fds[i], 0
+        if c:ready(epfd) then live = live + 1 end
+    end
+    var events : (&opaque)[64]
+    while live > 0 do
+        var n = C.pollready(epfd, &events[0], 64)
+        for i = 0, n do
+            if not [&Connection](events[i]):ready(epfd) then live = live - 1 end
+        end
+    end
+    C.free(connections)
+    C.close(epfd)
+end)
+
+local total = CONNECTIONS * ROUNDS
+print(("%d connections, %d round trips each"):format(CONNECTIONS, ROUNDS))
+print(("%-12s %12.0f round trips/s"):format("coroutines", total / coroutines()))
+print(("%-12s %12.0f round trips/s"):format("callbacks", total / callbacks()))
@@ -0,0 +1,42 @@
+-- Measures terralib.loadfile throughput in MB/s on a large generated Terra file.
+-- Mixes Terra definitions, long identifiers and long strings so both the
+-- lexer's name and long-string paths are exercised.
+
+local nfunctions = tonumber(arg and arg[1]) or 10000
+local niterations = 5
+
+local filename = os.tmpname()
+local f = assert(io.open(filename, "w"))
+f:write("#!/usr/bin/env terra\n")
+for i = 1, nfunctions do
+    f:write(([==[
+local documentation_for_function_number_%d = [[
+    computes a weighted sum over the first n elements of an array
+]]
+terra function_number_%d(first_argument : int, array_of_values : &double, n : int) : double
+    var accumulated_result : double = 0.0
+    for index = 0, n do
+        accumulated_result = accumulated_result + array_of_values[index] * first_argument
+    end
+    return accumulated_result
+end
+]==]):format(i, i))
+end
+f:close()
+
+local f = assert(io.open(filename, "r"))
+local size = #f:read("*a")
+f:close()
+
+local best = math.huge
+for i = 1, niterations do
+    collectgarbage("collect")
+    local begin = terralib.currenttimeinseconds()
+    local chunk = assert(terralib.loadfile(filename))
+    best = math.min(best, terralib.currenttimeinseconds() - begin)
+    chunk = nil
+end
+os.remove(filename)
+
+print(("loaded %.2f MB in %.3f s: %.2f MB/s"):format(size / 2 ^ 20, best,
+    size / 2 ^ 20 / best))
@@ -0,0 +1,79 @@
+-- Table-driven kernels, CRC-32 and an AES S-box substitution, with their tables
+-- as constants and as mutable globals, plus the IR LLVM sees for each table.
+
+local N = tonumber((...)) or 16 * 1024 * 1024
+
+local crctable = terralib.newlist()
+for i = 0, 255 do
+    local c = i
+    for k = 1, 8 do
+        c = (c % 2 == 1) and bit.bxor(0xedb88320, bit.rshift(c, 1)) or bit.rshift(c, 1)
+    end
+    crctable:insert(c % 2^32)
+end
+
+-- the AES S-box, computed from the multiplicative inverse in GF(2^8)
+local sbox = terralib.newlist()
+do
+    local function mul(a, b)
+        local r = 0
+        for i = 1, 8 do
+            if b % 2 == 1 then r = bit.bxor(r, a) end
+            a = a * 2
+            if a >= 256 then a = bit.bxor(a, 0x11b) end
+            b = bit.rshift(b, 1)
+        end
+        return r
+    end
+    local function rotl(x, s) return bit.band(bit.bor(bit.lshift(x, s), bit.rshift(x, 8 - s)), 0xff) end
+    for i = 0, 255 do
+        local inv = 0
+        for j = 1, 255 do if mul(i, j) == 1 then inv = j end end
+        sbox:insert(bit.bxor(inv, rotl(inv, 1), rotl(inv, 2), rotl(inv, 3), rotl(inv, 4), 0x63))
+    end
+end
+assert(sbox[1] == 0x63 and sbox[2] == 0x7c and sbox[256] == 0x16)
+
+local function kernels(crc, box)
+    local terra crc32(data : &uint8, n : int64) : uint32
+        var c : uint32 = 0xffffffff
+        for i = 0, n do c = crc[(c ^ data[i]) and 0xff] ^ (c >> 8) end
+        return c ^ 0xffffffff
+    end
+    local terra subbytes(data : &uint8, n : int64)
+        for i = 0, n do data[i] = box[data[i]] end
+    end
+    return crc32, subbytes
+end
+
+local variants = {
+    { "constant", kernels(terralib.constant(terralib.new(uint32[256], crctable)),
+                          terralib.constant(terralib.new(uint8[256], sbox))) },
+    { "global", kernels(global(uint32[256], `arrayof(uint32, [crctable])),
+                        global(uint8[256], `arrayof(uint8, [sbox]))) },
+}
+
+local data, scratch = terralib.new(uint8[N]), terralib.new(uint8[N])
+for i = 0, N - 1 do data[i] = i * 7 % 251 end
+
+local function time(fn)
+    local best = math.huge
+    for i = 1, 3 do
+        local begin = terralib.currenttimeinseconds()
+        fn()
+        best = math.min(best, terralib.currenttimeinseconds() - begin)
+    end
+    return best
+end
+
+local results = {}
+for _, v in ipairs(variants) do
+    local name, crc32, subbytes = v[1], v[2], v[3]
+    local ir = terralib.saveobj(nil, "llvmir", { crc32 = crc32 })
+    local tabletype = ir:match("= [%w_ ]*constant (%b[])") or ir:match("= [%w_ ]*global (%b[])") or "?"
+    local tcrc = time(function() results[name] = crc32(data, N) end)
+    local tsub = time(function() subbytes(scratch, N) end)
+    print(("%-9s table %-12s crc32 %6.1f MB/s   subbytes %6.1f MB/s"):format(
+        name, tabletype, N / tcrc / 1e6, N / tsub / 1e6))
+end
+assert(results.constant == results.global)
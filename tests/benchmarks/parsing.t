@@ -0,0 +1,44 @@
+-- Measures front-end throughput: how fast terralib.loadstring can lex and parse a large
+-- generated file made mostly of Terra definitions. This covers building each tree in the
+-- parser's arena and converting it to Lua tables. Nothing is typechecked or compiled.
+
+local nfunctions = tonumber(arg and arg[1]) or 5000
+local niterations = 5
+
+local function generate(n)
+    local lines = terralib.newlist()
+    lines:insert("local C = {}")
+    for i = 1, n do
+        lines:insert(([[
+terra f%d(a : int, b : &double, n : int) : double
+    var s : double = 0.0
+    for i = 0, n do
+        if a > i then
+            s = s + b[i] * [double](a)
+        else
+            s = s - b[i] / 2.0
+        end
+    end
+    return s
+end
+C.f%d = f%d]]):format(i, i, i))
+    end
+    lines:insert("return C")
+    return lines:concat("\n")
+end
+
+local src = generate(nfunctions)
+local nlines = select(2, src:gsub("\n", "\n")) + 1
+
+local best = math.huge
+for i = 1, niterations do
+    collectgarbage("collect")
+    local begin = terralib.currenttimeinseconds()
+    local chunk = assert(terralib.loadstring(src, "parsing"))
+    local elapsed = terralib.currenttimeinseconds() - begin
+    best = math.min(best, elapsed)
+    chunk = nil
+end
+
+print(("parsed %d lines (%.2f MB) in %.3f s: %.0f lines/s, %.2f MB/s"):format(
+    nlines, #src / 2 ^ 20, best, nlines / best, #src / 2 ^ 20 / best))
@@ -0,0 +1,41 @@
+-- Compares tests/benchmark_fannkuchredux.t built with plain -O3 against a build
+-- optimized with a profile from a training run. Needs LLVM 17+, clang as the
+-- linker (CC=clang) and llvm-profdata on the PATH.
+
+local N = tonumber((...)) or 11
+local here = debug.getinfo(1, "S").source:match("^@(.*[/\\])") or "./"
+
+-- reuse the benchmark's kernels, but not its driver code at the bottom
+local f = assert(io.open(here .. "../benchmark_fannkuchredux.t"))
+local src = f:read("*a"):match("^(.*)local test = require")
+f:close()
+local main = assert(terralib.loadstring(src .. "return main", "benchmark_fannkuchredux"))()
+
+local function run(exe, n)
+    local begin = terralib.currenttimeinseconds()
+    assert(os.execute(("./%s %d > /dev/null"):format(exe, n)) == 0)
+    return terralib.currenttimeinseconds() - begin
+end
+local function best(exe)
+    local t = math.huge
+    for i = 1, 3 do t = math.min(t, run(exe, N)) end
+    return t
+end
+
+terralib.saveobj("fannkuch_o3", { main = main })
+
+terralib.saveobj("fannkuch_train", { main = main }, nil, nil,
+                 { pgo = "generate", profilefile = "fannkuch.profraw" })
+run("fannkuch_train", N - 1)
+assert(os.execute("llvm-profdata merge -o fannkuch.profdata fannkuch.profraw") == 0)
+
+terralib.saveobj("fannkuch_pgo", { main = main }, nil, nil,
+                 { pgo = "use", profilefile = "fannkuch.profdata" })
+
+local o3, pgo = best("fannkuch_o3"), best("fannkuch_pgo")
+print(("fannkuch(%d): -O3 %.3f s, PGO %.3f s, speedup %.2fx"):format(N, o3, pgo, o3 / pgo))
+
+for _, file in ipairs { "fannkuch_o3", "fannkuch_train", "fannkuch_pgo",
+                        "fannkuch.profraw", "fannkuch.profdata" } do
+    os.remove(file)
+end
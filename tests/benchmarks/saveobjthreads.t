@@ -0,0 +1,24 @@
+-- Measures the time saveobj spends generating code for a large shared library
+-- with 1, 2, 4 and 8 threads.
+
+local nfunctions = tonumber((...)) or 4000
+
+local exports = {}
+for i = 1, nfunctions do
+    exports["kernel" .. i] = terra(a : &double, n : int) : double
+        var s : double = 0
+        for j = 0, n do
+            s = s + a[j] * [i] / (a[(j + [i]) % n] + 1)
+        end
+        return s
+    end
+end
+
+local single
+for _, threads in ipairs { 1, 2, 4, 8 } do
+    local _, stats = terralib.saveobj("saveobjthreads.so", exports, nil, nil, { threads = threads })
+    single = single or stats.codegen
+    print(("%d threads: optimize %.2f s, codegen %.2f s (%.2fx), link %.2f s"):format(
+        threads, stats.optimize, stats.codegen, single / stats.codegen, stats.link))
+end
+os.remove("saveobjthreads.so")
@@ -0,0 +1,81 @@
+-- Cost of a per-thread counter: a thread-local global, JIT-compiled and in a saved
+-- executable with each TLS model, against pthread_getspecific on every access.
+
+local ffi = require("ffi")
+if ffi.os == "Windows" then
+    print("Not running thread-local benchmark on Windows")
+    return
+end
+
+local N = tonumber((...)) or 100000000
+
+local C = terralib.includecstring [[
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+]]
+
+local terra now() : double
+    var ts : C.timespec
+    C.clock_gettime(C.CLOCK_MONOTONIC, &ts)
+    return ts.tv_sec + ts.tv_nsec * 1e-9
+end
+
+local function kernels(model)
+    local counter = global(int64, 0):setthreadlocal(model)
+    -- opaque calls keep the loop from being folded into a single addition
+    local terra tick(i : int64) : int64
+        counter = counter + (i and 3)
+        return counter
+    end
+    tick:setinlined(false)
+    local terra loop(n : int64) : int64
+        for i = 0, n do tick(i) end
+        return counter
+    end
+    return loop
+end
+
+local key = global(C.pthread_key_t)
+local terra tickspecific(i : int64) : int64
+    var p = [&int64](C.pthread_getspecific(key))
+    @p = @p + (i and 3)
+    return @p
+end
+tickspecific:setinlined(false)
+local terra loopspecific(n : int64) : int64
+    var value : int64 = 0
+    C.pthread_key_create(&key, nil)
+    C.pthread_setspecific(key, &value)
+    for i = 0, n do tickspecific(i) end
+    return value
+end
+
+local function time(name, fn)
+    local begin = now()
+    local r = fn(N)
+    print(("%-28s %6.2f ns/access"):format(name, (now() - begin) / N * 1e9))
+    return r
+end
+
+local expected = time("pthread_getspecific (JIT)", loopspecific)
+assert(time("thread-local global (JIT)", kernels("general")) == expected)
+
+-- native TLS in saved executables
+for _, model in ipairs { "general", "initial-exec", "local-exec" } do
+    local loop = kernels(model)
+    local terra main(argc : int, argv : &rawstring)
+        var n = C.atoll(argv[1])
+        var begin = now()
+        var r = loop(n)
+        C.printf("%.2f %lld\n", (now() - begin) / n * 1e9, r)
+    end
+    terralib.saveobj("threadlocalbench", { main = main })
+    local f = io.popen("./threadlocalbench " .. N)
+    local ns, r = f:read("*n", "*n")
+    f:close()
+    assert(r == expected)
+    print(("%-28s %6.2f ns/access"):format("thread-local global (" .. model .. ")", ns))
+end
+os.remove("threadlocalbench")
@@ -0,0 +1,108 @@
+-- Throughput of lib/vecmath.t against the C library: each function applied to an
+-- array by a loop calling the C function, by the same loop once vecmath is
+-- registered so that the loop vectorizer calls its vector variants, and by a loop
+-- over explicit vectors of 4 doubles or 8 floats. Each line ends with the largest
+-- error of vecmath against the C library over the arguments, in ULPs.
+
+local ffi = require("ffi")
+local vecmath = require("vecmath")
+local C = terralib.includecstring [[
+#include <math.h>
+#include <stdlib.h>
+]]
+
+local N = 4096
+local iterations = tonumber((...)) or 1000
+
+-- the arguments of each function, y only for pow
+local ranges = {
+    exp = { -20, 20 }, log = { 1e-3, 1e3 }, sin = { -100, 100 }, cos = { -100, 100 },
+    pow = { 0.1, 10 }, tanh = { -5, 5 }, erf = { -4, 4 },
+}
+local order = { "exp", "log", "sin", "cos", "pow", "tanh", "erf" }
+
+vecmath.register()
+
+local function time(fn, ...)
+    local best = math.huge
+    for i = 1, 3 do
+        local begin = terralib.currenttimeinseconds()
+        fn(...)
+        best = math.min(best, terralib.currenttimeinseconds() - begin)
+    end
+    return N * iterations / best / 1e6
+end
+
+local function benchmark(E, name)
+    local W = E == double and 4 or 8
+    local V = vector(E, W)
+    local scalar = C[E == float and name .. "f" or name]
+    local vectorfn, reference = vecmath.generate(name, V), C[name]
+    local binary = name == "pow"
+
+    terra libm(xs : &E, ys : &E, out : &E, iterations : int)
+        for it = 0, iterations do
+            for i = 0, N do
+                out[i] = [binary and `scalar(xs[i], ys[i]) or `scalar(xs[i])]
+            end
+        end
+    end
+    terra explicit(xs : &E, ys : &E, out : &E, iterations : int)
+        for it = 0, iterations do
+            for i = 0, N, W do
+                var x = @[&V](xs + i)
+                @[&V](out + i) = [binary and `vectorfn(x, @[&V](ys + i)) or `vectorfn(x)]
+            end
+        end
+    end
+    -- the largest error of out against the C library in double precision, compiled
+    -- without the variants
+    terra maxulp(xs : &E, ys : &E, out : &E) : double
+        var worst = 0.0
+        for i = 0, N do
+            var want = [E]([binary and `reference(xs[i], ys[i]) or `reference(xs[i])])
+            var w : double = C.fabs(want)
+            var ulp = [E == double and `C.nextafter(w, [math.huge]) - w
+                                    or `C.nextafterf([float](w), [math.huge]) - w]
+            var err = C.fabs(out[i] - want) / ulp
+            if err > worst then worst = err end
+        end
+        return worst
+    end
+    -- arguments in 64-byte aligned arrays
+    terra arrays(lo : double, hi : double) : &E
+        var block = [&E](C.malloc(3 * N * sizeof(E) + 64))
+        var a = [&E](([intptr](block) + 63) and not 63)
+        for i = 0, N do
+            a[i] = [E](lo + (hi - lo) * C.rand() / [double](C.RAND_MAX))
+            a[N + i] = [E](-4 + 8.0 * C.rand() / [double](C.RAND_MAX))
+        end
+        return a
+    end
+
+    local T = tostring(E)
+    local function compile(fn, profile, signature)
+        local cu = terralib.newcompilationunit(terralib.nativetarget, true, profile)
+        return ffi.cast(signature or ("void (*)(%s*, %s*, %s*, int)"):format(T, T, T), cu:jitvalue(fn))
+    end
+    local a = arrays(ranges[name][1], ranges[name][2])
+    local xs, ys, out = a, a + N, a + 2 * N
+    -- unvectorized, loops call the C library; vectorized, they call the variants
+    local scalarprofile = { fastmath = false, vectorize = false }
+    local rates = {
+        time(compile(libm, scalarprofile), xs, ys, out, iterations),
+        time(compile(libm, { fastmath = false }), xs, ys, out, iterations),
+        time(compile(explicit, { fastmath = false }), xs, ys, out, iterations),
+    }
+    local errors = compile(maxulp, scalarprofile, ("double (*)(%s*, %s*, %s*)"):format(T, T, T))
+    return rates, errors(xs, ys, out)
+end
+
+print(("%-12s %12s %12s %12s %8s"):format("", "libm", "variants", "vectors", "max ulp"))
+for _, E in ipairs { double, float } do
+    for _, name in ipairs(order) do
+        local rates, ulps = benchmark(E, name)
+        print(("%-12s %8.1f M/s %8.1f M/s %8.1f M/s %8.2f"):format(
+            ("%s %s"):format(name, tostring(E)), rates[1], rates[2], rates[3], ulps))
+    end
+end
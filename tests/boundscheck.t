@@ -0,0 +1,50 @@
+local ffi = require("ffi")
+local std = require("std")
+
+terra get(a : &int[10], i : int) return (@a)[i] end
+terra sum(a : &int[10])
+    var s = 0
+    for i = 0, 10 do s = s + (@a)[i] end
+    return s
+end
+local IV = std.Vector(int)
+terra vecget(v : &IV, i : uint64) return @v:get(i) end
+terra custom(p : &int, n : int, i : int) return p[terralib.boundscheck(i, n)] end
+-- a zero-length trailing array indexes past its static extent, like C's flexible arrays
+struct Packet { n : int, data : int[0] }
+terra flexget(p : &Packet, i : int) return p.data[i] end
+
+local function ir(fn, profile)
+    return terralib.saveobj(nil, "llvmir", { fn = fn }, nil, nil, profile)
+end
+
+-- checks are only emitted when the profile asks for them
+for _, fn in ipairs { get, vecget, custom } do
+    assert(not ir(fn, {}):find("llvm.trap", 1, true))
+    assert(ir(fn, { boundscheck = true }):find("llvm.trap", 1, true))
+end
+assert(not ir(flexget, { boundscheck = true }):find("llvm.trap", 1, true))
+-- provably in-range accesses lose their checks after optimization
+assert(not ir(sum, { boundscheck = true }):find("llvm.trap", 1, true))
+
+-- the same code runs unchecked in the default JIT profile
+terra outofrange()
+    var a : int[10]
+    for i = 0, 10 do a[i] = i end
+    return get(&a, 3)
+end
+assert(outofrange() == 3)
+
+if ffi.os ~= "Windows" then
+    local C = terralib.includec("stdlib.h")
+    terra main(argc : int, argv : &rawstring)
+        var a : int[10]
+        for i = 0, 10 do a[i] = i end
+        var i = C.atoi(argv[1])
+        return terralib.select(get(&a, i) == i, 0, 1)
+    end
+    terralib.saveobj("boundscheck", { main = main }, nil, nil, { boundscheck = true })
+    assert(os.execute("./boundscheck 9") == 0)
+    assert(os.execute("./boundscheck 10 2> /dev/null") ~= 0)
+    os.remove("boundscheck")
+end
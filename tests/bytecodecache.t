@@ -0,0 +1,45 @@
+local ffi = require("ffi")
+if ffi.os == "Windows" then
+    print("Not running bytecode cache test on Windows")
+    return
+end
+
+local dir = os.tmpname()
+os.remove(dir)
+assert(os.execute("mkdir " .. dir) == 0)
+
+local function countentries()
+    local n = 0
+    local p = io.popen("ls " .. dir)
+    for _ in p:lines() do n = n + 1 end
+    p:close()
+    return n
+end
+
+local function writefile(name, contents)
+    local f = assert(io.open(name, "w"))
+    f:write(contents)
+    f:close()
+end
+
+local lua = dir .. "/pure.t"
+local mixed = dir .. "/mixed.t"
+writefile(lua, "local a = ... return (a or 0) + 1\n")
+writefile(mixed, "terra f() return 2 end return f()\n")
+
+terralib.bytecodecache = dir
+local before = countentries()
+
+-- pure Lua chunks are stored after the first load and reused afterwards
+assert(terralib.loadfile(lua)(1) == 2)
+assert(countentries() == before + 1)
+assert(terralib.loadfile(lua)(2) == 3)
+assert(countentries() == before + 1)
+
+-- chunks with Terra code are never cached
+assert(terralib.loadfile(mixed)() == 2)
+assert(terralib.loadfile(mixed)() == 2)
+assert(countentries() == before + 1)
+
+terralib.bytecodecache = nil
+os.execute("rm -r " .. dir)
@@ -0,0 +1,96 @@
+local ffi = require 'ffi'
+-- two Terra states attached to one compilation service, on two threads, should
+-- compile a function once and share the code, while functions with mutable
+-- globals stay in each state's own JIT
+if ffi.os == "Windows" then
+    print("Not running compilation service test on Windows")
+    return
+end
+
+terralib.includepath = terralib.includepath .. ";" .. terralib.terrahome .. "/include/terra"
+C = terralib.includecstring [[
+#include <pthread.h>
+#include <stdio.h>
+#include "terra.h"
+]]
+
+local libpath = terralib.terrahome.."/lib"
+
+terra doerror(L : &C.lua_State)
+    C.printf("%s\n",C.luaL_checklstring(L,-1,nil))
+    return 1
+end
+
+local thecode = [[
+terra add(a : int, b : int) return a + b end
+local counter = global(int, 0)
+terra bump() counter = counter + 1 return counter end
+assert(add(1, 2) == 3 and bump() == 1)
+-- a later caller uses the service's add instead of a copy of it
+terra addptr() return [&opaque](add) end
+assert(addptr() == terralib.cast(&opaque, add:getpointer()))
+-- code from the service is known to the state's debugging functions
+if terralib.lookupsymbol then
+    local si = terralib.new(terralib.SymbolInfo)
+    assert(terralib.lookupsymbol(add:getpointer(), si) and si.size > 0)
+end
+]]
+
+struct Worker {
+    S : &C.terra_CompilationService
+    result : int
+}
+
+terra work(arg : &opaque) : &opaque
+    var w = [&Worker](arg)
+    var L = C.luaL_newstate()
+    C.luaL_openlibs(L)
+    if C.terra_init(L) ~= 0 then
+        w.result = doerror(L)
+        return nil
+    end
+    C.terra_attachcompilationservice(L, w.S)
+    if C.terra_loadstring(L,thecode) ~= 0 or C.lua_pcall(L, 0, -1, 0) ~= 0 then
+        w.result = doerror(L)
+    else
+        w.result = 0
+    end
+    C.lua_close(L)
+    return nil
+end
+
+terra main(argc : int, argv : &rawstring)
+    var S = C.terra_newcompilationservice()
+    var workers : Worker[2]
+    var threads : C.pthread_t[2]
+    for i = 0, 2 do
+        workers[i] = Worker { S, 1 }
+        C.pthread_create(&threads[i], nil, work, &workers[i])
+    end
+    for i = 0, 2 do
+        C.pthread_join(threads[i], nil)
+    end
+    var ncompiled : C.size_t
+    var nreused : C.size_t
+    C.terra_compilationservicestats(S, &ncompiled, &nreused)
+    C.terra_freecompilationservice(S)
+    if workers[0].result ~= 0 or workers[1].result ~= 0 then return 1 end
+    -- add and addptr, each compiled by one state and reused by the other
+    if ncompiled ~= 2 or nreused ~= 2 then
+        C.printf("compiled %d, reused %d\n", [int](ncompiled), [int](nreused))
+        return 1
+    end
+    return 0
+end
+
+local libext = ffi.os == "OSX" and ".dylib" or ".so"
+local flags = terralib.newlist {"-Wl,-rpath,"..libpath,libpath.."/libterra"..libext,"-pthread"}
+local lua_lib = libpath.."/libluajit-5.1"..libext
+local f = io.open(lua_lib, "r")
+if f then
+    f:close()
+    flags:insert(lua_lib)
+end
+
+terralib.saveobj("compilationservice",{main = main},flags)
+assert(0 == os.execute("./compilationservice"))
@@ -0,0 +1,63 @@
+-- aggregate constants become typed constant globals that LLVM can fold
+
+struct Point { x : int8, y : double }
+struct Shape { name : rawstring, corners : Point[2], flags : vector(int, 4), closed : bool }
+
+local squares = terralib.newlist()
+for i = 0, 15 do squares:insert(i * i) end
+local squaretable = terralib.constant(terralib.new(uint32[16], squares))
+local shape = terralib.constant(terralib.new(Shape, {
+    corners = { { -1, 0.5 }, { 7, -2.25 } }, flags = terralib.new(vector(int, 4), 1, 2, 3, 4),
+    closed = true }))
+local lanes = terralib.constant(terralib.new(vector(float, 4), 1, 2, 3, 4))
+
+terra lookup(i : int) return squaretable[i] end
+terra fixed() return squaretable[5] + squaretable[6] end
+terra corner(i : int) return shape.corners[i].y end
+terra fields()
+    return shape.name == nil and shape.closed and shape.corners[0].x == -1 and shape.flags[3] == 4
+end
+terra copy() : Shape return shape end
+terra sum() : float
+    var v = lanes * lanes
+    return v[0] + v[1] + v[2] + v[3]
+end
+
+for i = 0, 15 do assert(lookup(i) == i * i) end
+assert(fixed() == 61)
+assert(corner(0) == 0.5 and corner(1) == -2.25)
+assert(fields())
+local s = copy()
+assert(s.corners[1].x == 7 and s.flags[2] == 3 and s.closed)
+assert(sum() == 30)
+
+local ir = terralib.saveobj(nil, "llvmir", { lookup = lookup, fixed = fixed, sum = sum })
+-- a typed table rather than a string of bytes
+assert(ir:find("private unnamed_addr constant %[16 x i32%] %[i32 0, i32 1, i32 4"))
+assert(not ir:find('c"\\00\\00\\00\\00\\01', 1, true))
+-- loads with constant indices fold away
+assert(ir:match("define[^\n]*@fixed%(.-\n}"):find("ret i32 61", 1, true))
+assert(ir:match("define[^\n]*@sum%(.-\n}"):find("ret float 3.000000e+01", 1, true))
+
+-- one global per constant, however often it is used
+local _, uses = ir:gsub("%[16 x i32%] %[i32 0", "")
+assert(uses == 1)
+
+-- constants still work in global initializers
+local g = global(Shape, shape)
+terra readg() return g.corners[1].y + g.flags[0] end
+assert(readg() == -1.25)
+
+-- floating-point elements keep their exact bits, including signaling NaN payloads
+local ffi = require("ffi")
+local floatbits = terralib.new(uint32[2], { 0x7fa00001, 0xffc00123 })
+local floats = terralib.new(float[2])
+ffi.copy(floats, floatbits, ffi.sizeof(floats))
+local doublebits = terralib.new(uint64[1], { 0x7ff0000000000001ULL })
+local doubles = terralib.new(double[1])
+ffi.copy(doubles, doublebits, ffi.sizeof(doubles))
+local nanfloats, nandoubles = terralib.constant(floats), terralib.constant(doubles)
+terra floatbitsat(i : int) : uint32 var f = nanfloats[i] return @[&uint32](&f) end
+terra doublebitsat(i : int) : uint64 var d = nandoubles[i] return @[&uint64](&d) end
+assert(floatbitsat(0) == 0x7fa00001 and floatbitsat(1) == 0xffc00123)
+assert(doublebitsat(0) == 0x7ff0000000000001ULL)
@@ -0,0 +1,85 @@
+if terralib.llvm_version < 170 then
+    print("Not running coroutine tests with LLVM " .. terralib.llvm_version)
+    assert(not pcall(terralib.coroutine, terra() end))
+    return
+end
+
+-- a generator: each resume produces the next value in out
+terra count(out : &int, n : int)
+    for i = 0, n do
+        @out = i
+        terralib.suspend()
+    end
+end
+local startcount = terralib.coroutine(count)
+assert(startcount:gettype().returntype == &opaque)
+
+terra sum(n : int) : int
+    var v : int
+    var h = startcount(&v, n)
+    var s = 0
+    while not terralib.coroutinedone(h) do
+        s = s + v
+        terralib.resume(h)
+    end
+    terralib.destroycoroutine(h)
+    return s
+end
+assert(sum(10) == 45)
+assert(sum(0) == 0)
+
+-- deferred calls run when the body finishes and when a suspended coroutine is destroyed
+local cleanups = global(int, 0)
+terra cleanup() cleanups = cleanups + 1 end
+terra guarded(self : &&opaque)
+    defer cleanup()
+    @self = terralib.currentcoroutine()
+    terralib.suspend()
+    terralib.suspend()
+end
+local startguarded = terralib.coroutine(guarded)
+terra destroyearly() : bool
+    var self : &opaque
+    var h = startguarded(&self)
+    var ok = self == h and not terralib.coroutinedone(h) and cleanups == 0
+    terralib.resume(h)
+    terralib.destroycoroutine(h)
+    return ok and cleanups == 1
+end
+terra runtoend() : bool
+    var self : &opaque
+    var h = startguarded(&self)
+    terralib.resume(h)
+    terralib.resume(h)
+    var ok = terralib.coroutinedone(h) and cleanups == 2
+    terralib.destroycoroutine(h)
+    return ok and cleanups == 2
+end
+assert(destroyearly())
+assert(runtoend())
+
+-- a return ends the coroutine
+terra early(out : &int)
+    @out = 1
+    terralib.suspend()
+    if @out == 1 then return end
+    @out = 3
+end
+local startearly = terralib.coroutine(early)
+terra testearly() : bool
+    var v : int
+    var h = startearly(&v)
+    terralib.resume(h)
+    var ok = terralib.coroutinedone(h) and v == 1
+    terralib.destroycoroutine(h)
+    return ok
+end
+assert(testearly())
+
+-- coroutines can be saved in object files
+assert(terralib.saveobj(nil, "llvmir", { sum = sum }, nil, nil, false):find("define"))
+
+assert(not pcall(terralib.compile, terra() terralib.suspend() end))
+assert(not pcall(terralib.compile, terra() return terralib.currentcoroutine() end))
+assert(not pcall(terralib.coroutine, terra() return 1 end))
+assert(not pcall(terralib.coroutine, 1))
@@ -0,0 +1,62 @@
+if not terralib.cudacompile then
+	print("CUDA not enabled, not performing test...")
+	return
+end
+
+local tid = cudalib.nvvm_read_ptx_sreg_tid_x
+
+local counter = global(int, 0)
+
+terra scale(a : &float, s : float)
+    a[tid()] = a[tid()] * s
+end
+terra shift(a : &float, s : float)
+    a[tid()] = a[tid()] + s
+end
+terra count(a : &float)
+    counter = counter + [int](a[tid()])
+end
+terra sines(a : &float)
+    a[tid()] = cudalib.nvvm_sin_approx_f(a[tid()])
+end
+
+local module = { scale = scale, shift = shift, count = count, sines = sines, counter = counter }
+
+-- the same module for the same target is only lowered once
+local first, cached, nlowered = cudalib.toptx(module, false, 60)
+assert(not cached and nlowered == 1)
+local second, cached, nlowered = cudalib.toptx(module, false, 60)
+assert(cached and second == first and nlowered == 0)
+local _, cached = cudalib.toptx(module, false, 70)
+assert(not cached)
+
+local function occurrences(s, pattern)
+    local n = 0
+    for _ in s:gmatch(pattern) do n = n + 1 end
+    return n
+end
+
+-- kernels that share no globals are lowered in parallel and merged into one module
+local split, cached, nlowered = cudalib.toptx(module, false, 60, { threads = 4 })
+-- one partition per kernel, which only the split path produces
+assert(not cached and nlowered == 4)
+for k in pairs { scale = 1, shift = 1, count = 1, sines = 1 } do
+    assert(occurrences(split, "%.entry " .. k .. "%(") == 1)
+end
+assert(occurrences(split, "%.version") == 1)
+assert(occurrences(split, "%.visible %.global [^\n]*counter") == 1)
+
+-- and kept on disk when a cache directory is set
+local ffi = require("ffi")
+if ffi.os ~= "Windows" then
+    local dir = os.tmpname()
+    os.remove(dir)
+    os.execute("mkdir " .. dir)
+    terralib.ptxcache = dir
+    local ptx, cached = cudalib.toptx({ scale = scale }, false, 52)
+    assert(not cached)
+    local files = io.popen("ls " .. dir):read("*a")
+    assert(files:match("%.ptx"))
+    terralib.ptxcache = nil
+    os.execute("rm -r " .. dir)
+end
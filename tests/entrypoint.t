@@ -0,0 +1,47 @@
+local entrypoint = require("entrypoint")
+
+struct vec3 { x : float, y : float, z : float }
+
+terra add(a : int, b : int) return a + b end
+terra addvec(a : vec3, b : vec3) : vec3
+    return vec3 { a.x + b.x, a.y + b.y, a.z + b.z }
+end
+terra sum(a : int[4]) return a[0] + a[1] + a[2] + a[3] end
+terra isneg(x : double) return x < 0 end
+terra origin() : vec3 return vec3 { 0, 0, 0 } end
+terra store(p : &int, v : int) @p = v end
+terra pair(x : int) return x, x + 1 end
+
+local fadd = entrypoint(add)
+assert(fadd == entrypoint(add))
+assert(fadd(1, 2) == 3)
+
+local a, b = terralib.new(vec3, { 1, 2, 3 }), terralib.new(vec3, { 4, 5, 6 })
+local out = terralib.new(vec3)
+local faddvec = entrypoint(addvec)
+-- the result is written to the cdata passed first, and returned
+assert(faddvec(out, a, b) == out)
+assert(out.x == 5 and out.y == 7 and out.z == 9)
+for i = 1, 100 do faddvec(out, out, a) end
+assert(out.x == 105 and out.y == 207 and out.z == 309)
+-- without one, a new result is allocated
+local fresh = faddvec(nil, a, b)
+assert(fresh ~= out and fresh.z == 9)
+
+assert(entrypoint(sum)(terralib.new(int[4], { 1, 2, 3, 4 })) == 10)
+assert(entrypoint(isneg)(-1) == true and entrypoint(isneg)(1) == false)
+assert(entrypoint(origin)().x == 0)
+
+local x = terralib.new(int[1])
+assert(entrypoint(store)(x, 7) == nil and x[0] == 7)
+
+-- multiple results are a tuple, like calling the function directly
+local p = entrypoint(pair)(nil, 4)
+assert(p._0 == 4 and p._1 == 5)
+
+-- entry points behave like the function called from Lua
+for i = -5, 5 do
+    assert(fadd(i, i * 3) == add(i, i * 3))
+end
+
+assert(not pcall(entrypoint, 1))
@@ -0,0 +1,89 @@
+-- identical includes share one Clang run; anything that changes the arguments does not
+local C1 = terralib.includecstring [[
+#include <stdio.h>
+]]
+local C2 = terralib.includecstring [[
+#include <stdio.h>
+]]
+assert(C1.printf == C2.printf)
+
+-- each caller has its own namespace table
+C1.includeccache_added = 1
+assert(rawget(C2, "includeccache_added") == nil)
+
+local C3 = terralib.includecstring([[
+#include <stdio.h>
+]], {"-DTERRA_TEST_INCLUDECCACHE"})
+assert(C3.printf ~= C1.printf)
+
+local C4 = terralib.includecstring [[
+#ifdef TERRA_TEST_INCLUDECCACHE
+#error "should not be defined"
+#endif
+int includeccache_value() { return 7; }
+]]
+terra f() return C4.includeccache_value() end
+assert(f() == 7)
+
+-- a header that changes on disk is read again
+local function writeheader(value)
+    local file = assert(io.open("includeccache_header.h", "w"))
+    file:write(("#define INCLUDECCACHE_VALUE %d\n"):format(value))
+    file:close()
+end
+writeheader(1)
+assert(terralib.includec("includeccache_header.h", {"-I."}).INCLUDECCACHE_VALUE == 1)
+-- a different size, so the change is seen even within one tick of the file clock
+writeheader(100)
+assert(terralib.includec("includeccache_header.h", {"-I."}).INCLUDECCACHE_VALUE == 100)
+os.remove("includeccache_header.h")
+
+-- with terralib.includeccache set, a later process restores the result from disk,
+-- including struct layouts and the code of functions defined in the header
+local ffi = require("ffi")
+if ffi.os == "Windows" then return end
+local dir = os.tmpname()
+os.remove(dir)
+assert(os.execute("mkdir " .. dir) == 0)
+local function writefile(name, contents)
+    local file = assert(io.open(dir .. "/" .. name, "w"))
+    file:write(contents)
+    file:close()
+end
+writefile("cross.h", [[
+#define CROSS_VALUE 42
+enum { CROSS_ENUM = 3 };
+typedef struct cross_node {
+    int value;
+    struct cross_node *next;
+    union { int i; double d; } extra;
+} cross_node;
+int cross_sum(cross_node *n) {
+    int s = 0;
+    for (; n; n = n->next) s += n->value;
+    return s;
+}
+]])
+writefile("use.t", [[
+if ... == "cached" then
+    terralib.registercfile = function() error("clang should not run") end
+end
+local C = terralib.includecstring([=[
+#include <stdlib.h>
+#include "cross.h"
+]=], {"-I]] .. dir .. [["})
+terra sum()
+    var b : C.cross_node
+    b.value, b.next = 2, nil
+    var a : C.cross_node
+    a.value, a.next, a.extra.d = 40, &b, 1.5
+    return C.cross_sum(&a) + C.CROSS_ENUM + C.abs(-1)
+end
+assert(sum() == 46 and C.CROSS_VALUE == 42)
+assert(terralib.sizeof(C.cross_node) == 8 + 2 * terralib.sizeof(&opaque))
+]])
+local run = "TERRA_INCLUDEC_CACHE=" .. dir .. " " .. terralib.terrahome .. "/bin/terra " .. dir .. "/use.t"
+assert(os.execute(run) == 0)
+assert(os.execute("ls " .. dir .. "/*.includec > /dev/null") == 0)
+assert(os.execute(run .. " cached") == 0)
+os.execute("rm -r " .. dir)
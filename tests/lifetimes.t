@@ -0,0 +1,74 @@
+local ffi = require("ffi")
+
+local C = terralib.includecstring [[
+void terra_lifetimes_use(int *p);
+]]
+
+-- a large generated function whose blocks each use a 1 KB buffer; with lifetime
+-- markers the buffers can share one stack slot instead of one slot each
+local N = 16
+local function blocks(n)
+    local stmts = terralib.newlist()
+    for i = 1, n do
+        stmts:insert(quote
+            do
+                var buf : int[256]
+                buf[0] = [i]
+                C.terra_lifetimes_use(&buf[0])
+            end
+        end)
+    end
+    return stmts
+end
+terra many() [blocks(N)] end
+
+-- a label disables the markers since goto can jump back into a live scope
+terra withlabel()
+    ::top::
+    [blocks(2)]
+end
+
+-- arrays passed by value are copied to scratch space that only lives for the call
+struct Big { a : int[64] }
+terra take(b : Big) : int return b.a[0] end
+terra passes(b : Big) : int return take(b) + take(b) end
+
+local function ir(fn)
+    return terralib.saveobj(nil, "llvmir", { fn = fn }, nil, nil, false)
+end
+local function count(str, pattern) return select(2, str:gsub(pattern, "")) end
+
+local unoptimized = ir(many)
+assert(count(unoptimized, "call void @llvm%.lifetime%.start") == N)
+assert(count(unoptimized, "call void @llvm%.lifetime%.end") == N)
+assert(not ir(withlabel):find("llvm.lifetime", 1, true))
+assert(count(ir(passes), "call void @llvm%.lifetime%.start") == 2)
+
+-- the optimized frame holds about one buffer instead of all of them
+if ffi.arch == "x64" and ffi.os ~= "Windows" then
+    local asm = terralib.saveobj(nil, "asm", { many = many })
+    local frame = 0
+    for n in asm:gmatch("subq%s+%$(%d+),%s*%%rsp") do frame = math.max(frame, tonumber(n)) end
+    assert(frame >= 1024 and frame < 2 * 1024, "frame of " .. frame .. " bytes")
+end
+
+-- the markers do not change what the code computes
+local total = global(int, 0)
+terra accumulate(p : &int) total = total + @p end
+terra sequential() : int
+    escape
+        for i = 1, 8 do
+            emit quote
+                do
+                    var buf : int[256]
+                    buf[0] = i
+                    accumulate(&buf[0])
+                end
+            end
+        end
+    end
+    var b : Big
+    b.a[0] = 100
+    return total + passes(b)
+end
+assert(sequential() == 36 + 200)
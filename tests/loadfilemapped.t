@@ -0,0 +1,31 @@
+-- terralib.loadfile maps regular files and lexes names and long strings in place;
+-- check that the skipped #! line, long strings and line numbers still come out right.
+
+local src = [==[#!/usr/bin/env terra
+local s = [[
+first
+second]]
+local t = [=[a]]b]=]
+terra lineof() return [ debug.getinfo(1, "l").currentline ] end
+local crlf = [[x]] .. "\r\n" .. [[y]]
+return s, t, lineof(), crlf
+]==]
+
+local filename = os.tmpname()
+local f = assert(io.open(filename, "wb"))
+f:write(src)
+f:close()
+
+local s, t, line, crlf = assert(terralib.loadfile(filename))()
+os.remove(filename)
+
+assert(s == "first\nsecond")
+assert(t == "a]]b")
+assert(line == 6)
+assert(crlf == "x\r\ny")
+
+local emptyname = os.tmpname()
+local f = assert(io.open(emptyname, "wb"))
+f:close()
+assert(terralib.loadfile(emptyname))
+os.remove(emptyname)
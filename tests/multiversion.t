@@ -0,0 +1,60 @@
+local ffi = require("ffi")
+if ffi.arch ~= "x64" then
+    print("Not running multiversion test on " .. ffi.arch)
+    return
+end
+
+local multiversion = require("multiversion")
+
+terra dot(a : &float, b : &float, n : int) : float
+    var s : float = 0
+    for i = 0, n do s = s + a[i] * b[i] end
+    return s
+end
+
+local fastdot, versions = multiversion(dot, { "x86-64-v2", "x86-64-v3", "x86-64-v4" })
+assert(#versions == 3 and fastdot:gettype() == dot:gettype())
+
+terra test() : bool
+    var a : float[100]
+    var b : float[100]
+    for i = 0, 100 do a[i], b[i] = i, 2 end
+    return fastdot(a, b, 100) == dot(a, b, 100) and fastdot(a, b, 100) == 9900
+end
+assert(test())
+
+-- every version carries its own subtarget
+local ir = terralib.saveobj(nil, "llvmir", { fastdot = fastdot }, nil, nil, false)
+for _, cpu in ipairs { "x86-64-v2", "x86-64-v3", "x86-64-v4" } do
+    assert(ir:find('"target-cpu"="' .. cpu .. '"', 1, true))
+end
+
+-- custom checks run once, from the most preferred version down
+local checks = global(int, 0)
+terra never() : bool checks = checks + 1 return false end
+terra always() : bool checks = checks + 10 return true end
+terra unit(p : &int) @p = @p + 1 end
+local fastunit = multiversion(unit, {
+    { cpu = "x86-64", supported = always },
+    { cpu = "x86-64-v2", features = "+popcnt", supported = never },
+})
+local x = global(int, 0)
+terra callunit() fastunit(&x) fastunit(&x) end
+callunit()
+assert(x:get() == 2 and checks:get() == 11)
+
+assert(not pcall(multiversion, dot, { "pentium-pro" }))
+
+-- the levels decoded from fixed CPUID.1:ECX, CPUID.80000001h:ECX, CPUID.(7,0):EBX and XCR0
+local decode = multiversion.x86decode
+local v2ecx1 = 0x00982201 -- SSE3 SSSE3 CX16 SSE4.1 SSE4.2 POPCNT
+assert(decode(0, 0x1, 0, 0) == 1)
+assert(decode(v2ecx1, 0x1, 0, 0x7) == 2)
+assert(decode(v2ecx1 - 0x2000, 0x1, 0, 0x7) == 1) -- without CX16
+assert(decode(v2ecx1 - 0x1, 0x1, 0, 0x7) == 1) -- without SSE3
+-- FMA is a v3 feature: on its own it does not lift a v1 CPU to v2
+assert(decode(0x00981201, 0x1, 0, 0x7) == 1)
+local v3ecx1 = v2ecx1 + 0x38401000
+assert(decode(v3ecx1, 0x21, 0x128, 0x7) == 3)
+assert(decode(v3ecx1, 0x21, 0x128, 0x1) == 2) -- no YMM state
+assert(decode(v3ecx1, 0x21, 0xd0030128, 0xe7) == 4)
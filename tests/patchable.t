@@ -0,0 +1,31 @@
+local patchable = require("patchable")
+
+terra v1(x : int) return x + 1 end
+terra v2(x : int) return x * 2 end
+terra log(x : int) end
+
+local f = patchable.new(v1)
+assert(f:gettype() == v1:gettype() and patchable.ispatchable(f))
+
+-- compiled before the patch and never recompiled
+terra caller(x : int) return f(x) + f(x) end
+assert(caller(10) == 22)
+
+patchable.patch(f, v2)
+assert(caller(10) == 40 and f(3) == 6)
+local current, npatches = patchable.current(f)
+assert(current == v2 and npatches == 1)
+
+-- patching back and forth from another Terra function's point of view
+for i = 1, 10 do
+    patchable.patch(f, i % 2 == 0 and v2 or v1)
+    assert(caller(5) == (i % 2 == 0 and 20 or 12))
+end
+
+-- functions returning nothing
+local g = patchable.new(log)
+g(1)
+patchable.patch(g, terra(x : int) end)
+g(2)
+
+assert(not pcall(patchable.patch, f, log))
@@ -0,0 +1,33 @@
+-- optimization profiles validate their PGO settings
+if terralib.llvm_version < 170 then
+    assert(not pcall(terralib.newcompilationunit, terralib.nativetarget, false, {pgo = "generate"}))
+    return
+end
+
+terra f(a : int) return a + 1 end
+
+local ok, err = pcall(terralib.saveobj, nil, "object", {f = f}, nil, nil, {pgo = "sometimes"})
+assert(not ok and err:match("expected pgo"))
+
+ok, err = pcall(terralib.saveobj, nil, "object", {f = f}, nil, nil,
+                {pgo = "use", profilefile = "does/not/exist.profdata"})
+assert(not ok and err:match("readable profilefile"))
+
+-- instrumented code references the profiling runtime's counters
+local ir = terralib.saveobj(nil, "llvmir", {f = f}, nil, nil, {pgo = "generate"})
+assert(ir:match("__profc_"))
+
+-- linking instrumented code needs the Clang driver, which knows where the runtime is
+if require("ffi").os ~= "Windows" then
+    local cc = os.getenv("CC") or os.getenv("CXX") or "gcc"
+    local isclang = io.popen(cc .. " --version 2>/dev/null"):read("*a"):match("clang")
+    terra main() return f(1) - 2 end
+    local exe = os.tmpname()
+    ok, err = pcall(terralib.saveobj, exe, "executable", {main = main}, nil, nil, {pgo = "generate"})
+    os.remove(exe)
+    if isclang then
+        assert(ok or not err:match("needs the Clang driver"))
+    else
+        assert(not ok and err:match("needs the Clang driver"))
+    end
+end
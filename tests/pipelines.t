@@ -0,0 +1,64 @@
+local ffi = require("ffi")
+
+terra increment(a : &int, n : int)
+    for i = 0, n do a[i] = a[i] + 1 end
+end
+terra mix(x : int) : int
+    var h = x
+    for i = 0, 8 do h = (h ^ (h >> 7)) * 31 + i end
+    return h
+end
+terra twice(x : int) : int return mix(x) + mix(x + 1) end
+
+local function ir(fn, profile)
+    return terralib.saveobj(nil, "llvmir", { fn = fn }, nil, nil, profile)
+end
+local function vectorized(s) return s:find("<%d+ x i32>") ~= nil end
+
+-- levels
+assert(vectorized(ir(increment, {})))
+assert(not vectorized(ir(increment, { vectorize = false })))
+assert(ir(increment, { optlevel = 0 }):find("alloca", 1, true))
+assert(not ir(increment, { optlevel = 1 }):find("alloca", 1, true))
+assert(ir(increment, { optlevel = "s" }):find("optsize", 1, true))
+assert(ir(increment, { optlevel = "z" }):find("minsize", 1, true))
+assert(ir(increment, { vectorwidth = 128 }):find('"prefer-vector-width"="128"', 1, true))
+
+-- inlining
+local function callsmix(s) return s:find("call [^\n]*mix") ~= nil end
+assert(not callsmix(ir(twice, {})))
+assert(callsmix(ir(twice, { inlinethreshold = 0 })))
+
+-- the same options drive the JIT of a compilation unit
+for _, profile in ipairs { { optlevel = 0 }, { optlevel = 1 }, { optlevel = "s" },
+                           { unroll = false, vectorize = false }, { inlinethreshold = 0 } } do
+    local cu = terralib.newcompilationunit(terralib.nativetarget, true, profile)
+    local fn = ffi.cast("int (*)(int)", cu:jitvalue(twice))
+    assert(fn(3) == twice(3))
+end
+
+-- constant initializers are folded whatever the unit's pipeline is
+local struct Pair { a : int, b : int }
+local second = constant(`(Pair { 1, 2 }).b)
+terra getsecond() : int return second end
+local profiles = { { optlevel = 0 } }
+if terralib.llvm_version >= 170 then table.insert(profiles, { passes = "verify" }) end
+for _, profile in ipairs(profiles) do
+    local cu = terralib.newcompilationunit(terralib.nativetarget, true, profile)
+    assert(ffi.cast("int (*)()", cu:jitvalue(getsecond))() == 2)
+end
+
+assert(not pcall(terralib.saveobj, nil, "llvmir", { fn = increment }, nil, nil, { optlevel = 4 }))
+assert(not pcall(terralib.saveobj, nil, "llvmir", { fn = increment }, nil, nil, { unroll = 1 }))
+
+-- custom pipelines of function passes
+if terralib.llvm_version >= 170 then
+    local promoted = ir(increment, { passes = "sroa,instcombine" })
+    assert(not promoted:find("alloca", 1, true) and not vectorized(promoted))
+    local cu = terralib.newcompilationunit(terralib.nativetarget, true, { passes = "sroa" })
+    local fn = ffi.cast("int (*)(int)", cu:jitvalue(twice))
+    assert(fn(3) == twice(3))
+    local ok, err = pcall(terralib.newcompilationunit, terralib.nativetarget, true,
+                          { passes = "not-a-pass" })
+    assert(not ok and err:find("invalid pass pipeline", 1, true))
+end
@@ -0,0 +1,48 @@
+local function haveremark(remarks, kind, pass)
+    for _, r in ipairs(remarks) do
+        if r.kind == kind and r.pass == pass then return r end
+    end
+end
+
+terra increment(a : &int, n : int)
+    for i = 0, n do a[i] = a[i] + 1 end
+end
+terra sum(a : &float, n : int)
+    var s : float = 0
+    for i = 0, n do s = s + a[i] end -- not vectorized without reassociation
+    return s
+end
+
+local cu = terralib.newcompilationunit(terralib.nativetarget, true, { remarks = true })
+cu:jitvalue(increment)
+cu:jitvalue(sum)
+
+local passed = assert(haveremark(cu:remarks(increment), "passed", "loop-vectorize"))
+assert(passed.functionname == "increment" and passed.message:find("vectorized"))
+-- remarks point back into the Terra source through line tables
+assert(passed.filename:match("remarks%.t$") and passed.linenumber >= 7 and passed.linenumber <= 9)
+assert(haveremark(cu:remarks(sum), "analysis", "loop-vectorize")
+       or haveremark(cu:remarks(sum), "missed", "loop-vectorize"))
+assert(not haveremark(cu:remarks(sum), "passed", "loop-vectorize"))
+assert(#cu:remarks() >= #cu:remarks(increment) + #cu:remarks(sum))
+
+local yaml = terralib.remarkstoyaml(cu:remarks(increment))
+assert(yaml:find("--- !Passed\nPass:            'loop-vectorize'", 1, true))
+assert(yaml:find("Function:        'increment'", 1, true))
+
+-- the profile can select passes by name
+local inlineonly = terralib.newcompilationunit(terralib.nativetarget, true, { remarks = "^inline$" })
+inlineonly:jitvalue(increment)
+assert(not haveremark(inlineonly:remarks(increment), "passed", "loop-vectorize"))
+
+-- units without remarks record none
+local plain = terralib.newcompilationunit(terralib.nativetarget, true, {})
+plain:jitvalue(increment)
+assert(#plain:remarks(increment) == 0)
+
+-- saveobj returns the remarks of optimizing the module with its timings
+local _, stats = terralib.saveobj(nil, "llvmir", { increment = increment }, nil, nil,
+                                  { remarks = "loop-vectorize" })
+assert(haveremark(stats.remarks, "passed", "loop-vectorize"))
+local _, plainstats = terralib.saveobj(nil, "llvmir", { increment = increment })
+assert(plainstats.remarks == nil)
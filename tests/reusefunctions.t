@@ -0,0 +1,44 @@
+-- reloading identical code reuses the functions that were already compiled, while
+-- changed functions and everything that calls them are compiled again
+
+local code = [[
+local a, b = ...
+terra leaf(x : int) return x * [a] end
+terra middle(x : int) return leaf(x) + 1 end
+terra other(x : int) return x - [b] end
+terra root(x : int) return middle(x) + other(x) end
+return root
+]]
+
+local cu = terralib.jitcompilationunit
+local function load(a, b)
+    local before = cu:reusestats()
+    local root = terralib.loadstring(code)(a, b)
+    local r = root(10)
+    local after = cu:reusestats()
+    return r, after.emitted - before.emitted, after.reused - before.reused
+end
+
+local r, emitted, reused = load(2, 3)
+assert(r == 28 and emitted == 4 and reused == 0)
+
+-- nothing changed
+r, emitted, reused = load(2, 3)
+assert(r == 28 and emitted == 0 and reused == 4)
+
+-- other changed: it and root are recompiled, leaf and middle are reused
+r, emitted, reused = load(2, 5)
+assert(r == 26 and emitted == 2 and reused == 2)
+
+-- leaf changed: everything except other is recompiled
+r, emitted, reused = load(4, 5)
+assert(r == 46 and emitted == 3 and reused == 1)
+
+-- identical functions saved under two names share their code, and both names are exported
+terra one(x : int) return x + 1 end
+terra two(x : int) return x + 1 end
+local ir = terralib.saveobj(nil, "llvmir", { one = one, two = two })
+local function exported(name)
+    return ir:match("define[^\n]*@" .. name .. "%(") or ir:match("\n@" .. name .. " = [^\n]*alias")
+end
+assert(exported("one") and exported("two"))
@@ -0,0 +1,51 @@
+-- saveobj with threads > 1 splits the module and links the partitions back
+-- together; the result must behave exactly like a single-threaded save
+local ffi = require("ffi")
+if ffi.os == "Windows" or terralib.llvm_version < 130 then
+    print("Not running parallel saveobj test")
+    return
+end
+
+local C = terralib.includec("stdio.h")
+
+local fns = terralib.newlist()
+for i = 1, 64 do
+    -- a private helper per function, so partitions must reach each other's locals
+    local helper = terra(x : int) return x * i end
+    helper:setinlined(false)
+    fns:insert(terra(x : int) return helper(x) + 1 end)
+end
+
+local total = global(int, 0)
+terra main()
+    escape
+        for i, f in ipairs(fns) do
+            emit quote total = total + f(i) end
+        end
+    end
+    C.printf("%d\n", total)
+    return 0
+end
+
+local expected = 0
+for i = 1, 64 do expected = expected + i * i + 1 end
+
+local function output(exe)
+    local p = io.popen("./" .. exe)
+    local r = p:read("*a")
+    p:close()
+    os.remove(exe)
+    return tonumber(r)
+end
+
+local _, stats = terralib.saveobj("saveobjthreads", { main = main }, nil, nil, { threads = 4 })
+assert(stats.threads == 4 and stats.codegen > 0 and stats.link > 0)
+assert(output("saveobjthreads") == expected)
+
+-- object files are combined with a relocatable link
+terralib.saveobj("saveobjthreads.o", { main = main }, nil, nil, { threads = 3 })
+assert(os.execute("cc saveobjthreads.o -o saveobjthreads") == 0)
+os.remove("saveobjthreads.o")
+assert(output("saveobjthreads") == expected)
+
+assert(not pcall(terralib.saveobj, "saveobjthreads", { main = main }, nil, nil, { threads = 0 }))
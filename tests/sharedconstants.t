@@ -0,0 +1,47 @@
+-- large constant tables are JIT'd once per target and shared between units
+
+local ffi = require("ffi")
+
+local N = 4096
+local values = terralib.newlist()
+for i = 0, N - 1 do values:insert((i * 2654435761) % 2^31) end
+local big = terralib.constant(terralib.new(uint32[N], values))
+local small = terralib.constant(terralib.new(uint32[4], { 1, 2, 3, 4 }))
+
+local function reader()
+    return terra(i : int) : uint32 return big[i] + small[i % 4] end
+end
+
+local jit = terralib.jitcompilationunit
+local before = jit:reusestats()
+local a, b = reader(), reader()
+assert(a(5) == values[6] + 2)
+local after = jit:reusestats()
+assert(after.constants == before.constants + 1)
+assert(after.constantbytes == before.constantbytes + 4 * N)
+assert(b(N - 1) == values[N] + 4)
+after = jit:reusestats()
+assert(after.constants == before.constants + 1)
+assert(after.constantbytessaved == before.constantbytessaved + 4 * N)
+
+-- another unit of the same target shares the table as well
+local cu = terralib.newcompilationunit(terralib.nativetarget, true)
+local c = reader()
+local fn = ffi.cast("uint32_t (*)(int)", cu:jitvalue(c))
+assert(fn(100) == values[101] + 1)
+local stats = cu:reusestats()
+assert(stats.constants == after.constants)
+assert(stats.constantbytessaved == after.constantbytessaved + 4 * N)
+
+-- every unit still agrees on the values
+for i = 0, N - 1, 97 do
+    assert(a(i) == b(i) and b(i) == fn(i))
+end
+
+-- a large constant global is looked up by name, so it keeps its own definition and
+-- can be read from Lua
+local named = global(uint32[N], terralib.new(uint32[N], values), "sharedconstants_named", false, true)
+assert(named:getpointer()[7] == values[8])
+assert(named:get()[N - 1] == values[N])
+terra readnamed(i : int) : uint32 return named[i] end
+assert(readnamed(9) == values[10])
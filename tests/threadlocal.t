@@ -0,0 +1,82 @@
+local ffi = require("ffi")
+
+local counter = global(int, 10, "counter"):setthreadlocal()
+local scratch = global(double[4], nil, "scratch", false, false, 0, "initial-exec")
+assert(counter:isthreadlocal() and scratch:isthreadlocal())
+
+terra count(n : int)
+    for i = 0, n do counter = counter + 1 end
+    return counter
+end
+terra fill(x : double)
+    for i = 0, 4 do scratch[i] = x * i end
+    return scratch[3]
+end
+
+-- Lua runs on the main thread and sees its copy
+assert(count(5) == 15 and counter:get() == 15)
+counter:set(0)
+assert(count(1) == 1)
+assert(fill(2) == 6 and scratch:get()[1] == 2)
+
+-- saved objects use the requested model
+local ir = terralib.saveobj(nil, "llvmir", { count = count, fill = fill }, nil, nil, false)
+assert(ir:find("@counter = [%w_ ]*thread_local global i32 10"))
+assert(ir:find("@scratch = [%w_ ]*thread_local%(initialexec%) global %[4 x double%]"))
+
+assert(not pcall(function() global(int):setthreadlocal("fast") end))
+assert(not pcall(function() global(int, 1, "c", false, true):setthreadlocal() end))
+assert(not pcall(function() counter:setthreadlocal("local-exec") end))
+assert(tostring(counter):find("threadlocal", 1, true))
+
+-- constant field and element indices into a thread-local aggregate
+struct Stats { hits : int, history : int[3] }
+local stats = global(Stats, nil, "stats"):setthreadlocal()
+terra record(x : int) : int
+    stats.hits = stats.hits + 1
+    stats.history[2] = stats.history[1]
+    stats.history[1] = x
+    return stats.hits * 100 + stats.history[2]
+end
+assert(record(7) == 100 and record(8) == 207 and stats:get().history[1] == 8)
+
+-- addresses of a thread-local that several switch cases merge into one PHI
+local slot = global(int, 5, "slot"):setthreadlocal()
+local other = global(int, 0)
+terra pick(k : int) : int
+    var p : &int = &other
+    switch k do
+        case 1 then p = &slot
+        case 2 then p = &slot
+        case 3 then p = &slot
+    end
+    @p = @p + 1
+    return @p
+end
+assert(pick(2) == 6 and pick(3) == 7 and pick(9) == 1 and slot:get() == 7)
+
+if ffi.os == "Windows" then return end
+
+-- every thread starts from the initial value and counts on its own copy
+local C = terralib.includecstring [[
+#include <pthread.h>
+]]
+local N = 8
+terra worker(arg : &opaque) : &opaque
+    var result = [&int](arg)
+    @result = count(1000 + @result)
+    return nil
+end
+terra run(results : &int) : bool
+    var threads : C.pthread_t[N]
+    for i = 0, N do
+        results[i] = i
+        if C.pthread_create(&threads[i], nil, worker, &results[i]) ~= 0 then return false end
+    end
+    for i = 0, N do C.pthread_join(threads[i], nil) end
+    return true
+end
+local results = terralib.new(int[N])
+assert(run(results))
+for i = 0, N - 1 do assert(results[i] == 10 + 1000 + i) end
+assert(counter:get() == 1)
@@ -0,0 +1,173 @@
+local ffi = require("ffi")
+local vecmath = require("vecmath")
+local C = terralib.includecstring [[
+#include <math.h>
+]]
+
+local reference = {
+    exp = C.exp, log = C.log, sin = C.sin, cos = C.cos, pow = C.pow, tanh = C.tanh, erf = C.erf,
+}
+
+-- the largest error of vecmath's name over n points in ULPs of E, against the C
+-- library in double precision, evaluated N lanes at a time
+local function maxerror(name, E, N)
+    local T = N == 1 and E or vector(E, N)
+    local fn, ref = vecmath.generate(name, T), reference[name]
+    local function lanes(xs, i)
+        if N == 1 then return `[E](xs[i]) end
+        local l = terralib.newlist()
+        for j = 0, N - 1 do l:insert(`[E](xs[i + j])) end
+        return `vector([l])
+    end
+    local function lane(r, j)
+        return N == 1 and r or `r[j]
+    end
+    local call = name == "pow" and function(xs, ys, i) return `fn([lanes(xs, i)], [lanes(ys, i)]) end
+                                or function(xs, ys, i) return `fn([lanes(xs, i)]) end
+    return terra(xs : &double, ys : &double, n : int) : double
+        var worst = 0.0
+        for i = 0, n - N + 1, N do
+            var r = [call(xs, ys, i)]
+            escape
+                for j = 0, N - 1 do emit quote
+                    var x = [E](xs[i + j])
+                    var want : double = [E]([name == "pow" and `ref(x, [E](ys[i + j])) or `ref(x)])
+                    var got : double = [lane(r, j)]
+                    var err : double
+                    if want ~= want or C.fabs(want) == [math.huge] then
+                        err = terralib.select(got == want or (got ~= got and want ~= want), 0.0, 1e30)
+                    else
+                        var w = C.fabs(want)
+                        var ulp = [E == double and `C.nextafter(w, [math.huge]) - w
+                                                or `C.nextafterf([float](w), [math.huge]) - [float](w)]
+                        err = C.fabs(got - want) / ulp
+                    end
+                    if err > worst then worst = err end
+                end end
+            end
+        end
+        return worst
+    end
+end
+
+-- points spread over [lo, hi], or exponentially over [2^lo, 2^hi]
+local terra fill(xs : &double, n : int, lo : double, hi : double, exponential : bool)
+    for i = 0, n do
+        var u = lo + (hi - lo) * ((i * 7919) % n + 0.5) / n
+        xs[i] = terralib.select(exponential, C.exp2(u), u)
+    end
+end
+
+local n = 4096
+local xs = terralib.new(double[n])
+local ys = terralib.new(double[n])
+local cases = {
+    { "exp", 2, { { -745, 709 }, { -1, 1 } }, { { -103, 88 } } },
+    { "log", 2, { { -1074, 1023, true }, { -1, 1, true } }, { { -149, 127, true } } },
+    { "sin", 2, { { -1e6, 1e6 }, { -10, 10 } }, { { -1e6, 1e6 }, { -10, 10 } } },
+    { "cos", 2, { { -1e6, 1e6 }, { -10, 10 } }, { { -1e6, 1e6 }, { -10, 10 } } },
+    { "pow", 3, { { -30, 30, true } }, { { -6, 6, true } } },
+    { "tanh", 3, { { -25, 25 }, { -1, 1 } }, { { -25, 25 }, { -1, 1 } } },
+    { "erf", 3, { { -7, 7 }, { -1, 1 } }, { { -7, 7 }, { -1, 1 } } },
+}
+for _, case in ipairs(cases) do
+    local name, bound = case[1], case[2]
+    for _, t in ipairs { { double, case[3], { 1, 3, 4, 8 } }, { float, case[4], { 1, 4, 16 } } } do
+        local E, ranges, widths = unpack(t)
+        for _, range in ipairs(ranges) do
+            fill(xs, n, range[1], range[2], range[3] or false)
+            fill(ys, n, -20, 20, false)
+            for _, N in ipairs(widths) do
+                local err = maxerror(name, E, N)(xs, ys, n)
+                if err > bound then
+                    error(("%s for %s x %d on [%g, %g] is off by %g ULP"):format(
+                        name, tostring(E), N, range[1], range[2], err))
+                end
+            end
+        end
+    end
+end
+
+-- special values, in lane 2 of a vector and as scalars
+local function special(name, T)
+    local E = T:isvector() and T.type or T
+    local fn = vecmath.generate(name, T)
+    local function lane(r) return T:isvector() and `r[2] or r end
+    if name == "pow" then
+        return terra(x : double, y : double) : double
+            var r = fn([T]([E](x)), [T]([E](y)))
+            return [lane(r)]
+        end
+    end
+    return terra(x : double) : double
+        var r = fn([T]([E](x)))
+        return [lane(r)]
+    end
+end
+
+local inf, nan = math.huge, 0/0
+local function same(a, b)
+    if a ~= a then return b ~= b end
+    return a == b and (a ~= 0 or 1/a == 1/b)
+end
+local specials = {
+    exp = { { -inf, 0 }, { inf, inf }, { nan, nan }, { 0, 1 }, { 1000, inf }, { -1000, 0 } },
+    log = { { 0, -inf }, { -0.0, -inf }, { -1, nan }, { inf, inf }, { 1, 0 }, { nan, nan } },
+    sin = { { 0, 0 }, { -0.0, -0.0 }, { inf, nan }, { -inf, nan }, { nan, nan } },
+    cos = { { 0, 1 }, { -0.0, 1 }, { inf, nan }, { nan, nan } },
+    tanh = { { inf, 1 }, { -inf, -1 }, { -0.0, -0.0 }, { 30, 1 }, { nan, nan } },
+    erf = { { inf, 1 }, { -inf, -1 }, { -0.0, -0.0 }, { 10, 1 }, { nan, nan } },
+    pow = {
+        { 2, 10, 1024 }, { -2, 3, -8 }, { -2, 0.5, nan }, { 0, -1, inf }, { -0.0, -1, -inf },
+        { -0.0, 3, -0.0 }, { -0.0, 2, 0 }, { 0, 0, 1 }, { nan, 0, 1 }, { 1, nan, 1 },
+        { -1, inf, 1 }, { 0.5, inf, 0 }, { 2, -inf, 0 }, { inf, -2, 0 }, { -inf, 3, -inf },
+        { -inf, -3, -0.0 }, { nan, 2, nan }, { 2, nan, nan }, { 10, 400, inf },
+    },
+}
+for name, values in pairs(specials) do
+    for _, T in ipairs { double, vector(double, 4), float, vector(float, 4) } do
+        local fn = special(name, T)
+        for _, v in ipairs(values) do
+            local got = fn(unpack(v, 1, #v - 1))
+            if not same(got, v[#v]) then
+                local args = #v == 3 and ("%s, %s"):format(v[1], v[2]) or tostring(v[1])
+                error(("%s %s(%s) is %s, not %s"):format(tostring(T), name, args,
+                                                        tostring(got), tostring(v[#v])))
+            end
+        end
+    end
+end
+-- arguments too large for the vector reduction give what the C library gives
+for _, x in ipairs { 1e6, -3e10, 1e300 } do
+    assert(special("sin", vector(double, 4))(x) == C.sin(x))
+    assert(special("cos", double)(x) == C.cos(x))
+end
+
+-- the macros dispatch on the argument type
+terra mixed(x : double, y : float) : double
+    var v : vector(float, 4) = y
+    var w = vecmath.exp(v) + vecmath.pow(v, 2)
+    return vecmath.log(x) + vecmath.sin(1) + w[0]
+end
+assert(math.abs(mixed(math.exp(1), 0.5) - (1 + math.sin(1) + math.exp(0.5) + 0.25)) < 1e-6)
+
+-- once registered, loops calling the C library are vectorized with the variants
+vecmath.register()
+terra sines(xs : &double, ys : &double, n : int)
+    for i = 0, n do ys[i] = C.sin(xs[i]) end
+end
+terra powers(xs : &float, ys : &float, n : int)
+    for i = 0, n do ys[i] = C.powf(xs[i], 1.5f) end
+end
+local ir = terralib.saveobj(nil, "llvmir", { sines = sines, powers = powers })
+assert(ir:match("call[^\n]*vecmath_sin_f64x%d"))
+assert(ir:match("call[^\n]*vecmath_pow_f32x%d"))
+
+-- a unit of its own, as the JIT's has already compiled calls to sin
+local cu = terralib.newcompilationunit(terralib.nativetarget, true, {})
+local vectorized = ffi.cast("void (*)(double *, double *, int)", cu:jitvalue(sines))
+fill(xs, n, -100, 100, false)
+vectorized(xs, ys, n)
+for i = 0, n - 1 do
+    assert(math.abs(ys[i] - C.sin(xs[i])) <= 1e-15)
+end